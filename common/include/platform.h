@@ -50,7 +50,9 @@
 
 #define SPI_DEVICE 			USART0
 #define SPI_CLOCK 			cmuClock_USART0
-#define SPI_ROUTE 			USART_ROUTE_LOCATION_LOC0 | USART_ROUTE_RXPEN | USART_ROUTE_TXPEN | USART_ROUTE_CLKPEN | USART_ROUTE_CSPEN
+#define SPI_ROUTE 			USART_ROUTE_LOCATION_LOC0 | USART_ROUTE_RXPEN | USART_ROUTE_TXPEN | USART_ROUTE_CLKPEN
+#define SPI_DMAREQ_RX		DMAREQ_USART0_RXDATAV
+#define SPI_DMAREQ_TX		DMAREQ_USART0_TXBL
 
 /*** 			I2C Pins 				***/
 #define I2C_SDA_PIN 		4
@@ -61,18 +63,90 @@
 #define I2C_DEVICE 			I2C0
 #define I2C_CLOCK 			cmuClock_I2C0
 #define I2C_ROUTE 			I2C_ROUTE_LOCATION_LOC1 | I2C_ROUTE_SCLPEN | I2C_ROUTE_SDAPEN
+#define I2C_IRQ				I2C0_IRQn
+
+/*** 			UART Pins 				***/
+#define UART_TX_PIN 		0
+#define UART_TX_PORT	 	gpioPortD
+#define UART_RX_PIN 		1
+#define UART_RX_PORT	 	gpioPortD
+
+#define UART_DEVICE 		USART1
+#define UART_CLOCK 			cmuClock_USART1
+#define UART_ROUTE 			USART_ROUTE_LOCATION_LOC1 | USART_ROUTE_RXPEN | USART_ROUTE_TXPEN
+#define UART_RX_IRQ			USART1_RX_IRQn
+#define UART_DMAREQ_RX		DMAREQ_USART1_RXDATAV
+#define UART_DMAREQ_TX		DMAREQ_USART1_TXBL
 
 /*** 			PWM Pins 				***/
-#define PWM_TIMER_CLOCK		cmuClock_HFPER
-#define PWM_TIMER 			TIMER2
-#define TIM2_CC0_PIN 		7
-#define TIM2_CC0_PORT	 	gpioPortB
-#define TIM2_CC1_PIN 		8
-#define TIM2_CC1_PORT	 	gpioPortB
+//TIMER1 location 3, CC2 at this location shares PB11 with the DAC output so is not used
+#define PWM_TIMER 			TIMER1
+#define PWM_TIMER_CLOCK		cmuClock_TIMER1
+#define PWM_TIMER_IRQ		TIMER1_IRQn
+#define PWM_ROUTE_LOCATION	TIMER_ROUTE_LOCATION_LOC3
+#define PWM_CC0_PIN 		7
+#define PWM_CC0_PORT	 	gpioPortB
+#define PWM_CC1_PIN 		8
+#define PWM_CC1_PORT	 	gpioPortB
+
+/*** 			Sequencer Timer			***/
+#define SEQ_TIMER			TIMER3
+#define SEQ_TIMER_CLOCK		cmuClock_TIMER3
+#define SEQ_TIMER_IRQ		TIMER3_IRQn
+
+/*** 			Sample Clock			***/
+//Timer overflow routed over PRS to trigger ADC conversions
+#define SAMPLE_TIMER		TIMER2
+#define SAMPLE_TIMER_CLOCK	cmuClock_TIMER2
+#define SAMPLE_PRS_CHANNEL	0
+#define SAMPLE_PRS_SOURCE	PRS_CH_CTRL_SOURCESEL_TIMER2
+#define SAMPLE_PRS_SIGNAL	PRS_CH_CTRL_SIGSEL_TIMER2OF
+#define SAMPLE_ADC_PRSSEL	adcPRSSELCh0
+
+/*** 			Output Clock			***/
+//Low energy timer clocked from the core, underflow pulses routed over PRS to start DAC conversions.
+//Kept apart from the sample clock so output and capture can run at once.
+#define OUTPUT_TIMER		LETIMER0
+#define OUTPUT_TIMER_CLOCK	cmuClock_LETIMER0
+#define OUTPUT_PRS_CHANNEL	1
+#define OUTPUT_PRS_SOURCE	PRS_CH_CTRL_SOURCESEL_LETIMER0
+#define OUTPUT_PRS_SIGNAL	PRS_CH_CTRL_SIGSEL_LETIMER0CH0
+#define OUTPUT_DAC_PRSSEL	dacPRSSELCh1
+
+/*** 			Trigger Routing			***/
+//One PRS channel per trigger sink, sources are selected by the host
+#define TRIGGER_ADC_PRS_CHANNEL	2
+#define TRIGGER_ADC_PRSSEL	adcPRSSELCh2
+#define TRIGGER_DAC_PRS_CHANNEL	3
+#define TRIGGER_DAC_PRSSEL	dacPRSSELCh3
+
+/*** 			Pulse Counter			***/
+//GPIO pins are not at any PCNT location, so each counter input is fed from a pin over its own PRS channel
+#define COUNTER_DEVICE		PCNT0
+#define COUNTER_CLOCK		cmuClock_PCNT0
+#define COUNTER_IRQ			PCNT0_IRQn
+#define COUNTER_S0_PRS_CHANNEL	4
+#define COUNTER_S0_PRSSEL	pcntPRSCh4
+#define COUNTER_S1_PRS_CHANNEL	5
+#define COUNTER_S1_PRSSEL	pcntPRSCh5
+
+/*** 			Motion Generator		***/
+//Borrows the PWM timer while moving, step and direction are driven on GPIO pins
+#define MOTION_TIMER		PWM_TIMER
+
+/*** 			Logic Capture			***/
+//GPIO0-3 are on one port and GPIO4-5 on another, each port is read by its own DMA channel paced by
+//the sample timer, the low port on overflow and the high port on a compare match just after it
+#define LOGIC_PORT_LOW		GPIO0_PORT
+#define LOGIC_PORT_HIGH		GPIO4_PORT
+#define LOGIC_DMAREQ_LOW	DMAREQ_TIMER2_UFOF
+#define LOGIC_DMAREQ_HIGH	DMAREQ_TIMER2_CC0
+#define LOGIC_COMPARE_CC	0
 
 /*** 			ADC Pins 				***/
 #define ADC_DEVICE			ADC0
 #define ADC_CLOCK 			cmuClock_ADC0
+#define ADC_DMAREQ_SCAN		DMAREQ_ADC0_SCAN
 
 //ADC0_CH0
 #define ADC_CH0_PIN 		0
@@ -94,5 +168,6 @@
 #define DAC_CHANNEL 		0
 #define DAC0_PIN 			11
 #define DAC0_PORT  	 		gpioPortB
+#define DAC_DMAREQ			DMAREQ_DAC0_CH0
 
 #endif
@@ -22,7 +22,14 @@ enum usbthing_module_e {
     USBTHING_MODULE_I2C = 4,
     USBTHING_MODULE_PWM = 5,
     USBTHING_MODULE_ADC = 6,
-    USBTHING_MODULE_DAC = 7
+    USBTHING_MODULE_DAC = 7,
+    USBTHING_MODULE_SEQ = 8,
+    USBTHING_MODULE_LOGIC = 9,
+    USBTHING_MODULE_TRIGGER = 10,
+    USBTHING_MODULE_CONTROL = 11,
+    USBTHING_MODULE_COUNTER = 12,
+    USBTHING_MODULE_MOTION = 13,
+    USBTHING_MODULE_UART = 14
 };
 
 enum usb_thing_cmd_e {
@@ -31,11 +38,21 @@ enum usb_thing_cmd_e {
     USBTHING_CMD_PWM_CFG = 0xC1,
     USBTHING_CMD_PWM_EN = 0xC2,
     USBTHING_CMD_PWM_SET = 0xC3,
+    USBTHING_CMD_PWM_UPDATE = 0xC4,
+    USBTHING_CMD_PWM_GET = 0xC5,
     USBTHING_CMD_ADC_CFG = 0xD1,
     USBTHING_CMD_ADC_GET = 0xD2,
     USBTHING_CMD_DAC_CFG = 0xE1,
     USBTHING_CMD_DAC_SET = 0xE3,
-    USBTHING_CMD_UART_CFG = 0xF1
+    USBTHING_CMD_DAC_STREAM_START = 0xE4,
+    USBTHING_CMD_DAC_STREAM_STOP = 0xE5,
+    USBTHING_CMD_DAC_STREAM_STATUS = 0xE6,
+    USBTHING_CMD_DAC_GEN_LOAD = 0xE7,
+    USBTHING_CMD_DAC_GEN_SET = 0xE8,
+    USBTHING_CMD_DAC_GEN_STOP = 0xE9,
+    USBTHING_CMD_UART_CFG = 0xF1,
+    USBTHING_CMD_UART_STATUS = 0xF2,
+    USBTHING_CMD_UART_STOP = 0xF3
 };
 
 enum usb_thing_error_e {
@@ -43,14 +60,18 @@ enum usb_thing_error_e {
     USBTHING_ERROR_USB_DISCONNECT = -1,
     USBTHING_ERROR_USB_TIMEOUT = -2,
     USBTHING_ERROR_PERIPHERAL_FAILED = -3,
-    USBTHING_ERROR_PERIPHERAL_TIMEOUT = -4
+    USBTHING_ERROR_PERIPHERAL_TIMEOUT = -4,
+    USBTHING_ERROR_USB_CANCELLED = -5,
+    USBTHING_ERROR_USB_FAILED = -6,
+    USBTHING_ERROR_BUSY = -7,
+    USBTHING_ERROR_INVALID_REQUEST = -8
 };
 
 
 /*****       Protocol Configuration         *****/
 #define USBTHING_SERIAL_MAX_SIZE        32
 #define USBTHING_FIRMWARE_MAX_SIZE      32
-#define USBTHING_SPI_MAX_SIZE           64
+#define USBTHING_SPI_MAX_SIZE           512     //Maximum bytes per SPI bulk transfer
 
 
 /*****       Protocol Configuration         *****/
@@ -94,7 +115,9 @@ struct base_cmd_s {
 enum usbthing_gpio_cmd_e {
     USBTHING_GPIO_CMD_CONFIG = 0,
     USBTHING_GPIO_CMD_GET = 1,
-    USBTHING_GPIO_CMD_SET = 2
+    USBTHING_GPIO_CMD_SET = 2,
+    USBTHING_GPIO_CMD_SET_MASK = 3,
+    USBTHING_GPIO_CMD_GET_MASK = 4
 };
 
 enum usbthing_gpio_mode_e {
@@ -116,7 +139,8 @@ enum usbthing_gpio_pull_e {
 enum usbthing_gpio_int_e {
     USBTHING_GPIO_INT_DISABLE = 0,
     USBTHING_GPIO_INT_RISING = 1,
-    USBTHING_GPIO_INT_FALLING = 2
+    USBTHING_GPIO_INT_FALLING = 2,
+    USBTHING_GPIO_INT_BOTH = 3
 };
 
 struct gpio_config_s {
@@ -135,24 +159,67 @@ struct gpio_get_s {
     uint8_t level;
 } __attribute((packed));
 
+//Pin masks, bit n corresponds to GPIO n. Set is applied first, then clear, then toggle
+struct gpio_set_mask_s {
+    uint32_t set;
+    uint32_t clear;
+    uint32_t toggle;
+} __attribute((packed));
+
+struct gpio_get_mask_s {
+    uint32_t levels;
+} __attribute((packed));
+
 struct gpio_cmd_s {
     union {
         struct gpio_config_s config;
         struct gpio_set_s set;
         struct gpio_get_s get;
+        struct gpio_set_mask_s set_mask;
+        struct gpio_get_mask_s get_mask;
     };
 } __attribute((packed));
 
 #define USBTHING_CMD_GPIO_CFG_SIZE              (sizeof(struct gpio_config_s))
 #define USBTHING_CMD_GPIO_GET_SIZE              (sizeof(struct gpio_get_s))
 #define USBTHING_CMD_GPIO_SET_SIZE              (sizeof(struct gpio_set_s))
+#define USBTHING_CMD_GPIO_SET_MASK_SIZE         (sizeof(struct gpio_set_mask_s))
+#define USBTHING_CMD_GPIO_GET_MASK_SIZE         (sizeof(struct gpio_get_mask_s))
 
 /*****      ADC Configuration messages          *****/
 
 enum usbthing_adc_cmd_e {
     USBTHING_ADC_CMD_CONFIG = 0,
     USBTHING_ADC_CMD_ENABLE = 1,
-    USBTHING_ADC_CMD_GET = 2
+    USBTHING_ADC_CMD_GET = 2,
+    USBTHING_ADC_CMD_STREAM_START = 3,
+    USBTHING_ADC_CMD_STREAM_STOP = 4,
+    USBTHING_ADC_CMD_SCOPE_CONFIG = 5,
+    USBTHING_ADC_CMD_SCOPE_ARM = 6,
+    USBTHING_ADC_CMD_SCOPE_TRIGGER = 7,
+    USBTHING_ADC_CMD_SCOPE_STATUS = 8,
+    USBTHING_ADC_CMD_SCOPE_READ = 9,
+    USBTHING_ADC_CMD_MONITOR_CONFIG = 10,
+    USBTHING_ADC_CMD_MONITOR_START = 11,
+    USBTHING_ADC_CMD_MONITOR_STOP = 12,
+    USBTHING_ADC_CMD_OVERSAMPLE = 13
+};
+
+//Scope capture trigger sources
+enum usbthing_scope_trigger_e {
+    USBTHING_SCOPE_TRIGGER_MANUAL = 0,          //!< Only USBTHING_ADC_CMD_SCOPE_TRIGGER
+    USBTHING_SCOPE_TRIGGER_RISING = 1,          //!< Sample crosses level upwards
+    USBTHING_SCOPE_TRIGGER_FALLING = 2,         //!< Sample crosses level downwards
+    USBTHING_SCOPE_TRIGGER_GPIO_RISING = 3,     //!< Rising edge on pin
+    USBTHING_SCOPE_TRIGGER_GPIO_FALLING = 4     //!< Falling edge on pin
+};
+
+enum usbthing_scope_state_e {
+    USBTHING_SCOPE_STATE_IDLE = 0,
+    USBTHING_SCOPE_STATE_FILLING = 1,           //!< Capturing pre-trigger samples
+    USBTHING_SCOPE_STATE_ARMED = 2,             //!< Waiting for the trigger
+    USBTHING_SCOPE_STATE_TRIGGERED = 3,         //!< Capturing post-trigger samples
+    USBTHING_SCOPE_STATE_DONE = 4               //!< Capture ready to read
 };
 
 enum usbthing_adc_ref_e {
@@ -177,21 +244,121 @@ struct adc_enable_s {
     uint8_t enable;
 } __attribute((packed));
 
+//Single conversion result, left aligned to 16 bits (USBTHING_ADC_FULL_SCALE)
 struct adc_get_s {
     uint32_t value;
 } __attribute((packed));
 
+//Average 1 << shift conversions for each single read, zero disables oversampling
+struct adc_oversample_s {
+    uint8_t shift;
+} __attribute((packed));
+
+//Start streaming, channels is a mask of (1 << usbthing_adc_channel_e), rate is in scans per second
+struct adc_stream_start_s {
+    uint8_t channels;
+    uint8_t encoding;                           //!< usbthing_adc_encoding_e
+    uint8_t reserved[2];
+    uint32_t rate;
+} __attribute((packed));
+
+//Burst capture of one channel at rate samples per second, pre + post samples around the trigger
+struct adc_scope_config_s {
+    uint8_t channel;
+    uint8_t trigger;
+    uint8_t pin;                                //!< GPIO triggers
+    uint8_t reserved;
+    uint16_t level;                             //!< Level triggers, raw 12 bit value
+    uint16_t reserved2;
+    uint32_t rate;
+    uint32_t pre_samples;
+    uint32_t post_samples;
+} __attribute((packed));
+
+struct adc_scope_status_s {
+    uint8_t state;
+    uint8_t reserved[3];
+    uint32_t samples;                           //!< Samples available to read once done
+} __attribute((packed));
+
+//Window monitor thresholds for one channel, raw 12 bit values. An excursion ends once the sample
+//is back inside the window by at least hysteresis.
+struct adc_monitor_config_s {
+    uint8_t channel;
+    uint8_t enable;
+    uint16_t low;
+    uint16_t high;
+    uint16_t hysteresis;
+} __attribute((packed));
+
+//Start sampling monitored channels, rate in scans per second
+struct adc_monitor_start_s {
+    uint32_t rate;
+} __attribute((packed));
+
 struct adc_cmd_s {
     union {
         struct adc_config_s config;
         struct adc_enable_s enable;
         struct adc_get_s get;
+        struct adc_oversample_s oversample;
+        struct adc_stream_start_s stream_start;
+        struct adc_scope_config_s scope_config;
+        struct adc_scope_status_s scope_status;
+        struct adc_monitor_config_s monitor_config;
+        struct adc_monitor_start_s monitor_start;
     };
 } __attribute((packed));
 
 #define USBTHING_CMD_ADC_CONFIG_SIZE     (sizeof(struct adc_config_s))
 #define USBTHING_CMD_ADC_ENABLE_SIZE     (sizeof(struct adc_enable_s))
 #define USBTHING_CMD_ADC_GET_SIZE        (sizeof(struct adc_get_s))
+#define USBTHING_CMD_ADC_OVERSAMPLE_SIZE (sizeof(struct adc_oversample_s))
+#define USBTHING_ADC_OVERSAMPLE_MAX      5       //Maximum oversampling shift (32 conversions, ~0.2ms in the USB interrupt)
+#define USBTHING_ADC_FULL_SCALE          65536   //Single read and batch ADC results
+#define USBTHING_CMD_ADC_STREAM_START_SIZE (sizeof(struct adc_stream_start_s))
+#define USBTHING_CMD_ADC_STREAM_STOP_SIZE  0
+#define USBTHING_CMD_ADC_SCOPE_CONFIG_SIZE (sizeof(struct adc_scope_config_s))
+#define USBTHING_CMD_ADC_SCOPE_ARM_SIZE    0
+#define USBTHING_CMD_ADC_SCOPE_TRIGGER_SIZE 0
+#define USBTHING_CMD_ADC_SCOPE_STATUS_SIZE (sizeof(struct adc_scope_status_s))
+#define USBTHING_CMD_ADC_SCOPE_READ_SIZE   0
+#define USBTHING_CMD_ADC_MONITOR_CONFIG_SIZE (sizeof(struct adc_monitor_config_s))
+#define USBTHING_CMD_ADC_MONITOR_START_SIZE  (sizeof(struct adc_monitor_start_s))
+#define USBTHING_CMD_ADC_MONITOR_STOP_SIZE   0
+#define USBTHING_ADC_MONITOR_MAX_RATE       10000   //Maximum monitor scans per second
+
+//Scope captures are held on the device and read back over the stream endpoint in one bulk transfer
+//of (pre_samples + post_samples) 12 bit samples, starting pre_samples before the trigger.
+#define USBTHING_ADC_SCOPE_MAX_SAMPLES      15360
+#define USBTHING_ADC_SCOPE_MAX_RATE         800000
+
+//Streamed samples are sent over the stream endpoint in fixed size blocks, each a header followed by
+//12 bit samples. Each scan holds one sample per enabled channel in descending channel order.
+//Blocks dropped on the device still consume a sequence number so the host can count them.
+#define USBTHING_ADC_BLOCK_SIZE             512
+#define USBTHING_ADC_STREAM_MAX_RATE        100000  //Maximum samples per second, summed over channels
+#define USBTHING_ADC_STREAM_MAX_RATE_DELTA  200000  //As above for delta encoded streams
+
+//Delta encoded blocks replace the samples with the difference from the previous sample of the same
+//channel in the block (the first from zero), zigzag mapped ((d << 1) ^ (d >> 15)) and sent as one byte
+//if under 0x80, otherwise as two bytes low seven bits first with the top bit of the first set.
+//Encoded blocks are sent short, and padded by a byte if they would end on a packet boundary.
+enum usbthing_adc_encoding_e {
+    USBTHING_ADC_ENCODING_RAW = 0,
+    USBTHING_ADC_ENCODING_DELTA = 1
+};
+
+struct usbthing_adc_block_header_s {
+    uint32_t sequence;
+    uint16_t samples;                           //!< Valid samples in the block, a whole number of scans
+    uint8_t channels;                           //!< Channel mask the block was captured with
+    uint8_t encoding;                           //!< usbthing_adc_encoding_e
+    uint64_t timestamp;                         //!< Completion time of the last scan, USBTHING_TIMEBASE_HZ ticks
+} __attribute((packed));
+
+#define USBTHING_ADC_BLOCK_MAX_SAMPLES      ((USBTHING_ADC_BLOCK_SIZE - sizeof(struct usbthing_adc_block_header_s)) \
+                                             / sizeof(uint16_t))
 
 /*****      DAC Configuration messages          *****/
 struct dac_config_s {
@@ -203,32 +370,92 @@ struct dac_set_s {
     uint16_t value;
 } __attribute((packed));
 
+/*****      DAC streaming          *****/
+//Samples are raw 12 bit DAC codes sent as uint16_t over the stream OUT endpoint, any number per transfer.
+//The device buffers them in blocks of USBTHING_DAC_BLOCK_SIZE bytes and starts output once two blocks
+//(or a short transfer) have been received, holding the last value whenever it runs out of samples.
+#define USBTHING_DAC_BLOCK_SIZE             512
+#define USBTHING_DAC_STREAM_BLOCKS          16      //Device FIFO depth in blocks
+#define USBTHING_DAC_STREAM_MAX_RATE        100000  //Maximum samples per second
+
+enum usbthing_dac_stream_state_e {
+    USBTHING_DAC_STREAM_IDLE = 0,
+    USBTHING_DAC_STREAM_PRIMING = 1,            //!< Started, waiting for the first samples
+    USBTHING_DAC_STREAM_RUNNING = 2
+};
+
+struct dac_stream_start_s {
+    uint32_t rate;                              //!< Samples per second
+} __attribute((packed));
+
+struct dac_stream_status_s {
+    uint8_t state;                              //!< usbthing_dac_stream_state_e
+    uint8_t reserved;
+    uint16_t queued;                            //!< Samples buffered on the device
+    uint32_t played;                            //!< Samples output since start
+    uint32_t underruns;                         //!< Times output ran out of samples while running
+} __attribute((packed));
+
+/*****      DAC function generator          *****/
+//Waveforms are built on the device into a table of whole periods, looped by DMA with no further USB traffic.
+//Changes are built into a second table and swapped in at the end of a period.
+#define USBTHING_DAC_GEN_MAX_SAMPLES        2048    //Table length, and the longest arbitrary waveform
+#define USBTHING_DAC_GEN_MIN_SAMPLES        8       //Fewest samples per period
+#define USBTHING_DAC_GEN_MAX_RATE           USBTHING_DAC_STREAM_MAX_RATE
+
+enum usbthing_dac_shape_e {
+    USBTHING_DAC_SHAPE_SINE = 0,
+    USBTHING_DAC_SHAPE_SQUARE = 1,
+    USBTHING_DAC_SHAPE_TRIANGLE = 2,
+    USBTHING_DAC_SHAPE_SAWTOOTH = 3,
+    USBTHING_DAC_SHAPE_ARBITRARY = 4            //!< Period loaded with USBTHING_CMD_DAC_GEN_LOAD
+};
+
+//USBTHING_CMD_DAC_GEN_LOAD takes the period length in wIndex, the period follows over the stream OUT
+//endpoint as int16_t values scaled to +/-32767
+struct dac_gen_config_s {
+    uint8_t shape;                              //!< usbthing_dac_shape_e
+    uint8_t reserved;
+    uint16_t amplitude;                         //!< Peak deviation from offset, DAC codes
+    uint16_t offset;                            //!< DAC codes
+    uint32_t frequency;                         //!< Millihertz
+} __attribute((packed));
+
 struct dac_cmd_s {
     union {
         struct dac_config_s config;
         struct dac_set_s set;
+        struct dac_stream_start_s stream_start;
+        struct dac_stream_status_s stream_status;
+        struct dac_gen_config_s gen_config;
     };
 } __attribute((packed));
 
 #define USBTHING_CMD_DAC_CFG_SIZE (sizeof(struct dac_config_s))
 #define USBTHING_CMD_DAC_SET_SIZE (sizeof(struct dac_set_s))
-
-/*****      PWM Configuration messages          *****/
-struct usbthing_pwm_config_s {
-    uint32_t freq_le;
-} __attribute((packed));
+#define USBTHING_CMD_DAC_STREAM_START_SIZE  (sizeof(struct dac_stream_start_s))
+#define USBTHING_CMD_DAC_STREAM_STOP_SIZE   0
+#define USBTHING_CMD_DAC_STREAM_STATUS_SIZE (sizeof(struct dac_stream_status_s))
+#define USBTHING_CMD_DAC_GEN_LOAD_SIZE      0
+#define USBTHING_CMD_DAC_GEN_SET_SIZE       (sizeof(struct dac_gen_config_s))
+#define USBTHING_CMD_DAC_GEN_STOP_SIZE      0
 
 /*****      SPI Configuration messages          *****/
+//Each SPI bulk OUT transfer is answered on the bulk IN endpoint with the same number of bytes read,
+//or with a zero length packet if the transfer could not be run.
 enum usbthing_spi_cmd_e {
     USBTHING_SPI_CMD_CONFIG = 0,
-    USBTHING_SPI_CMD_CLOSE = 1
+    USBTHING_SPI_CMD_CLOSE = 1,
+    USBTHING_SPI_CMD_XFER_INIT = 2
 };
 
 enum usbthing_spi_speed_e {
-    USBTHING_SPI_SPEED_100KHZ = 100000,              //!< Standard mode (100 kbps)
-    USBTHING_SPI_SPEED_400KHZ = 400000,              //!< Full mode (400 kbps)
-    USBTHING_SPI_SPEED_1MHZ = 1000000,               //!< Fast mode (1 Mpbs)
-    USBTHING_SPI_SPEED_5MHZ = 5000000                //!< High speed mode (3.2 Mbps)
+    USBTHING_SPI_SPEED_100KHZ = 100000,              //!< 100 kHz
+    USBTHING_SPI_SPEED_400KHZ = 400000,              //!< 400 kHz
+    USBTHING_SPI_SPEED_1MHZ = 1000000,               //!< 1 MHz
+    USBTHING_SPI_SPEED_5MHZ = 5000000,               //!< 5 MHz
+    USBTHING_SPI_SPEED_12MHZ = 12000000,             //!< 12 MHz
+    USBTHING_SPI_SPEED_24MHZ = 24000000              //!< 24 MHz (HFPERCLK / 2, maximum)
 };
 
 enum usbthing_spi_clock_mode_e {
@@ -243,16 +470,463 @@ struct spi_config_s {
     uint8_t clk_mode;
 } __attribute((packed));
 
+//Declares a transaction spanning multiple bulk transfers, CS is held until all bytes have been clocked
+struct usbthing_spi_data_msg_xfer_init_s {
+    uint32_t bytes_out;
+    uint32_t bytes_in;
+} __attribute((packed));
+
 struct spi_cmd_s {
     union {
         struct spi_config_s config;
+        struct usbthing_spi_data_msg_xfer_init_s xfer_init;
     };
 };
 
 #define USBTHING_CMD_SPI_CONFIG_SIZE            (sizeof(struct spi_config_s))
 #define USBTHING_CMD_SPI_CLOSE_SIZE             0
+#define USBTHING_CMD_SPI_XFER_INIT_SIZE         (sizeof(struct usbthing_spi_data_msg_xfer_init_s))
+
+/*****      Event messages                  *****/
+
+//Events are timestamped on the device and streamed to the host over the interrupt endpoint
+#define USBTHING_TIMEBASE_HZ                    48000000    //Event timestamp tick rate (core clock)
+
+enum usbthing_event_source_e {
+    USBTHING_EVENT_SOURCE_GPIO = 1,             //!< id: pin, value: level after the edge
+    USBTHING_EVENT_SOURCE_ADC_LOW = 2,          //!< id: channel, value: sample below the low threshold
+    USBTHING_EVENT_SOURCE_ADC_HIGH = 3,         //!< id: channel, value: sample above the high threshold
+    USBTHING_EVENT_SOURCE_ADC_INSIDE = 4,       //!< id: channel, value: sample back inside the window
+    USBTHING_EVENT_SOURCE_CONTROL = 5,          //!< id: usbthing_control_telemetry_e, value: see there
+    USBTHING_EVENT_SOURCE_COUNTER = 6,          //!< id: 0, value: int16_t count change since the last report
+    USBTHING_EVENT_SOURCE_MOTION = 7,           //!< id: usbthing_motion_event_e, value: low 16 bits of the position
+    USBTHING_EVENT_SOURCE_UART = 8              //!< id: usbthing_uart_event_e, value: see there
+};
+
+struct usbthing_event_msg_s {
+    uint8_t source;                             //!< Event source (usbthing_event_source_e)
+    uint8_t id;                                 //!< Source specific identifier
+    uint16_t value;                             //!< Source specific value
+    uint32_t sequence;                          //!< Incrementing event counter, gaps indicate dropped events
+    uint64_t timestamp;                         //!< Device timebase ticks
+} __attribute((packed));
+
+#define USBTHING_EVENT_PACKET_SIZE              64
+#define USBTHING_EVENTS_PER_PACKET              (USBTHING_EVENT_PACKET_SIZE / sizeof(struct usbthing_event_msg_s))
+
+/*****      Batch messages                  *****/
+
+//A batch is a header followed by a list of operations, each an op header plus length payload bytes.
+//Results for operations that return data are packed in order after the result header.
+#define USBTHING_BATCH_MAX_SIZE                 512     //Maximum bytes per batch request or response
+
+enum usbthing_batch_op_e {
+    USBTHING_BATCH_OP_GPIO_SET = 1,             //!< arg: pin, value: level
+    USBTHING_BATCH_OP_GPIO_GET = 2,             //!< arg: pin, returns 1 byte
+    USBTHING_BATCH_OP_SPI_TRANSFER = 3,         //!< payload: data out, returns length bytes
+    USBTHING_BATCH_OP_I2C_WRITE = 4,            //!< arg: address, payload: data out
+    USBTHING_BATCH_OP_I2C_READ = 5,             //!< arg: address, value: bytes to read, returns value bytes
+    USBTHING_BATCH_OP_I2C_WRITE_READ = 6,       //!< arg: address, value: bytes to read, payload: data out
+    USBTHING_BATCH_OP_DELAY_US = 7,             //!< value: delay in microseconds
+    USBTHING_BATCH_OP_ADC_GET = 8,              //!< arg: channel, returns 4 bytes
+    USBTHING_BATCH_OP_DAC_SET = 9,              //!< arg: enable, value: raw output value
+    USBTHING_BATCH_OP_GPIO_SET_MASK = 10,       //!< payload: gpio_set_mask_s
+    USBTHING_BATCH_OP_GPIO_GET_MASK = 11,       //!< returns 4 bytes, bit n is the level of GPIO n
+
+    //Flow control, only valid in sequencer programs
+    USBTHING_BATCH_OP_LOOP_START = 16,          //!< value: iterations, zero to repeat until stopped
+    USBTHING_BATCH_OP_LOOP_END = 17,            //!< Jump back to the matching loop start
+    USBTHING_BATCH_OP_WAIT_PIN = 18             //!< arg: pin, value: level, payload: uint32 timeout in us (zero waits forever)
+};
+
+struct usbthing_batch_header_s {
+    uint8_t id;                                 //!< Batch ID, echoed in the result
+    uint8_t count;                              //!< Number of operations
+    uint16_t length;                            //!< Total length including this header
+} __attribute((packed));
+
+struct usbthing_batch_op_s {
+    uint8_t op;                                 //!< Operation (usbthing_batch_op_e)
+    uint8_t arg;                                //!< Pin, address or channel
+    uint16_t value;                             //!< Level, read length, delay or output value
+    uint16_t length;                            //!< Payload bytes following this header
+} __attribute((packed));
+
+struct usbthing_batch_result_s {
+    uint8_t id;                                 //!< Batch ID from the request
+    uint8_t completed;                          //!< Operations completed successfully
+    int8_t result;                              //!< Error code of the failed operation or zero
+    uint8_t reserved;
+    uint16_t length;                            //!< Total length including this header
+} __attribute((packed));
+
+/*****      Sequencer messages                  *****/
+
+//Programs use the batch encoding (header and op list) and are stored on the device by ID. They run from a
+//timer interrupt, ops without a delay between them running for at most 1ms before the program pauses for
+//100us so the rest of the device keeps being serviced. Loops without a delay are paced by these pauses.
+#define USBTHING_SEQ_MAX_PROGRAMS               4
+#define USBTHING_SEQ_PROGRAM_MAX_SIZE           256
+
+enum usbthing_seq_cmd_e {
+    USBTHING_SEQ_CMD_STORE = 0,                 //!< Store program, wIndex: program ID
+    USBTHING_SEQ_CMD_RUN = 1,                   //!< Run program, wIndex: program ID
+    USBTHING_SEQ_CMD_STOP = 2,                  //!< Stop the running program
+    USBTHING_SEQ_CMD_STATUS = 3                 //!< Fetch sequencer status
+};
+
+enum usbthing_seq_state_e {
+    USBTHING_SEQ_STATE_IDLE = 0,
+    USBTHING_SEQ_STATE_RUNNING = 1,
+    USBTHING_SEQ_STATE_DONE = 2,
+    USBTHING_SEQ_STATE_ERROR = 3
+};
+
+struct seq_status_s {
+    uint8_t state;                              //!< Sequencer state (usbthing_seq_state_e)
+    uint8_t program;                            //!< Current or last program ID
+    int8_t result;                              //!< Error code when state is error
+    uint8_t reserved;
+    uint32_t ops_executed;                      //!< Operations executed by the current or last run
+} __attribute((packed));
+
+struct seq_cmd_s {
+    union {
+        struct seq_status_s status;
+    };
+} __attribute((packed));
+
+#define USBTHING_CMD_SEQ_RUN_SIZE               0
+#define USBTHING_CMD_SEQ_STOP_SIZE              0
+#define USBTHING_CMD_SEQ_STATUS_SIZE            (sizeof(struct seq_status_s))
+
+/*****      Logic capture messages              *****/
+
+//Captures sample all GPIO pins at once into device memory, pre_samples before and post_samples after
+//the trigger. Capture state is reported with usbthing_scope_state_e values.
+#define USBTHING_LOGIC_MAX_SAMPLES              7680
+#define USBTHING_LOGIC_MAX_RATE                 1000000
+
+enum usbthing_logic_cmd_e {
+    USBTHING_LOGIC_CMD_CONFIG = 0,
+    USBTHING_LOGIC_CMD_ARM = 1,                 //!< Start capturing
+    USBTHING_LOGIC_CMD_TRIGGER = 2,             //!< Trigger now, or once armed
+    USBTHING_LOGIC_CMD_STATUS = 3,
+    USBTHING_LOGIC_CMD_READ = 4                 //!< Send the capture over the stream endpoint
+};
+
+enum usbthing_logic_trigger_e {
+    USBTHING_LOGIC_TRIGGER_MANUAL = 0,          //!< Only USBTHING_LOGIC_CMD_TRIGGER
+    USBTHING_LOGIC_TRIGGER_PATTERN = 1,         //!< Pins in mask change to match value
+    USBTHING_LOGIC_TRIGGER_RISING = 2,          //!< Rising edge on pin
+    USBTHING_LOGIC_TRIGGER_FALLING = 3          //!< Falling edge on pin
+};
+
+//Samples are one byte each, bit n holding the level of GPIOn. Run length encoded captures replace
+//each run of identical samples with the sample, bits 6-7 holding the run length less one if under four.
+//Otherwise bits 6-7 are set and the run length less four follows, seven bits per byte low bits first,
+//the top bit set on all but the last byte. An encoded capture is never larger than the raw capture.
+enum usbthing_logic_encoding_e {
+    USBTHING_LOGIC_ENCODING_RAW = 0,
+    USBTHING_LOGIC_ENCODING_RLE = 1
+};
+
+struct logic_config_s {
+    uint8_t trigger;                            //!< usbthing_logic_trigger_e
+    uint8_t pin;                                //!< Edge triggers
+    uint8_t mask;                               //!< Pattern triggers, bit n for GPIOn
+    uint8_t value;
+    uint8_t encoding;                           //!< usbthing_logic_encoding_e
+    uint8_t reserved[3];
+    uint32_t rate;                              //!< Samples per second
+    uint32_t pre_samples;
+    uint32_t post_samples;
+} __attribute((packed));
+
+struct logic_status_s {
+    uint8_t state;                              //!< usbthing_scope_state_e
+    uint8_t reserved[3];
+    uint32_t samples;                           //!< Samples captured once done
+    uint32_t length;                            //!< Bytes to read once done
+} __attribute((packed));
+
+struct logic_cmd_s {
+    union {
+        struct logic_config_s config;
+        struct logic_status_s status;
+    };
+} __attribute((packed));
+
+#define USBTHING_CMD_LOGIC_CONFIG_SIZE          (sizeof(struct logic_config_s))
+#define USBTHING_CMD_LOGIC_ARM_SIZE             0
+#define USBTHING_CMD_LOGIC_TRIGGER_SIZE         0
+#define USBTHING_CMD_LOGIC_STATUS_SIZE          (sizeof(struct logic_status_s))
+#define USBTHING_CMD_LOGIC_READ_SIZE            0
+
+/*****      Trigger routing messages            *****/
+
+//Hardware links from a source signal to a peripheral action, acted on within a few clock cycles with no
+//CPU involvement. Each sink has one route, routing a sink again replaces its source.
+//An ADC stream started at rate zero takes one scan per ADC trigger, each sent as its own timestamped block.
+//A DAC route holds direct DAC writes until the next trigger, streams and the generator use their own clock.
+enum usbthing_trigger_cmd_e {
+    USBTHING_TRIGGER_CMD_ROUTE = 0,
+    USBTHING_TRIGGER_CMD_CLEAR = 1              //!< Remove the route to the sink in wIndex
+};
+
+enum usbthing_trigger_sink_e {
+    USBTHING_TRIGGER_SINK_ADC = 0,              //!< Start an ADC scan
+    USBTHING_TRIGGER_SINK_DAC = 1,              //!< Convert the last value written to the DAC
+    USBTHING_TRIGGER_NUM_SINKS = 2
+};
+
+enum usbthing_trigger_source_e {
+    USBTHING_TRIGGER_SOURCE_GPIO = 0,           //!< Edge on an input pin
+    USBTHING_TRIGGER_SOURCE_SAMPLE_CLOCK = 1,   //!< Each ADC stream, scope, monitor or logic sample
+    USBTHING_TRIGGER_SOURCE_OUTPUT_CLOCK = 2    //!< Each DAC stream or generator sample
+};
+
+enum usbthing_trigger_edge_e {
+    USBTHING_TRIGGER_EDGE_RISING = 0,
+    USBTHING_TRIGGER_EDGE_FALLING = 1,
+    USBTHING_TRIGGER_EDGE_BOTH = 2
+};
+
+struct trigger_route_s {
+    uint8_t sink;                               //!< usbthing_trigger_sink_e
+    uint8_t source;                             //!< usbthing_trigger_source_e
+    uint8_t pin;                                //!< GPIO sources
+    uint8_t edge;                               //!< GPIO sources, usbthing_trigger_edge_e
+} __attribute((packed));
+
+struct trigger_cmd_s {
+    union {
+        struct trigger_route_s route;
+    };
+} __attribute((packed));
+
+#define USBTHING_CMD_TRIGGER_ROUTE_SIZE         (sizeof(struct trigger_route_s))
+#define USBTHING_CMD_TRIGGER_CLEAR_SIZE         0
+
+/*****      Counter messages                    *****/
+
+//Pulse counter fed from two GPIO pins over PRS, so any pins configured as inputs may be used.
+//The 16 bit hardware count is extended to 32 bits on the device as it overflows.
+enum usbthing_counter_cmd_e {
+    USBTHING_COUNTER_CMD_CONFIG = 0,            //!< Starts counting from zero
+    USBTHING_COUNTER_CMD_READ = 1,              //!< wIndex: usbthing_counter_read_e
+    USBTHING_COUNTER_CMD_STOP = 2
+};
+
+enum usbthing_counter_mode_e {
+    USBTHING_COUNTER_MODE_QUADRATURE = 0,       //!< Encoder A and B channels, counts up or down by direction
+    USBTHING_COUNTER_MODE_SINGLE = 1            //!< Edges on A, counting down while B is high
+};
+
+enum usbthing_counter_read_e {
+    USBTHING_COUNTER_READ = 0,
+    USBTHING_COUNTER_READ_LATCH = 1             //!< Return the count and restart from zero in one step
+};
+
+#define USBTHING_COUNTER_PIN_NONE               0xFF    //!< Single mode without a direction input
+
+struct counter_config_s {
+    uint8_t mode;                               //!< usbthing_counter_mode_e
+    uint8_t pin_a;
+    uint8_t pin_b;
+    uint8_t falling;                            //!< Count falling rather than rising edges (single mode)
+    uint16_t report_ms;                         //!< USBTHING_EVENT_SOURCE_COUNTER interval, zero for none
+    uint16_t reserved;
+} __attribute((packed));
+
+struct counter_read_s {
+    int32_t count;
+    uint32_t reserved;
+    uint64_t timestamp;                         //!< Device timebase ticks when read
+} __attribute((packed));
+
+struct counter_cmd_s {
+    union {
+        struct counter_config_s config;
+        struct counter_read_s read;
+    };
+} __attribute((packed));
+
+#define USBTHING_CMD_COUNTER_CONFIG_SIZE        (sizeof(struct counter_config_s))
+#define USBTHING_CMD_COUNTER_READ_SIZE          (sizeof(struct counter_read_s))
+#define USBTHING_CMD_COUNTER_STOP_SIZE          0
+
+/*****      Motion messages                     *****/
+
+//Step and direction outputs for a stepper driver on two GPIO pins. Moves follow a trapezoidal profile
+//computed on the device, accelerating at a constant rate up to the maximum speed and decelerating to
+//stop on the target. The generator borrows the PWM timer for each move, stopping any PWM output or capture,
+//and PWM configuration is refused while moving.
+#define USBTHING_MOTION_MAX_SPEED               50000   //Steps per second
+#define USBTHING_MOTION_MAX_ACCELERATION        1000000 //Steps per second squared
+
+enum usbthing_motion_cmd_e {
+    USBTHING_MOTION_CMD_CONFIG = 0,             //!< Refused while moving
+    USBTHING_MOTION_CMD_MOVE = 1,               //!< Refused while moving
+    USBTHING_MOTION_CMD_STOP = 2,               //!< wIndex: usbthing_motion_stop_e
+    USBTHING_MOTION_CMD_STATUS = 3,
+    USBTHING_MOTION_CMD_POSITION = 4            //!< Redefine the current position, refused while moving
+};
+
+enum usbthing_motion_stop_e {
+    USBTHING_MOTION_STOP_DECELERATE = 0,        //!< Ramp down at the move's acceleration
+    USBTHING_MOTION_STOP_HALT = 1               //!< Stop stepping at once
+};
+
+enum usbthing_motion_event_e {
+    USBTHING_MOTION_EVENT_POSITION = 0,         //!< Periodic while moving
+    USBTHING_MOTION_EVENT_DONE = 1,             //!< Target reached
+    USBTHING_MOTION_EVENT_STOPPED = 2           //!< Stopped short of the target
+};
+
+struct motion_config_s {
+    uint8_t step_pin;
+    uint8_t dir_pin;
+    uint8_t invert;                             //!< Direction pin low rather than high for positive moves
+    uint8_t reserved;
+    uint16_t report_ms;                         //!< USBTHING_MOTION_EVENT_POSITION interval, zero for none
+    uint16_t reserved2;
+} __attribute((packed));
+
+struct motion_move_s {
+    int32_t target;                             //!< Absolute position in steps
+    uint32_t speed;                             //!< Steps per second
+    uint32_t acceleration;                      //!< Steps per second squared
+} __attribute((packed));
+
+struct motion_status_s {
+    uint8_t moving;
+    uint8_t reserved[3];
+    int32_t position;
+    int32_t target;
+    uint32_t speed;                             //!< Current step rate, steps per second
+} __attribute((packed));
+
+struct motion_position_s {
+    int32_t position;
+} __attribute((packed));
+
+struct motion_cmd_s {
+    union {
+        struct motion_config_s config;
+        struct motion_move_s move;
+        struct motion_status_s status;
+        struct motion_position_s position;
+    };
+} __attribute((packed));
+
+#define USBTHING_CMD_MOTION_CONFIG_SIZE         (sizeof(struct motion_config_s))
+#define USBTHING_CMD_MOTION_MOVE_SIZE           (sizeof(struct motion_move_s))
+#define USBTHING_CMD_MOTION_STOP_SIZE           0
+#define USBTHING_CMD_MOTION_STATUS_SIZE         (sizeof(struct motion_status_s))
+#define USBTHING_CMD_MOTION_POSITION_SIZE       (sizeof(struct motion_position_s))
+
+/*****      Control loop messages               *****/
+
+//PID loop run on the device, reading an ADC channel and driving an output at a fixed rate.
+//Inputs and setpoints are 16 bit ADC results (USBTHING_ADC_FULL_SCALE), outputs are output codes.
+//Gains are signed 16.16 fixed point output codes per input unit, the integral gain per sample and the
+//derivative gain per unit change between samples. The integral is clamped to the output limits.
+//Direct ADC reads are refused while the loop runs, as are DAC writes or PWM commands and moves for the
+//output it drives. A PWM output must already be configured as an output, at the frequency to be used.
+#define USBTHING_CONTROL_MAX_RATE               10000   //Loop iterations per second
+
+enum usbthing_control_cmd_e {
+    USBTHING_CONTROL_CMD_CONFIG = 0,            //!< Allowed while running, the integral is kept
+    USBTHING_CONTROL_CMD_SETPOINT = 1,
+    USBTHING_CONTROL_CMD_START = 2,
+    USBTHING_CONTROL_CMD_STOP = 3,              //!< The output holds its last value
+    USBTHING_CONTROL_CMD_STATUS = 4
+};
+
+enum usbthing_control_output_e {
+    USBTHING_CONTROL_OUTPUT_DAC = 0,            //!< 12 bit DAC codes
+    USBTHING_CONTROL_OUTPUT_PWM = 1             //!< Duty cycle of a PWM channel, fractions of USBTHING_PWM_DUTY_FULL
+};
+
+enum usbthing_control_state_e {
+    USBTHING_CONTROL_STATE_IDLE = 0,
+    USBTHING_CONTROL_STATE_RUNNING = 1
+};
+
+//Telemetry events are sent in pairs with the same timestamp every telemetry iterations
+enum usbthing_control_telemetry_e {
+    USBTHING_CONTROL_TELEMETRY_INPUT = 0,       //!< value: input
+    USBTHING_CONTROL_TELEMETRY_OUTPUT = 1       //!< value: output code
+};
+
+struct control_config_s {
+    uint8_t input;                              //!< usbthing_adc_channel_e
+    uint8_t output;                             //!< usbthing_control_output_e
+    uint16_t telemetry;                         //!< Iterations per telemetry event pair, zero for none
+    uint32_t rate;                              //!< Iterations per second
+    int32_t kp;
+    int32_t ki;
+    int32_t kd;
+    uint16_t output_min;
+    uint16_t output_max;
+    uint8_t channel;                            //!< PWM channel for USBTHING_CONTROL_OUTPUT_PWM
+    uint8_t reserved[3];
+} __attribute((packed));
+
+//The working setpoint moves towards the new setpoint by ramp input units per second, zero jumps to it
+struct control_setpoint_s {
+    uint16_t setpoint;
+    uint16_t reserved;
+    uint32_t ramp;
+} __attribute((packed));
+
+struct control_status_s {
+    uint8_t state;                              //!< usbthing_control_state_e
+    uint8_t saturated;                          //!< Output was limited on the last iteration
+    uint16_t setpoint;                          //!< Working setpoint, while ramping
+    uint16_t input;
+    uint16_t output;
+    uint32_t iterations;
+    uint8_t output_device;                      //!< usbthing_control_output_e of the output codes
+    uint8_t reserved[3];
+} __attribute((packed));
+
+struct control_cmd_s {
+    union {
+        struct control_config_s config;
+        struct control_setpoint_s setpoint;
+        struct control_status_s status;
+    };
+} __attribute((packed));
+
+#define USBTHING_CMD_CONTROL_CONFIG_SIZE        (sizeof(struct control_config_s))
+#define USBTHING_CMD_CONTROL_SETPOINT_SIZE      (sizeof(struct control_setpoint_s))
+#define USBTHING_CMD_CONTROL_START_SIZE         0
+#define USBTHING_CMD_CONTROL_STOP_SIZE          0
+#define USBTHING_CMD_CONTROL_STATUS_SIZE        (sizeof(struct control_status_s))
 
 /*****      I2C Configuration messages          *****/
+//Transfers are sent to the I2C bulk OUT endpoint as a usbthing_i2c_transfer_s followed by num_write bytes.
+//The response on the I2C bulk IN endpoint is the same header with result set to a usb_thing_error_e,
+//followed by the num_read bytes read when the result is USBTHING_ERROR_OK.
+//A transfer is abandoned with USBTHING_ERROR_PERIPHERAL_TIMEOUT once it has taken twice its time on the
+//bus at the configured speed plus USBTHING_I2C_STRETCH_TIMEOUT_MS, which allows for clock stretching.
+//Message transfers chain up to USBTHING_I2C_MAX_MESSAGES messages with repeated starts, as Linux I2C_RDWR.
+//The request is a usbthing_i2c_messages_s, count usbthing_i2c_msg_s and then the data of each write message in
+//order. The response is the usbthing_i2c_messages_s with result and completed set, followed by the data of each
+//read message in order when the result is USBTHING_ERROR_OK. Both are limited to USBTHING_I2C_BUFFER_SIZE.
+//A scan is the usbthing_i2c_messages_s alone with mode USBTHING_I2C_MODE_SCAN. Each address from
+//USBTHING_I2C_SCAN_FIRST to USBTHING_I2C_SCAN_LAST is probed with a zero length write, and the response carries
+//a USBTHING_I2C_SCAN_SIZE byte bitmap with bit (address % 8) of byte (address / 8) set for each that acknowledged.
+#define USBTHING_I2C_MAX_SIZE                   255
+#define USBTHING_I2C_STRETCH_TIMEOUT_MS         10
+#define USBTHING_I2C_BUFFER_SIZE                512
+#define USBTHING_I2C_MAX_MESSAGES               32
+#define USBTHING_I2C_MSG_FLAG_READ              (1 << 0)
+#define USBTHING_I2C_SCAN_FIRST                 0x08
+#define USBTHING_I2C_SCAN_LAST                  0x77
+#define USBTHING_I2C_SCAN_SIZE                  16
 #define USBTHING_I2C_CFG_SPEED_SHIFT            (0)
 #define USBTHING_I2C_CFG_SPEED_MASK             (0x0F << USBTHING_I2C_CFG_SPEED_SHIFT)
 #define USBTHING_I2C_CFG_SIZE                   0
@@ -267,7 +941,9 @@ enum usbthing_i2c_speed_e {
 enum usbthing_i2c_transfer_mode_e {
     USBTHING_I2C_MODE_READ = 0,                 //!< Read only mode
     USBTHING_I2C_MODE_WRITE = 1,                //!< Write only mode
-    USBTHING_I2C_MODE_WRITE_READ = 2            //!< Write and read mode
+    USBTHING_I2C_MODE_WRITE_READ = 2,           //!< Write and read mode
+    USBTHING_I2C_MODE_MESSAGES = 3,             //!< Message array mode
+    USBTHING_I2C_MODE_SCAN = 4                  //!< Bus scan mode
 };
 
 struct usbthing_i2c_cfg_s {
@@ -279,48 +955,164 @@ struct usbthing_i2c_transfer_s {
     uint8_t address;                            //!< I2C Device address
     uint8_t num_write;                          //!< Number of bytes to write
     uint8_t num_read;                           //!< Number of bytes to read
-    int8_t result;                              //!< Transaction result
+    int8_t result;                              //!< Transaction result, set in the response
+} __attribute((packed));
+
+struct usbthing_i2c_messages_s {
+    uint8_t mode;                               //!< I2C Transfer mode, messages or scan
+    uint8_t count;                              //!< Number of messages following
+    uint8_t completed;                          //!< Messages completed or addresses probed, set in the response
+    int8_t result;                              //!< Transaction result, set in the response
+} __attribute((packed));
+
+struct usbthing_i2c_msg_s {
+    uint8_t address;                            //!< I2C Device address
+    uint8_t flags;                              //!< USBTHING_I2C_MSG_FLAG_x
+    uint8_t length;                             //!< Number of bytes to write or read
 } __attribute((packed));
 
 /*****      PWM Configuration messages          *****/
+//Channels share one timer and so one frequency. Duty cycles are fractions of USBTHING_PWM_DUTY_FULL,
+//changes are buffered by the timer and take effect at the start of the next period.
+#define USBTHING_PWM_NUM_CHANNELS       2
+#define USBTHING_PWM_DUTY_FULL          0xFFFF
+#define USBTHING_PWM_MIN_FREQUENCY      1
+#define USBTHING_PWM_MAX_FREQUENCY      1000000     //Duty resolution is 48 steps at this frequency
+
+//Capture timestamps every edge on one channel pin from interrupt context, which limits the input frequency.
+//The channel is passed in wIndex when configuring, and results are read with USBTHING_CMD_PWM_GET.
+#define USBTHING_PWM_CAPTURE_MAX_FREQUENCY  100000
+#define USBTHING_PWM_CAPTURE_MAX_TIMEOUT    40000   //Milliseconds
+#define USBTHING_PWM_CAPTURE_MAX_WAVES      65535
 
 enum usbthing_pwm_mode_e {
     PWM_MODE_OUTPUT = 0,
     PWM_MODE_CAPTURE = 1
 };
 
+enum usbthing_pwm_capture_state_e {
+    USBTHING_PWM_CAPTURE_IDLE = 0,
+    USBTHING_PWM_CAPTURE_RUNNING = 1,
+    USBTHING_PWM_CAPTURE_DONE = 2,
+    USBTHING_PWM_CAPTURE_TIMEOUT = 3,           //!< Results cover the whole periods seen, if any
+    USBTHING_PWM_CAPTURE_OVERRUN = 4            //!< Edges arrived faster than they were read, no results
+};
+
+//Measured from the first rising edge over num_waves whole periods
 struct pwm_cfg_cap_s {
     uint32_t timeout_ms;
     uint32_t num_waves;
-};
+} __attribute((packed));
 
 struct pwm_cfg_out_s {
-    uint32_t freq;
-};
+    uint32_t freq;                              //!< Hz
+} __attribute((packed));
 
+//Reconfiguring disables all channels
 struct pwm_cfg_s {
-    uint8_t mode;
+    uint8_t mode;                               //!< usbthing_pwm_mode_e
     union {
         struct pwm_cfg_out_s output;
         struct pwm_cfg_cap_s capture;
     };
-};
+} __attribute((packed));
+
+//Disabled channels are driven low
+struct pwm_enable_s {
+    uint8_t channel;
+    uint8_t enable;
+} __attribute((packed));
 
 struct pwm_set_s {
+    uint8_t channel;
+    uint8_t reserved;
     uint16_t duty_cycle;
-};
+} __attribute((packed));
+
+//All channels change at the start of the same period
+struct pwm_update_s {
+    uint16_t duty_cycle[USBTHING_PWM_NUM_CHANNELS];
+} __attribute((packed));
 
+//Without a whole period the frequency is zero and the duty cycle follows the pin level
 struct pwm_get_s {
-    uint32_t frequency;
-    uint32_t duty_cycle;
-};
+    uint8_t state;                              //!< usbthing_pwm_capture_state_e
+    uint8_t reserved;
+    uint16_t waves;                             //!< Whole periods measured
+    uint32_t frequency;                         //!< Millihertz
+    uint32_t duty_cycle;                        //!< Fraction of USBTHING_PWM_DUTY_FULL
+} __attribute((packed));
 
 struct pwm_cmd_s {
     union {
         struct pwm_cfg_s pwm_cfg;
+        struct pwm_enable_s enable;
+        struct pwm_set_s set;
+        struct pwm_update_s update;
+        struct pwm_get_s get;
     };
+} __attribute((packed));
+
+#define USBTHING_CMD_PWM_CFG_SIZE           (sizeof(struct pwm_cfg_s))
+#define USBTHING_CMD_PWM_EN_SIZE            (sizeof(struct pwm_enable_s))
+#define USBTHING_CMD_PWM_SET_SIZE           (sizeof(struct pwm_set_s))
+#define USBTHING_CMD_PWM_UPDATE_SIZE        (sizeof(struct pwm_update_s))
+#define USBTHING_CMD_PWM_GET_SIZE           (sizeof(struct pwm_get_s))
+
+/*****      UART messages                       *****/
+//Serial bridge. Received bytes are sent on the UART bulk IN endpoint as they arrive, in transfers of up to
+//USBTHING_UART_BLOCK_SIZE bytes that always end in a short packet. Bytes written to the UART bulk OUT endpoint
+//are transmitted in order, the device stops accepting transfers while its transmit blocks are full.
+//Both directions are DMA driven from rings on the device, so no bytes are handled one at a time.
+//TX and RX share PD0 and PD1 with ADC channels CH3 and CH2. Opening the UART is refused while either channel
+//is streamed, captured, monitored or read by the control loop, and reads and captures of either channel are
+//refused while the UART is open.
+#define USBTHING_UART_ADC_CHANNELS          ((1 << USBTHING_ADC_CH2) | (1 << USBTHING_ADC_CH3))
+#define USBTHING_UART_BLOCK_SIZE            512
+#define USBTHING_UART_RX_BUFFER_SIZE        4096    //Device receive ring, 44ms at 921600 baud
+#define USBTHING_UART_TX_BLOCKS             4       //Device transmit blocks of USBTHING_UART_BLOCK_SIZE
+#define USBTHING_UART_MIN_BAUD              300
+#define USBTHING_UART_MAX_BAUD              2000000
+
+enum usbthing_uart_parity_e {
+    USBTHING_UART_PARITY_NONE = 0,
+    USBTHING_UART_PARITY_EVEN = 1,
+    USBTHING_UART_PARITY_ODD = 2
+};
+
+enum usbthing_uart_event_e {
+    USBTHING_UART_EVENT_LOST = 0,               //!< value: received bytes lost since the last report, saturated
+    USBTHING_UART_EVENT_ERROR = 1               //!< value: framing and parity errors since the last report
 };
 
+struct uart_config_s {
+    uint32_t baud;
+    uint8_t data_bits;                          //!< 7 or 8, excluding any parity bit
+    uint8_t parity;                             //!< usbthing_uart_parity_e
+    uint8_t stop_bits;                          //!< 1 or 2
+    uint8_t reserved;
+} __attribute((packed));
+
+struct uart_status_s {
+    uint32_t received;                          //!< Bytes received since configured
+    uint32_t transmitted;                       //!< Bytes transmitted since configured
+    uint32_t lost;                              //!< Received bytes overwritten before being sent to the host
+    uint32_t errors;                            //!< Framing and parity errors
+    uint16_t rx_queued;                         //!< Received bytes waiting to be sent to the host
+    uint16_t tx_queued;                         //!< Bytes waiting to be transmitted
+} __attribute((packed));
+
+struct uart_cmd_s {
+    union {
+        struct uart_config_s config;
+        struct uart_status_s status;
+    };
+} __attribute((packed));
+
+#define USBTHING_CMD_UART_CFG_SIZE          (sizeof(struct uart_config_s))
+#define USBTHING_CMD_UART_STATUS_SIZE       (sizeof(struct uart_status_s))
+#define USBTHING_CMD_UART_STOP_SIZE         0
+
 /*****      Combined control message            *****/
 
 struct usbthing_ctrl_s {
@@ -331,6 +1123,14 @@ struct usbthing_ctrl_s {
         struct spi_cmd_s spi_cmd;
         struct adc_cmd_s adc_cmd;
         struct dac_cmd_s dac_cmd;
+        struct pwm_cmd_s pwm_cmd;
+        struct seq_cmd_s seq_cmd;
+        struct logic_cmd_s logic_cmd;
+        struct trigger_cmd_s trigger_cmd;
+        struct control_cmd_s control_cmd;
+        struct counter_cmd_s counter_cmd;
+        struct motion_cmd_s motion_cmd;
+        struct uart_cmd_s uart_cmd;
     };
 } __attribute((packed));
 
@@ -355,11 +1155,6 @@ enum spi_data_msg_id_e {
     SPI_DATA_MSG_ID_XFER_COMPLETE = 4
 };
 
-struct usbthing_spi_data_msg_xfer_init_s {
-    uint16_t bytes_out;
-    uint16_t bytes_in;
-};
-
 struct usbthing_spi_data_msg_s {
     union {
         struct usbthing_spi_data_msg_xfer_init_s init;
@@ -139,6 +139,60 @@ static const uint8_t configDesc[] __attribute__ ((aligned(4))) = {
   0,                                    /* wMaxPacketSize (MSB) */
   1,                                    /* bInterval            */
 
+  /*** Bulk Endpoint Descriptor 4 (OUT) ***/
+  USB_ENDPOINT_DESCSIZE,                /* bLength              */
+  USB_ENDPOINT_DESCRIPTOR,              /* bDescriptorType      */
+  EP4_OUT,                              /* bEndpointAddress     */
+  USB_EPTYPE_BULK,                      /* bmAttributes         */
+  USB_MAX_EP_SIZE,                      /* wMaxPacketSize (LSB) */
+  0,                                    /* wMaxPacketSize (MSB) */
+  0,                                    /* bInterval            */
+
+  /*** Bulk Endpoint Descriptor 4 (IN) ***/
+  USB_ENDPOINT_DESCSIZE,                /* bLength              */
+  USB_ENDPOINT_DESCRIPTOR,              /* bDescriptorType      */
+  EP4_IN,                               /* bEndpointAddress     */
+  USB_EPTYPE_BULK,                      /* bmAttributes         */
+  USB_MAX_EP_SIZE,                      /* wMaxPacketSize (LSB) */
+  0,                                    /* wMaxPacketSize (MSB) */
+  0,                                    /* bInterval            */
+
+  /*** Bulk Endpoint Descriptor 5 (IN) ***/
+  USB_ENDPOINT_DESCSIZE,                /* bLength              */
+  USB_ENDPOINT_DESCRIPTOR,              /* bDescriptorType      */
+  EP5_IN,                               /* bEndpointAddress     */
+  USB_EPTYPE_BULK,                      /* bmAttributes         */
+  USB_MAX_EP_SIZE,                      /* wMaxPacketSize (LSB) */
+  0,                                    /* wMaxPacketSize (MSB) */
+  0,                                    /* bInterval            */
+
+  /*** Bulk Endpoint Descriptor 5 (OUT) ***/
+  USB_ENDPOINT_DESCSIZE,                /* bLength              */
+  USB_ENDPOINT_DESCRIPTOR,              /* bDescriptorType      */
+  EP5_OUT,                              /* bEndpointAddress     */
+  USB_EPTYPE_BULK,                      /* bmAttributes         */
+  USB_MAX_EP_SIZE,                      /* wMaxPacketSize (LSB) */
+  0,                                    /* wMaxPacketSize (MSB) */
+  0,                                    /* bInterval            */
+
+  /*** Bulk Endpoint Descriptor 6 (IN) ***/
+  USB_ENDPOINT_DESCSIZE,                /* bLength              */
+  USB_ENDPOINT_DESCRIPTOR,              /* bDescriptorType      */
+  EP6_IN,                               /* bEndpointAddress     */
+  USB_EPTYPE_BULK,                      /* bmAttributes         */
+  USB_MAX_EP_SIZE,                      /* wMaxPacketSize (LSB) */
+  0,                                    /* wMaxPacketSize (MSB) */
+  0,                                    /* bInterval            */
+
+  /*** Bulk Endpoint Descriptor 6 (OUT) ***/
+  USB_ENDPOINT_DESCSIZE,                /* bLength              */
+  USB_ENDPOINT_DESCRIPTOR,              /* bDescriptorType      */
+  EP6_OUT,                              /* bEndpointAddress     */
+  USB_EPTYPE_BULK,                      /* bmAttributes         */
+  USB_MAX_EP_SIZE,                      /* wMaxPacketSize (LSB) */
+  0,                                    /* wMaxPacketSize (MSB) */
+  0,                                    /* bInterval            */
+
 };
 
 /* Define the String Descriptor for the device. String must be properly
@@ -168,7 +222,13 @@ static const uint8_t bufferingMultiplier[ NUM_EP_USED + 1 ] = {
   2,  /* Bulk */
   2,  /* Bulk */
   2,  /* Bulk */
-  1   /* Interrupt */
+  1,  /* Interrupt */
+  2,  /* Bulk */
+  2,  /* Bulk */
+  2,  /* Bulk */
+  2,  /* Bulk */
+  2,  /* Bulk */
+  2   /* Bulk */
 };
 
 /* Define callbacks that are called by the USB stack on different events. */
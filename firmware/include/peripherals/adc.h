@@ -11,6 +11,16 @@ extern "C" {
 void ADC_init(uint32_t reference);
 void ADC_close();
 uint32_t ADC_get(uint8_t channel);
+void ADC_set_oversample(uint8_t shift);
+uint32_t ADC_single_time_us();
+
+//Streaming block callback, called from interrupt context with a filled block, returns the next block to fill
+typedef uint16_t *(*adc_stream_cb_t)(uint16_t *block);
+
+int ADC_stream_start(uint32_t inputs, uint32_t rate, uint16_t samples,
+                     uint16_t *first, uint16_t *second, adc_stream_cb_t callback);
+void ADC_stream_stop();
+uint32_t ADC_stream_index(uint64_t timestamp);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,19 @@
+#ifndef COUNTER_H
+#define COUNTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int COUNTER_start(bool quadrature, int pin_a, int pin_b, bool falling);
+void COUNTER_stop();
+int32_t COUNTER_get();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -12,6 +12,20 @@ void DAC_configure();
 void DAC_close();
 void DAC_enable(bool enable);
 void DAC_set(uint32_t value);
+void DAC_trigger(bool enable);
+
+//Streaming block callback, called from interrupt context with a block that has been output,
+//returns the next block to output and sets its length in samples
+typedef uint16_t *(*dac_stream_cb_t)(uint16_t *block, uint16_t *samples);
+
+int DAC_stream_start(uint32_t rate, uint16_t *first, uint16_t first_samples,
+                     uint16_t *second, uint16_t second_samples, dac_stream_cb_t callback);
+int DAC_stream_start_ticks(uint32_t ticks, uint16_t *first, uint16_t first_samples,
+                           uint16_t *second, uint16_t second_samples, dac_stream_cb_t callback);
+uint32_t DAC_stream_clock();
+int DAC_stream_rate(uint32_t rate);
+int DAC_stream_ticks(uint32_t ticks);
+void DAC_stream_stop();
 
 #ifdef __cplusplus
 }
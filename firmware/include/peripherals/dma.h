@@ -0,0 +1,31 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "em_dma.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//DMA channel allocation, each peripheral driver owns its channels
+enum dma_channel_e {
+	DMA_CHANNEL_SPI_RX = 0,
+	DMA_CHANNEL_SPI_TX = 1,
+	DMA_CHANNEL_ADC = 2,
+	DMA_CHANNEL_LOGIC_LOW = 3,
+	DMA_CHANNEL_LOGIC_HIGH = 4,
+	DMA_CHANNEL_DAC = 5,
+	DMA_CHANNEL_UART_RX = 6,
+	DMA_CHANNEL_UART_TX = 7
+};
+
+void DMA_init();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
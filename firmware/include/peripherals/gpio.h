@@ -3,6 +3,7 @@
 #define GPIO_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 enum gpio_mode_e {
 	GPIO_MODE_INPUT,
@@ -15,7 +16,8 @@ enum gpio_pin_e {
 	GPIO2 = 2,
 	GPIO3 = 3,
 	GPIO4 = 4,
-	GPIO5 = 5
+	GPIO5 = 5,
+	GPIO_NUM_PINS = 6
 };
 
 enum led_pin_e {
@@ -37,4 +39,23 @@ extern void GPIO_led_set(int led, bool value);
 
 extern bool GPIO_get(int pin);
 
+extern void GPIO_set_mask(uint32_t set, uint32_t clear, uint32_t toggle);
+
+extern uint32_t GPIO_get_mask();
+
+extern uint32_t GPIO_port_bits(int port, uint32_t pins);
+
+//Edge interrupt callback, called from interrupt context with the level after the edge
+typedef void (*gpio_int_cb_t)(uint8_t pin, bool level, uint64_t timestamp);
+
+extern void GPIO_configure_int(int pin, bool rising, bool falling);
+
+extern void GPIO_set_int_callback(int pin, gpio_int_cb_t callback);
+
+extern gpio_int_cb_t GPIO_get_int_callback(int pin);
+
+extern void GPIO_get_int_config(int pin, bool *rising, bool *falling);
+
+extern int GPIO_prs_signal(int pin, uint32_t *source, uint32_t *signal);
+
 #endif
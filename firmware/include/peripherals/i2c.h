@@ -3,8 +3,33 @@
 #define I2C_H
 
 #include <stdint.h>
+#include <stdbool.h>
+
+//Transfer results
+#define I2C_RESULT_OK           0
+#define I2C_RESULT_NACK         -1      //Address or data not acknowledged
+#define I2C_RESULT_ERROR        -2      //Arbitration lost or bus error
+#define I2C_RESULT_TIMEOUT      -3      //Abandoned at its deadline
+#define I2C_RESULT_BUSY         -4      //A transfer is already running
+
+//Message flags
+#define I2C_MSG_FLAG_READ       (1 << 0)
+
+//Single message of a transfer, messages after the first follow a repeated start
+struct i2c_msg_s {
+    uint8_t address;
+    uint8_t flags;
+    uint16_t length;
+    uint8_t *data;
+};
+
+//Transfer completion callback, called from interrupt context with the number of messages completed
+typedef void (*i2c_xfer_cb_t)(int8_t result, uint8_t completed);
 
 void I2C_init(uint32_t baud);
+int8_t I2C_transfer_start(struct i2c_msg_s *msgs, uint8_t count, i2c_xfer_cb_t callback);
+bool I2C_busy();
+void I2C_poll();
 int8_t I2C_write(uint8_t address, uint32_t num_bytes, const uint8_t *data_array);
 int8_t I2C_read(uint8_t address, uint32_t num_bytes, uint8_t *data_array);
 int8_t I2C_write_read(uint8_t address, uint32_t num_write_bytes, const uint8_t *write_data_array, uint32_t num_read_bytes, uint8_t *read_data_array);
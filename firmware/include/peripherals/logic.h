@@ -0,0 +1,22 @@
+#ifndef LOGIC_H
+#define LOGIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Capture segment callback, called from interrupt context with a filled segment, returns the next segment to fill
+typedef uint32_t *(*logic_capture_cb_t)(uint32_t *segment);
+
+int LOGIC_start(uint32_t rate, uint16_t samples, uint32_t *first, uint32_t *second, logic_capture_cb_t callback);
+void LOGIC_stop();
+uint32_t LOGIC_index(uint64_t timestamp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
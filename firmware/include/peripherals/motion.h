@@ -0,0 +1,27 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Move completion callback, called from interrupt context with whether the target was reached
+typedef void (*motion_done_cb_t)(bool reached, int32_t position);
+
+int MOTION_configure(int step_pin, int dir_pin, bool invert);
+int MOTION_start(int32_t target, uint32_t speed, uint32_t acceleration, motion_done_cb_t callback);
+void MOTION_stop(bool halt);
+bool MOTION_busy();
+int32_t MOTION_position();
+int32_t MOTION_target();
+uint32_t MOTION_speed();
+int MOTION_set_position(int32_t position);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,4 +1,3 @@
-
 #ifndef PWM_H
 #define PWM_H
 
@@ -9,10 +8,18 @@
 extern "C" {
 #endif
 
-void PWM_init();
+//Interrupt handler for a driver borrowing the timer, passed the enabled flags that were set
+typedef void (*pwm_timer_handler_t)(uint32_t flags);
+
+int PWM_init(uint32_t frequency);
 void PWM_close();
 void PWM_enable(uint8_t channel, bool enable);
-void PWM_set(uint8_t channel);
+void PWM_set(uint8_t channel, uint16_t duty);
+void PWM_update(const uint16_t *duty);
+int PWM_capture_start(uint8_t channel, uint32_t waves, uint32_t timeout_ms);
+uint8_t PWM_capture_result(uint32_t *frequency, uint32_t *duty, uint32_t *waves);
+void PWM_timer_claim(pwm_timer_handler_t handler);
+bool PWM_timer_claimed();
 
 #ifdef __cplusplus
 }
@@ -1,11 +1,21 @@
-
 #ifndef SPI_H
 #define SPI_H
 
 #include <stdint.h>
+#include <stdbool.h>
+
+//Transfer flags
+#define SPI_XFER_FLAG_HOLD_CS		(1 << 0)	//Leave CS asserted on completion
+
+//Transfer completion callback, called from interrupt context
+typedef void (*spi_xfer_cb_t)(int8_t result, uint16_t length);
 
 int8_t SPI_init(uint32_t baud, uint8_t clock_mode);
 int8_t SPI_transfer(uint16_t length, uint8_t *data_out, uint8_t *data_in);
+int8_t SPI_transfer_start(uint16_t length, uint8_t *data_out, uint8_t *data_in, uint8_t flags, spi_xfer_cb_t callback);
+bool SPI_busy();
+void SPI_cs_assert();
+void SPI_cs_release();
 int8_t SPI_close();
 
 #endif
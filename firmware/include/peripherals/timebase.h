@@ -0,0 +1,19 @@
+#ifndef TIMEBASE_H
+#define TIMEBASE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Free running 64 bit timebase at the core clock rate (USBTHING_TIMEBASE_HZ)
+void TIMEBASE_init();
+uint64_t TIMEBASE_get();
+void TIMEBASE_update();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef UART_H
+#define UART_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//Transmit completion callback, called from interrupt context once a block has been handed to the USART
+typedef void (*uart_tx_cb_t)();
+
+int UART_init(uint32_t baud, uint8_t data_bits, uint8_t parity, uint8_t stop_bits);
+void UART_close();
+uint16_t UART_rx_read(uint8_t *data, uint16_t size);
+uint32_t UART_rx_queued();
+uint32_t UART_rx_received();
+uint32_t UART_rx_lost();
+uint32_t UART_rx_errors();
+int UART_write(const uint8_t *data, uint16_t length, uart_tx_cb_t callback);
+bool UART_tx_busy();
+
+#endif
@@ -6,9 +6,16 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #include "em_usb.h"
 
 int adc_handle_setup(const USB_Setup_TypeDef *setup);
+void adc_svc_poll();
+bool adc_svc_busy();
+bool adc_svc_configured();
+uint8_t adc_svc_channels();
 
 #ifdef __cplusplus
 }
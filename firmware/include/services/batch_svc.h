@@ -0,0 +1,22 @@
+#ifndef BATCH_SVC_H
+#define BATCH_SVC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "em_usb.h"
+#include "protocol.h"
+
+void batch_svc_start();
+void batch_svc_poll();
+int batch_svc_execute(const uint8_t *request, uint16_t length, uint8_t *response, uint16_t size);
+int batch_svc_run_op(const struct usbthing_batch_op_s *op, const uint8_t *payload, uint8_t *result, uint16_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
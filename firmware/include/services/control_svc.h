@@ -0,0 +1,23 @@
+#ifndef CONTROL_SVC_H
+#define CONTROL_SVC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "em_usb.h"
+
+int control_handle_setup(const USB_Setup_TypeDef *setup);
+bool control_svc_busy();
+bool control_svc_output(uint8_t output);
+uint8_t control_svc_channels();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
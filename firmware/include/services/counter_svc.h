@@ -0,0 +1,17 @@
+#ifndef COUNTER_SVC_H
+#define COUNTER_SVC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "em_usb.h"
+
+int counter_handle_setup(const USB_Setup_TypeDef *setup);
+void counter_svc_poll();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -6,9 +6,13 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
+
 #include "em_usb.h"
 
 int dac_handle_setup(const USB_Setup_TypeDef *setup);
+bool dac_svc_busy();
+void dac_svc_poll();
 
 #ifdef __cplusplus
 }
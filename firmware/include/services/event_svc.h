@@ -0,0 +1,17 @@
+#ifndef EVENT_SVC_H
+#define EVENT_SVC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+void event_svc_start();
+void event_svc_push(uint8_t source, uint8_t id, uint16_t value, uint64_t timestamp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,4 +1,3 @@
-
 #ifndef I2C_SVC_H
 #define I2C_SVC_H
 
@@ -8,13 +7,12 @@ extern "C" {
 
 #include "em_usb.h"
 
-void i2c_start();
-int i2c_handle_setup(const USB_Setup_TypeDef *setup);
-int i2c_data_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
-int i2c_data_receive_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+void i2c_svc_start();
+int i2c_svc_handle_setup(const USB_Setup_TypeDef *setup);
+void i2c_svc_poll();
 
 #ifdef __cplusplus
 }
 #endif
 
-#endiI2C
\ No newline at end of file
+#endif
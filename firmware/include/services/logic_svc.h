@@ -0,0 +1,20 @@
+#ifndef LOGIC_SVC_H
+#define LOGIC_SVC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "em_usb.h"
+
+int logic_handle_setup(const USB_Setup_TypeDef *setup);
+void logic_svc_poll();
+bool logic_svc_busy();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef MOTION_SVC_H
+#define MOTION_SVC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "em_usb.h"
+
+int motion_handle_setup(const USB_Setup_TypeDef *setup);
+bool motion_svc_busy();
+void motion_svc_poll();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef PWM_SVC_H
+#define PWM_SVC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "em_usb.h"
+
+int pwm_handle_setup(const USB_Setup_TypeDef *setup);
+bool pwm_svc_ready();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
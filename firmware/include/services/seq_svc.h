@@ -0,0 +1,17 @@
+#ifndef SEQ_SVC_H
+#define SEQ_SVC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "em_usb.h"
+
+void seq_svc_init();
+int seq_handle_setup(const USB_Setup_TypeDef *setup);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef TRIGGER_SVC_H
+#define TRIGGER_SVC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "em_usb.h"
+
+int trigger_handle_setup(const USB_Setup_TypeDef *setup);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
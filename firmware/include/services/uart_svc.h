@@ -0,0 +1,20 @@
+#ifndef UART_SVC_H
+#define UART_SVC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "em_usb.h"
+
+int uart_handle_setup(const USB_Setup_TypeDef *setup);
+void uart_svc_poll();
+bool uart_svc_busy();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
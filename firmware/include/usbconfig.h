@@ -44,7 +44,7 @@ extern "C" {
 #define USB_DEVICE
 
 /* Specify number of endpoints used (in addition to EP0) */
-#define NUM_EP_USED 5
+#define NUM_EP_USED 11
 
 /* Select TIMER0 to be used by the USB stack. This timer
  * must not be used by the application. */
@@ -70,6 +70,24 @@ extern "C" {
 /* Endpoint for USB interrupt data IN  (device to host).    */
 #define EP_INT_IN          0x83
 
+/* Endpoint for batch commands OUT (host to device).    */
+#define EP4_OUT            0x04
+
+/* Endpoint for batch results IN  (device to host).    */
+#define EP4_IN             0x84
+
+/* Endpoint for streamed samples IN  (device to host).    */
+#define EP5_IN             0x85
+
+/* Endpoint for streamed samples OUT (host to device).    */
+#define EP5_OUT            0x05
+
+/* Endpoint for UART received data IN  (device to host).    */
+#define EP6_IN             0x86
+
+/* Endpoint for UART transmit data OUT (host to device).    */
+#define EP6_OUT            0x06
+
 /**********************************************************
  * Debug Configuration. Enable the stack to output
  * debug messages to a console. This example is
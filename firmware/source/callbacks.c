@@ -49,22 +49,28 @@
 #include "services/gpio_svc.h"
 #include "services/adc_svc.h"
 #include "services/spi_svc.h"
+#include "services/i2c_svc.h"
 #include "services/dac_svc.h"
+#include "services/pwm_svc.h"
+#include "services/batch_svc.h"
+#include "services/seq_svc.h"
+#include "services/event_svc.h"
+#include "services/logic_svc.h"
+#include "services/trigger_svc.h"
+#include "services/control_svc.h"
+#include "services/counter_svc.h"
+#include "services/motion_svc.h"
+#include "services/uart_svc.h"
 
 #include "peripherals/gpio.h"
-#include "peripherals/i2c.h"
 #include "peripherals/spi.h"
 #include "peripherals/dac.h"
 
 
-#define BUFFERSIZE 500
-
 /* Buffer to receive incoming messages. Needs to be
  * WORD aligned and an integer number of WORDs large */
 
 UBUF(cmd_buffer, 32);
-STATIC_UBUF(i2c_receive_buffer, BUFFERSIZE);
-STATIC_UBUF(i2c_transmit_buffer, BUFFERSIZE);
 
 
 /* Counter to increase when receiving a 'tick' message */
@@ -98,7 +104,9 @@ void stateChange(USBD_State_TypeDef oldState, USBD_State_TypeDef newState)
     } else if (newState == USBD_STATE_CONFIGURED) {
         /* Start waiting for the 'tick' messages */
         spi_svc_start();
-        USBD_Read(EP2_OUT, i2c_receive_buffer, BUFFERSIZE, i2c_data_receive_callback);
+        batch_svc_start();
+        event_svc_start();
+        i2c_svc_start();
         GPIO_conn_led_set(true);
 
     } else if ( newState != USBD_STATE_SUSPENDED ) {
@@ -106,42 +114,6 @@ void stateChange(USBD_State_TypeDef oldState, USBD_State_TypeDef newState)
     }
 }
 
-static int i2c_configured = 0;
-
-int i2c_configure(const USB_Setup_TypeDef *setup)
-{
-    int res = USB_STATUS_REQ_ERR;
-
-    CHECK_SETUP_OUT(USBTHING_I2C_CFG_SIZE);
-
-    uint8_t mode = setup->wValue;
-    uint8_t flags = setup->wIndex;
-    uint32_t baud;
-
-    //Set baud rate based on mode
-    switch (mode) {
-    case USBTHING_I2C_SPEED_STANDARD:
-        baud = 100000;
-        break;
-    case USBTHING_I2C_SPEED_FULL:
-        baud = 400000;
-        break;
-    case USBTHING_I2C_SPEED_FAST:
-        baud = 1000000;
-        break;
-    case USBTHING_I2C_SPEED_HIGH:
-        baud = 3200000;
-        break;
-    }
-
-    //Initialize I2C
-    I2C_init(baud);
-
-    i2c_configured = 1;
-
-    return USB_STATUS_OK;
-}
-
 int setupCmd(const USB_Setup_TypeDef *setup)
 {
     //TODO: handle commands
@@ -162,65 +134,34 @@ int setupCmd(const USB_Setup_TypeDef *setup)
     case USBTHING_MODULE_DAC:
         return dac_handle_setup(setup);
 
-    case USBTHING_CMD_I2C_CFG:
-        return i2c_configure(setup);
-    }
+    case USBTHING_MODULE_PWM:
+        return pwm_handle_setup(setup);
 
-    //Signal command was not handled
-    return USB_STATUS_REQ_UNHANDLED;
-}
+    case USBTHING_MODULE_SEQ:
+        return seq_handle_setup(setup);
 
-int i2c_data_sent_callback(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
-{
-    /* Remove warnings for unused variables */
-    (void)xferred;
-    (void)remaining;
+    case USBTHING_MODULE_LOGIC:
+        return logic_handle_setup(setup);
 
-    //Restart EP_OUT
-    USBD_Read(EP1_OUT, i2c_receive_buffer, BUFFERSIZE, i2c_data_receive_callback);
+    case USBTHING_MODULE_TRIGGER:
+        return trigger_handle_setup(setup);
 
-    if ( status != USB_STATUS_OK ) {
-        /* Handle error */
-    }
-    return USB_STATUS_OK;
-}
+    case USBTHING_MODULE_CONTROL:
+        return control_handle_setup(setup);
 
-int i2c_data_receive_callback(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
-{
-    //Remove unused variable warnings
-    (void)xferred;
-    (void)remaining;
-
-    //TODO: what if i2c is not initialized?
-
-    if ( status == USB_STATUS_OK ) {
-        struct usbthing_i2c_transfer_s *config = (struct usbthing_i2c_transfer_s *) i2c_receive_buffer;
-
-        //TODO: bounds checking of num_write, num_read vs. xferred and maximum
-
-        //Call hardware function based on mode
-        switch (config->mode) {
-        case USBTHING_I2C_MODE_WRITE:
-            I2C_write(config->address, config->num_write, i2c_receive_buffer + sizeof(struct usbthing_i2c_transfer_s));
-            //nb. dummy write back to USB (allows ordering/exclusion)
-            USBD_Write(EP2_IN, i2c_receive_buffer + sizeof(struct usbthing_i2c_transfer_s), config->num_write, i2c_data_sent_callback);
-            break;
-        case USBTHING_I2C_MODE_READ:
-            I2C_read(config->address, config->num_read, i2c_transmit_buffer);
-            USBD_Write(EP2_IN, i2c_transmit_buffer, config->num_read, i2c_data_sent_callback);
-            break;
-        case USBTHING_I2C_MODE_WRITE_READ:
-            I2C_write_read(config->address, config->num_write, i2c_receive_buffer + sizeof(struct usbthing_i2c_transfer_s), config->num_read, i2c_transmit_buffer);
-            USBD_Write(EP2_IN, i2c_transmit_buffer, config->num_read, i2c_data_sent_callback);
-            break;
-        }
-
-    } else {
-        //TODO: handle errors
-
-        //Restart EP_OUT
-        USBD_Read(EP1_OUT, i2c_receive_buffer, BUFFERSIZE, i2c_data_receive_callback);
+    case USBTHING_MODULE_COUNTER:
+        return counter_handle_setup(setup);
+
+    case USBTHING_MODULE_MOTION:
+        return motion_handle_setup(setup);
+
+    case USBTHING_MODULE_UART:
+        return uart_handle_setup(setup);
+
+    case USBTHING_CMD_I2C_CFG:
+        return i2c_svc_handle_setup(setup);
     }
 
-    return USB_STATUS_OK;
+    //Signal command was not handled
+    return USB_STATUS_REQ_UNHANDLED;
 }
@@ -45,7 +45,17 @@
 #include "descriptors.h"
 #include "platform.h"
 #include "peripherals/gpio.h"
+#include "peripherals/timebase.h"
 #include "services/spi_svc.h"
+#include "services/i2c_svc.h"
+#include "services/batch_svc.h"
+#include "services/adc_svc.h"
+#include "services/seq_svc.h"
+#include "services/logic_svc.h"
+#include "services/dac_svc.h"
+#include "services/counter_svc.h"
+#include "services/motion_svc.h"
+#include "services/uart_svc.h"
 
 #define DEBUG_USB
 
@@ -74,9 +84,15 @@ int main(void)
 
     printf("\nStarting USB Device...\n");
 
+    /* Start event timebase */
+    TIMEBASE_init();
+
     /* Set up GPIO interrupts */
     GPIO_init();
 
+    /* Set up sequencer timer */
+    seq_svc_init();
+
     /* Start USB stack. Callback routines in callbacks.c will be called
      * when connected to a host.  */
     USBD_Init(&initstruct);
@@ -92,6 +108,31 @@ int main(void)
 #endif
 
     while (1) {
+        //Execute any pending batch outside of interrupt context
+        batch_svc_poll();
+
+        //Reorder completed scope and logic captures outside of interrupt context
+        adc_svc_poll();
+        logic_svc_poll();
+
+        //Build pending function generator tables outside of interrupt context
+        dac_svc_poll();
+
+        //Report counter changes at the requested interval
+        counter_svc_poll();
+
+        //Report stepper positions while moving
+        motion_svc_poll();
+
+        //Forward received UART bytes and report losses
+        uart_svc_poll();
+
+        //Start I2C transfers held behind a batch, and abandon any past their deadline
+        i2c_svc_poll();
+
+        //Extend the timebase across counter wraps
+        TIMEBASE_update();
+
         if(usbthing_busy > 0) {
             GPIO_act_led_set(true);
         } else{
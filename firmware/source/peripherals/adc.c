@@ -1,4 +1,3 @@
-
 #include "peripherals/adc.h"
 
 #include <stdint.h>
@@ -6,20 +5,60 @@
 #include "em_cmu.h"
 #include "em_adc.h"
 #include "em_gpio.h"
+#include "em_prs.h"
+#include "em_timer.h"
+#include "em_dma.h"
 
 #include "platform.h"
+#include "peripherals/dma.h"
+#include "peripherals/timebase.h"
+
+#define ADC_SINGLE_UNCONFIGURED     0xFF
+#define ADC_CLOCK_HZ                7000000
+#define ADC_CLOCK_FAST_HZ           13000000    //Maximum ADC clock
+#define ADC_FAST_THRESHOLD          200000      //Conversions per second above which the fast clock is used
+#define ADC_RESULT_BITS             16          //Single results are left aligned to this width
+#define ADC_OVS_BITS                4           //Extra bits gained by oversampling, larger ratios are shifted down
+#define ADC_SINGLE_CYCLES           (32 + 13)   //Acquisition and 12 bit conversion clocks per single sample
+#define ADC_WARMUP_US               1           //The ADC is warmed up again for each single conversion
+
+static void adc_dma_complete(unsigned int channel, bool primary, void *user);
 
 static int voltage_reference = adcRefVDD;
 
+//Input currently configured for single conversions, avoids reconfiguring on every read
+static uint8_t single_channel = ADC_SINGLE_UNCONFIGURED;
+
+//Single conversions average 1 << oversample samples in hardware, kept across ADC_init
+static uint8_t oversample = 0;
+
+//Streaming state, each DMA descriptor fills one block before the callback supplies the next
+static DMA_CB_TypeDef adc_dma_cb = {
+    .cbFunc = adc_dma_complete,
+    .userPtr = NULL
+};
+
+static adc_stream_cb_t stream_callback = NULL;
+static uint16_t *stream_blocks[2];
+static uint16_t stream_samples = 0;
+
+//Sample clock timing, for mapping timestamps onto scan indices
+static uint64_t stream_start_time = 0;
+static uint32_t stream_period = 1;
+
 void ADC_init(uint32_t reference)
 {
     ADC_Init_TypeDef adc_init = ADC_INIT_DEFAULT;
 
     adc_init.timebase = ADC_TimebaseCalc(0);
-    adc_init.prescale = ADC_PrescaleCalc(7000000, 0);
+    adc_init.prescale = ADC_PrescaleCalc(ADC_CLOCK_HZ, 0);
+    if (oversample != 0) {
+        adc_init.ovsRateSel = (ADC_OvsRateSel_TypeDef)(oversample - 1);
+    }
 
     //Todo: fine tuned config here
     voltage_reference = reference;
+    single_channel = ADC_SINGLE_UNCONFIGURED;
 
     CMU_ClockEnable(ADC_CLOCK, true);
 
@@ -28,21 +67,47 @@ void ADC_init(uint32_t reference)
 
 void ADC_close()
 {
+    ADC_stream_stop();
+
     ADC_Reset(ADC_DEVICE);
 
+    single_channel = ADC_SINGLE_UNCONFIGURED;
+
     CMU_ClockEnable(ADC_CLOCK, false);
 }
 
+//Set the single conversion oversampling ratio (1 << shift), scans are unaffected as they use 12 bit results
+void ADC_set_oversample(uint8_t shift)
+{
+    oversample = shift;
+
+    if (shift != 0) {
+        ADC_DEVICE->CTRL = (ADC_DEVICE->CTRL & ~_ADC_CTRL_OVSRSEL_MASK)
+                           | ((uint32_t)(shift - 1) << _ADC_CTRL_OVSRSEL_SHIFT);
+    }
+
+    //Resolution is set per conversion type
+    single_channel = ADC_SINGLE_UNCONFIGURED;
+}
+
+//Single conversion, left aligned to ADC_RESULT_BITS
 uint32_t ADC_get(uint8_t channel)
 {
-    uint16_t res;
-    ADC_InitSingle_TypeDef single_init = ADC_INITSINGLE_DEFAULT;
+    uint32_t res;
+    uint8_t bits;
+
+    if (channel != single_channel) {
+        ADC_InitSingle_TypeDef single_init = ADC_INITSINGLE_DEFAULT;
 
-    single_init.input = channel;
-    single_init.reference = voltage_reference;
-    single_init.acqTime = adcAcqTime32;
+        single_init.input = channel;
+        single_init.reference = voltage_reference;
+        single_init.acqTime = adcAcqTime32;
+        single_init.resolution = (oversample != 0) ? adcResOVS : adcRes12Bit;
 
-    ADC_InitSingle(ADC_DEVICE, &single_init);
+        ADC_InitSingle(ADC_DEVICE, &single_init);
+
+        single_channel = channel;
+    }
 
     ADC_Start(ADC_DEVICE, adcStartSingle);
 
@@ -51,5 +116,169 @@ uint32_t ADC_get(uint8_t channel)
 
     res = ADC_DataSingleGet(ADC_DEVICE);
 
-    return res;
-}
\ No newline at end of file
+    //Oversampled results gain a bit per doubling up to 16 bits, beyond that the hardware shifts them down
+    bits = 12 + ((oversample < ADC_OVS_BITS) ? oversample : ADC_OVS_BITS);
+
+    return res << (ADC_RESULT_BITS - bits);
+}
+
+//Time taken by ADC_get at the current oversampling ratio in microseconds, rounded up
+uint32_t ADC_single_time_us()
+{
+    uint32_t clock = CMU_ClockFreqGet(cmuClock_HFPER) / (ADC_PrescaleCalc(ADC_CLOCK_HZ, 0) + 1);
+    uint64_t cycles = (uint64_t)ADC_SINGLE_CYCLES << oversample;
+
+    return ADC_WARMUP_US + (uint32_t)((cycles * 1000000 + clock - 1) / clock);
+}
+
+//Scan the given inputs (ADC_SCANCTRL_INPUTMASK_x) at rate scans per second, results are DMAd in
+//blocks of samples conversions alternately into first and second, then into buffers returned by the callback
+//Above ADC_FAST_THRESHOLD conversions per second the ADC clock is raised and acquisition time shortened
+//At rate zero each scan is started by the trigger route (TRIGGER_ADC_PRS_CHANNEL) instead of the sample clock
+int ADC_stream_start(uint32_t inputs, uint32_t rate, uint16_t samples,
+                     uint16_t *first, uint16_t *second, adc_stream_cb_t callback)
+{
+    uint32_t ticks = 0;
+    uint8_t prescale = 0;
+    uint8_t count = 0;
+    bool fast;
+
+    if ((inputs == 0) || (samples == 0) || (samples > 1024)) {
+        return -1;
+    }
+
+    ADC_stream_stop();
+
+    for (uint8_t i = 0; i < 32; i++) {
+        if (inputs & (1 << i)) {
+            count ++;
+        }
+    }
+    fast = (rate * count) > ADC_FAST_THRESHOLD;
+
+    CMU_ClockEnable(cmuClock_PRS, true);
+
+    //Sample clock, timer overflow triggers a scan over PRS
+    if (rate != 0) {
+        ticks = CMU_ClockFreqGet(cmuClock_HFPER) / rate;
+        while (((ticks >> prescale) > 0x10000) && (prescale < timerPrescale1024)) {
+            prescale ++;
+        }
+        if ((ticks >> prescale) < 2) {
+            return -2;
+        }
+
+        CMU_ClockEnable(SAMPLE_TIMER_CLOCK, true);
+
+        TIMER_Init_TypeDef timer_init = TIMER_INIT_DEFAULT;
+        timer_init.enable = false;
+        timer_init.prescale = (TIMER_Prescale_TypeDef)prescale;
+
+        TIMER_Init(SAMPLE_TIMER, &timer_init);
+        TIMER_TopSet(SAMPLE_TIMER, (ticks >> prescale) - 1);
+        TIMER_CounterSet(SAMPLE_TIMER, 0);
+
+        PRS_SourceSignalSet(SAMPLE_PRS_CHANNEL, SAMPLE_PRS_SOURCE, SAMPLE_PRS_SIGNAL, prsEdgeOff);
+    }
+
+    //Scan sequence, a shorter acquisition time than single reads to allow higher rates
+    ADC_InitScan_TypeDef scan_init = ADC_INITSCAN_DEFAULT;
+    scan_init.prsSel = (rate != 0) ? SAMPLE_ADC_PRSSEL : TRIGGER_ADC_PRSSEL;
+    scan_init.prsEnable = true;
+    scan_init.reference = voltage_reference;
+    scan_init.acqTime = (fast == true) ? adcAcqTime2 : adcAcqTime8;
+    scan_init.input = inputs;
+
+    ADC_InitScan(ADC_DEVICE, &scan_init);
+
+    ADC_DEVICE->CTRL = (ADC_DEVICE->CTRL & ~_ADC_CTRL_PRESC_MASK)
+                       | ((uint32_t)ADC_PrescaleCalc((fast == true) ? ADC_CLOCK_FAST_HZ : ADC_CLOCK_HZ, 0)
+                          << _ADC_CTRL_PRESC_SHIFT);
+
+    //Ping-pong DMA from the scan result register
+    DMA_init();
+
+    DMA_CfgChannel_TypeDef channel = {
+        .highPri = false,
+        .enableInt = true,
+        .select = ADC_DMAREQ_SCAN,
+        .cb = &adc_dma_cb
+    };
+    DMA_CfgChannel(DMA_CHANNEL_ADC, &channel);
+
+    DMA_CfgDescr_TypeDef descr = {
+        .dstInc = dmaDataInc2,
+        .srcInc = dmaDataIncNone,
+        .size = dmaDataSize2,
+        .arbRate = dmaArbitrate1,
+        .hprot = 0
+    };
+    DMA_CfgDescr(DMA_CHANNEL_ADC, true, &descr);
+    DMA_CfgDescr(DMA_CHANNEL_ADC, false, &descr);
+
+    stream_callback = callback;
+    stream_samples = samples;
+    stream_blocks[0] = first;
+    stream_blocks[1] = second;
+
+    DMA_ActivatePingPong(DMA_CHANNEL_ADC, false,
+                         first, (void *)&ADC_DEVICE->SCANDATA, samples - 1,
+                         second, (void *)&ADC_DEVICE->SCANDATA, samples - 1);
+
+    //The sample timer and timebase both run from the 48MHz core clock, triggered scans have no fixed period
+    stream_period = (rate != 0) ? (ticks >> prescale) << prescale : 1;
+    stream_start_time = TIMEBASE_get();
+
+    if (rate != 0) {
+        TIMER_Enable(SAMPLE_TIMER, true);
+    }
+
+    return 0;
+}
+
+//Index of the first scan started after the given timestamp
+uint32_t ADC_stream_index(uint64_t timestamp)
+{
+    if (timestamp <= stream_start_time) {
+        return 0;
+    }
+
+    return (timestamp - stream_start_time) / stream_period;
+}
+
+void ADC_stream_stop()
+{
+    if (stream_callback == NULL) {
+        return;
+    }
+
+    TIMER_Enable(SAMPLE_TIMER, false);
+    DMA_ChannelEnable(DMA_CHANNEL_ADC, false);
+
+    //Disable PRS triggering so single conversions are unaffected, and restore the default clock
+    ADC_DEVICE->SCANCTRL &= ~ADC_SCANCTRL_PRSEN;
+    ADC_DEVICE->CTRL = (ADC_DEVICE->CTRL & ~_ADC_CTRL_PRESC_MASK)
+                       | ((uint32_t)ADC_PrescaleCalc(ADC_CLOCK_HZ, 0) << _ADC_CTRL_PRESC_SHIFT);
+
+    stream_callback = NULL;
+}
+
+//Called from the DMA interrupt each time a block is complete
+static void adc_dma_complete(unsigned int channel, bool primary, void *user)
+{
+    (void)user;
+
+    uint8_t index = (primary == true) ? 0 : 1;
+
+    if (stream_callback == NULL) {
+        return;
+    }
+
+    //Hand the block over and refill the descriptor with the next buffer, the callback may stop the stream
+    stream_blocks[index] = stream_callback(stream_blocks[index]);
+    if (stream_callback == NULL) {
+        return;
+    }
+
+    DMA_RefreshPingPong(channel, primary, false, stream_blocks[index], NULL, stream_samples - 1, false);
+}
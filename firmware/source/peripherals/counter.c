@@ -0,0 +1,130 @@
+#include "peripherals/counter.h"
+
+#include <stdint.h>
+
+#include "em_device.h"
+#include "em_cmu.h"
+#include "em_int.h"
+#include "em_pcnt.h"
+#include "em_prs.h"
+
+#include "platform.h"
+#include "peripherals/gpio.h"
+
+//Upper half of the count, moved on each hardware overflow or underflow
+static volatile int32_t counter_high = 0;
+static bool counter_running = false;
+static int32_t counter_final = 0;
+
+//Count edges on GPIO pin_a, in quadrature with pin_b or with pin_b (if not negative) giving the direction.
+//The pulse counter is clocked by its S0 input so it keeps up with edges far faster than interrupts could.
+int COUNTER_start(bool quadrature, int pin_a, int pin_b, bool falling)
+{
+    uint32_t source_a, signal_a;
+    uint32_t source_b, signal_b;
+
+    if ((GPIO_prs_signal(pin_a, &source_a, &signal_a) < 0)
+        || ((pin_b >= 0) && (GPIO_prs_signal(pin_b, &source_b, &signal_b) < 0))
+        || ((pin_b < 0) && quadrature) || (pin_a == pin_b)) {
+        return -1;
+    }
+
+    COUNTER_stop();
+
+    CMU_ClockEnable(cmuClock_PRS, true);
+    PRS_SourceSignalSet(COUNTER_S0_PRS_CHANNEL, source_a, signal_a, prsEdgeOff);
+    if (pin_b >= 0) {
+        PRS_SourceSignalSet(COUNTER_S1_PRS_CHANNEL, source_b, signal_b, prsEdgeOff);
+    }
+
+    //Register writes are synchronised through the LFA branch, set up as for the DAC output clock
+    CMU_ClockEnable(cmuClock_CORELE, true);
+    CMU_ClockSelectSet(cmuClock_LFA, cmuSelect_CORELEDIV2);
+    CMU_ClockEnable(COUNTER_CLOCK, true);
+
+    PCNT_Init_TypeDef init = PCNT_INIT_DEFAULT;
+    init.mode = (quadrature == true) ? pcntModeExtQuad : pcntModeExtSingle;
+    init.counter = 0;
+    init.top = 0xFFFF;
+    init.negEdge = falling;
+    init.s1CntDir = (pin_b >= 0);
+    init.s0PRS = COUNTER_S0_PRSSEL;
+    init.s1PRS = COUNTER_S1_PRSSEL;
+
+    PCNT_PRSInputEnable(COUNTER_DEVICE, pcntPRSInputS0, true);
+    PCNT_PRSInputEnable(COUNTER_DEVICE, pcntPRSInputS1, pin_b >= 0);
+    PCNT_Init(COUNTER_DEVICE, &init);
+
+    counter_high = 0;
+    counter_final = 0;
+
+    PCNT_IntClear(COUNTER_DEVICE, PCNT_IF_OF | PCNT_IF_UF);
+    PCNT_IntEnable(COUNTER_DEVICE, PCNT_IF_OF | PCNT_IF_UF);
+    NVIC_ClearPendingIRQ(COUNTER_IRQ);
+    NVIC_EnableIRQ(COUNTER_IRQ);
+
+    counter_running = true;
+
+    return 0;
+}
+
+//Stop counting, the last count remains readable
+void COUNTER_stop()
+{
+    if (counter_running == false) {
+        return;
+    }
+
+    counter_final = COUNTER_get();
+    counter_running = false;
+
+    NVIC_DisableIRQ(COUNTER_IRQ);
+    PCNT_Reset(COUNTER_DEVICE);
+    CMU_ClockEnable(COUNTER_CLOCK, false);
+
+    PRS_SourceSignalSet(COUNTER_S0_PRS_CHANNEL, 0, 0, prsEdgeOff);
+    PRS_SourceSignalSet(COUNTER_S1_PRS_CHANNEL, 0, 0, prsEdgeOff);
+}
+
+//Signed 32 bit count, safe to call from interrupt context
+int32_t COUNTER_get()
+{
+    uint32_t count;
+    uint32_t flags;
+    int32_t high;
+
+    if (counter_running == false) {
+        return counter_final;
+    }
+
+    INT_Disable();
+
+    count = PCNT_CounterGet(COUNTER_DEVICE);
+    flags = PCNT_IntGet(COUNTER_DEVICE);
+    high = counter_high;
+
+    //A wrap not yet handled by the interrupt shows as a count just past it
+    if ((flags & PCNT_IF_OF) && (count < 0x8000)) {
+        high ++;
+    } else if ((flags & PCNT_IF_UF) && (count >= 0x8000)) {
+        high --;
+    }
+
+    INT_Enable();
+
+    return (int32_t)(((uint32_t)high << 16) + count);
+}
+
+void PCNT0_IRQHandler(void)
+{
+    uint32_t flags = PCNT_IntGet(COUNTER_DEVICE);
+
+    PCNT_IntClear(COUNTER_DEVICE, flags);
+
+    if (flags & PCNT_IF_OF) {
+        counter_high ++;
+    }
+    if (flags & PCNT_IF_UF) {
+        counter_high --;
+    }
+}
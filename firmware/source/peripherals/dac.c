@@ -6,8 +6,40 @@
 #include "em_cmu.h"
 #include "em_dac.h"
 #include "em_opamp.h"
+#include "em_letimer.h"
+#include "em_prs.h"
+#include "em_dma.h"
 
 #include "platform.h"
+#include "peripherals/dma.h"
+
+#if DAC_CHANNEL == 0
+#define DAC_CHANNEL_CTRL    CH0CTRL
+#define DAC_CHANNEL_DATA    CH0DATA
+#elif DAC_CHANNEL == 1
+#define DAC_CHANNEL_CTRL    CH1CTRL
+#define DAC_CHANNEL_DATA    CH1DATA
+#else
+#error Invalid DAC channel
+#endif
+
+//Largest output clock divider (CMU LFAPRESC0)
+#define OUTPUT_PRESCALE_MAX 15
+
+static void dac_dma_complete(unsigned int channel, bool primary, void *user);
+static void dac_trigger_apply();
+
+static DMA_CB_TypeDef dac_dma_cb = {
+    .cbFunc = dac_dma_complete,
+    .userPtr = NULL
+};
+
+static dac_stream_cb_t stream_callback = NULL;
+static uint16_t *stream_blocks[2];
+static uint8_t stream_prescale = 0;
+
+//Direct writes are converted on the trigger route rather than immediately
+static bool trigger_enabled = false;
 
 void DAC_configure()
 {
@@ -23,6 +55,7 @@ void DAC_configure()
     //Initialize the DAC
     DAC_Init(DAC_DEVICE, &dac_init);
     DAC_InitChannel(DAC_DEVICE, &channel_init, DAC_CHANNEL);
+    dac_trigger_apply();
 
     //Setup opamp (DAC->OPAMP->PIN)
     OPAMP_Init_TypeDef configuration0 =  OPA_INIT_DIFF_RECEIVER_OPA0 ;
@@ -32,6 +65,8 @@ void DAC_configure()
 
 void DAC_close()
 {
+    DAC_stream_stop();
+
     DAC_Reset(DAC_DEVICE);
 
     CMU_ClockEnable(DAC_CLOCK, false);
@@ -51,4 +86,194 @@ void DAC_set(uint32_t value)
 #else
 #error Invalid DAC channel
 #endif
-}
\ No newline at end of file
+}
+
+//Output samples at rate per second, DMAd from first then second (lengths in samples), then from blocks
+//returned by the callback. Each conversion is started by the output clock so updates are evenly spaced.
+int DAC_stream_start(uint32_t rate, uint16_t *first, uint16_t first_samples,
+                     uint16_t *second, uint16_t second_samples, dac_stream_cb_t callback)
+{
+    if (rate == 0) {
+        return -1;
+    }
+
+    return DAC_stream_start_ticks((DAC_stream_clock() + rate / 2) / rate, first, first_samples,
+                                  second, second_samples, callback);
+}
+
+//As DAC_stream_start, with the sample period given in output clock ticks (see DAC_stream_clock)
+int DAC_stream_start_ticks(uint32_t ticks, uint16_t *first, uint16_t first_samples,
+                           uint16_t *second, uint16_t second_samples, dac_stream_cb_t callback)
+{
+    uint8_t prescale = 0;
+
+    if ((ticks == 0) || (first_samples == 0) || (first_samples > 1024)
+            || (second_samples == 0) || (second_samples > 1024)) {
+        return -1;
+    }
+
+    DAC_stream_stop();
+
+    CMU_ClockEnable(cmuClock_PRS, true);
+
+    while (((ticks >> prescale) > 0x10000) && (prescale < OUTPUT_PRESCALE_MAX)) {
+        prescale ++;
+    }
+    if ((ticks >> prescale) < 2) {
+        return -2;
+    }
+    CMU_ClockDivSet(OUTPUT_TIMER_CLOCK, (CMU_ClkDiv_TypeDef)(1 << prescale));
+    stream_prescale = prescale;
+
+    //Single cycle pulse on each underflow, repeat count must be non-zero for the output to be driven
+    LETIMER_Init_TypeDef timer_init = LETIMER_INIT_DEFAULT;
+    timer_init.enable = false;
+    timer_init.comp0Top = true;
+    timer_init.ufoa0 = letimerUFOAPulse;
+    timer_init.repMode = letimerRepeatFree;
+
+    LETIMER_Init(OUTPUT_TIMER, &timer_init);
+    LETIMER_CompareSet(OUTPUT_TIMER, 0, (ticks >> prescale) - 1);
+    LETIMER_RepeatSet(OUTPUT_TIMER, 0, 1);
+
+    PRS_SourceSignalSet(OUTPUT_PRS_CHANNEL, OUTPUT_PRS_SOURCE, OUTPUT_PRS_SIGNAL, prsEdgeOff);
+
+    //Written values are held until the next output clock pulse starts a conversion
+    DAC_DEVICE->DAC_CHANNEL_CTRL = (DAC_DEVICE->DAC_CHANNEL_CTRL & ~_DAC_CH0CTRL_PRSSEL_MASK)
+                                   | DAC_CH0CTRL_PRSEN
+                                   | ((uint32_t)OUTPUT_DAC_PRSSEL << _DAC_CH0CTRL_PRSSEL_SHIFT);
+
+    //Ping-pong DMA into the channel data register, requested each time it has been converted
+    DMA_init();
+
+    DMA_CfgChannel_TypeDef channel = {
+        .highPri = false,
+        .enableInt = true,
+        .select = DAC_DMAREQ,
+        .cb = &dac_dma_cb
+    };
+    DMA_CfgChannel(DMA_CHANNEL_DAC, &channel);
+
+    DMA_CfgDescr_TypeDef descr = {
+        .dstInc = dmaDataIncNone,
+        .srcInc = dmaDataInc2,
+        .size = dmaDataSize2,
+        .arbRate = dmaArbitrate1,
+        .hprot = 0
+    };
+    DMA_CfgDescr(DMA_CHANNEL_DAC, true, &descr);
+    DMA_CfgDescr(DMA_CHANNEL_DAC, false, &descr);
+
+    stream_callback = callback;
+    stream_blocks[0] = first;
+    stream_blocks[1] = second;
+
+    DMA_ActivatePingPong(DMA_CHANNEL_DAC, false,
+                         (void *)&DAC_DEVICE->DAC_CHANNEL_DATA, first, first_samples - 1,
+                         (void *)&DAC_DEVICE->DAC_CHANNEL_DATA, second, second_samples - 1);
+
+    LETIMER_Enable(OUTPUT_TIMER, true);
+
+    return 0;
+}
+
+//Output clock frequency before division, rates dividing it exactly are output exactly
+uint32_t DAC_stream_clock()
+{
+    //Output clock runs from the core clock, no other peripheral uses the LFA branch
+    CMU_ClockEnable(cmuClock_CORELE, true);
+    CMU_ClockSelectSet(cmuClock_LFA, cmuSelect_CORELEDIV2);
+    CMU_ClockEnable(OUTPUT_TIMER_CLOCK, true);
+
+    //A running stream keeps its divider
+    if (stream_callback == NULL) {
+        CMU_ClockDivSet(OUTPUT_TIMER_CLOCK, cmuClkDiv_1);
+        stream_prescale = 0;
+    }
+
+    return CMU_ClockFreqGet(OUTPUT_TIMER_CLOCK) << stream_prescale;
+}
+
+//Change the rate of a running stream without interrupting it, the new period starts at the next update
+int DAC_stream_rate(uint32_t rate)
+{
+    if ((stream_callback == NULL) || (rate == 0)) {
+        return -1;
+    }
+
+    return DAC_stream_ticks((DAC_stream_clock() + rate / 2) / rate);
+}
+
+//As DAC_stream_rate, with the sample period given in output clock ticks
+int DAC_stream_ticks(uint32_t ticks)
+{
+    if ((stream_callback == NULL) || (ticks == 0)) {
+        return -1;
+    }
+
+    if (((ticks >> stream_prescale) > 0x10000) || ((ticks >> stream_prescale) < 2)) {
+        return -2;
+    }
+
+    LETIMER_CompareSet(OUTPUT_TIMER, 0, (ticks >> stream_prescale) - 1);
+
+    return 0;
+}
+
+//Stop output, the last value converted is held
+void DAC_stream_stop()
+{
+    if (stream_callback == NULL) {
+        return;
+    }
+
+    LETIMER_Enable(OUTPUT_TIMER, false);
+    DMA_ChannelEnable(DMA_CHANNEL_DAC, false);
+
+    //Return to converting each write for DAC_set, immediately or on the trigger route
+    stream_callback = NULL;
+    dac_trigger_apply();
+}
+
+//Convert direct writes on pulses from the trigger route (TRIGGER_DAC_PRS_CHANNEL), a running stream keeps
+//its own clock until stopped
+void DAC_trigger(bool enable)
+{
+    trigger_enabled = enable;
+
+    if (stream_callback == NULL) {
+        dac_trigger_apply();
+    }
+}
+
+static void dac_trigger_apply()
+{
+    if (trigger_enabled == true) {
+        DAC_DEVICE->DAC_CHANNEL_CTRL = (DAC_DEVICE->DAC_CHANNEL_CTRL & ~_DAC_CH0CTRL_PRSSEL_MASK)
+                                       | DAC_CH0CTRL_PRSEN
+                                       | ((uint32_t)TRIGGER_DAC_PRSSEL << _DAC_CH0CTRL_PRSSEL_SHIFT);
+    } else {
+        DAC_DEVICE->DAC_CHANNEL_CTRL &= ~DAC_CH0CTRL_PRSEN;
+    }
+}
+
+//Called from the DMA interrupt each time a block has been output
+static void dac_dma_complete(unsigned int channel, bool primary, void *user)
+{
+    (void)user;
+
+    uint8_t index = (primary == true) ? 0 : 1;
+    uint16_t samples;
+
+    if (stream_callback == NULL) {
+        return;
+    }
+
+    //Hand the block back and refill the descriptor with the next one, the callback may stop the stream
+    stream_blocks[index] = stream_callback(stream_blocks[index], &samples);
+    if (stream_callback == NULL) {
+        return;
+    }
+
+    DMA_RefreshPingPong(channel, primary, false, NULL, stream_blocks[index], samples - 1, false);
+}
@@ -0,0 +1,43 @@
+
+#include "peripherals/dma.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "em_cmu.h"
+#include "em_dma.h"
+
+//With more than 8 channels the controller places the alternate descriptors 16 slots (0x200 bytes) after
+//the primary ones, and the control block must be aligned to 512 bytes rather than 256
+#if DMA_CHAN_COUNT > 8
+#define DMA_CONTROL_CHANNELS        16
+#define DMA_CONTROL_ALIGN           512
+#else
+#define DMA_CONTROL_CHANNELS        8
+#define DMA_CONTROL_ALIGN           256
+#endif
+
+//DMA control block, primary then alternate descriptors for every channel slot
+static DMA_DESCRIPTOR_TypeDef dma_control_block[DMA_CONTROL_CHANNELS * 2] __attribute__ ((aligned(DMA_CONTROL_ALIGN)));
+
+static bool dma_initialised = false;
+
+//Initialise the DMA controller, shared by all peripheral drivers
+void DMA_init()
+{
+    if (dma_initialised == true) {
+        return;
+    }
+
+    //Enable clock
+    CMU_ClockEnable(cmuClock_DMA, true);
+
+    DMA_Init_TypeDef dma_config = {
+        .hprot = 0,
+        .controlBlock = dma_control_block
+    };
+
+    DMA_Init(&dma_config);
+
+    dma_initialised = true;
+}
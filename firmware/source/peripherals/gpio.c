@@ -3,8 +3,34 @@
 
 #include "em_cmu.h"
 #include "em_gpio.h"
+#include "em_int.h"
 
 #include "platform.h"
+#include "peripherals/timebase.h"
+
+#define GPIO_NUM_PORTS  6
+
+//Board pin map, indexed by gpio_pin_e
+struct gpio_pin_s {
+    GPIO_Port_TypeDef port;
+    uint8_t pin;
+};
+
+static const struct gpio_pin_s gpio_pins[GPIO_NUM_PINS] = {
+    { GPIO0_PORT, GPIO0_PIN },
+    { GPIO1_PORT, GPIO1_PIN },
+    { GPIO2_PORT, GPIO2_PIN },
+    { GPIO3_PORT, GPIO3_PIN },
+    { GPIO4_PORT, GPIO4_PIN },
+    { GPIO5_PORT, GPIO5_PIN }
+};
+
+//Pins with rising and falling edge interrupts enabled, indexed by gpio_pin_e
+static uint8_t gpio_int_rising = 0;
+static uint8_t gpio_int_falling = 0;
+static gpio_int_cb_t gpio_int_callbacks[GPIO_NUM_PINS] = { NULL };
+
+static void GPIO_handle_int(uint32_t flags);
 
 void GPIO_init()
 {
@@ -67,134 +93,238 @@ void GPIO_led_set(int led, bool value)
 
 void GPIO_configure(int pin, bool output, bool pull_enabled, bool pull_up)
 {
+    if ((pin < 0) || (pin >= GPIO_NUM_PINS)) {
+        return;
+    }
+
     //TODO: enable pull
-    switch (pin) {
-    case GPIO0:
-        if (output == true) {
-            GPIO_PinModeSet(GPIO0_PORT, GPIO0_PIN, gpioModePushPull, 0);
-        } else {
-            GPIO_PinModeSet(GPIO0_PORT, GPIO0_PIN, gpioModeInput, 0);
-        }
+    if (output == true) {
+        GPIO_PinModeSet(gpio_pins[pin].port, gpio_pins[pin].pin, gpioModePushPull, 0);
+    } else {
+        GPIO_PinModeSet(gpio_pins[pin].port, gpio_pins[pin].pin, gpioModeInput, 0);
+    }
+}
+
+void GPIO_set(int pin, bool value)
+{
+    if ((pin < 0) || (pin >= GPIO_NUM_PINS)) {
         return;
-    case GPIO1:
-        if (output == true) {
-            GPIO_PinModeSet(GPIO1_PORT, GPIO1_PIN, gpioModePushPull, 0);
-        } else {
-            GPIO_PinModeSet(GPIO1_PORT, GPIO1_PIN, gpioModeInput, 0);
+    }
+
+    if (value == true) {
+        GPIO->P[gpio_pins[pin].port].DOUTSET = 1 << gpio_pins[pin].pin;
+    } else {
+        GPIO->P[gpio_pins[pin].port].DOUTCLR = 1 << gpio_pins[pin].pin;
+    }
+}
+
+bool GPIO_get(int pin)
+{
+    if ((pin < 0) || (pin >= GPIO_NUM_PINS)) {
+        return 0;
+    }
+
+    return (GPIO->P[gpio_pins[pin].port].DIN >> gpio_pins[pin].pin) & 1;
+}
+
+//Apply set, clear then toggle masks (indexed by gpio_pin_e) with one register write per port
+//Pins sharing a port change on the same cycle, ports are written back to back with interrupts disabled
+void GPIO_set_mask(uint32_t set, uint32_t clear, uint32_t toggle)
+{
+    uint32_t port_set[GPIO_NUM_PORTS] = {0};
+    uint32_t port_clear[GPIO_NUM_PORTS] = {0};
+    uint32_t port_toggle[GPIO_NUM_PORTS] = {0};
+
+    for (int i = 0; i < GPIO_NUM_PINS; i++) {
+        uint32_t bit = 1 << gpio_pins[i].pin;
+
+        if (set & (1 << i)) {
+            port_set[gpio_pins[i].port] |= bit;
         }
-        return;
-    case GPIO2:
-        if (output == true) {
-            GPIO_PinModeSet(GPIO2_PORT, GPIO2_PIN, gpioModePushPull, 0);
-        } else {
-            GPIO_PinModeSet(GPIO2_PORT, GPIO2_PIN, gpioModeInput, 0);
+        if (clear & (1 << i)) {
+            port_clear[gpio_pins[i].port] |= bit;
         }
-        return;
-    case GPIO3:
-        if (output == true) {
-            GPIO_PinModeSet(GPIO3_PORT, GPIO3_PIN, gpioModePushPull, 0);
-        } else {
-            GPIO_PinModeSet(GPIO3_PORT, GPIO3_PIN, gpioModeInput, 0);
+        if (toggle & (1 << i)) {
+            port_toggle[gpio_pins[i].port] |= bit;
         }
-        return;
-    case GPIO4:
-        if (output == true) {
-            GPIO_PinModeSet(GPIO4_PORT, GPIO4_PIN, gpioModePushPull, 0);
-        } else {
-            GPIO_PinModeSet(GPIO4_PORT, GPIO4_PIN, gpioModeInput, 0);
+    }
+
+    INT_Disable();
+    for (int port = 0; port < GPIO_NUM_PORTS; port++) {
+        if (port_set[port] != 0) {
+            GPIO->P[port].DOUTSET = port_set[port];
         }
-        return;
-    case GPIO5:
-        if (output == true) {
-            GPIO_PinModeSet(GPIO5_PORT, GPIO5_PIN, gpioModePushPull, 0);
-        } else {
-            GPIO_PinModeSet(GPIO5_PORT, GPIO5_PIN, gpioModeInput, 0);
+        if (port_clear[port] != 0) {
+            GPIO->P[port].DOUTCLR = port_clear[port];
+        }
+        if (port_toggle[port] != 0) {
+            GPIO->P[port].DOUTTGL = port_toggle[port];
         }
-        return;
     }
+    INT_Enable();
 }
 
-void GPIO_set(int pin, bool value)
+//Snapshot all pin levels as a mask indexed by gpio_pin_e, each port input register is read once
+uint32_t GPIO_get_mask()
 {
-    switch (pin) {
-    case GPIO0:
-        if (value == true) {
-            GPIO_PinOutSet(GPIO0_PORT, GPIO0_PIN);
-        } else {
-            GPIO_PinOutClear(GPIO0_PORT, GPIO0_PIN);
-        }
-        return;
-    case GPIO1:
-        if (value == true) {
-            GPIO_PinOutSet(GPIO1_PORT, GPIO1_PIN);
-        } else {
-            GPIO_PinOutClear(GPIO1_PORT, GPIO1_PIN);
-        }
-        return;
-    case GPIO2:
-        if (value == true) {
-            GPIO_PinOutSet(GPIO2_PORT, GPIO2_PIN);
-        } else {
-            GPIO_PinOutClear(GPIO2_PORT, GPIO2_PIN);
+    uint32_t port_in[GPIO_NUM_PORTS];
+    uint32_t levels = 0;
+
+    INT_Disable();
+    for (int port = 0; port < GPIO_NUM_PORTS; port++) {
+        port_in[port] = GPIO->P[port].DIN;
+    }
+    INT_Enable();
+
+    for (int i = 0; i < GPIO_NUM_PINS; i++) {
+        if (port_in[gpio_pins[i].port] & (1 << gpio_pins[i].pin)) {
+            levels |= (1 << i);
         }
-        return;
-    case GPIO3:
-        if (value == true) {
-            GPIO_PinOutSet(GPIO3_PORT, GPIO3_PIN);
-        } else {
-            GPIO_PinOutClear(GPIO3_PORT, GPIO3_PIN);
+    }
+
+    return levels;
+}
+
+//Bits within a port's registers for the pins in a mask of (1 << gpio_pin_e), pins on other ports are ignored
+uint32_t GPIO_port_bits(int port, uint32_t pins)
+{
+    uint32_t bits = 0;
+
+    for (int i = 0; i < GPIO_NUM_PINS; i++) {
+        if ((pins & (1 << i)) && (gpio_pins[i].port == port)) {
+            bits |= (1 << gpio_pins[i].pin);
         }
+    }
+
+    return bits;
+}
+
+//Set the handler for edges on a pin, each pin is owned by one service at a time
+void GPIO_set_int_callback(int pin, gpio_int_cb_t callback)
+{
+    if ((pin < 0) || (pin >= GPIO_NUM_PINS)) {
         return;
-    case GPIO4:
-        if (value == true) {
-            GPIO_PinOutSet(GPIO4_PORT, GPIO4_PIN);
-        } else {
-            GPIO_PinOutClear(GPIO4_PORT, GPIO4_PIN);
-        }
+    }
+
+    gpio_int_callbacks[pin] = callback;
+}
+
+gpio_int_cb_t GPIO_get_int_callback(int pin)
+{
+    if ((pin < 0) || (pin >= GPIO_NUM_PINS)) {
+        return NULL;
+    }
+
+    return gpio_int_callbacks[pin];
+}
+
+//Edges currently enabled on a pin, so a service borrowing it can restore them
+void GPIO_get_int_config(int pin, bool *rising, bool *falling)
+{
+    if ((pin < 0) || (pin >= GPIO_NUM_PINS)) {
+        *rising = false;
+        *falling = false;
         return;
-    case GPIO5:
-        if (value == true) {
-            GPIO_PinOutSet(GPIO5_PORT, GPIO5_PIN);
-        } else {
-            GPIO_PinOutClear(GPIO5_PORT, GPIO5_PIN);
-        }
+    }
+
+    *rising = (gpio_int_rising & (1 << pin)) != 0;
+    *falling = (gpio_int_falling & (1 << pin)) != 0;
+}
+
+//Configure edge interrupts, external interrupt lines are numbered by pin so each GPIO has its own line
+void GPIO_configure_int(int pin, bool rising, bool falling)
+{
+    if ((pin < 0) || (pin >= GPIO_NUM_PINS)) {
         return;
     }
+
+    const struct gpio_pin_s *gpio = &gpio_pins[pin];
+    bool enable = rising || falling;
+
+    GPIO_IntConfig(gpio->port, gpio->pin, rising, falling, enable);
+
+    if (rising == true) {
+        gpio_int_rising |= (1 << pin);
+    } else {
+        gpio_int_rising &= ~(1 << pin);
+    }
+
+    if (falling == true) {
+        gpio_int_falling |= (1 << pin);
+    } else {
+        gpio_int_falling &= ~(1 << pin);
+    }
+
+    if (enable == true) {
+        NVIC_ClearPendingIRQ((gpio->pin & 1) ? GPIO_ODD_IRQn : GPIO_EVEN_IRQn);
+        NVIC_EnableIRQ((gpio->pin & 1) ? GPIO_ODD_IRQn : GPIO_EVEN_IRQn);
+    }
 }
 
-bool GPIO_get(int pin)
+//PRS producer for a pin, selects the pin's port for its external interrupt line without changing which
+//edges interrupt. Sets the source and signal for PRS_SourceSignalSet.
+int GPIO_prs_signal(int pin, uint32_t *source, uint32_t *signal)
 {
-    switch (pin) {
-    case GPIO0:
-        return GPIO_PinInGet(GPIO0_PORT, GPIO0_PIN);
-    case GPIO1:
-        return GPIO_PinInGet(GPIO1_PORT, GPIO1_PIN);
-    case GPIO2:
-        return GPIO_PinInGet(GPIO2_PORT, GPIO2_PIN);
-    case GPIO3:
-        return GPIO_PinInGet(GPIO3_PORT, GPIO3_PIN);
-    case GPIO4:
-        return GPIO_PinInGet(GPIO4_PORT, GPIO4_PIN);
-    case GPIO5:
-        return GPIO_PinInGet(GPIO5_PORT, GPIO5_PIN);
-    default:
-        return 0;
+    if ((pin < 0) || (pin >= GPIO_NUM_PINS)) {
+        return -1;
+    }
+
+    const struct gpio_pin_s *gpio = &gpio_pins[pin];
+    uint32_t shift = (gpio->pin & 7) * 4;
+
+    if (gpio->pin < 8) {
+        GPIO->EXTIPSELL = (GPIO->EXTIPSELL & ~(0xFUL << shift)) | ((uint32_t)gpio->port << shift);
+        *source = PRS_CH_CTRL_SOURCESEL_GPIOL;
+    } else {
+        GPIO->EXTIPSELH = (GPIO->EXTIPSELH & ~(0xFUL << shift)) | ((uint32_t)gpio->port << shift);
+        *source = PRS_CH_CTRL_SOURCESEL_GPIOH;
+    }
+    *signal = (uint32_t)(gpio->pin & 7) << _PRS_CH_CTRL_SIGSEL_SHIFT;
+
+    return 0;
+}
+
+//Timestamp and report edges on the flagged interrupt lines
+static void GPIO_handle_int(uint32_t flags)
+{
+    uint64_t timestamp = TIMEBASE_get();
+    bool level;
+
+    GPIO_IntClear(flags);
+
+    for (uint8_t i = 0; i < GPIO_NUM_PINS; i++) {
+        if (((flags & (1 << gpio_pins[i].pin)) == 0)
+            || (((gpio_int_rising | gpio_int_falling) & (1 << i)) == 0)) {
+            continue;
+        }
+
+        //Single edge interrupts imply the level, otherwise sample the pin
+        if ((gpio_int_falling & (1 << i)) == 0) {
+            level = true;
+        } else if ((gpio_int_rising & (1 << i)) == 0) {
+            level = false;
+        } else {
+            level = GPIO_PinInGet(gpio_pins[i].port, gpio_pins[i].pin);
+        }
+
+        if (gpio_int_callbacks[i] != NULL) {
+            gpio_int_callbacks[i](i, level, timestamp);
+        }
     }
 }
 
 /**********************************************************
- * Interrupt handler for push button 0
+ * Interrupt handler for odd numbered pins
  **********************************************************/
 void GPIO_ODD_IRQHandler(void)
 {
-    //TODO
-    //USBD_Write(EP_IN, button0message, sizeof(button0message), dataSentCallback);
+    GPIO_handle_int(GPIO_IntGetEnabled() & 0xAAAA);
 }
 
 /**********************************************************
- * Interrupt handler for push button 1
+ * Interrupt handler for even numbered pins
  **********************************************************/
 void GPIO_EVEN_IRQHandler(void)
 {
-    //TODO
+    GPIO_handle_int(GPIO_IntGetEnabled() & 0x5555);
 }
\ No newline at end of file
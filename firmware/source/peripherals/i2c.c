@@ -1,19 +1,55 @@
 
 #include "peripherals/i2c.h"
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "em_i2c.h"
 #include "em_gpio.h"
 #include "em_cmu.h"
 #include "em_int.h"
 
 #include "platform.h"
+#include "protocol.h"
+#include "peripherals/timebase.h"
+
+#define I2C_BITS_PER_BYTE       9       //Including the acknowledge
 
-#define ENABLE_INTERRUPTS   INT_Enable();
-#define DISABLE_INTERRUPTS  INT_Disable();
+//Transfers run from the I2C interrupt, one state per bus phase being waited on
+enum i2c_state_e {
+    I2C_STATE_IDLE = 0,
+    I2C_STATE_ADDRESS,
+    I2C_STATE_WRITE,
+    I2C_STATE_READ,
+    I2C_STATE_STOP
+};
 
 /***        Internal function prototypes            ***/
 
-static int8_t transfer(I2C_TransferSeq_TypeDef *i2c_transfer_ptr, I2C_TypeDef *i2c_bus_ptr);
+static void i2c_msg_begin();
+static void i2c_msg_next();
+static void i2c_write_next();
+static void i2c_finish(int8_t result);
+static void i2c_sync_complete(int8_t result, uint8_t completed);
+static int8_t transfer(struct i2c_msg_s *msgs, uint8_t count);
+
+/***        Internal state                          ***/
+
+static uint32_t i2c_baud = 0;
+
+static volatile uint8_t i2c_state = I2C_STATE_IDLE;
+static struct i2c_msg_s *i2c_msgs = NULL;
+static uint8_t i2c_count = 0;
+static uint8_t i2c_index = 0;
+static uint16_t i2c_position = 0;
+static int8_t i2c_result = I2C_RESULT_OK;
+static i2c_xfer_cb_t i2c_callback = NULL;
+static uint64_t i2c_deadline = 0;
+
+//Completion of blocking transfers
+static volatile bool i2c_sync_done = false;
+static volatile int8_t i2c_sync_result = I2C_RESULT_OK;
 
 /***        Interface Functions                     ***/
 
@@ -42,73 +78,253 @@ void I2C_init(uint32_t baud)
     //Set route
     I2C_DEVICE->ROUTE = I2C_ROUTE;
 
-    //Enable auto ack
-    I2C_DEVICE->CTRL |= I2C_CTRL_AUTOACK;
+    //Received bytes are acknowledged from the interrupt so the last of each read can be NACKed
+    I2C_DEVICE->CTRL &= ~I2C_CTRL_AUTOACK;
+
+    i2c_baud = baud;
+
+    NVIC_ClearPendingIRQ(I2C_IRQ);
+    NVIC_EnableIRQ(I2C_IRQ);
+}
+
+//Start a transfer of count messages, joined by repeated starts and ended by a stop. The messages and their
+//data must remain valid until the callback.
+int8_t I2C_transfer_start(struct i2c_msg_s *msgs, uint8_t count, i2c_xfer_cb_t callback)
+{
+    uint64_t bits = 0;
+
+    if ((i2c_baud == 0) || (count == 0)) {
+        return I2C_RESULT_ERROR;
+    }
+
+    //Reads must take at least one byte, to have one to NACK
+    for (uint8_t i = 0; i < count; i++) {
+        if (((msgs[i].flags & I2C_MSG_FLAG_READ) != 0) && (msgs[i].length == 0)) {
+            return I2C_RESULT_ERROR;
+        }
+        bits += (msgs[i].length + 1) * I2C_BITS_PER_BYTE + 2;
+    }
+
+    INT_Disable();
+
+    if (i2c_state != I2C_STATE_IDLE) {
+        INT_Enable();
+        return I2C_RESULT_BUSY;
+    }
+
+    //Allow twice the time on the bus, and the same again for clock stretching
+    i2c_deadline = TIMEBASE_get()
+                   + 2 * bits * USBTHING_TIMEBASE_HZ / i2c_baud
+                   + (uint64_t)USBTHING_I2C_STRETCH_TIMEOUT_MS * (USBTHING_TIMEBASE_HZ / 1000);
+
+    i2c_msgs = msgs;
+    i2c_count = count;
+    i2c_index = 0;
+    i2c_result = I2C_RESULT_OK;
+    i2c_callback = callback;
+
+    //Recover from anything left behind by an abandoned transfer
+    if (I2C_DEVICE->STATE & I2C_STATE_BUSY) {
+        I2C_DEVICE->CMD = I2C_CMD_ABORT;
+    }
+    I2C_DEVICE->CMD = I2C_CMD_CLEARPC | I2C_CMD_CLEARTX;
+    while (I2C_DEVICE->STATUS & I2C_STATUS_RXDATAV) {
+        (void)I2C_DEVICE->RXDATA;
+    }
+
+    I2C_IntClear(I2C_DEVICE, _I2C_IFC_MASK);
+    I2C_IntEnable(I2C_DEVICE, I2C_IF_ACK | I2C_IF_NACK | I2C_IF_RXDATAV | I2C_IF_MSTOP
+                  | I2C_IF_ARBLOST | I2C_IF_BUSERR);
+
+    i2c_msg_begin();
+
+    INT_Enable();
+
+    return I2C_RESULT_OK;
+}
+
+bool I2C_busy()
+{
+    return i2c_state != I2C_STATE_IDLE;
+}
+
+//Abandon a transfer that has passed its deadline, eg. held up by a device stretching the clock indefinitely
+void I2C_poll()
+{
+    INT_Disable();
+
+    if ((i2c_state != I2C_STATE_IDLE) && (TIMEBASE_get() > i2c_deadline)) {
+        I2C_DEVICE->CMD = I2C_CMD_ABORT;
+        i2c_finish(I2C_RESULT_TIMEOUT);
+    }
+
+    INT_Enable();
 }
 
 //I2C write
 int8_t I2C_write(uint8_t address, uint32_t num_bytes, const uint8_t *data_array)
 {
-    I2C_TransferSeq_TypeDef i2c_transfer = {
-        .addr = address << 1,
-        .flags = I2C_FLAG_WRITE,
-        .buf[0] = { .data = data_array, .len = num_bytes },
+    struct i2c_msg_s msgs[1] = {
+        { .address = address, .flags = 0, .length = num_bytes, .data = (uint8_t *)data_array }
     };
 
-    return transfer(&i2c_transfer, I2C_DEVICE);
+    return transfer(msgs, 1);
 }
 
 //I2C read
 int8_t I2C_read(uint8_t address, uint32_t num_bytes, uint8_t *data_array)
 {
-    I2C_TransferSeq_TypeDef i2c_transfer = {
-        .addr = address << 1,
-        .flags = I2C_FLAG_READ,
-        .buf[0] = { .data = data_array, .len = num_bytes },
+    struct i2c_msg_s msgs[1] = {
+        { .address = address, .flags = I2C_MSG_FLAG_READ, .length = num_bytes, .data = data_array }
     };
 
-    return transfer(&i2c_transfer, I2C_DEVICE);
+    return transfer(msgs, 1);
 }
 
 //I2C Write and read
 int8_t I2C_write_read(uint8_t address, uint32_t num_write_bytes, const uint8_t *write_data_array, uint32_t num_read_bytes, uint8_t *read_data_array)
 {
-    I2C_TransferSeq_TypeDef i2c_transfer = {
-        .addr = address << 1,
-        .flags = I2C_FLAG_WRITE_READ,
-        .buf[0] = { .data = write_data_array, .len = num_write_bytes },
-        .buf[1] = { .data = read_data_array, .len = num_read_bytes },
+    struct i2c_msg_s msgs[2] = {
+        { .address = address, .flags = 0, .length = num_write_bytes, .data = (uint8_t *)write_data_array },
+        { .address = address, .flags = I2C_MSG_FLAG_READ, .length = num_read_bytes, .data = read_data_array }
     };
 
-    return transfer(&i2c_transfer, I2C_DEVICE);
+    return transfer(msgs, 2);
 }
 
 /***        Internal function implementations       ***/
 
-//Internal transfer function
-static int8_t transfer(I2C_TransferSeq_TypeDef *i2c_transfer_ptr, I2C_TypeDef *i2c_bus_ptr)
+//Address the current message, as a start or repeated start
+static void i2c_msg_begin()
 {
-    int8_t result;
+    struct i2c_msg_s *msg = &i2c_msgs[i2c_index];
 
-    // I2C bus access must be atomic
-    DISABLE_INTERRUPTS;
+    i2c_position = 0;
+    i2c_state = I2C_STATE_ADDRESS;
 
-    result = I2C_TransferInit(i2c_bus_ptr, i2c_transfer_ptr);
+    I2C_DEVICE->CMD = I2C_CMD_START;
+    I2C_DEVICE->TXDATA = (msg->address << 1) | (((msg->flags & I2C_MSG_FLAG_READ) != 0) ? 1 : 0);
+}
 
-    while (result == i2cTransferInProgress) {
-        result = I2C_Transfer(i2c_bus_ptr);
+static void i2c_msg_next()
+{
+    i2c_index ++;
+
+    if (i2c_index < i2c_count) {
+        i2c_msg_begin();
+    } else {
+        I2C_DEVICE->CMD = I2C_CMD_STOP;
+        i2c_state = I2C_STATE_STOP;
     }
+}
 
-    // Reenable I2C access
-    ENABLE_INTERRUPTS;
+static void i2c_write_next()
+{
+    struct i2c_msg_s *msg = &i2c_msgs[i2c_index];
 
-    // TODO handle some errors?
-    if (result == i2cTransferDone) {
-        return 0;
-    } else if (result == i2cTransferNack) {
-        return -1;
+    if (i2c_position < msg->length) {
+        I2C_DEVICE->TXDATA = msg->data[i2c_position ++];
     } else {
-        return -2;
+        i2c_msg_next();
+    }
+}
+
+static void i2c_finish(int8_t result)
+{
+    i2c_xfer_cb_t callback = i2c_callback;
+
+    I2C_IntDisable(I2C_DEVICE, _I2C_IEN_MASK);
+    i2c_state = I2C_STATE_IDLE;
+    i2c_callback = NULL;
+
+    if (callback != NULL) {
+        callback(result, i2c_index);
+    }
+}
+
+static void i2c_sync_complete(int8_t result, uint8_t completed)
+{
+    (void)completed;
+
+    i2c_sync_result = result;
+    i2c_sync_done = true;
+}
+
+//Run a transfer to completion, for callers outside interrupt context. USB and other interrupts are serviced
+//throughout, and a transfer already running from the service is waited for first.
+static int8_t transfer(struct i2c_msg_s *msgs, uint8_t count)
+{
+    int8_t result;
+
+    i2c_sync_done = false;
+
+    do {
+        I2C_poll();
+        result = I2C_transfer_start(msgs, count, i2c_sync_complete);
+    } while (result == I2C_RESULT_BUSY);
+
+    if (result < 0) {
+        return result;
     }
+
+    while (i2c_sync_done == false) {
+        I2C_poll();
+    }
+
+    return i2c_sync_result;
 }
 
+void I2C0_IRQHandler(void)
+{
+    uint32_t flags = I2C_IntGet(I2C_DEVICE);
+    struct i2c_msg_s *msg;
+
+    I2C_IntClear(I2C_DEVICE, flags);
+
+    if (i2c_state == I2C_STATE_IDLE) {
+        return;
+    }
+
+    //The bus has been lost, there is no stop to wait for
+    if (flags & (I2C_IF_ARBLOST | I2C_IF_BUSERR)) {
+        I2C_DEVICE->CMD = I2C_CMD_ABORT;
+        i2c_finish(I2C_RESULT_ERROR);
+        return;
+    }
+
+    if ((flags & I2C_IF_NACK) && (i2c_state != I2C_STATE_STOP)) {
+        i2c_result = I2C_RESULT_NACK;
+        I2C_DEVICE->CMD = I2C_CMD_STOP;
+        i2c_state = I2C_STATE_STOP;
+    }
+
+    if ((i2c_state == I2C_STATE_ADDRESS) && (flags & I2C_IF_ACK)) {
+        flags &= ~I2C_IF_ACK;
+        if ((i2c_msgs[i2c_index].flags & I2C_MSG_FLAG_READ) != 0) {
+            i2c_state = I2C_STATE_READ;
+        } else {
+            i2c_state = I2C_STATE_WRITE;
+            i2c_write_next();
+        }
+    }
+
+    if ((i2c_state == I2C_STATE_WRITE) && (flags & I2C_IF_ACK)) {
+        i2c_write_next();
+    }
+
+    //Acknowledge each byte but the last, which is NACKed before the next message or the stop
+    if ((i2c_state == I2C_STATE_READ) && (I2C_DEVICE->STATUS & I2C_STATUS_RXDATAV)) {
+        msg = &i2c_msgs[i2c_index];
+        msg->data[i2c_position ++] = I2C_DEVICE->RXDATA;
+        if (i2c_position < msg->length) {
+            I2C_DEVICE->CMD = I2C_CMD_ACK;
+        } else {
+            I2C_DEVICE->CMD = I2C_CMD_NACK;
+            i2c_msg_next();
+        }
+    }
+
+    if ((i2c_state == I2C_STATE_STOP) && (flags & I2C_IF_MSTOP)) {
+        i2c_finish(i2c_result);
+    }
+}
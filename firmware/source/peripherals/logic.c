@@ -0,0 +1,173 @@
+#include "peripherals/logic.h"
+
+#include <stdint.h>
+
+#include "em_cmu.h"
+#include "em_gpio.h"
+#include "em_timer.h"
+#include "em_dma.h"
+
+#include "platform.h"
+#include "peripherals/dma.h"
+#include "peripherals/timebase.h"
+
+static void logic_dma_complete(unsigned int channel, bool primary, void *user);
+
+//Only the high port channel interrupts, the low port channel has always finished the same segment first
+static DMA_CB_TypeDef logic_dma_cb = {
+    .cbFunc = logic_dma_complete,
+    .userPtr = NULL
+};
+
+static logic_capture_cb_t capture_callback = NULL;
+static uint32_t *capture_segments[2];
+static uint16_t capture_samples = 0;
+
+//Sample clock timing, for mapping timestamps onto sample indices
+static uint64_t capture_start_time = 0;
+static uint32_t capture_period = 1;
+
+//Sample the GPIO ports at rate samples per second, each sample is a word holding LOGIC_PORT_LOW in the
+//low half and LOGIC_PORT_HIGH in the high half. Segments of samples words are filled alternately
+//into first and second, then into segments returned by the callback.
+int LOGIC_start(uint32_t rate, uint16_t samples, uint32_t *first, uint32_t *second, logic_capture_cb_t callback)
+{
+    uint32_t ticks;
+    uint8_t prescale = 0;
+
+    if ((rate == 0) || (samples == 0) || (samples > 1024)) {
+        return -1;
+    }
+
+    LOGIC_stop();
+
+    ticks = CMU_ClockFreqGet(cmuClock_HFPER) / rate;
+    while (((ticks >> prescale) > 0x10000) && (prescale < timerPrescale1024)) {
+        prescale ++;
+    }
+    if ((ticks >> prescale) < 2) {
+        return -2;
+    }
+
+    CMU_ClockEnable(SAMPLE_TIMER_CLOCK, true);
+
+    //Reading the ports does not clear the timer DMA requests, so clear them as each channel is serviced
+    TIMER_Init_TypeDef timer_init = TIMER_INIT_DEFAULT;
+    timer_init.enable = false;
+    timer_init.prescale = (TIMER_Prescale_TypeDef)prescale;
+    timer_init.dmaClrAct = true;
+
+    TIMER_Init(SAMPLE_TIMER, &timer_init);
+    TIMER_TopSet(SAMPLE_TIMER, (ticks >> prescale) - 1);
+
+    TIMER_InitCC_TypeDef compare_init = TIMER_INITCC_DEFAULT;
+    compare_init.mode = timerCCModeCompare;
+
+    TIMER_InitCC(SAMPLE_TIMER, LOGIC_COMPARE_CC, &compare_init);
+    TIMER_CompareSet(SAMPLE_TIMER, LOGIC_COMPARE_CC, 0);
+
+    //Start past the compare value so the first sample of each port comes from the same period
+    TIMER_CounterSet(SAMPLE_TIMER, 1);
+
+    DMA_init();
+
+    DMA_CfgChannel_TypeDef channel_low = {
+        .highPri = false,
+        .enableInt = false,
+        .select = LOGIC_DMAREQ_LOW,
+        .cb = NULL
+    };
+    DMA_CfgChannel(DMA_CHANNEL_LOGIC_LOW, &channel_low);
+
+    DMA_CfgChannel_TypeDef channel_high = {
+        .highPri = false,
+        .enableInt = true,
+        .select = LOGIC_DMAREQ_HIGH,
+        .cb = &logic_dma_cb
+    };
+    DMA_CfgChannel(DMA_CHANNEL_LOGIC_HIGH, &channel_high);
+
+    //Half words from each port, interleaved into sample words
+    DMA_CfgDescr_TypeDef descr = {
+        .dstInc = dmaDataInc4,
+        .srcInc = dmaDataIncNone,
+        .size = dmaDataSize2,
+        .arbRate = dmaArbitrate1,
+        .hprot = 0
+    };
+    DMA_CfgDescr(DMA_CHANNEL_LOGIC_LOW, true, &descr);
+    DMA_CfgDescr(DMA_CHANNEL_LOGIC_LOW, false, &descr);
+    DMA_CfgDescr(DMA_CHANNEL_LOGIC_HIGH, true, &descr);
+    DMA_CfgDescr(DMA_CHANNEL_LOGIC_HIGH, false, &descr);
+
+    capture_callback = callback;
+    capture_samples = samples;
+    capture_segments[0] = first;
+    capture_segments[1] = second;
+
+    DMA_ActivatePingPong(DMA_CHANNEL_LOGIC_LOW, false,
+                         first, (void *)&GPIO->P[LOGIC_PORT_LOW].DIN, samples - 1,
+                         second, (void *)&GPIO->P[LOGIC_PORT_LOW].DIN, samples - 1);
+    DMA_ActivatePingPong(DMA_CHANNEL_LOGIC_HIGH, false,
+                         (uint16_t *)first + 1, (void *)&GPIO->P[LOGIC_PORT_HIGH].DIN, samples - 1,
+                         (uint16_t *)second + 1, (void *)&GPIO->P[LOGIC_PORT_HIGH].DIN, samples - 1);
+
+    //The sample timer and timebase both run from the 48MHz core clock
+    capture_period = (ticks >> prescale) << prescale;
+    capture_start_time = TIMEBASE_get();
+
+    TIMER_Enable(SAMPLE_TIMER, true);
+
+    return 0;
+}
+
+//Index of the first sample taken after the given timestamp
+uint32_t LOGIC_index(uint64_t timestamp)
+{
+    if (timestamp <= capture_start_time) {
+        return 0;
+    }
+
+    return (timestamp - capture_start_time) / capture_period;
+}
+
+void LOGIC_stop()
+{
+    if (capture_callback == NULL) {
+        return;
+    }
+
+    TIMER_Enable(SAMPLE_TIMER, false);
+    DMA_ChannelEnable(DMA_CHANNEL_LOGIC_LOW, false);
+    DMA_ChannelEnable(DMA_CHANNEL_LOGIC_HIGH, false);
+
+    //Return the timer to its default configuration for ADC sampling
+    TIMER_InitCC_TypeDef compare_init = TIMER_INITCC_DEFAULT;
+    TIMER_InitCC(SAMPLE_TIMER, LOGIC_COMPARE_CC, &compare_init);
+    SAMPLE_TIMER->CTRL &= ~TIMER_CTRL_DMACLRACT;
+
+    capture_callback = NULL;
+}
+
+//Called from the DMA interrupt each time the high port channel completes a segment
+static void logic_dma_complete(unsigned int channel, bool primary, void *user)
+{
+    (void)user;
+
+    uint8_t index = (primary == true) ? 0 : 1;
+
+    if (capture_callback == NULL) {
+        return;
+    }
+
+    //Hand the segment over and refill both channels' descriptors, the callback may stop the capture
+    capture_segments[index] = capture_callback(capture_segments[index]);
+    if (capture_callback == NULL) {
+        return;
+    }
+
+    DMA_RefreshPingPong(DMA_CHANNEL_LOGIC_LOW, primary, false,
+                        capture_segments[index], NULL, capture_samples - 1, false);
+    DMA_RefreshPingPong(channel, primary, false,
+                        (uint16_t *)capture_segments[index] + 1, NULL, capture_samples - 1, false);
+}
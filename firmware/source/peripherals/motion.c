@@ -0,0 +1,317 @@
+#include "peripherals/motion.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "em_device.h"
+#include "em_cmu.h"
+#include "em_int.h"
+#include "em_timer.h"
+
+#include "platform.h"
+#include "peripherals/gpio.h"
+#include "peripherals/pwm.h"
+
+#define MOTION_PULSE_US         3       //Step pulse width, within the minimum of common stepper drivers
+#define MOTION_MIN_TICKS        64      //Timer ticks per step at full speed, sets the speed resolution
+#define MOTION_MAX_PERIOD       (0xFFFF << 8)
+
+//Each step is taken on a timer overflow and ends on a compare match a pulse width later. The period to
+//the following step is written to the top buffer from the same interrupt, so the timer reloads it
+//itself and latency does not accumulate from step to step. The step pin is set from the interrupt, so
+//each edge still jitters by the interrupt latency. Periods are held in 24.8 fixed point.
+static int motion_step_pin = -1;
+static int motion_dir_pin = -1;
+static bool motion_invert = false;
+static motion_done_cb_t motion_callback = NULL;
+
+static volatile bool motion_moving = false;
+static volatile int32_t motion_position = 0;
+static int32_t motion_target = 0;
+static int32_t motion_dir = 1;
+static uint32_t motion_tick_rate = 0;
+static uint32_t motion_pulse = 0;
+
+//Steps still to take, and the periods before them not yet given to the timer
+static volatile uint32_t motion_remaining = 0;
+static volatile uint32_t motion_plan = 0;
+static uint32_t motion_accel_steps = 0;
+static uint32_t motion_period = 0;
+static uint32_t motion_period_min = 0;
+
+static uint32_t motion_isqrt(uint64_t value);
+static uint32_t motion_next_period();
+static void motion_pulse_end();
+static void motion_finish();
+static void motion_timer_handler(uint32_t flags);
+
+//Select the GPIO pins driving a step/direction stepper driver, both become outputs driven low
+int MOTION_configure(int step_pin, int dir_pin, bool invert)
+{
+    if ((step_pin < 0) || (step_pin >= GPIO_NUM_PINS) || (dir_pin < 0) || (dir_pin >= GPIO_NUM_PINS)
+        || (step_pin == dir_pin) || (motion_moving == true)) {
+        return -1;
+    }
+
+    GPIO_configure(step_pin, true, false, false);
+    GPIO_configure(dir_pin, true, false, false);
+
+    motion_step_pin = step_pin;
+    motion_dir_pin = dir_pin;
+    motion_invert = invert;
+
+    return 0;
+}
+
+//Move to an absolute position, accelerating up to speed (steps per second) at acceleration (steps per
+//second squared) and decelerating at the same rate to stop on the target. Stops any PWM output or capture.
+int MOTION_start(int32_t target, uint32_t speed, uint32_t acceleration, motion_done_cb_t callback)
+{
+    uint32_t clock = CMU_ClockFreqGet(cmuClock_HFPER);
+    uint32_t distance;
+    uint64_t first, minimum;
+    uint8_t prescale = 0;
+
+    if ((motion_step_pin < 0) || (motion_moving == true) || (speed == 0) || (acceleration == 0)) {
+        return -1;
+    }
+
+    motion_callback = callback;
+    motion_target = target;
+
+    if (target == motion_position) {
+        if (callback != NULL) {
+            callback(true, motion_position);
+        }
+        return 0;
+    }
+
+    motion_dir = (target > motion_position) ? 1 : -1;
+    distance = (motion_dir > 0) ? (uint32_t)(target - motion_position) : (uint32_t)(motion_position - target);
+
+    //The first step from standstill takes 0.676 * clock * sqrt(2 / acceleration), the factor correcting
+    //for the approximation below being poor over its first steps
+    first = 173 * (uint64_t)motion_isqrt(2 * (uint64_t)clock * clock / acceleration);
+    minimum = ((uint64_t)clock << 8) / speed;
+    if (first < minimum) {
+        first = minimum;
+    }
+
+    //Prescale until the first period fits the timer, unless it would cost too much resolution at speed,
+    //in which case the first step is taken early
+    while ((prescale < timerPrescale1024) && ((first >> (prescale + 8)) > 0xFFFF)
+           && ((minimum >> (prescale + 9)) >= MOTION_MIN_TICKS)) {
+        prescale ++;
+    }
+
+    motion_period = ((first >> prescale) > MOTION_MAX_PERIOD) ? MOTION_MAX_PERIOD : (first >> prescale);
+    motion_period_min = minimum >> prescale;
+    if ((motion_period_min >> 8) < 2) {
+        return -2;
+    }
+
+    motion_tick_rate = clock >> prescale;
+    motion_pulse = (uint64_t)motion_tick_rate * MOTION_PULSE_US / 1000000;
+    if (motion_pulse >= (motion_period_min >> 9)) {
+        motion_pulse = motion_period_min >> 9;
+    }
+    if (motion_pulse == 0) {
+        motion_pulse = 1;
+    }
+
+    PWM_timer_claim(motion_timer_handler);
+
+    TIMER_Init_TypeDef timer_init = TIMER_INIT_DEFAULT;
+    timer_init.enable = false;
+    timer_init.prescale = (TIMER_Prescale_TypeDef)prescale;
+
+    TIMER_Init(MOTION_TIMER, &timer_init);
+    TIMER_CounterSet(MOTION_TIMER, 0);
+
+    //Compare without an output, only its interrupt is used
+    TIMER_InitCC_TypeDef compare_init = TIMER_INITCC_DEFAULT;
+    compare_init.mode = timerCCModeCompare;
+
+    TIMER_InitCC(MOTION_TIMER, 0, &compare_init);
+    TIMER_CompareSet(MOTION_TIMER, 0, motion_pulse);
+
+    motion_remaining = distance;
+    motion_plan = distance - 1;
+    motion_accel_steps = 0;
+
+    //Periods to the second and third steps, following ones are loaded as each step is taken
+    if (motion_plan > 0) {
+        TIMER_TopSet(MOTION_TIMER, (motion_period >> 8) - 1);
+        motion_plan --;
+    } else {
+        TIMER_TopSet(MOTION_TIMER, 0xFFFF);
+    }
+    if (motion_plan > 0) {
+        TIMER_TopBufSet(MOTION_TIMER, motion_next_period() - 1);
+        motion_plan --;
+    }
+
+    GPIO_set(motion_dir_pin, (motion_dir > 0) != motion_invert);
+
+    TIMER_IntClear(MOTION_TIMER, TIMER_IF_OF | TIMER_IF_CC0);
+    TIMER_IntEnable(MOTION_TIMER, TIMER_IF_OF | TIMER_IF_CC0);
+    NVIC_ClearPendingIRQ(PWM_TIMER_IRQ);
+    NVIC_EnableIRQ(PWM_TIMER_IRQ);
+
+    //First step now, the rest on overflows
+    motion_moving = true;
+    GPIO_set(motion_step_pin, true);
+    motion_position += motion_dir;
+    motion_remaining --;
+
+    TIMER_Enable(MOTION_TIMER, true);
+
+    return 0;
+}
+
+//Stop the move, either decelerating over as many steps as it took to reach the current speed or at once
+void MOTION_stop(bool halt)
+{
+    INT_Disable();
+
+    if (motion_moving == true) {
+        if (halt == true) {
+            GPIO_set(motion_step_pin, false);
+            motion_remaining = 0;
+            motion_finish();
+        } else if (motion_plan > motion_accel_steps) {
+            motion_remaining -= motion_plan - motion_accel_steps;
+            motion_plan = motion_accel_steps;
+        }
+    }
+
+    INT_Enable();
+}
+
+bool MOTION_busy()
+{
+    return motion_moving;
+}
+
+int32_t MOTION_position()
+{
+    return motion_position;
+}
+
+int32_t MOTION_target()
+{
+    return motion_target;
+}
+
+//Current step rate in steps per second, from the period being timed
+uint32_t MOTION_speed()
+{
+    if (motion_moving == false) {
+        return 0;
+    }
+
+    return motion_tick_rate / (TIMER_TopGet(MOTION_TIMER) + 1);
+}
+
+int MOTION_set_position(int32_t position)
+{
+    if (motion_moving == true) {
+        return -1;
+    }
+
+    motion_position = position;
+    motion_target = position;
+
+    return 0;
+}
+
+//Integer square root, bit by bit
+static uint32_t motion_isqrt(uint64_t value)
+{
+    uint64_t root = 0;
+    uint64_t bit = (uint64_t)1 << 62;
+
+    while (bit > value) {
+        bit >>= 2;
+    }
+
+    while (bit != 0) {
+        if (value >= root + bit) {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return root;
+}
+
+//Period before the next step to be planned, in timer ticks. Constant acceleration is approximated per step
+//by c(n) = c(n-1) - 2c(n-1) / (4n + 1), which is run backwards to decelerate over as many steps as were
+//spent accelerating once only that many remain.
+static uint32_t motion_next_period()
+{
+    if (motion_plan <= motion_accel_steps) {
+        motion_period += (2 * motion_period) / (4 * motion_accel_steps - 1);
+        motion_accel_steps --;
+        if (motion_period > MOTION_MAX_PERIOD) {
+            motion_period = MOTION_MAX_PERIOD;
+        }
+    } else if (motion_period > motion_period_min) {
+        motion_accel_steps ++;
+        motion_period -= (2 * motion_period) / (4 * motion_accel_steps + 1);
+        if (motion_period < motion_period_min) {
+            motion_period = motion_period_min;
+        }
+    }
+
+    return motion_period >> 8;
+}
+
+static void motion_pulse_end()
+{
+    GPIO_set(motion_step_pin, false);
+
+    if ((motion_moving == true) && (motion_remaining == 0)) {
+        motion_finish();
+    }
+}
+
+static void motion_finish()
+{
+    TIMER_IntDisable(MOTION_TIMER, TIMER_IF_OF | TIMER_IF_CC0);
+    TIMER_Enable(MOTION_TIMER, false);
+
+    motion_moving = false;
+
+    if (motion_callback != NULL) {
+        motion_callback(motion_position == motion_target, motion_position);
+    }
+}
+
+static void motion_timer_handler(uint32_t flags)
+{
+    //End of the previous pulse first when the interrupt was late enough to see both
+    if (flags & TIMER_IF_CC0) {
+        motion_pulse_end();
+    }
+
+    if ((flags & TIMER_IF_OF) && (motion_moving == true) && (motion_remaining > 0)) {
+        GPIO_set(motion_step_pin, true);
+        motion_position += motion_dir;
+        motion_remaining --;
+
+        if (motion_plan > 0) {
+            TIMER_TopBufSet(MOTION_TIMER, motion_next_period() - 1);
+            motion_plan --;
+        }
+
+        //Already past the compare match, so end the pulse here
+        if (TIMER_CounterGet(MOTION_TIMER) >= motion_pulse) {
+            TIMER_IntClear(MOTION_TIMER, TIMER_IF_CC0);
+            motion_pulse_end();
+        }
+    }
+}
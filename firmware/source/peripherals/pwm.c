@@ -2,31 +2,379 @@
 #include "peripherals/pwm.h"
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include "em_cmu.h"
+#include "em_gpio.h"
+#include "em_int.h"
 #include "em_timer.h"
 
 #include "platform.h"
+#include "protocol.h"
 
-void PWM_init()
+//Compare values are written to the buffer registers and loaded by the timer on overflow, so the
+//output never sees a partial period. Values above TOP hold the output high for the whole period.
+static bool pwm_running = false;
+static uint32_t pwm_top = 0;
+static uint16_t pwm_compare[USBTHING_PWM_NUM_CHANNELS];
+static const uint32_t pwm_route[USBTHING_PWM_NUM_CHANNELS] = {
+	TIMER_ROUTE_CC0PEN,
+	TIMER_ROUTE_CC1PEN
+};
+
+//Pins as GPIO, for output defaults and capture levels
+static const GPIO_Port_TypeDef pwm_ports[USBTHING_PWM_NUM_CHANNELS] = {
+	PWM_CC0_PORT,
+	PWM_CC1_PORT
+};
+static const uint8_t pwm_pins[USBTHING_PWM_NUM_CHANNELS] = {
+	PWM_CC0_PIN,
+	PWM_CC1_PIN
+};
+
+//Capture runs the timer unprescaled over its full range, counting overflows in the interrupt to extend
+//edge times to 32 bits (89 seconds at 48MHz)
+static bool pwm_capturing = false;
+static volatile uint8_t capture_state = USBTHING_PWM_CAPTURE_IDLE;
+static uint8_t capture_channel = 0;
+static bool capture_started = false;
+static uint32_t capture_overflows = 0;
+static uint32_t capture_timeout = 0;
+static uint32_t capture_target = 0;
+static uint32_t capture_waves = 0;
+static uint32_t capture_first = 0;
+static uint32_t capture_rise = 0;
+static uint32_t capture_high = 0;
+static uint32_t capture_high_whole = 0;
+
+//Another driver may borrow the timer, taking its interrupts until the timer is closed or reconfigured
+static pwm_timer_handler_t pwm_handler = NULL;
+
+static uint16_t pwm_duty_compare(uint16_t duty);
+static void pwm_capture_edge(bool rising, uint32_t time);
+static void pwm_capture_finish(uint8_t state);
+
+//Start the timer at the given frequency with all channels disabled and at zero duty
+int PWM_init(uint32_t frequency)
 {
-	//CMU_ClockEnable(PWM_TIMER_CLOCK);
+	uint32_t ticks;
+	uint8_t prescale = 0;
+
+	if (frequency == 0) {
+		return -1;
+	}
+
+	//TOP must stay below 0xFFFF so that a compare value can exceed it
+	ticks = CMU_ClockFreqGet(cmuClock_HFPER) / frequency;
+	while (((ticks >> prescale) > 0xFFFF) && (prescale < timerPrescale1024)) {
+		prescale ++;
+	}
+	if (((ticks >> prescale) > 0xFFFF) || ((ticks >> prescale) < 2)) {
+		return -2;
+	}
+
+	PWM_close();
+
+	CMU_ClockEnable(PWM_TIMER_CLOCK, true);
+
+	for (uint8_t i = 0; i < USBTHING_PWM_NUM_CHANNELS; i++) {
+		GPIO_PinModeSet(pwm_ports[i], pwm_pins[i], gpioModePushPull, 0);
+	}
 
+	TIMER_Init_TypeDef timer_init = TIMER_INIT_DEFAULT;
+	timer_init.enable = false;
+	timer_init.prescale = (TIMER_Prescale_TypeDef)prescale;
 
+	TIMER_Init(PWM_TIMER, &timer_init);
+
+	pwm_top = (ticks >> prescale) - 1;
+	TIMER_TopSet(PWM_TIMER, pwm_top);
+	TIMER_CounterSet(PWM_TIMER, 0);
+
+	TIMER_InitCC_TypeDef compare_init = TIMER_INITCC_DEFAULT;
+	compare_init.mode = timerCCModePWM;
+
+	for (uint8_t i = 0; i < USBTHING_PWM_NUM_CHANNELS; i++) {
+		pwm_compare[i] = 0;
+		TIMER_InitCC(PWM_TIMER, i, &compare_init);
+		TIMER_CompareSet(PWM_TIMER, i, 0);
+		TIMER_CompareBufSet(PWM_TIMER, i, 0);
+	}
+
+	PWM_TIMER->ROUTE = PWM_ROUTE_LOCATION;
+
+	TIMER_IntClear(PWM_TIMER, TIMER_IF_OF);
+	NVIC_ClearPendingIRQ(PWM_TIMER_IRQ);
+	NVIC_EnableIRQ(PWM_TIMER_IRQ);
+
+	TIMER_Enable(PWM_TIMER, true);
+	pwm_running = true;
+
+	return 0;
 }
 
 void PWM_close()
 {
+	if (pwm_running == false) {
+		return;
+	}
+
+	NVIC_DisableIRQ(PWM_TIMER_IRQ);
+	TIMER_IntDisable(PWM_TIMER, _TIMER_IEN_MASK);
+
+	//Output pins fall back to GPIO outputs driven low, capture pins stay inputs
+	PWM_TIMER->ROUTE = 0;
+	TIMER_Reset(PWM_TIMER);
+
+	CMU_ClockEnable(PWM_TIMER_CLOCK, false);
+
+	if (pwm_capturing && (capture_state == USBTHING_PWM_CAPTURE_RUNNING)) {
+		capture_state = USBTHING_PWM_CAPTURE_IDLE;
+	}
+	pwm_capturing = false;
+	pwm_handler = NULL;
+	pwm_running = false;
+}
+
+//Stop any output or capture and hand the timer, clocked but otherwise reset, to another driver
+void PWM_timer_claim(pwm_timer_handler_t handler)
+{
+	PWM_close();
+
+	CMU_ClockEnable(PWM_TIMER_CLOCK, true);
 
+	pwm_handler = handler;
+	pwm_running = true;
+}
 
+//Whether the timer is on loan, outputs stay unusable until the timer is reconfigured
+bool PWM_timer_claimed()
+{
+	return pwm_handler != NULL;
 }
 
 void PWM_enable(uint8_t channel, bool enable)
 {
+	if ((pwm_running == false) || (pwm_handler != NULL) || (channel >= USBTHING_PWM_NUM_CHANNELS)) {
+		return;
+	}
+
+	if (enable) {
+		PWM_TIMER->ROUTE |= pwm_route[channel];
+	} else {
+		PWM_TIMER->ROUTE &= ~pwm_route[channel];
+	}
+}
+
+//Change one channel from the start of the next period
+void PWM_set(uint8_t channel, uint16_t duty)
+{
+	if ((pwm_running == false) || (pwm_handler != NULL) || (channel >= USBTHING_PWM_NUM_CHANNELS)) {
+		return;
+	}
+
+	INT_Disable();
+	pwm_compare[channel] = pwm_duty_compare(duty);
+	TIMER_CompareBufSet(PWM_TIMER, channel, pwm_compare[channel]);
+	INT_Enable();
+}
+
+//Change all channels from the start of the same period. Writing the buffers directly could straddle an
+//overflow, so they are written from the overflow interrupt with the rest of the period to spare.
+void PWM_update(const uint16_t *duty)
+{
+	if ((pwm_running == false) || (pwm_handler != NULL)) {
+		return;
+	}
+
+	INT_Disable();
+	for (uint8_t i = 0; i < USBTHING_PWM_NUM_CHANNELS; i++) {
+		pwm_compare[i] = pwm_duty_compare(duty[i]);
+	}
+	TIMER_IntClear(PWM_TIMER, TIMER_IF_OF);
+	TIMER_IntEnable(PWM_TIMER, TIMER_IF_OF);
+	INT_Enable();
+}
+
+//Measure num_waves whole periods on a channel pin, from its first rising edge. Stops the PWM output.
+int PWM_capture_start(uint8_t channel, uint32_t waves, uint32_t timeout_ms)
+{
+	if ((channel >= USBTHING_PWM_NUM_CHANNELS) || (waves == 0)) {
+		return -1;
+	}
+
+	PWM_close();
+
+	CMU_ClockEnable(PWM_TIMER_CLOCK, true);
+
+	GPIO_PinModeSet(pwm_ports[channel], pwm_pins[channel], gpioModeInput, 0);
+
+	TIMER_Init_TypeDef timer_init = TIMER_INIT_DEFAULT;
+	timer_init.enable = false;
+
+	TIMER_Init(PWM_TIMER, &timer_init);
+	TIMER_TopSet(PWM_TIMER, 0xFFFF);
+	TIMER_CounterSet(PWM_TIMER, 0);
+
+	//Both edges, the status register reports which one each capture was
+	TIMER_InitCC_TypeDef capture_init = TIMER_INITCC_DEFAULT;
+	capture_init.mode = timerCCModeCapture;
+	capture_init.edge = timerEdgeBoth;
+	capture_init.eventCtrl = timerEventEveryEdge;
+
+	TIMER_InitCC(PWM_TIMER, channel, &capture_init);
+
+	PWM_TIMER->ROUTE = PWM_ROUTE_LOCATION | pwm_route[channel];
+
+	capture_channel = channel;
+	capture_target = waves;
+	capture_timeout = timeout_ms * (CMU_ClockFreqGet(cmuClock_HFPER) / 1000);
+	capture_started = false;
+	capture_overflows = 0;
+	capture_waves = 0;
+	capture_high = 0;
+	capture_high_whole = 0;
+	capture_state = USBTHING_PWM_CAPTURE_RUNNING;
+	pwm_capturing = true;
+	pwm_running = true;
+
+	TIMER_IntClear(PWM_TIMER, TIMER_IF_OF | (TIMER_IF_CC0 << channel) | (TIMER_IF_ICBOF0 << channel));
+	TIMER_IntEnable(PWM_TIMER, TIMER_IF_OF | (TIMER_IF_CC0 << channel));
+	NVIC_ClearPendingIRQ(PWM_TIMER_IRQ);
+	NVIC_EnableIRQ(PWM_TIMER_IRQ);
+
+	TIMER_Enable(PWM_TIMER, true);
+
+	return 0;
+}
+
+//Capture state (usbthing_pwm_capture_state_e) and results so far, frequency in millihertz and duty as a
+//fraction of USBTHING_PWM_DUTY_FULL
+uint8_t PWM_capture_result(uint32_t *frequency, uint32_t *duty, uint32_t *waves)
+{
+	uint8_t state;
+	uint32_t span;
+	uint32_t high;
+	uint32_t count;
+
+	INT_Disable();
+	state = capture_state;
+	count = capture_waves;
+	span = capture_rise - capture_first;
+	high = capture_high_whole;
+	INT_Enable();
+
+	*waves = count;
+
+	if (count == 0) {
+		*frequency = 0;
+		*duty = (GPIO_PinInGet(pwm_ports[capture_channel], pwm_pins[capture_channel]) != 0)
+		        ? USBTHING_PWM_DUTY_FULL : 0;
+		return state;
+	}
+
+	*frequency = ((uint64_t)count * CMU_ClockFreqGet(cmuClock_HFPER) * 1000 + span / 2) / span;
+	*duty = ((uint64_t)high * USBTHING_PWM_DUTY_FULL + span / 2) / span;
+
+	return state;
+}
+
+void TIMER1_IRQHandler(void)
+{
+	uint32_t flags = TIMER_IntGetEnabled(PWM_TIMER);
+
+	TIMER_IntClear(PWM_TIMER, flags);
+
+	if (pwm_handler != NULL) {
+		pwm_handler(flags);
+		return;
+	}
+
+	if (pwm_capturing == false) {
+		TIMER_IntDisable(PWM_TIMER, TIMER_IF_OF);
+
+		for (uint8_t i = 0; i < USBTHING_PWM_NUM_CHANNELS; i++) {
+			TIMER_CompareBufSet(PWM_TIMER, i, pwm_compare[i]);
+		}
+		return;
+	}
+
+	//Empty the capture buffer. An overflow pending alongside an early capture happened before it, so the
+	//flags are read again after each capture to catch overflows since the interrupt was entered.
+	while (PWM_TIMER->STATUS & (TIMER_STATUS_ICV0 << capture_channel)) {
+		bool rising = (PWM_TIMER->STATUS & (TIMER_STATUS_CCPOL0 << capture_channel)) == 0;
+		uint32_t value = TIMER_CaptureGet(PWM_TIMER, capture_channel);
+		uint32_t pending = PWM_TIMER->IF;
+		uint32_t time;
+
+		//A lost edge would merge or split periods, nothing measured can be trusted
+		if ((pending & (TIMER_IF_ICBOF0 << capture_channel)) && (capture_state == USBTHING_PWM_CAPTURE_RUNNING)) {
+			TIMER_IntClear(PWM_TIMER, TIMER_IF_ICBOF0 << capture_channel);
+			capture_waves = 0;
+			pwm_capture_finish(USBTHING_PWM_CAPTURE_OVERRUN);
+			return;
+		}
+
+		if (pending & TIMER_IF_OF) {
+			TIMER_IntClear(PWM_TIMER, TIMER_IF_OF);
+			flags |= TIMER_IF_OF;
+		}
+
+		time = (capture_overflows << 16) | value;
+		if ((flags & TIMER_IF_OF) && (value < 0x8000)) {
+			time += 0x10000;
+		}
+		pwm_capture_edge(rising, time);
+	}
 
+	if (flags & TIMER_IF_OF) {
+		capture_overflows ++;
+
+		if ((capture_state == USBTHING_PWM_CAPTURE_RUNNING)
+		        && ((capture_overflows << 16) >= capture_timeout)) {
+			pwm_capture_finish(USBTHING_PWM_CAPTURE_TIMEOUT);
+		}
+	}
 }
 
-void PWM_set(uint8_t channel)
+//Scale a duty cycle to the period, full duty is one past TOP so the output never clears
+static uint16_t pwm_duty_compare(uint16_t duty)
 {
+	return ((uint32_t)duty * (pwm_top + 1) + USBTHING_PWM_DUTY_FULL / 2) / USBTHING_PWM_DUTY_FULL;
+}
+
+//Periods run from rising edge to rising edge, only high time within whole periods counts
+static void pwm_capture_edge(bool rising, uint32_t time)
+{
+	if (capture_state != USBTHING_PWM_CAPTURE_RUNNING) {
+		return;
+	}
+
+	if (rising == false) {
+		if (capture_started) {
+			capture_high += time - capture_rise;
+		}
+		return;
+	}
 
-}
\ No newline at end of file
+	if (capture_started == false) {
+		capture_started = true;
+		capture_first = time;
+	} else {
+		capture_waves ++;
+		capture_high_whole = capture_high;
+	}
+	capture_rise = time;
+
+	if (capture_waves >= capture_target) {
+		pwm_capture_finish(USBTHING_PWM_CAPTURE_DONE);
+	}
+}
+
+//Results stay readable, the timer stops until the next capture or output configuration
+static void pwm_capture_finish(uint8_t state)
+{
+	TIMER_IntDisable(PWM_TIMER, _TIMER_IEN_MASK);
+	TIMER_Enable(PWM_TIMER, false);
+	capture_state = state;
+}
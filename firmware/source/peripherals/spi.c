@@ -7,8 +7,33 @@
 #include "em_usart.h"
 #include "em_gpio.h"
 #include "em_cmu.h"
+#include "em_dma.h"
 
 #include "platform.h"
+#include "peripherals/dma.h"
+
+/***        Internal function prototypes            ***/
+
+static void spi_dma_complete(unsigned int channel, bool primary, void *user);
+
+/***        Internal state                          ***/
+
+static DMA_CB_TypeDef spi_dma_cb = {
+    .cbFunc = spi_dma_complete,
+    .userPtr = NULL
+};
+
+//Dummy words for receive only and transmit only transfers
+static uint8_t spi_tx_dummy = 0xFF;
+static uint8_t spi_rx_dummy;
+
+static bool spi_initialised = false;
+static volatile bool spi_busy = false;
+static uint8_t spi_flags = 0;
+static uint16_t spi_length = 0;
+static spi_xfer_cb_t spi_callback = NULL;
+
+/***        Interface Functions                     ***/
 
 int8_t SPI_init(uint32_t baud, uint8_t clock_mode)
 {
@@ -24,58 +49,190 @@ int8_t SPI_init(uint32_t baud, uint8_t clock_mode)
 
     GPIO_PinOutSet(SPI_CS_PORT, SPI_CS_PIN);
 
-    //TODO: determine clock mode
+    //Map clock mode onto USART clock polarity and phase
+    USART_ClockMode_TypeDef usart_clock_mode;
+    switch (clock_mode) {
+    case 1:
+        usart_clock_mode = usartClockMode1;
+        break;
+    case 2:
+        usart_clock_mode = usartClockMode2;
+        break;
+    case 3:
+        usart_clock_mode = usartClockMode3;
+        break;
+    default:
+        usart_clock_mode = usartClockMode0;
+        break;
+    }
 
     //Configure USART
     USART_InitSync_TypeDef spiConfig = {
-        .enable = usartEnable,
+        .enable = usartDisable,
         .refFreq = 0,
         .baudrate = baud,
         .databits = usartDatabits8,
         .master = true,
         .msbf = true,
-        .clockMode = clock_mode,
+        .clockMode = usart_clock_mode,
     };
 
     //Initialize USART
     USART_InitSync(SPI_DEVICE, &spiConfig);
 
-    //Set up route
+    //Set up route, CS is driven in software so it can be held across transfers
     SPI_DEVICE->ROUTE |= SPI_ROUTE;
 
+    //Configure DMA channels, RX completion signals the end of a transfer
+    DMA_init();
+
+    DMA_CfgChannel_TypeDef rx_channel = {
+        .highPri = true,
+        .enableInt = true,
+        .select = SPI_DMAREQ_RX,
+        .cb = &spi_dma_cb
+    };
+    DMA_CfgChannel(DMA_CHANNEL_SPI_RX, &rx_channel);
+
+    DMA_CfgChannel_TypeDef tx_channel = {
+        .highPri = false,
+        .enableInt = false,
+        .select = SPI_DMAREQ_TX,
+        .cb = NULL
+    };
+    DMA_CfgChannel(DMA_CHANNEL_SPI_TX, &tx_channel);
+
+    spi_busy = false;
+    spi_initialised = true;
+
+    //Enable USART once, rather than per transfer
+    USART_Enable(SPI_DEVICE, usartEnable);
+
     return 0;
 }
 
 int8_t SPI_close()
 {
+    //Stop any transfer in progress
+    DMA_ChannelEnable(DMA_CHANNEL_SPI_RX, false);
+    DMA_ChannelEnable(DMA_CHANNEL_SPI_TX, false);
+    spi_busy = false;
+    spi_initialised = false;
+
+    USART_Enable(SPI_DEVICE, usartDisable);
+
     GPIO_PinModeSet(SPI_MOSI_PORT,  SPI_MOSI_PIN,  gpioModeDisabled, 1);
     GPIO_PinModeSet(SPI_MISO_PORT,  SPI_MISO_PIN,  gpioModeDisabled, 0);
     GPIO_PinModeSet(SPI_CS_PORT,  SPI_CS_PIN,  gpioModeDisabled, 1);
     GPIO_PinModeSet(SPI_CLK_PORT, SPI_CLK_PIN, gpioModeDisabled, 1);
 
     CMU_ClockEnable(SPI_CLOCK, false);
-    CMU_ClockEnable(GPIO_CLOCK, false);
 
     return 0;
 }
 
-int8_t SPI_transfer(uint16_t length, uint8_t *data_out, uint8_t *data_in)
+void SPI_cs_assert()
 {
-    //Enable USART
-    USART_Enable(SPI_DEVICE, usartEnable);
-
-    //Assert CS
     GPIO_PinOutClear(SPI_CS_PORT, SPI_CS_PIN);
+}
+
+void SPI_cs_release()
+{
+    GPIO_PinOutSet(SPI_CS_PORT, SPI_CS_PIN);
+}
+
+bool SPI_busy()
+{
+    return spi_busy;
+}
 
-    //Transfer data
-    for (uint16_t i = 0; i < length; i++) {
-        data_in[i] = USART_SpiTransfer(SPI_DEVICE, data_out[i]);
+//Start a DMA transfer, data_out or data_in may be NULL for receive or transmit only transfers
+int8_t SPI_transfer_start(uint16_t length, uint8_t *data_out, uint8_t *data_in, uint8_t flags, spi_xfer_cb_t callback)
+{
+    if (spi_initialised == false) {
+        return -3;
     }
 
-    //De-assert CS
-    GPIO_PinOutSet(SPI_CS_PORT, SPI_CS_PIN);
+    if (spi_busy == true) {
+        return -1;
+    }
+
+    if ((length == 0) || (length > 1024)) {
+        return -2;
+    }
+
+    spi_busy = true;
+    spi_flags = flags;
+    spi_length = length;
+    spi_callback = callback;
+
+    //Flush stale receive data
+    SPI_DEVICE->CMD = USART_CMD_CLEARRX;
+
+    //Configure descriptors, fixed addresses are used for dummy words
+    DMA_CfgDescr_TypeDef rx_descr = {
+        .dstInc = (data_in != NULL) ? dmaDataInc1 : dmaDataIncNone,
+        .srcInc = dmaDataIncNone,
+        .size = dmaDataSize1,
+        .arbRate = dmaArbitrate1,
+        .hprot = 0
+    };
+    DMA_CfgDescr(DMA_CHANNEL_SPI_RX, true, &rx_descr);
+
+    DMA_CfgDescr_TypeDef tx_descr = {
+        .dstInc = dmaDataIncNone,
+        .srcInc = (data_out != NULL) ? dmaDataInc1 : dmaDataIncNone,
+        .size = dmaDataSize1,
+        .arbRate = dmaArbitrate1,
+        .hprot = 0
+    };
+    DMA_CfgDescr(DMA_CHANNEL_SPI_TX, true, &tx_descr);
+
+    SPI_cs_assert();
+
+    //Arm RX before TX so no received byte can be missed
+    DMA_ActivateBasic(DMA_CHANNEL_SPI_RX, true, false,
+                      (data_in != NULL) ? (void *)data_in : (void *)&spi_rx_dummy,
+                      (void *)&SPI_DEVICE->RXDATA, length - 1);
+
+    DMA_ActivateBasic(DMA_CHANNEL_SPI_TX, true, false,
+                      (void *)&SPI_DEVICE->TXDATA,
+                      (data_out != NULL) ? (void *)data_out : (void *)&spi_tx_dummy, length - 1);
+
+    return 0;
+}
+
+//Blocking transfer
+int8_t SPI_transfer(uint16_t length, uint8_t *data_out, uint8_t *data_in)
+{
+    int8_t res;
+
+    res = SPI_transfer_start(length, data_out, data_in, 0, NULL);
+    if (res < 0) {
+        return res;
+    }
+
+    while (spi_busy == true);
 
-    //Disable USART
-    USART_Enable(SPI_DEVICE, usartDisable);
     return 0;
 }
+
+/***        Internal Functions                      ***/
+
+//Called from the DMA interrupt once the last byte has been received
+static void spi_dma_complete(unsigned int channel, bool primary, void *user)
+{
+    (void)channel;
+    (void)primary;
+    (void)user;
+
+    if ((spi_flags & SPI_XFER_FLAG_HOLD_CS) == 0) {
+        SPI_cs_release();
+    }
+
+    spi_busy = false;
+
+    if (spi_callback != NULL) {
+        spi_callback(0, spi_length);
+    }
+}
@@ -0,0 +1,49 @@
+
+#include "peripherals/timebase.h"
+
+#include <stdint.h>
+
+#include "em_device.h"
+#include "em_int.h"
+
+//Upper word of the timebase, extended each time the cycle counter is seen to wrap
+static uint32_t timebase_high = 0;
+static uint32_t timebase_last = 0;
+
+//Start the DWT cycle counter
+void TIMEBASE_init()
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    timebase_high = 0;
+    timebase_last = 0;
+}
+
+//Read the timebase, safe to call from interrupt context
+uint64_t TIMEBASE_get()
+{
+    uint32_t now;
+    uint64_t timestamp;
+
+    INT_Disable();
+
+    now = DWT->CYCCNT;
+    if (now < timebase_last) {
+        timebase_high ++;
+    }
+    timebase_last = now;
+
+    timestamp = ((uint64_t)timebase_high << 32) | now;
+
+    INT_Enable();
+
+    return timestamp;
+}
+
+//Must be called at least once per counter wrap (~89s at 48MHz), called from the main loop
+void TIMEBASE_update()
+{
+    (void)TIMEBASE_get();
+}
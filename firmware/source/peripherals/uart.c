@@ -0,0 +1,354 @@
+#include "peripherals/uart.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "em_device.h"
+#include "em_usart.h"
+#include "em_gpio.h"
+#include "em_cmu.h"
+#include "em_dma.h"
+#include "em_int.h"
+
+#include "platform.h"
+#include "protocol.h"
+#include "peripherals/dma.h"
+
+#define UART_RX_SEGMENT         128
+#define UART_RX_SEGMENTS        (USBTHING_UART_RX_BUFFER_SIZE / UART_RX_SEGMENT)
+
+/***        Internal function prototypes            ***/
+
+static uint32_t uart_rx_head();
+static void uart_rx_complete(unsigned int channel, bool primary, void *user);
+static void uart_tx_complete(unsigned int channel, bool primary, void *user);
+
+/***        Internal state                          ***/
+
+static DMA_CB_TypeDef uart_rx_cb = {
+    .cbFunc = uart_rx_complete,
+    .userPtr = NULL
+};
+
+static DMA_CB_TypeDef uart_tx_cb = {
+    .cbFunc = uart_tx_complete,
+    .userPtr = NULL
+};
+
+//Receive ring, filled a segment at a time by ping-pong DMA so reception never waits on the CPU. Positions
+//are free running byte counts, taken modulo the ring size to index it. The segment each descriptor fills is
+//recorded so the write position can be read back from whichever descriptor is active.
+static uint8_t uart_rx_ring[USBTHING_UART_RX_BUFFER_SIZE] __attribute__ ((aligned(4)));
+static uint32_t uart_rx_segment[2];
+static volatile uint32_t uart_rx_tail = 0;
+static volatile uint32_t uart_rx_lost = 0;
+static volatile uint32_t uart_rx_errors = 0;
+
+static bool uart_open = false;
+static volatile bool uart_tx_busy = false;
+static uart_tx_cb_t uart_tx_callback = NULL;
+
+/***        Interface Functions                     ***/
+
+int UART_init(uint32_t baud, uint8_t data_bits, uint8_t parity, uint8_t stop_bits)
+{
+    if ((baud == 0) || ((data_bits != 7) && (data_bits != 8)) || (parity > USBTHING_UART_PARITY_ODD)
+        || ((stop_bits != 1) && (stop_bits != 2))) {
+        return -1;
+    }
+
+    UART_close();
+
+    //Enable clocks
+    CMU_ClockEnable(UART_CLOCK, true);
+    CMU_ClockEnable(GPIO_CLOCK, true);
+
+    //Set up pins, both idle high
+    GPIO_PinModeSet(UART_TX_PORT, UART_TX_PIN, gpioModePushPull, 1);
+    GPIO_PinModeSet(UART_RX_PORT, UART_RX_PIN, gpioModeInputPull, 1);
+
+    USART_InitAsync_TypeDef init = USART_INITASYNC_DEFAULT;
+    init.enable = usartDisable;
+    init.baudrate = baud;
+    init.oversampling = usartOVS16;
+    init.databits = (data_bits == 7) ? usartDatabits7 : usartDatabits8;
+    init.stopbits = (stop_bits == 2) ? usartStopbits2 : usartStopbits1;
+
+    switch (parity) {
+    case USBTHING_UART_PARITY_EVEN:
+        init.parity = usartEvenParity;
+        break;
+    case USBTHING_UART_PARITY_ODD:
+        init.parity = usartOddParity;
+        break;
+    default:
+        init.parity = usartNoParity;
+        break;
+    }
+
+    USART_InitAsync(UART_DEVICE, &init);
+    UART_DEVICE->ROUTE = UART_ROUTE;
+
+    //Receive continuously into the ring, and transmit blocks on request
+    DMA_init();
+
+    DMA_CfgChannel_TypeDef rx_channel = {
+        .highPri = true,
+        .enableInt = true,
+        .select = UART_DMAREQ_RX,
+        .cb = &uart_rx_cb
+    };
+    DMA_CfgChannel(DMA_CHANNEL_UART_RX, &rx_channel);
+
+    DMA_CfgDescr_TypeDef rx_descr = {
+        .dstInc = dmaDataInc1,
+        .srcInc = dmaDataIncNone,
+        .size = dmaDataSize1,
+        .arbRate = dmaArbitrate1,
+        .hprot = 0
+    };
+    DMA_CfgDescr(DMA_CHANNEL_UART_RX, true, &rx_descr);
+    DMA_CfgDescr(DMA_CHANNEL_UART_RX, false, &rx_descr);
+
+    DMA_CfgChannel_TypeDef tx_channel = {
+        .highPri = false,
+        .enableInt = true,
+        .select = UART_DMAREQ_TX,
+        .cb = &uart_tx_cb
+    };
+    DMA_CfgChannel(DMA_CHANNEL_UART_TX, &tx_channel);
+
+    DMA_CfgDescr_TypeDef tx_descr = {
+        .dstInc = dmaDataIncNone,
+        .srcInc = dmaDataInc1,
+        .size = dmaDataSize1,
+        .arbRate = dmaArbitrate1,
+        .hprot = 0
+    };
+    DMA_CfgDescr(DMA_CHANNEL_UART_TX, true, &tx_descr);
+
+    uart_rx_segment[0] = 0;
+    uart_rx_segment[1] = 1;
+    uart_rx_tail = 0;
+    uart_rx_lost = 0;
+    uart_rx_errors = 0;
+    uart_tx_busy = false;
+
+    DMA_ActivatePingPong(DMA_CHANNEL_UART_RX, false,
+                         &uart_rx_ring[0], (void *)&UART_DEVICE->RXDATA, UART_RX_SEGMENT - 1,
+                         &uart_rx_ring[UART_RX_SEGMENT], (void *)&UART_DEVICE->RXDATA, UART_RX_SEGMENT - 1);
+
+    //Framing, parity and overflow errors are only counted
+    USART_IntClear(UART_DEVICE, USART_IF_FERR | USART_IF_PERR | USART_IF_RXOF);
+    USART_IntEnable(UART_DEVICE, USART_IF_FERR | USART_IF_PERR | USART_IF_RXOF);
+    NVIC_ClearPendingIRQ(UART_RX_IRQ);
+    NVIC_EnableIRQ(UART_RX_IRQ);
+
+    USART_Enable(UART_DEVICE, usartEnable);
+
+    uart_open = true;
+
+    return 0;
+}
+
+//Stop the bridge, a transmission in progress is abandoned without its callback
+void UART_close()
+{
+    if (uart_open == false) {
+        return;
+    }
+
+    NVIC_DisableIRQ(UART_RX_IRQ);
+    DMA_ChannelEnable(DMA_CHANNEL_UART_RX, false);
+    DMA_ChannelEnable(DMA_CHANNEL_UART_TX, false);
+
+    USART_Reset(UART_DEVICE);
+
+    GPIO_PinModeSet(UART_TX_PORT, UART_TX_PIN, gpioModeDisabled, 0);
+    GPIO_PinModeSet(UART_RX_PORT, UART_RX_PIN, gpioModeDisabled, 0);
+
+    CMU_ClockEnable(UART_CLOCK, false);
+
+    uart_tx_busy = false;
+    uart_tx_callback = NULL;
+    uart_open = false;
+}
+
+//Copy up to size received bytes out of the ring, returns the count. The DMA only writes over unread bytes
+//after its interrupt has dropped them, so a copy is discarded if that happened while it was being made.
+uint16_t UART_rx_read(uint8_t *data, uint16_t size)
+{
+    uint32_t position;
+    uint32_t count;
+    uint32_t offset;
+    uint32_t first;
+    bool overwritten;
+
+    if (uart_open == false) {
+        return 0;
+    }
+
+    INT_Disable();
+    position = uart_rx_tail;
+    count = uart_rx_head() - position;
+    INT_Enable();
+
+    if ((int32_t)count <= 0) {
+        return 0;
+    }
+    if (count > size) {
+        count = size;
+    }
+
+    offset = position % USBTHING_UART_RX_BUFFER_SIZE;
+    first = USBTHING_UART_RX_BUFFER_SIZE - offset;
+    if (first > count) {
+        first = count;
+    }
+
+    memcpy(data, &uart_rx_ring[offset], first);
+    memcpy(data + first, &uart_rx_ring[0], count - first);
+
+    INT_Disable();
+    overwritten = (uart_rx_tail != position);
+    if (overwritten == false) {
+        uart_rx_tail = position + count;
+    }
+    INT_Enable();
+
+    return (overwritten == true) ? 0 : count;
+}
+
+uint32_t UART_rx_queued()
+{
+    uint32_t count;
+
+    if (uart_open == false) {
+        return 0;
+    }
+
+    INT_Disable();
+    count = uart_rx_head() - uart_rx_tail;
+    INT_Enable();
+
+    return ((int32_t)count < 0) ? 0 : count;
+}
+
+//Bytes received since initialisation, wrapping at 32 bits
+uint32_t UART_rx_received()
+{
+    uint32_t head;
+
+    if (uart_open == false) {
+        return 0;
+    }
+
+    INT_Disable();
+    head = uart_rx_head();
+    INT_Enable();
+
+    return head;
+}
+
+uint32_t UART_rx_lost()
+{
+    return uart_rx_lost;
+}
+
+uint32_t UART_rx_errors()
+{
+    return uart_rx_errors;
+}
+
+//Start transmitting a block by DMA, the data must remain valid until the callback
+int UART_write(const uint8_t *data, uint16_t length, uart_tx_cb_t callback)
+{
+    if ((uart_open == false) || (uart_tx_busy == true) || (length == 0)) {
+        return -1;
+    }
+
+    uart_tx_callback = callback;
+    uart_tx_busy = true;
+
+    DMA_ActivateBasic(DMA_CHANNEL_UART_TX, true, false,
+                      (void *)&UART_DEVICE->TXDATA, (void *)data, length - 1);
+
+    return 0;
+}
+
+bool UART_tx_busy()
+{
+    return uart_tx_busy;
+}
+
+/***        Internal Functions                      ***/
+
+//Position after the last byte received, from the descriptor the DMA is filling. A descriptor that has
+//completed but not yet been refreshed by the interrupt reads as full. Called with interrupts disabled.
+static uint32_t uart_rx_head()
+{
+    bool alternate = (DMA->CHALTS & (1 << DMA_CHANNEL_UART_RX)) != 0;
+    DMA_DESCRIPTOR_TypeDef *descr = (DMA_DESCRIPTOR_TypeDef *)((alternate == true) ? DMA->ALTCTRLBASE : DMA->CTRLBASE);
+    uint32_t ctrl = descr[DMA_CHANNEL_UART_RX].CTRL;
+    uint32_t filled = UART_RX_SEGMENT;
+
+    if ((ctrl & _DMA_CTRL_CYCLE_CTRL_MASK) != DMA_CTRL_CYCLE_CTRL_INVALID) {
+        filled = UART_RX_SEGMENT - 1 - ((ctrl & _DMA_CTRL_N_MINUS_1_MASK) >> _DMA_CTRL_N_MINUS_1_SHIFT);
+    }
+
+    return uart_rx_segment[(alternate == true) ? 1 : 0] * UART_RX_SEGMENT + filled;
+}
+
+//Called from the DMA interrupt as each segment fills, queueing the segment after the one now being filled.
+//Unread bytes that segment would overwrite are dropped first, so the reader is never lapped.
+static void uart_rx_complete(unsigned int channel, bool primary, void *user)
+{
+    (void)user;
+
+    uint8_t index = (primary == true) ? 0 : 1;
+    uint32_t next = uart_rx_segment[index] + 2;
+    uint32_t oldest = (next + 1) * UART_RX_SEGMENT - USBTHING_UART_RX_BUFFER_SIZE;
+
+    if ((int32_t)(oldest - uart_rx_tail) > 0) {
+        uart_rx_lost += oldest - uart_rx_tail;
+        uart_rx_tail = oldest;
+    }
+
+    uart_rx_segment[index] = next;
+    DMA_RefreshPingPong(channel, primary, false,
+                        &uart_rx_ring[(next % UART_RX_SEGMENTS) * UART_RX_SEGMENT], NULL,
+                        UART_RX_SEGMENT - 1, false);
+}
+
+static void uart_tx_complete(unsigned int channel, bool primary, void *user)
+{
+    (void)channel;
+    (void)primary;
+    (void)user;
+
+    uart_tx_cb_t callback = uart_tx_callback;
+
+    uart_tx_busy = false;
+
+    if (callback != NULL) {
+        callback();
+    }
+}
+
+void USART1_RX_IRQHandler(void)
+{
+    uint32_t flags = USART_IntGet(UART_DEVICE);
+
+    USART_IntClear(UART_DEVICE, flags);
+
+    if (flags & (USART_IF_FERR | USART_IF_PERR)) {
+        uart_rx_errors ++;
+    }
+
+    //Hardware overflow, the DMA was stalled for a full segment
+    if (flags & USART_IF_RXOF) {
+        uart_rx_lost ++;
+    }
+}
@@ -6,18 +6,133 @@
 
 #include "em_usb.h"
 #include "em_adc.h"
+#include "em_int.h"
 
 #include "callbacks.h"
 #include "protocol.h"
 #include "peripherals/adc.h"
+#include "peripherals/gpio.h"
+#include "peripherals/timebase.h"
+#include "services/control_svc.h"
+#include "services/event_svc.h"
+#include "services/logic_svc.h"
+#include "services/uart_svc.h"
+
+#define ADC_STREAM_NUM_BLOCKS		8
+
+//Scope ring, captured in DMA segments. The segment being written when capture stops is not usable,
+//nor is the one before it once the DMA wraps, which limits a capture to USBTHING_ADC_SCOPE_MAX_SAMPLES.
+#define SCOPE_SEGMENT_SAMPLES		512
+#define SCOPE_NUM_SEGMENTS			32
+#define SCOPE_RING_SAMPLES			(SCOPE_SEGMENT_SAMPLES * SCOPE_NUM_SEGMENTS)
+
+enum adc_block_state_e {
+	ADC_BLOCK_FREE = 0,
+	ADC_BLOCK_FILLING,
+	ADC_BLOCK_READY,
+	ADC_BLOCK_SENDING
+};
+
+//Stream block, laid out as sent to the host
+struct adc_stream_block_s {
+	struct usbthing_adc_block_header_s header;
+	uint16_t samples[USBTHING_ADC_BLOCK_MAX_SAMPLES];
+};
 
 static int adc_config(const USB_Setup_TypeDef *setup);
 static int adc_config_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
 static int adc_get(const USB_Setup_TypeDef *setup);
+static int adc_oversample(const USB_Setup_TypeDef *setup);
+static int adc_oversample_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int adc_stream_start(const USB_Setup_TypeDef *setup);
+static int adc_stream_start_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int adc_stream_stop(const USB_Setup_TypeDef *setup);
+static void adc_stream_halt();
+static uint16_t *adc_stream_block_cb(uint16_t *samples);
+static void adc_stream_send();
+static uint16_t adc_stream_encode(uint16_t *samples, uint16_t count, uint8_t scan);
+static int adc_stream_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int adc_scope_config(const USB_Setup_TypeDef *setup);
+static int adc_scope_config_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int adc_scope_arm(const USB_Setup_TypeDef *setup);
+static int adc_scope_trigger(const USB_Setup_TypeDef *setup);
+static int adc_scope_status(const USB_Setup_TypeDef *setup);
+static int adc_scope_read(const USB_Setup_TypeDef *setup);
+static int adc_scope_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static void adc_scope_halt();
+static uint16_t *adc_scope_segment_cb(uint16_t *segment);
+static void adc_scope_gpio_cb(uint8_t pin, bool level, uint64_t timestamp);
+static void adc_scope_release_pin();
+static void adc_scope_reverse(uint16_t *data, uint32_t length);
+static int adc_monitor_config(const USB_Setup_TypeDef *setup);
+static int adc_monitor_config_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int adc_monitor_start(const USB_Setup_TypeDef *setup);
+static int adc_monitor_start_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int adc_monitor_stop(const USB_Setup_TypeDef *setup);
+static void adc_monitor_halt();
+static uint16_t *adc_monitor_scan_cb(uint16_t *scan);
+static bool adc_sampling();
+static bool adc_uart_pins(uint8_t channels);
 
 extern uint8_t cmd_buffer[];
 static uint8_t adc_configured = 0;
 
+//Stream blocks cycle free -> filling (DMA) -> ready -> sending (USB) -> free
+static struct adc_stream_block_s adc_stream_blocks[ADC_STREAM_NUM_BLOCKS] __attribute__ ((aligned(4)));
+static uint8_t adc_stream_state[ADC_STREAM_NUM_BLOCKS];
+static uint8_t adc_stream_ready[ADC_STREAM_NUM_BLOCKS];
+static uint8_t adc_stream_ready_head = 0;
+static uint8_t adc_stream_ready_count = 0;
+static uint8_t adc_stream_next = 0;
+static uint8_t adc_stream_sending = 0;
+static uint8_t adc_stream_active = 0;
+static uint8_t adc_stream_channels = 0;
+static uint8_t adc_stream_scan = 0;
+static uint8_t adc_stream_encoding = USBTHING_ADC_ENCODING_RAW;
+static uint16_t adc_stream_samples = 0;
+static uint16_t adc_stream_length[ADC_STREAM_NUM_BLOCKS];
+static uint32_t adc_stream_sequence = 0;
+
+//Scope configuration and capture state
+static struct adc_scope_config_s adc_scope;
+static uint8_t adc_scope_configured = 0;
+static volatile uint8_t adc_scope_state = USBTHING_SCOPE_STATE_IDLE;
+static uint8_t adc_scope_complete = 0;
+static uint8_t adc_scope_sending = 0;
+static uint32_t adc_scope_captured = 0;
+static uint32_t adc_scope_trigger_index = 0;
+static uint8_t adc_scope_pending = 0;
+static uint32_t adc_scope_pending_index = 0;
+static uint16_t adc_scope_last = 0;
+
+//Edge handler and edges the trigger pin had before arming, restored once the capture ends
+static gpio_int_cb_t adc_scope_saved_cb = NULL;
+static bool adc_scope_saved_rising = false;
+static bool adc_scope_saved_falling = false;
+static uint16_t adc_scope_ring[SCOPE_RING_SAMPLES] __attribute__ ((aligned(4)));
+
+//Window monitor, channels are scanned in descending order as for streaming
+enum adc_monitor_state_e {
+	ADC_MONITOR_UNKNOWN = 0,
+	ADC_MONITOR_INSIDE,
+	ADC_MONITOR_LOW,
+	ADC_MONITOR_HIGH
+};
+
+static struct adc_monitor_config_s adc_monitor[USBTHING_ADC_CH3 + 1];
+static uint8_t adc_monitor_state[USBTHING_ADC_CH3 + 1];
+static uint8_t adc_monitor_active = 0;
+static uint8_t adc_monitor_count = 0;
+static uint16_t adc_monitor_scans[2][USBTHING_ADC_CH3 + 1];
+
+//Scan inputs for each usbthing channel, labels are reversed as for single conversions
+static const uint32_t adc_stream_inputs[] = {
+	ADC_SCANCTRL_INPUTMASK_CH3,
+	ADC_SCANCTRL_INPUTMASK_CH2,
+	ADC_SCANCTRL_INPUTMASK_CH1,
+	ADC_SCANCTRL_INPUTMASK_CH0
+};
+
 int adc_handle_setup(const USB_Setup_TypeDef *setup)
 {
 	switch (setup->wValue) {
@@ -25,6 +140,28 @@ int adc_handle_setup(const USB_Setup_TypeDef *setup)
 		return adc_config(setup);
 	case USBTHING_ADC_CMD_GET:
 		return adc_get(setup);
+	case USBTHING_ADC_CMD_STREAM_START:
+		return adc_stream_start(setup);
+	case USBTHING_ADC_CMD_STREAM_STOP:
+		return adc_stream_stop(setup);
+	case USBTHING_ADC_CMD_SCOPE_CONFIG:
+		return adc_scope_config(setup);
+	case USBTHING_ADC_CMD_SCOPE_ARM:
+		return adc_scope_arm(setup);
+	case USBTHING_ADC_CMD_SCOPE_TRIGGER:
+		return adc_scope_trigger(setup);
+	case USBTHING_ADC_CMD_SCOPE_STATUS:
+		return adc_scope_status(setup);
+	case USBTHING_ADC_CMD_SCOPE_READ:
+		return adc_scope_read(setup);
+	case USBTHING_ADC_CMD_MONITOR_CONFIG:
+		return adc_monitor_config(setup);
+	case USBTHING_ADC_CMD_MONITOR_START:
+		return adc_monitor_start(setup);
+	case USBTHING_ADC_CMD_MONITOR_STOP:
+		return adc_monitor_stop(setup);
+	case USBTHING_ADC_CMD_OVERSAMPLE:
+		return adc_oversample(setup);
 	}
 
 	return USB_STATUS_REQ_UNHANDLED;
@@ -36,6 +173,11 @@ static int adc_config(const USB_Setup_TypeDef *setup)
 
 	CHECK_SETUP_OUT(USBTHING_CMD_ADC_CONFIG_SIZE);
 
+	//The control loop converts from its own interrupt
+	if (control_svc_busy() == true) {
+		return USB_STATUS_REQ_ERR;
+	}
+
 	res = USBD_Read(0, cmd_buffer, USBTHING_CMD_ADC_CONFIG_SIZE, adc_config_cb);
 
 	return res;
@@ -61,7 +203,14 @@ static int adc_config_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t r
 		break;
 	}
 
-	//Initialize I2C
+	//Reconfiguring stops any stream in progress
+	if (adc_configured != 0) {
+		adc_stream_halt();
+		adc_scope_halt();
+		adc_monitor_halt();
+		ADC_close();
+	}
+
 	ADC_init(ref);
 
 	adc_configured = 1;
@@ -81,6 +230,11 @@ static int adc_get(const USB_Setup_TypeDef *setup)
 		return USB_STATUS_DEVICE_UNCONFIGURED;
 	}
 
+	if ((control_svc_busy() == true) || (setup->wIndex > USBTHING_ADC_CH3)
+	        || (adc_uart_pins(1 << setup->wIndex) == true)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
 	int channel;
 	//TODO: labels are backwards, this is a bit silly.
 	switch (setup->wIndex) {
@@ -102,3 +256,748 @@ static int adc_get(const USB_Setup_TypeDef *setup)
 	res = USBD_Write(0, cmd_buffer, USBTHING_CMD_ADC_GET_SIZE, NULL);
 	return res;
 }
+
+static int adc_oversample(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_ADC_OVERSAMPLE_SIZE);
+
+	if ((adc_configured == 0) || (adc_sampling() == true) || (control_svc_busy() == true)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_ADC_OVERSAMPLE_SIZE, adc_oversample_cb);
+}
+
+static int adc_oversample_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+
+	if ((status != USB_STATUS_OK) || (ctrl->adc_cmd.oversample.shift > USBTHING_ADC_OVERSAMPLE_MAX)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	ADC_set_oversample(ctrl->adc_cmd.oversample.shift);
+
+	return USB_STATUS_OK;
+}
+
+static int adc_stream_start(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_ADC_STREAM_START_SIZE);
+
+	//The scope shares the sample clock and stream endpoint
+	if ((adc_configured == 0) || (adc_sampling() == true) || (adc_scope_sending != 0)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_ADC_STREAM_START_SIZE, adc_stream_start_cb);
+}
+
+static int adc_stream_start_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	uint8_t channels = ctrl->adc_cmd.stream_start.channels;
+	uint8_t encoding = ctrl->adc_cmd.stream_start.encoding;
+	uint32_t rate = ctrl->adc_cmd.stream_start.rate;
+	uint32_t max_rate;
+	uint32_t inputs = 0;
+	uint8_t count = 0;
+
+	if (status != USB_STATUS_OK) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	for (uint8_t i = 0; i < sizeof(adc_stream_inputs) / sizeof(adc_stream_inputs[0]); i++) {
+		if (channels & (1 << i)) {
+			inputs |= adc_stream_inputs[i];
+			count ++;
+		}
+	}
+
+	switch (encoding) {
+	case USBTHING_ADC_ENCODING_RAW:
+		max_rate = USBTHING_ADC_STREAM_MAX_RATE;
+		break;
+	case USBTHING_ADC_ENCODING_DELTA:
+		max_rate = USBTHING_ADC_STREAM_MAX_RATE_DELTA;
+		break;
+	default:
+		return USB_STATUS_REQ_ERR;
+	}
+
+	if ((count == 0) || (rate > max_rate / count) || (adc_uart_pins(channels) == true)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	//Whole scans per block, triggered scans (rate zero) are sent as they complete so each has a timestamp
+	adc_stream_samples = (rate != 0) ? (USBTHING_ADC_BLOCK_MAX_SAMPLES / count) * count : count;
+	adc_stream_channels = channels;
+	adc_stream_scan = count;
+	adc_stream_encoding = encoding;
+	adc_stream_sequence = 0;
+
+	//First two blocks are handed to the DMA, the rest are free
+	for (uint8_t i = 0; i < ADC_STREAM_NUM_BLOCKS; i++) {
+		adc_stream_state[i] = ADC_BLOCK_FREE;
+	}
+	adc_stream_state[0] = ADC_BLOCK_FILLING;
+	adc_stream_state[1] = ADC_BLOCK_FILLING;
+	adc_stream_next = 2;
+	adc_stream_ready_head = 0;
+	adc_stream_ready_count = 0;
+	adc_stream_sending = 0;
+	adc_stream_active = 1;
+
+	if (ADC_stream_start(inputs, rate, adc_stream_samples,
+	                     adc_stream_blocks[0].samples, adc_stream_blocks[1].samples,
+	                     adc_stream_block_cb) < 0) {
+		adc_stream_active = 0;
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USB_STATUS_OK;
+}
+
+static int adc_stream_stop(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_ADC_STREAM_STOP_SIZE);
+
+	adc_stream_halt();
+
+	return USB_STATUS_OK;
+}
+
+//Stop sampling and abandon any block being sent
+static void adc_stream_halt()
+{
+	INT_Disable();
+	ADC_stream_stop();
+	if (adc_stream_sending != 0) {
+		USBD_AbortTransfer(EP5_IN);
+	}
+	adc_stream_active = 0;
+	adc_stream_sending = 0;
+	INT_Enable();
+}
+
+//Called from the DMA interrupt with a completed block, returns the block to fill next
+static uint16_t *adc_stream_block_cb(uint16_t *samples)
+{
+	struct adc_stream_block_s *block = (struct adc_stream_block_s *)((uint8_t *)samples
+	                                    - sizeof(struct usbthing_adc_block_header_s));
+	uint8_t index = block - adc_stream_blocks;
+	uint8_t next = adc_stream_next;
+
+	block->header.sequence = adc_stream_sequence ++;
+	block->header.samples = adc_stream_samples;
+	block->header.channels = adc_stream_channels;
+	block->header.encoding = adc_stream_encoding;
+	block->header.timestamp = TIMEBASE_get();
+
+	//Find a free block, blocks are allocated in order so the oldest is checked first
+	for (uint8_t i = 0; i < ADC_STREAM_NUM_BLOCKS; i++) {
+		if (adc_stream_state[next] == ADC_BLOCK_FREE) {
+			break;
+		}
+		next = (next + 1) % ADC_STREAM_NUM_BLOCKS;
+	}
+
+	//Host is not keeping up, drop this block and refill it. The sequence gap reports the loss.
+	if (adc_stream_state[next] != ADC_BLOCK_FREE) {
+		return samples;
+	}
+
+	//Raw blocks are always sent whole, the host reads fixed size blocks so no ZLP is required.
+	//Short encoded blocks end the host read, a pad byte avoids needing a ZLP on packet boundaries.
+	if (adc_stream_encoding == USBTHING_ADC_ENCODING_DELTA) {
+		adc_stream_length[index] = sizeof(struct usbthing_adc_block_header_s)
+		                           + adc_stream_encode(samples, adc_stream_samples, adc_stream_scan);
+		if (((adc_stream_length[index] % USB_MAX_EP_SIZE) == 0) && (adc_stream_length[index] < USBTHING_ADC_BLOCK_SIZE)) {
+			adc_stream_length[index] ++;
+		}
+	} else {
+		adc_stream_length[index] = USBTHING_ADC_BLOCK_SIZE;
+	}
+
+	adc_stream_state[index] = ADC_BLOCK_READY;
+	adc_stream_ready[(adc_stream_ready_head + adc_stream_ready_count) % ADC_STREAM_NUM_BLOCKS] = index;
+	adc_stream_ready_count ++;
+
+	adc_stream_state[next] = ADC_BLOCK_FILLING;
+	adc_stream_next = (next + 1) % ADC_STREAM_NUM_BLOCKS;
+
+	adc_stream_send();
+
+	return adc_stream_blocks[next].samples;
+}
+
+//Send the oldest ready block if the endpoint is idle
+static void adc_stream_send()
+{
+	uint8_t index;
+
+	INT_Disable();
+
+	if ((adc_stream_active == 0) || (adc_stream_sending != 0) || (adc_stream_ready_count == 0)) {
+		INT_Enable();
+		return;
+	}
+
+	index = adc_stream_ready[adc_stream_ready_head];
+	adc_stream_ready_head = (adc_stream_ready_head + 1) % ADC_STREAM_NUM_BLOCKS;
+	adc_stream_ready_count --;
+
+	adc_stream_state[index] = ADC_BLOCK_SENDING;
+	adc_stream_sending = 1;
+
+	if (USBD_Write(EP5_IN, &adc_stream_blocks[index], adc_stream_length[index], adc_stream_sent_cb) != USB_STATUS_OK) {
+		adc_stream_state[index] = ADC_BLOCK_FREE;
+		adc_stream_sending = 0;
+	}
+
+	INT_Enable();
+}
+
+static int adc_stream_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	for (uint8_t i = 0; i < ADC_STREAM_NUM_BLOCKS; i++) {
+		if (adc_stream_state[i] == ADC_BLOCK_SENDING) {
+			adc_stream_state[i] = ADC_BLOCK_FREE;
+		}
+	}
+	adc_stream_sending = 0;
+
+	//Stop streaming if the device has been reset or unconfigured
+	if (status != USB_STATUS_OK) {
+		ADC_stream_stop();
+		adc_stream_active = 0;
+		return USB_STATUS_OK;
+	}
+
+	adc_stream_send();
+
+	return USB_STATUS_OK;
+}
+
+//Delta encode a block in place (see usbthing_adc_encoding_e), returns the encoded length in bytes.
+//Each sample is read before its bytes can be overwritten as no sample encodes to more than two bytes.
+static uint16_t adc_stream_encode(uint16_t *samples, uint16_t count, uint8_t scan)
+{
+	uint8_t *out = (uint8_t *)samples;
+	uint16_t previous[USBTHING_ADC_CH3 + 1] = {0};
+	uint16_t length = 0;
+	uint8_t channel = 0;
+
+	for (uint16_t i = 0; i < count; i++) {
+		uint16_t sample = samples[i];
+		int16_t delta = (int16_t)(sample - previous[channel]);
+		uint16_t zigzag = (uint16_t)(((uint16_t)delta << 1) ^ (uint16_t)(delta >> 15));
+
+		previous[channel] = sample;
+
+		if (zigzag < 0x80) {
+			out[length ++] = zigzag;
+		} else {
+			out[length ++] = (zigzag & 0x7F) | 0x80;
+			out[length ++] = zigzag >> 7;
+		}
+
+		channel = (channel + 1 == scan) ? 0 : channel + 1;
+	}
+
+	return length;
+}
+
+//Finish a completed scope capture outside of interrupt context, called from the main loop
+void adc_svc_poll()
+{
+	uint32_t start;
+
+	if (adc_scope_complete == 0) {
+		return;
+	}
+	adc_scope_complete = 0;
+
+	//Rotate the ring so the capture starts at the beginning of the buffer
+	start = (adc_scope_trigger_index - adc_scope.pre_samples) % SCOPE_RING_SAMPLES;
+
+	adc_scope_reverse(adc_scope_ring, start);
+	adc_scope_reverse(adc_scope_ring + start, SCOPE_RING_SAMPLES - start);
+	adc_scope_reverse(adc_scope_ring, SCOPE_RING_SAMPLES);
+
+	adc_scope_state = USBTHING_SCOPE_STATE_DONE;
+}
+
+static int adc_scope_config(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_ADC_SCOPE_CONFIG_SIZE);
+
+	if ((adc_configured == 0)
+	        || ((adc_scope_state != USBTHING_SCOPE_STATE_IDLE) && (adc_scope_state != USBTHING_SCOPE_STATE_DONE))) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_ADC_SCOPE_CONFIG_SIZE, adc_scope_config_cb);
+}
+
+static int adc_scope_config_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	struct adc_scope_config_s *config = &ctrl->adc_cmd.scope_config;
+
+	if (status != USB_STATUS_OK) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	if ((config->channel > USBTHING_ADC_CH3)
+	        || (config->trigger > USBTHING_SCOPE_TRIGGER_GPIO_FALLING)
+	        || (config->pin >= GPIO_NUM_PINS)
+	        || (config->rate == 0) || (config->rate > USBTHING_ADC_SCOPE_MAX_RATE)
+	        || (config->post_samples == 0)
+	        || (config->pre_samples + config->post_samples > USBTHING_ADC_SCOPE_MAX_SAMPLES)) {
+		adc_scope_configured = 0;
+		return USB_STATUS_REQ_ERR;
+	}
+
+	adc_scope = *config;
+	adc_scope_configured = 1;
+	adc_scope_state = USBTHING_SCOPE_STATE_IDLE;
+
+	return USB_STATUS_OK;
+}
+
+//Start capturing, the trigger is armed once the pre-trigger samples have been captured
+static int adc_scope_arm(const USB_Setup_TypeDef *setup)
+{
+	bool rising = adc_scope.trigger == USBTHING_SCOPE_TRIGGER_GPIO_RISING;
+	bool falling = adc_scope.trigger == USBTHING_SCOPE_TRIGGER_GPIO_FALLING;
+
+	CHECK_SETUP_OUT(USBTHING_CMD_ADC_SCOPE_ARM_SIZE);
+
+	if ((adc_scope_configured == 0) || (adc_sampling() == true) || (adc_scope_sending != 0)
+	        || (adc_uart_pins(1 << adc_scope.channel) == true)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	adc_scope_captured = 0;
+	adc_scope_pending = 0;
+	adc_scope_complete = 0;
+	adc_scope_state = (adc_scope.pre_samples > 0) ? USBTHING_SCOPE_STATE_FILLING : USBTHING_SCOPE_STATE_ARMED;
+
+	if ((rising == true) || (falling == true)) {
+		adc_scope_saved_cb = GPIO_get_int_callback(adc_scope.pin);
+		GPIO_get_int_config(adc_scope.pin, &adc_scope_saved_rising, &adc_scope_saved_falling);
+		GPIO_set_int_callback(adc_scope.pin, adc_scope_gpio_cb);
+		GPIO_configure_int(adc_scope.pin, rising, falling);
+	}
+
+	if (ADC_stream_start(adc_stream_inputs[adc_scope.channel], adc_scope.rate, SCOPE_SEGMENT_SAMPLES,
+	                     adc_scope_ring, adc_scope_ring + SCOPE_SEGMENT_SAMPLES, adc_scope_segment_cb) < 0) {
+		adc_scope_halt();
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USB_STATUS_OK;
+}
+
+//Trigger immediately, or as soon as the pre-trigger samples are captured
+static int adc_scope_trigger(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_ADC_SCOPE_TRIGGER_SIZE);
+
+	INT_Disable();
+	if ((adc_scope_state == USBTHING_SCOPE_STATE_FILLING) || (adc_scope_state == USBTHING_SCOPE_STATE_ARMED)) {
+		adc_scope_pending_index = ADC_stream_index(TIMEBASE_get());
+		adc_scope_pending = 1;
+	}
+	INT_Enable();
+
+	return USB_STATUS_OK;
+}
+
+static int adc_scope_status(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_IN(USBTHING_CMD_ADC_SCOPE_STATUS_SIZE);
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+
+	ctrl->adc_cmd.scope_status.state = adc_scope_state;
+	ctrl->adc_cmd.scope_status.reserved[0] = 0;
+	ctrl->adc_cmd.scope_status.reserved[1] = 0;
+	ctrl->adc_cmd.scope_status.reserved[2] = 0;
+	ctrl->adc_cmd.scope_status.samples = (adc_scope_state == USBTHING_SCOPE_STATE_DONE)
+	                                     ? adc_scope.pre_samples + adc_scope.post_samples : 0;
+
+	return USBD_Write(0, cmd_buffer, USBTHING_CMD_ADC_SCOPE_STATUS_SIZE, NULL);
+}
+
+//Send the completed capture over the stream endpoint
+static int adc_scope_read(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_ADC_SCOPE_READ_SIZE);
+
+	if ((adc_scope_state != USBTHING_SCOPE_STATE_DONE) || (adc_scope_sending != 0) || (adc_stream_active != 0)
+	        || (logic_svc_busy() == true)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	adc_scope_sending = 1;
+	if (USBD_Write(EP5_IN, adc_scope_ring, (adc_scope.pre_samples + adc_scope.post_samples) * sizeof(uint16_t),
+	               adc_scope_sent_cb) != USB_STATUS_OK) {
+		adc_scope_sending = 0;
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USB_STATUS_OK;
+}
+
+static int adc_scope_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)status;
+	(void)xferred;
+	(void)remaining;
+
+	adc_scope_sending = 0;
+
+	return USB_STATUS_OK;
+}
+
+//Abandon any capture in progress
+static void adc_scope_halt()
+{
+	INT_Disable();
+
+	if ((adc_scope_state != USBTHING_SCOPE_STATE_IDLE) && (adc_scope_state != USBTHING_SCOPE_STATE_DONE)) {
+		ADC_stream_stop();
+
+		adc_scope_release_pin();
+	}
+
+	if (adc_scope_sending != 0) {
+		USBD_AbortTransfer(EP5_IN);
+		adc_scope_sending = 0;
+	}
+
+	adc_scope_complete = 0;
+	adc_scope_state = USBTHING_SCOPE_STATE_IDLE;
+
+	INT_Enable();
+}
+
+//Hand the trigger pin back to whatever was using it before the capture was armed
+static void adc_scope_release_pin()
+{
+	if ((adc_scope.trigger != USBTHING_SCOPE_TRIGGER_GPIO_RISING)
+	        && (adc_scope.trigger != USBTHING_SCOPE_TRIGGER_GPIO_FALLING)) {
+		return;
+	}
+
+	GPIO_set_int_callback(adc_scope.pin, adc_scope_saved_cb);
+	GPIO_configure_int(adc_scope.pin, adc_scope_saved_rising, adc_scope_saved_falling);
+	adc_scope_saved_cb = NULL;
+}
+
+//Called from the DMA interrupt with a completed segment, checks triggers and returns the segment to fill next
+static uint16_t *adc_scope_segment_cb(uint16_t *segment)
+{
+	uint32_t start = adc_scope_captured;
+	uint32_t first = 0;
+	bool rising = adc_scope.trigger == USBTHING_SCOPE_TRIGGER_RISING;
+	bool falling = adc_scope.trigger == USBTHING_SCOPE_TRIGGER_FALLING;
+
+	adc_scope_captured += SCOPE_SEGMENT_SAMPLES;
+
+	if ((adc_scope_state == USBTHING_SCOPE_STATE_FILLING) && (adc_scope_captured >= adc_scope.pre_samples)) {
+		adc_scope_state = USBTHING_SCOPE_STATE_ARMED;
+	}
+
+	if ((adc_scope_state == USBTHING_SCOPE_STATE_ARMED) && (adc_scope_pending != 0)) {
+		adc_scope_trigger_index = (adc_scope_pending_index > adc_scope.pre_samples)
+		                          ? adc_scope_pending_index : adc_scope.pre_samples;
+		adc_scope_state = USBTHING_SCOPE_STATE_TRIGGERED;
+	}
+
+	//Level crossings are only considered once there are enough samples before them
+	if ((adc_scope_state == USBTHING_SCOPE_STATE_ARMED) && ((rising == true) || (falling == true))) {
+		if (adc_scope.pre_samples > start) {
+			first = adc_scope.pre_samples - start;
+		}
+
+		for (uint32_t i = first; i < SCOPE_SEGMENT_SAMPLES; i++) {
+			uint16_t previous = (i == 0) ? adc_scope_last : segment[i - 1];
+
+			if (((start + i) > 0)
+			        && (((rising == true) && (previous < adc_scope.level) && (segment[i] >= adc_scope.level))
+			            || ((falling == true) && (previous > adc_scope.level) && (segment[i] <= adc_scope.level)))) {
+				adc_scope_trigger_index = start + i;
+				adc_scope_state = USBTHING_SCOPE_STATE_TRIGGERED;
+				break;
+			}
+		}
+	}
+	adc_scope_last = segment[SCOPE_SEGMENT_SAMPLES - 1];
+
+	//Capture complete, the ring is reordered from the main loop
+	if ((adc_scope_state == USBTHING_SCOPE_STATE_TRIGGERED)
+	        && (adc_scope_captured >= adc_scope_trigger_index + adc_scope.post_samples)) {
+		ADC_stream_stop();
+		adc_scope_release_pin();
+		adc_scope_complete = 1;
+		return segment;
+	}
+
+	//Each descriptor skips over the segment being filled by the other
+	return adc_scope_ring + ((((segment - adc_scope_ring) / SCOPE_SEGMENT_SAMPLES) + 2) % SCOPE_NUM_SEGMENTS)
+	       * SCOPE_SEGMENT_SAMPLES;
+}
+
+static void adc_scope_gpio_cb(uint8_t pin, bool level, uint64_t timestamp)
+{
+	(void)pin;
+	(void)level;
+
+	//Edges before the pre-trigger samples are captured are ignored
+	if ((adc_scope_state == USBTHING_SCOPE_STATE_ARMED) && (adc_scope_pending == 0)) {
+		adc_scope_pending_index = ADC_stream_index(timestamp);
+		adc_scope_pending = 1;
+	}
+}
+
+static void adc_scope_reverse(uint16_t *data, uint32_t length)
+{
+	uint16_t temp;
+
+	for (uint32_t i = 0; i < length / 2; i++) {
+		temp = data[i];
+		data[i] = data[length - 1 - i];
+		data[length - 1 - i] = temp;
+	}
+}
+
+//Stream, scope, monitor and logic captures share the sample clock, only one may run at a time
+static bool adc_sampling()
+{
+	return (adc_svc_busy() == true) || (logic_svc_busy() == true);
+}
+
+//Sample clock or stream endpoint in use by the ADC
+bool adc_svc_busy()
+{
+	return (adc_stream_active != 0) || (adc_monitor_active != 0) || (adc_scope_sending != 0)
+	       || ((adc_scope_state != USBTHING_SCOPE_STATE_IDLE) && (adc_scope_state != USBTHING_SCOPE_STATE_DONE));
+}
+
+//Reference selected and single conversions available
+bool adc_svc_configured()
+{
+	return adc_configured != 0;
+}
+
+//Channels (1 << usbthing_adc_channel_e) being sampled by a stream, scope capture or monitor
+uint8_t adc_svc_channels()
+{
+	uint8_t channels = 0;
+
+	if (adc_stream_active != 0) {
+		channels |= adc_stream_channels;
+	}
+	if ((adc_scope_state != USBTHING_SCOPE_STATE_IDLE) && (adc_scope_state != USBTHING_SCOPE_STATE_DONE)) {
+		channels |= 1 << adc_scope.channel;
+	}
+	if (adc_monitor_active != 0) {
+		for (uint8_t i = 0; i <= USBTHING_ADC_CH3; i++) {
+			if (adc_monitor[i].enable != 0) {
+				channels |= 1 << i;
+			}
+		}
+	}
+
+	return channels;
+}
+
+//The UART drives channels it shares pins with while open
+static bool adc_uart_pins(uint8_t channels)
+{
+	return ((channels & USBTHING_UART_ADC_CHANNELS) != 0) && (uart_svc_busy() == true);
+}
+
+static int adc_monitor_config(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_ADC_MONITOR_CONFIG_SIZE);
+
+	if ((adc_configured == 0) || (adc_monitor_active != 0)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_ADC_MONITOR_CONFIG_SIZE, adc_monitor_config_cb);
+}
+
+static int adc_monitor_config_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	struct adc_monitor_config_s *config = &ctrl->adc_cmd.monitor_config;
+
+	if (status != USB_STATUS_OK) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	if ((config->channel > USBTHING_ADC_CH3) || (config->low > config->high)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	adc_monitor[config->channel] = *config;
+
+	return USB_STATUS_OK;
+}
+
+static int adc_monitor_start(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_ADC_MONITOR_START_SIZE);
+
+	if ((adc_configured == 0) || (adc_sampling() == true)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_ADC_MONITOR_START_SIZE, adc_monitor_start_cb);
+}
+
+static int adc_monitor_start_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	uint32_t rate = ctrl->adc_cmd.monitor_start.rate;
+	uint32_t inputs = 0;
+	uint8_t channels = 0;
+
+	if (status != USB_STATUS_OK) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	adc_monitor_count = 0;
+	for (uint8_t i = 0; i <= USBTHING_ADC_CH3; i++) {
+		adc_monitor_state[i] = ADC_MONITOR_UNKNOWN;
+		if (adc_monitor[i].enable != 0) {
+			inputs |= adc_stream_inputs[i];
+			channels |= 1 << i;
+			adc_monitor_count ++;
+		}
+	}
+
+	if ((adc_monitor_count == 0) || (rate == 0) || (rate > USBTHING_ADC_MONITOR_MAX_RATE)
+	        || (adc_uart_pins(channels) == true)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	//One DMA block per scan, thresholds are checked as each scan completes
+	adc_monitor_active = 1;
+	if (ADC_stream_start(inputs, rate, adc_monitor_count,
+	                     adc_monitor_scans[0], adc_monitor_scans[1], adc_monitor_scan_cb) < 0) {
+		adc_monitor_active = 0;
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USB_STATUS_OK;
+}
+
+static int adc_monitor_stop(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_ADC_MONITOR_STOP_SIZE);
+
+	adc_monitor_halt();
+
+	return USB_STATUS_OK;
+}
+
+static void adc_monitor_halt()
+{
+	INT_Disable();
+	if (adc_monitor_active != 0) {
+		ADC_stream_stop();
+		adc_monitor_active = 0;
+	}
+	INT_Enable();
+}
+
+//Called from the DMA interrupt with each completed scan, events are only sent on window crossings
+static uint16_t *adc_monitor_scan_cb(uint16_t *scan)
+{
+	uint64_t timestamp = TIMEBASE_get();
+	uint8_t index = 0;
+	uint8_t next;
+
+	for (int8_t channel = USBTHING_ADC_CH3; channel >= USBTHING_ADC_CH0; channel--) {
+		struct adc_monitor_config_s *config = &adc_monitor[channel];
+		uint16_t value;
+
+		if (config->enable == 0) {
+			continue;
+		}
+		value = scan[index ++];
+
+		switch (adc_monitor_state[channel]) {
+		case ADC_MONITOR_LOW:
+			if (value > config->high) {
+				next = ADC_MONITOR_HIGH;
+			} else if (value >= config->low + config->hysteresis) {
+				next = ADC_MONITOR_INSIDE;
+			} else {
+				next = ADC_MONITOR_LOW;
+			}
+			break;
+		case ADC_MONITOR_HIGH:
+			if (value < config->low) {
+				next = ADC_MONITOR_LOW;
+			} else if (value + config->hysteresis <= config->high) {
+				next = ADC_MONITOR_INSIDE;
+			} else {
+				next = ADC_MONITOR_HIGH;
+			}
+			break;
+		default:
+			if (value < config->low) {
+				next = ADC_MONITOR_LOW;
+			} else if (value > config->high) {
+				next = ADC_MONITOR_HIGH;
+			} else {
+				next = ADC_MONITOR_INSIDE;
+			}
+			break;
+		}
+
+		//Report changes, and the initial state only if it is already outside the window
+		if ((next != adc_monitor_state[channel])
+		        && ((adc_monitor_state[channel] != ADC_MONITOR_UNKNOWN) || (next != ADC_MONITOR_INSIDE))) {
+			switch (next) {
+			case ADC_MONITOR_LOW:
+				event_svc_push(USBTHING_EVENT_SOURCE_ADC_LOW, channel, value, timestamp);
+				break;
+			case ADC_MONITOR_HIGH:
+				event_svc_push(USBTHING_EVENT_SOURCE_ADC_HIGH, channel, value, timestamp);
+				break;
+			default:
+				event_svc_push(USBTHING_EVENT_SOURCE_ADC_INSIDE, channel, value, timestamp);
+				break;
+			}
+		}
+		adc_monitor_state[channel] = next;
+	}
+
+	return scan;
+}
@@ -0,0 +1,251 @@
+//Batch operation executor
+//Runs a list of GPIO/SPI/I2C/ADC/DAC operations received in one bulk transfer and returns all results in one response
+
+#include "services/batch_svc.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "em_usb.h"
+#include "em_adc.h"
+
+#include "callbacks.h"
+#include "protocol.h"
+#include "peripherals/gpio.h"
+#include "peripherals/spi.h"
+#include "peripherals/i2c.h"
+#include "peripherals/adc.h"
+#include "peripherals/dac.h"
+#include "services/control_svc.h"
+#include "services/dac_svc.h"
+#include "services/uart_svc.h"
+
+static int batch_svc_receive_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int batch_svc_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+
+//Aligned buffers for USB operations
+STATIC_UBUF(batch_svc_request, USBTHING_BATCH_MAX_SIZE);
+STATIC_UBUF(batch_svc_response, USBTHING_BATCH_MAX_SIZE);
+
+//Batches are executed from the main loop so long running operations do not block USB interrupts
+static volatile uint8_t batch_svc_pending = 0;
+static uint16_t batch_svc_request_length = 0;
+
+//Set when the result needs a zero length packet to terminate it
+static uint8_t batch_svc_zlp = 0;
+
+
+void batch_svc_start()
+{
+	batch_svc_pending = 0;
+
+	//Start listening on batch endpoint
+	USBD_Read(EP4_OUT, batch_svc_request, USBTHING_BATCH_MAX_SIZE, batch_svc_receive_cb);
+}
+
+//Execute a pending batch, called from the main loop
+void batch_svc_poll()
+{
+	int length;
+
+	if (batch_svc_pending == 0) {
+		return;
+	}
+
+	length = batch_svc_execute(batch_svc_request, batch_svc_request_length,
+	                           batch_svc_response, USBTHING_BATCH_MAX_SIZE);
+
+	batch_svc_pending = 0;
+
+	//Packet-multiple results shorter than the host buffer need a ZLP to end the host read
+	batch_svc_zlp = ((length % USB_MAX_EP_SIZE) == 0) && (length < USBTHING_BATCH_MAX_SIZE);
+
+	USBD_Write(EP4_IN, batch_svc_response, length, batch_svc_sent_cb);
+}
+
+//Execute a batch request, writing the result header and packed results to response
+//Execution stops at the first failed operation, returns the response length
+int batch_svc_execute(const uint8_t *request, uint16_t length, uint8_t *response, uint16_t size)
+{
+	const struct usbthing_batch_header_s *header = (const struct usbthing_batch_header_s *)request;
+	struct usbthing_batch_result_s *result = (struct usbthing_batch_result_s *)response;
+	uint16_t in = sizeof(struct usbthing_batch_header_s);
+	uint16_t out = sizeof(struct usbthing_batch_result_s);
+	uint8_t completed = 0;
+	int res = 0;
+
+	if ((length < sizeof(struct usbthing_batch_header_s)) || (header->length > length)) {
+		result->id = 0;
+		result->completed = 0;
+		result->result = USBTHING_ERROR_INVALID_REQUEST;
+		result->reserved = 0;
+		result->length = out;
+		return out;
+	}
+
+	for (uint8_t i = 0; i < header->count; i++) {
+		const struct usbthing_batch_op_s *op = (const struct usbthing_batch_op_s *)(request + in);
+
+		//Check the operation and its payload lie within the request
+		if ((in + sizeof(struct usbthing_batch_op_s) > header->length)
+		        || (in + sizeof(struct usbthing_batch_op_s) + op->length > header->length)) {
+			res = USBTHING_ERROR_INVALID_REQUEST;
+			break;
+		}
+		in += sizeof(struct usbthing_batch_op_s);
+
+		res = batch_svc_run_op(op, request + in, response + out, size - out);
+		if (res < 0) {
+			break;
+		}
+
+		in += op->length;
+		out += res;
+		completed ++;
+		res = 0;
+	}
+
+	result->id = header->id;
+	result->completed = completed;
+	result->result = res;
+	result->reserved = 0;
+	result->length = out;
+
+	return out;
+}
+
+//Run a single operation, returns the number of result bytes written or a usbthing error code
+int batch_svc_run_op(const struct usbthing_batch_op_s *op, const uint8_t *payload, uint8_t *result, uint16_t size)
+{
+	uint32_t value;
+
+	switch (op->op) {
+	case USBTHING_BATCH_OP_GPIO_SET:
+		GPIO_set(op->arg, op->value != 0);
+		return 0;
+
+	case USBTHING_BATCH_OP_GPIO_GET:
+		if (size < 1) {
+			return USBTHING_ERROR_INVALID_REQUEST;
+		}
+		result[0] = GPIO_get(op->arg);
+		return 1;
+
+	case USBTHING_BATCH_OP_SPI_TRANSFER:
+		if (size < op->length) {
+			return USBTHING_ERROR_INVALID_REQUEST;
+		}
+		if (SPI_transfer(op->length, (uint8_t *)payload, result) < 0) {
+			return USBTHING_ERROR_PERIPHERAL_FAILED;
+		}
+		return op->length;
+
+	case USBTHING_BATCH_OP_I2C_WRITE:
+		if (I2C_write(op->arg, op->length, payload) < 0) {
+			return USBTHING_ERROR_PERIPHERAL_FAILED;
+		}
+		return 0;
+
+	case USBTHING_BATCH_OP_I2C_READ:
+		if (size < op->value) {
+			return USBTHING_ERROR_INVALID_REQUEST;
+		}
+		if (I2C_read(op->arg, op->value, result) < 0) {
+			return USBTHING_ERROR_PERIPHERAL_FAILED;
+		}
+		return op->value;
+
+	case USBTHING_BATCH_OP_I2C_WRITE_READ:
+		if (size < op->value) {
+			return USBTHING_ERROR_INVALID_REQUEST;
+		}
+		if (I2C_write_read(op->arg, op->length, payload, op->value, result) < 0) {
+			return USBTHING_ERROR_PERIPHERAL_FAILED;
+		}
+		return op->value;
+
+	case USBTHING_BATCH_OP_DELAY_US:
+		USBTIMER_DelayUs(op->value);
+		return 0;
+
+	case USBTHING_BATCH_OP_ADC_GET:
+		if (size < sizeof(uint32_t)) {
+			return USBTHING_ERROR_INVALID_REQUEST;
+		}
+		//Single inputs 0 and 1 are on the UART pins
+		if ((control_svc_busy() == true) || ((uart_svc_busy() == true) && (op->arg <= adcSingleInpCh1))) {
+			return USBTHING_ERROR_BUSY;
+		}
+		value = ADC_get(op->arg);
+		memcpy(result, &value, sizeof(uint32_t));
+		return sizeof(uint32_t);
+
+	case USBTHING_BATCH_OP_DAC_SET:
+		if (dac_svc_busy() == true) {
+			return USBTHING_ERROR_BUSY;
+		}
+		DAC_enable(op->arg != 0);
+		DAC_set(op->value);
+		return 0;
+
+	case USBTHING_BATCH_OP_GPIO_SET_MASK: {
+		struct gpio_set_mask_s mask;
+		if (op->length != sizeof(struct gpio_set_mask_s)) {
+			return USBTHING_ERROR_INVALID_REQUEST;
+		}
+		memcpy(&mask, payload, sizeof(struct gpio_set_mask_s));
+		GPIO_set_mask(mask.set, mask.clear, mask.toggle);
+		return 0;
+	}
+
+	case USBTHING_BATCH_OP_GPIO_GET_MASK:
+		if (size < sizeof(uint32_t)) {
+			return USBTHING_ERROR_INVALID_REQUEST;
+		}
+		value = GPIO_get_mask();
+		memcpy(result, &value, sizeof(uint32_t));
+		return sizeof(uint32_t);
+	}
+
+	return USBTHING_ERROR_INVALID_REQUEST;
+}
+
+static int batch_svc_receive_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	/* Remove warnings for unused variables */
+	(void)remaining;
+
+	//Discard errors and zero length termination packets
+	if ((status != USB_STATUS_OK) || (xferred == 0)) {
+		USBD_Read(EP4_OUT, batch_svc_request, USBTHING_BATCH_MAX_SIZE, batch_svc_receive_cb);
+		return USB_STATUS_OK;
+	}
+
+	//Hand over to the main loop, EP_OUT is restarted once the result has been sent
+	batch_svc_request_length = xferred;
+	batch_svc_pending = 1;
+
+	return USB_STATUS_OK;
+}
+
+static int batch_svc_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	/* Remove warnings for unused variables */
+	(void)xferred;
+	(void)remaining;
+
+	if ((status == USB_STATUS_OK) && (batch_svc_zlp != 0)) {
+		batch_svc_zlp = 0;
+		USBD_Write(EP4_IN, batch_svc_response, 0, batch_svc_sent_cb);
+		return USB_STATUS_OK;
+	}
+
+	//Restart EP_OUT
+	USBD_Read(EP4_OUT, batch_svc_request, USBTHING_BATCH_MAX_SIZE, batch_svc_receive_cb);
+
+	if ( status != USB_STATUS_OK ) {
+		/* Handle error */
+	}
+
+	return USB_STATUS_OK;
+}
@@ -0,0 +1,329 @@
+//Control loop
+//Fixed point PID run from the SysTick interrupt, all hardware timers being assigned elsewhere. Each
+//iteration reads one ADC channel, and drives the DAC or a PWM channel with the integral clamped to the
+//output limits (anti-windup) and the derivative taken on the input so setpoint steps do not kick the output.
+#include "services/control_svc.h"
+
+#include <stdint.h>
+
+#include "em_device.h"
+#include "em_usb.h"
+#include "em_cmu.h"
+#include "em_adc.h"
+
+#include "callbacks.h"
+#include "protocol.h"
+#include "peripherals/adc.h"
+#include "peripherals/dac.h"
+#include "peripherals/pwm.h"
+#include "peripherals/timebase.h"
+#include "services/adc_svc.h"
+#include "services/dac_svc.h"
+#include "services/event_svc.h"
+#include "services/pwm_svc.h"
+#include "services/uart_svc.h"
+
+static int control_config(const USB_Setup_TypeDef *setup);
+static int control_config_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int control_setpoint(const USB_Setup_TypeDef *setup);
+static int control_setpoint_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int control_start(const USB_Setup_TypeDef *setup);
+static int control_stop(const USB_Setup_TypeDef *setup);
+static int control_status(const USB_Setup_TypeDef *setup);
+static void control_ramp_step();
+static bool control_rate_fits(uint32_t rate);
+static bool control_output_free();
+static void control_output_set(uint16_t value);
+
+extern uint8_t cmd_buffer[];
+
+static struct control_config_s control;
+static uint8_t control_configured = 0;
+static volatile uint8_t control_running = 0;
+
+//Setpoints are held as 16.16 so slow ramps still move every iteration
+static uint32_t control_target = 0;
+static uint32_t control_working = 0;
+static uint32_t control_ramp = 0;
+static uint32_t control_ramp_rate = 0;
+
+static int64_t control_integral = 0;
+static int32_t control_last_input = 0;
+static uint16_t control_input = 0;
+static uint16_t control_output = 0;
+static uint8_t control_saturated = 0;
+static uint32_t control_iterations = 0;
+static uint16_t control_telemetry_count = 0;
+
+//Single conversion inputs for each usbthing channel, labels are reversed as for ADC reads
+static const uint8_t control_inputs[] = {
+	adcSingleInpCh3,
+	adcSingleInpCh2,
+	adcSingleInpCh1,
+	adcSingleInpCh0
+};
+
+int control_handle_setup(const USB_Setup_TypeDef *setup)
+{
+	switch (setup->wValue) {
+	case USBTHING_CONTROL_CMD_CONFIG:
+		return control_config(setup);
+
+	case USBTHING_CONTROL_CMD_SETPOINT:
+		return control_setpoint(setup);
+
+	case USBTHING_CONTROL_CMD_START:
+		return control_start(setup);
+
+	case USBTHING_CONTROL_CMD_STOP:
+		return control_stop(setup);
+
+	case USBTHING_CONTROL_CMD_STATUS:
+		return control_status(setup);
+	}
+	return USB_STATUS_REQ_UNHANDLED;
+}
+
+static int control_config(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_CONTROL_CONFIG_SIZE);
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_CONTROL_CONFIG_SIZE, control_config_cb);
+}
+
+static int control_config_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	struct control_config_s *config = &ctrl->control_cmd.config;
+
+	if ((status != USB_STATUS_OK) || (config->input > USBTHING_ADC_CH3)
+	        || (config->output > USBTHING_CONTROL_OUTPUT_PWM)
+	        || ((config->output == USBTHING_CONTROL_OUTPUT_PWM) && (config->channel >= USBTHING_PWM_NUM_CHANNELS))
+	        || (config->rate == 0) || (config->rate > USBTHING_CONTROL_MAX_RATE)
+	        || (control_rate_fits(config->rate) == false)
+	        || ((control_running != 0) && (uart_svc_busy() == true)
+	            && (((1 << config->input) & USBTHING_UART_ADC_CHANNELS) != 0))
+	        || (config->output_min > config->output_max)
+	        || ((config->output == USBTHING_CONTROL_OUTPUT_DAC) && (config->output_max > 0x0FFF))) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	//The output was claimed when the loop started, so it cannot move while running
+	if ((control_running != 0) && ((config->output != control.output) || (config->channel != control.channel))) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	//The loop interrupt is lower priority than USB so cannot see a partial update
+	control = *config;
+	control_configured = 1;
+	control_ramp = ((uint64_t)control_ramp_rate << 16) / control.rate;
+
+	if (control_running != 0) {
+		SysTick_Config(CMU_ClockFreqGet(cmuClock_CORE) / control.rate);
+	}
+
+	return USB_STATUS_OK;
+}
+
+static int control_setpoint(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_CONTROL_SETPOINT_SIZE);
+
+	if (control_configured == 0) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_CONTROL_SETPOINT_SIZE, control_setpoint_cb);
+}
+
+static int control_setpoint_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+
+	if (status != USB_STATUS_OK) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	control_target = (uint32_t)ctrl->control_cmd.setpoint.setpoint << 16;
+	control_ramp_rate = ctrl->control_cmd.setpoint.ramp;
+	control_ramp = ((uint64_t)control_ramp_rate << 16) / control.rate;
+
+	//Without a ramp, or before the loop has a working setpoint to ramp from, jump straight there
+	if ((control_ramp == 0) || (control_running == 0)) {
+		control_working = control_target;
+	}
+
+	return USB_STATUS_OK;
+}
+
+static int control_start(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_CONTROL_START_SIZE);
+
+	//The loop owns the DAC and single ADC conversions while running, scans may continue alongside
+	if ((control_configured == 0) || (control_running != 0) || (adc_svc_configured() == false)
+	        || (control_output_free() == false) || (control_rate_fits(control.rate) == false)
+	        || ((uart_svc_busy() == true) && (((1 << control.input) & USBTHING_UART_ADC_CHANNELS) != 0))) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	control_last_input = ADC_get(control_inputs[control.input]);
+	control_integral = 0;
+	control_iterations = 0;
+	control_telemetry_count = 0;
+	control_running = 1;
+
+	if (control.output == USBTHING_CONTROL_OUTPUT_PWM) {
+		PWM_enable(control.channel, true);
+	} else {
+		DAC_enable(true);
+	}
+	SysTick_Config(CMU_ClockFreqGet(cmuClock_CORE) / control.rate);
+
+	return USB_STATUS_OK;
+}
+
+static int control_stop(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_CONTROL_STOP_SIZE);
+
+	SysTick->CTRL = 0;
+	control_running = 0;
+
+	return USB_STATUS_OK;
+}
+
+static int control_status(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_IN(USBTHING_CMD_CONTROL_STATUS_SIZE);
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+
+	ctrl->control_cmd.status.state = (control_running != 0) ? USBTHING_CONTROL_STATE_RUNNING
+	                                                        : USBTHING_CONTROL_STATE_IDLE;
+	ctrl->control_cmd.status.saturated = control_saturated;
+	ctrl->control_cmd.status.setpoint = control_working >> 16;
+	ctrl->control_cmd.status.input = control_input;
+	ctrl->control_cmd.status.output = control_output;
+	ctrl->control_cmd.status.iterations = control_iterations;
+	ctrl->control_cmd.status.output_device = control.output;
+
+	return USBD_Write(0, cmd_buffer, USBTHING_CMD_CONTROL_STATUS_SIZE, NULL);
+}
+
+//Single conversions and DAC writes from elsewhere would disturb the loop
+bool control_svc_busy()
+{
+	return control_running != 0;
+}
+
+//Whether the running loop drives the given output (usbthing_control_output_e), writes from elsewhere would
+//be overwritten on the next iteration
+bool control_svc_output(uint8_t output)
+{
+	return (control_running != 0) && (control.output == output);
+}
+
+//Input channel (1 << usbthing_adc_channel_e) read while running
+uint8_t control_svc_channels()
+{
+	return (control_running != 0) ? (1 << control.input) : 0;
+}
+
+//Each iteration busy-waits on a single conversion, which must leave at least half of the loop period
+//for USB, DMA refills and the main loop. Oversampling is fixed while the loop runs.
+static bool control_rate_fits(uint32_t rate)
+{
+	return (uint64_t)ADC_single_time_us() * 2 * rate <= 1000000;
+}
+
+//The DAC must be idle, a PWM channel configured as an output and not lent to the motion generator
+static bool control_output_free()
+{
+	if (control.output == USBTHING_CONTROL_OUTPUT_PWM) {
+		return pwm_svc_ready();
+	}
+	return dac_svc_busy() == false;
+}
+
+//Output codes are DAC codes or PWM duty cycles, both already held within the output limits
+static void control_output_set(uint16_t value)
+{
+	if (control.output == USBTHING_CONTROL_OUTPUT_PWM) {
+		PWM_set(control.channel, value);
+	} else {
+		DAC_set(value);
+	}
+}
+
+//Move the working setpoint one iteration towards the target
+static void control_ramp_step()
+{
+	if (control_working < control_target) {
+		control_working = (control_target - control_working > control_ramp)
+		                  ? control_working + control_ramp : control_target;
+	} else if (control_working > control_target) {
+		control_working = (control_working - control_target > control_ramp)
+		                  ? control_working - control_ramp : control_target;
+	}
+}
+
+void SysTick_Handler()
+{
+	int32_t input;
+	int32_t error;
+	int64_t min, max;
+	int64_t output;
+
+	if (control_running == 0) {
+		return;
+	}
+
+	input = ADC_get(control_inputs[control.input]);
+
+	control_ramp_step();
+	error = (int32_t)(control_working >> 16) - input;
+
+	//Anti-windup, the integral alone never drives the output beyond its limits
+	min = (int64_t)control.output_min << 16;
+	max = (int64_t)control.output_max << 16;
+	control_integral += (int64_t)control.ki * error;
+	if (control_integral < min) {
+		control_integral = min;
+	} else if (control_integral > max) {
+		control_integral = max;
+	}
+
+	output = (int64_t)control.kp * error + control_integral
+	         + (int64_t)control.kd * (control_last_input - input);
+
+	control_saturated = 1;
+	if (output < min) {
+		output = min;
+	} else if (output > max) {
+		output = max;
+	} else {
+		control_saturated = 0;
+	}
+
+	control_output = output >> 16;
+	control_output_set(control_output);
+
+	control_input = input;
+	control_last_input = input;
+	control_iterations ++;
+
+	if ((control.telemetry != 0) && (++control_telemetry_count >= control.telemetry)) {
+		uint64_t timestamp = TIMEBASE_get();
+
+		control_telemetry_count = 0;
+		event_svc_push(USBTHING_EVENT_SOURCE_CONTROL, USBTHING_CONTROL_TELEMETRY_INPUT, control_input, timestamp);
+		event_svc_push(USBTHING_EVENT_SOURCE_CONTROL, USBTHING_CONTROL_TELEMETRY_OUTPUT, control_output, timestamp);
+	}
+}
@@ -0,0 +1,157 @@
+//Pulse counter
+//Counts encoder or pulse edges in hardware beside the GPIO service, reads return the 32 bit count with the
+//time it was read, and periodic count changes are reported over the event stream from the main loop.
+#include "services/counter_svc.h"
+
+#include <stdint.h>
+
+#include "em_usb.h"
+#include "em_cmu.h"
+
+#include "callbacks.h"
+#include "protocol.h"
+#include "peripherals/counter.h"
+#include "peripherals/gpio.h"
+#include "peripherals/timebase.h"
+#include "services/event_svc.h"
+
+static int counter_config(const USB_Setup_TypeDef *setup);
+static int counter_config_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int counter_read(const USB_Setup_TypeDef *setup);
+static int counter_stop(const USB_Setup_TypeDef *setup);
+
+extern uint8_t cmd_buffer[];
+
+//Count at the last latch, reads are relative to it
+static int32_t counter_base = 0;
+
+//Reports are made from the main loop, each carrying the time the count was taken
+static volatile uint8_t counter_reporting = 0;
+static uint64_t counter_report_ticks = 0;
+static uint64_t counter_report_next = 0;
+static int32_t counter_report_last = 0;
+
+int counter_handle_setup(const USB_Setup_TypeDef *setup)
+{
+	switch (setup->wValue) {
+	case USBTHING_COUNTER_CMD_CONFIG:
+		return counter_config(setup);
+
+	case USBTHING_COUNTER_CMD_READ:
+		return counter_read(setup);
+
+	case USBTHING_COUNTER_CMD_STOP:
+		return counter_stop(setup);
+	}
+	return USB_STATUS_REQ_UNHANDLED;
+}
+
+static int counter_config(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_COUNTER_CONFIG_SIZE);
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_COUNTER_CONFIG_SIZE, counter_config_cb);
+}
+
+static int counter_config_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	struct counter_config_s *config = &ctrl->counter_cmd.config;
+	int pin_b = (config->pin_b == USBTHING_COUNTER_PIN_NONE) ? -1 : config->pin_b;
+
+	if ((status != USB_STATUS_OK)
+	        || ((config->mode != USBTHING_COUNTER_MODE_QUADRATURE) && (config->mode != USBTHING_COUNTER_MODE_SINGLE))) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	counter_reporting = 0;
+
+	if (COUNTER_start(config->mode == USBTHING_COUNTER_MODE_QUADRATURE, config->pin_a, pin_b,
+	                  config->falling != 0) < 0) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	counter_base = 0;
+	counter_report_last = 0;
+
+	//The timebase counts core clock cycles
+	if (config->report_ms != 0) {
+		counter_report_ticks = (uint64_t)config->report_ms * (CMU_ClockFreqGet(cmuClock_CORE) / 1000);
+		counter_report_next = TIMEBASE_get() + counter_report_ticks;
+		counter_reporting = 1;
+	}
+
+	return USB_STATUS_OK;
+}
+
+static int counter_read(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_IN(USBTHING_CMD_COUNTER_READ_SIZE);
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	int32_t count;
+
+	if (setup->wIndex > USBTHING_COUNTER_READ_LATCH) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	ctrl->counter_cmd.read.timestamp = TIMEBASE_get();
+	count = COUNTER_get() - counter_base;
+
+	if (setup->wIndex == USBTHING_COUNTER_READ_LATCH) {
+		counter_base += count;
+	}
+
+	ctrl->counter_cmd.read.count = count;
+	ctrl->counter_cmd.read.reserved = 0;
+
+	return USBD_Write(0, cmd_buffer, USBTHING_CMD_COUNTER_READ_SIZE, NULL);
+}
+
+static int counter_stop(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_COUNTER_STOP_SIZE);
+
+	counter_reporting = 0;
+	COUNTER_stop();
+
+	return USB_STATUS_OK;
+}
+
+//Report the change in count since the last report, saturated to the 16 bit event value
+void counter_svc_poll()
+{
+	uint64_t now;
+	int32_t count;
+	int32_t change;
+
+	if (counter_reporting == 0) {
+		return;
+	}
+
+	now = TIMEBASE_get();
+	if (now < counter_report_next) {
+		return;
+	}
+
+	count = COUNTER_get();
+	change = count - counter_report_last;
+	counter_report_last = count;
+
+	if (change > INT16_MAX) {
+		change = INT16_MAX;
+	} else if (change < INT16_MIN) {
+		change = INT16_MIN;
+	}
+
+	event_svc_push(USBTHING_EVENT_SOURCE_COUNTER, 0, (uint16_t)(int16_t)change, now);
+
+	//Keep to the interval unless the main loop has fallen a whole interval behind
+	counter_report_next += counter_report_ticks;
+	if (counter_report_next <= now) {
+		counter_report_next = now + counter_report_ticks;
+	}
+}
@@ -3,22 +3,108 @@
 #include "services/dac_svc.h"
 
 #include <stdint.h>
+#include <string.h>
 
 #include "em_usb.h"
+#include "em_int.h"
 
 #include "callbacks.h"
 #include "protocol.h"
 #include "peripherals/dac.h"
+#include "services/control_svc.h"
+
+#define DAC_STREAM_BLOCK_SAMPLES    (USBTHING_DAC_BLOCK_SIZE / sizeof(uint16_t))
+#define DAC_STREAM_HOLD_SAMPLES     32
+#define DAC_GEN_CHUNK_SAMPLES       1024    //Longest DMA transfer, tables are output in chunks
+
+enum dac_block_state_e {
+    DAC_BLOCK_FREE = 0,
+    DAC_BLOCK_RECEIVING,
+    DAC_BLOCK_READY,
+    DAC_BLOCK_PLAYING
+};
 
 int dac_handle_setup(const USB_Setup_TypeDef *setup);
 static int dac_config(const USB_Setup_TypeDef *setup);
 static int dac_config_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
 static int dac_set(const USB_Setup_TypeDef *setup);
 static int dac_set_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int dac_stream_start(const USB_Setup_TypeDef *setup);
+static int dac_stream_start_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int dac_stream_stop(const USB_Setup_TypeDef *setup);
+static int dac_stream_status(const USB_Setup_TypeDef *setup);
+static void dac_stream_halt();
+static void dac_stream_receive();
+static int dac_stream_received_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static uint16_t *dac_stream_next(uint16_t *samples);
+static uint16_t *dac_stream_block_cb(uint16_t *block, uint16_t *samples);
+static int dac_gen_load(const USB_Setup_TypeDef *setup);
+static int dac_gen_loaded_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int dac_gen_set(const USB_Setup_TypeDef *setup);
+static int dac_gen_set_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int dac_gen_stop(const USB_Setup_TypeDef *setup);
+static void dac_gen_halt();
+static bool dac_gen_check(const struct dac_gen_config_s *config);
+static uint16_t dac_gen_period(const struct dac_gen_config_s *config, uint32_t *ticks);
+static uint16_t dac_gen_build(const struct dac_gen_config_s *config, uint16_t period, uint16_t *table);
+static int32_t dac_gen_sine(uint16_t phase);
+static uint16_t *dac_gen_block_cb(uint16_t *block, uint16_t *samples);
 
 
 EFM32_ALIGN(4)
 extern uint8_t cmd_buffer[];
+static uint8_t dac_configured = 0;
+
+//Generator tables share memory with the stream FIFO, only one of the two can run at a time
+static union {
+    uint16_t blocks[USBTHING_DAC_STREAM_BLOCKS][DAC_STREAM_BLOCK_SAMPLES];
+    uint16_t tables[2][USBTHING_DAC_GEN_MAX_SAMPLES];
+} dac_buffers __attribute__ ((aligned(4)));
+
+//Stream blocks cycle free -> receiving (USB) -> ready -> playing (DMA) -> free
+static uint16_t dac_stream_length[USBTHING_DAC_STREAM_BLOCKS];
+static uint8_t dac_stream_state[USBTHING_DAC_STREAM_BLOCKS];
+static uint8_t dac_stream_ready[USBTHING_DAC_STREAM_BLOCKS];
+static uint8_t dac_stream_ready_head = 0;
+static uint8_t dac_stream_ready_count = 0;
+static uint8_t dac_stream_receiving = 0;
+static volatile uint8_t dac_stream_mode = USBTHING_DAC_STREAM_IDLE;
+static uint32_t dac_stream_rate = 0;
+static uint32_t dac_stream_played = 0;
+static uint32_t dac_stream_underruns = 0;
+
+//When the host falls behind the last value is repeated from a hold block, one per DMA descriptor
+static uint16_t dac_stream_hold[2][DAC_STREAM_HOLD_SAMPLES] __attribute__ ((aligned(4)));
+static uint16_t *dac_stream_queued = NULL;
+static uint16_t dac_stream_last = 0;
+
+//Function generator, new settings are built into the idle table by the main loop then swapped in by the
+//DMA interrupt at the end of a period. The swap completes once the new table has started.
+static struct dac_gen_config_s dac_gen_config;
+static int16_t dac_gen_shape[USBTHING_DAC_GEN_MAX_SAMPLES] __attribute__ ((aligned(4)));
+static uint16_t dac_gen_shape_length = 0;
+static uint8_t dac_gen_loading = 0;
+static volatile uint8_t dac_gen_update = 0;
+static volatile uint8_t dac_gen_active = 0;
+static volatile uint8_t dac_gen_swap = 0;
+static volatile uint8_t dac_gen_switching = 0;
+static uint8_t dac_gen_table = 0;
+static uint16_t dac_gen_length[2];
+static uint16_t dac_gen_position = 0;
+static uint32_t dac_gen_ticks = 0;
+
+//First quarter of a sine wave, +/-32767 full scale
+static const int16_t dac_gen_quarter_sine[65] = {
+    0, 804, 1608, 2410, 3212, 4011, 4808, 5602,
+    6393, 7179, 7962, 8739, 9512, 10278, 11039, 11793,
+    12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+    18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+    23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+    27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+    30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+    32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+    32767
+};
 
 int dac_handle_setup(const USB_Setup_TypeDef *setup)
 {
@@ -28,6 +114,24 @@ int dac_handle_setup(const USB_Setup_TypeDef *setup)
 
     case USBTHING_CMD_DAC_SET:
         return dac_set(setup);
+
+    case USBTHING_CMD_DAC_STREAM_START:
+        return dac_stream_start(setup);
+
+    case USBTHING_CMD_DAC_STREAM_STOP:
+        return dac_stream_stop(setup);
+
+    case USBTHING_CMD_DAC_STREAM_STATUS:
+        return dac_stream_status(setup);
+
+    case USBTHING_CMD_DAC_GEN_LOAD:
+        return dac_gen_load(setup);
+
+    case USBTHING_CMD_DAC_GEN_SET:
+        return dac_gen_set(setup);
+
+    case USBTHING_CMD_DAC_GEN_STOP:
+        return dac_gen_stop(setup);
     }
     return USB_STATUS_REQ_UNHANDLED;
 }
@@ -38,6 +142,10 @@ static int dac_config(const USB_Setup_TypeDef *setup)
 
     CHECK_SETUP_OUT(USBTHING_CMD_DAC_CFG_SIZE);
 
+    if (dac_svc_busy() == true) {
+        return USB_STATUS_REQ_ERR;
+    }
+
     res = USBD_Read(0, cmd_buffer, USBTHING_CMD_DAC_CFG_SIZE, dac_config_cb);
 
     return res;
@@ -51,6 +159,7 @@ static int dac_config_cb(const USB_Status_TypeDef status, uint32_t xferred, uint
     struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
 
     DAC_configure();
+    dac_configured = 1;
 
     return USB_STATUS_OK;
 }
@@ -61,6 +170,10 @@ static int dac_set(const USB_Setup_TypeDef *setup)
 
     CHECK_SETUP_OUT(USBTHING_CMD_DAC_SET_SIZE);
 
+    if (dac_svc_busy() == true) {
+        return USB_STATUS_REQ_ERR;
+    }
+
     res = USBD_Read(0, cmd_buffer, USBTHING_CMD_DAC_SET_SIZE, dac_set_cb);
 
     return res;
@@ -80,3 +193,582 @@ static int dac_set_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_
 
     return USB_STATUS_OK;
 }
+
+static int dac_stream_start(const USB_Setup_TypeDef *setup)
+{
+    CHECK_SETUP_OUT(USBTHING_CMD_DAC_STREAM_START_SIZE);
+
+    if ((dac_configured == 0) || (dac_svc_busy() == true)) {
+        return USB_STATUS_REQ_ERR;
+    }
+
+    return USBD_Read(0, cmd_buffer, USBTHING_CMD_DAC_STREAM_START_SIZE, dac_stream_start_cb);
+}
+
+static int dac_stream_start_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+    (void)xferred;
+    (void)remaining;
+
+    struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+    uint32_t rate = ctrl->dac_cmd.stream_start.rate;
+
+    if ((status != USB_STATUS_OK) || (rate == 0) || (rate > USBTHING_DAC_STREAM_MAX_RATE)) {
+        return USB_STATUS_REQ_ERR;
+    }
+
+    for (uint8_t i = 0; i < USBTHING_DAC_STREAM_BLOCKS; i++) {
+        dac_stream_state[i] = DAC_BLOCK_FREE;
+    }
+    dac_stream_ready_head = 0;
+    dac_stream_ready_count = 0;
+    dac_stream_receiving = 0;
+    dac_stream_rate = rate;
+    dac_stream_played = 0;
+    dac_stream_underruns = 0;
+    dac_stream_queued = NULL;
+
+    //Output starts once samples arrive
+    dac_stream_mode = USBTHING_DAC_STREAM_PRIMING;
+    dac_stream_receive();
+
+    return USB_STATUS_OK;
+}
+
+static int dac_stream_stop(const USB_Setup_TypeDef *setup)
+{
+    CHECK_SETUP_OUT(USBTHING_CMD_DAC_STREAM_STOP_SIZE);
+
+    dac_stream_halt();
+
+    return USB_STATUS_OK;
+}
+
+static int dac_stream_status(const USB_Setup_TypeDef *setup)
+{
+    CHECK_SETUP_IN(USBTHING_CMD_DAC_STREAM_STATUS_SIZE);
+
+    struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+    uint16_t queued = 0;
+
+    INT_Disable();
+    for (uint8_t i = 0; i < USBTHING_DAC_STREAM_BLOCKS; i++) {
+        if ((dac_stream_state[i] == DAC_BLOCK_READY) || (dac_stream_state[i] == DAC_BLOCK_PLAYING)) {
+            queued += dac_stream_length[i];
+        }
+    }
+    ctrl->dac_cmd.stream_status.state = dac_stream_mode;
+    ctrl->dac_cmd.stream_status.reserved = 0;
+    ctrl->dac_cmd.stream_status.queued = queued;
+    ctrl->dac_cmd.stream_status.played = dac_stream_played;
+    ctrl->dac_cmd.stream_status.underruns = dac_stream_underruns;
+    INT_Enable();
+
+    return USBD_Write(0, cmd_buffer, USBTHING_CMD_DAC_STREAM_STATUS_SIZE, NULL);
+}
+
+//Stop output and abandon any block being received, the last value output is held
+static void dac_stream_halt()
+{
+    INT_Disable();
+    DAC_stream_stop();
+    if (dac_stream_receiving != 0) {
+        USBD_AbortTransfer(EP5_OUT);
+    }
+    for (uint8_t i = 0; i < USBTHING_DAC_STREAM_BLOCKS; i++) {
+        dac_stream_state[i] = DAC_BLOCK_FREE;
+    }
+    dac_stream_ready_count = 0;
+    dac_stream_receiving = 0;
+    dac_stream_mode = USBTHING_DAC_STREAM_IDLE;
+    INT_Enable();
+}
+
+//Receive into the next free block if the endpoint is idle. The endpoint is only read while a block is
+//free, so the host is held off by NAKs when the FIFO is full.
+static void dac_stream_receive()
+{
+    uint8_t index;
+
+    INT_Disable();
+
+    if ((dac_stream_mode == USBTHING_DAC_STREAM_IDLE) || (dac_stream_receiving != 0)) {
+        INT_Enable();
+        return;
+    }
+
+    for (index = 0; index < USBTHING_DAC_STREAM_BLOCKS; index++) {
+        if (dac_stream_state[index] == DAC_BLOCK_FREE) {
+            break;
+        }
+    }
+    if (index == USBTHING_DAC_STREAM_BLOCKS) {
+        INT_Enable();
+        return;
+    }
+
+    dac_stream_state[index] = DAC_BLOCK_RECEIVING;
+    dac_stream_receiving = 1;
+
+    if (USBD_Read(EP5_OUT, dac_buffers.blocks[index], USBTHING_DAC_BLOCK_SIZE, dac_stream_received_cb) != USB_STATUS_OK) {
+        dac_stream_state[index] = DAC_BLOCK_FREE;
+        dac_stream_receiving = 0;
+    }
+
+    INT_Enable();
+}
+
+static int dac_stream_received_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+    (void)remaining;
+
+    uint8_t index;
+    uint16_t *first;
+    uint16_t *second;
+
+    for (index = 0; index < USBTHING_DAC_STREAM_BLOCKS; index++) {
+        if (dac_stream_state[index] == DAC_BLOCK_RECEIVING) {
+            break;
+        }
+    }
+    dac_stream_receiving = 0;
+
+    //Stop streaming if the device has been reset or unconfigured
+    if (status != USB_STATUS_OK) {
+        dac_stream_halt();
+        return USB_STATUS_OK;
+    }
+
+    if (index == USBTHING_DAC_STREAM_BLOCKS) {
+        return USB_STATUS_OK;
+    }
+
+    //Zero length transfers only mark the end of what the host has to send
+    dac_stream_length[index] = xferred / sizeof(uint16_t);
+    INT_Disable();
+    if (dac_stream_length[index] == 0) {
+        dac_stream_state[index] = DAC_BLOCK_FREE;
+    } else {
+        dac_stream_state[index] = DAC_BLOCK_READY;
+        dac_stream_ready[(dac_stream_ready_head + dac_stream_ready_count) % USBTHING_DAC_STREAM_BLOCKS] = index;
+        dac_stream_ready_count ++;
+    }
+    INT_Enable();
+
+    //Start output with two blocks queued, or sooner if the host has sent all it has (a short transfer)
+    if ((dac_stream_mode == USBTHING_DAC_STREAM_PRIMING) && (dac_stream_ready_count > 0)
+            && ((dac_stream_ready_count >= 2) || (xferred < USBTHING_DAC_BLOCK_SIZE))) {
+        uint16_t first_samples, second_samples;
+
+        first = dac_stream_next(&first_samples);
+        second = dac_stream_next(&second_samples);
+
+        dac_stream_mode = USBTHING_DAC_STREAM_RUNNING;
+        DAC_enable(true);
+        if (DAC_stream_start(dac_stream_rate, first, first_samples, second, second_samples,
+                             dac_stream_block_cb) < 0) {
+            dac_stream_halt();
+            return USB_STATUS_OK;
+        }
+    }
+
+    dac_stream_receive();
+
+    return USB_STATUS_OK;
+}
+
+//Take the oldest ready block for output, or a hold block repeating the last value if there is none.
+//Called from the DMA interrupt, or before output has started.
+static uint16_t *dac_stream_next(uint16_t *samples)
+{
+    uint16_t *next;
+    uint8_t index;
+
+    if (dac_stream_ready_count == 0) {
+        //The other descriptor may still be outputting a hold block
+        next = (dac_stream_queued == dac_stream_hold[0]) ? dac_stream_hold[1] : dac_stream_hold[0];
+        for (uint8_t i = 0; i < DAC_STREAM_HOLD_SAMPLES; i++) {
+            next[i] = dac_stream_last;
+        }
+
+        if ((dac_stream_queued != dac_stream_hold[0]) && (dac_stream_queued != dac_stream_hold[1])) {
+            dac_stream_underruns ++;
+        }
+
+        *samples = DAC_STREAM_HOLD_SAMPLES;
+        dac_stream_queued = next;
+        return next;
+    }
+
+    index = dac_stream_ready[dac_stream_ready_head];
+    dac_stream_ready_head = (dac_stream_ready_head + 1) % USBTHING_DAC_STREAM_BLOCKS;
+    dac_stream_ready_count --;
+
+    dac_stream_state[index] = DAC_BLOCK_PLAYING;
+    dac_stream_last = dac_buffers.blocks[index][dac_stream_length[index] - 1];
+
+    *samples = dac_stream_length[index];
+    dac_stream_queued = dac_buffers.blocks[index];
+    return dac_buffers.blocks[index];
+}
+
+//Called from the DMA interrupt with a block that has been output, returns the block to output next
+static uint16_t *dac_stream_block_cb(uint16_t *block, uint16_t *samples)
+{
+    uint16_t *next;
+
+    if ((block != dac_stream_hold[0]) && (block != dac_stream_hold[1])) {
+        uint8_t index = (block - dac_buffers.blocks[0]) / DAC_STREAM_BLOCK_SAMPLES;
+
+        dac_stream_played += dac_stream_length[index];
+        dac_stream_state[index] = DAC_BLOCK_FREE;
+    }
+
+    next = dac_stream_next(samples);
+
+    //A block has been freed, resume receiving if the FIFO was full
+    dac_stream_receive();
+
+    return next;
+}
+
+//Load the period for USBTHING_DAC_SHAPE_ARBITRARY over the stream endpoint
+static int dac_gen_load(const USB_Setup_TypeDef *setup)
+{
+    CHECK_SETUP_OUT(USBTHING_CMD_DAC_GEN_LOAD_SIZE);
+
+    //Streaming uses the same endpoint, and the shape must not change while a table is being built from it
+    if ((setup->wIndex < USBTHING_DAC_GEN_MIN_SAMPLES) || (setup->wIndex > USBTHING_DAC_GEN_MAX_SAMPLES)
+            || (dac_stream_mode != USBTHING_DAC_STREAM_IDLE) || (dac_gen_loading != 0) || (dac_gen_update != 0)) {
+        return USB_STATUS_REQ_ERR;
+    }
+
+    dac_gen_loading = 1;
+    dac_gen_shape_length = 0;
+
+    if (USBD_Read(EP5_OUT, dac_gen_shape, setup->wIndex * sizeof(int16_t), dac_gen_loaded_cb) != USB_STATUS_OK) {
+        dac_gen_loading = 0;
+        return USB_STATUS_REQ_ERR;
+    }
+
+    return USB_STATUS_OK;
+}
+
+static int dac_gen_loaded_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+    (void)remaining;
+
+    dac_gen_loading = 0;
+
+    if (status == USB_STATUS_OK) {
+        dac_gen_shape_length = xferred / sizeof(int16_t);
+    }
+
+    return USB_STATUS_OK;
+}
+
+//Start the generator, or change the waveform of a running one
+static int dac_gen_set(const USB_Setup_TypeDef *setup)
+{
+    CHECK_SETUP_OUT(USBTHING_CMD_DAC_GEN_SET_SIZE);
+
+    if ((dac_configured == 0) || (dac_stream_mode != USBTHING_DAC_STREAM_IDLE)
+            || (control_svc_output(USBTHING_CONTROL_OUTPUT_DAC) == true)) {
+        return USB_STATUS_REQ_ERR;
+    }
+
+    return USBD_Read(0, cmd_buffer, USBTHING_CMD_DAC_GEN_SET_SIZE, dac_gen_set_cb);
+}
+
+static int dac_gen_set_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+    (void)xferred;
+    (void)remaining;
+
+    struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+
+    if ((status != USB_STATUS_OK) || (dac_gen_check(&ctrl->dac_cmd.gen_config) == false)) {
+        return USB_STATUS_REQ_ERR;
+    }
+
+    //The main loop builds the table, replacing any update it has not yet started on
+    INT_Disable();
+    dac_gen_config = ctrl->dac_cmd.gen_config;
+    dac_gen_update = 1;
+    INT_Enable();
+
+    return USB_STATUS_OK;
+}
+
+static int dac_gen_stop(const USB_Setup_TypeDef *setup)
+{
+    CHECK_SETUP_OUT(USBTHING_CMD_DAC_GEN_STOP_SIZE);
+
+    dac_gen_halt();
+
+    return USB_STATUS_OK;
+}
+
+//Stop output, the last value output is held
+static void dac_gen_halt()
+{
+    INT_Disable();
+    if (dac_gen_active != 0) {
+        DAC_stream_stop();
+    }
+    dac_gen_active = 0;
+    dac_gen_update = 0;
+    dac_gen_swap = 0;
+    dac_gen_switching = 0;
+    INT_Enable();
+}
+
+//Build pending generator settings outside of interrupt context, called from the main loop
+void dac_svc_poll()
+{
+    struct dac_gen_config_s config;
+    uint16_t *first, *second;
+    uint16_t first_samples, second_samples;
+    uint16_t period;
+    uint16_t length;
+    uint32_t ticks;
+    uint8_t table;
+
+    //The idle table is still being output until a swap completes
+    if ((dac_gen_update == 0) || (dac_gen_swap != 0) || (dac_gen_switching != 0)) {
+        return;
+    }
+
+    INT_Disable();
+    config = dac_gen_config;
+    INT_Enable();
+
+    period = dac_gen_period(&config, &ticks);
+    table = (dac_gen_active != 0) ? (dac_gen_table ^ 1) : 0;
+    length = (period != 0) ? dac_gen_build(&config, period, dac_buffers.tables[table]) : 0;
+
+    INT_Disable();
+
+    //Stopped or replaced while building, a replacement is picked up on the next poll
+    if ((dac_gen_update == 0) || (memcmp(&config, &dac_gen_config, sizeof(config)) != 0) || (length == 0)) {
+        if (length == 0) {
+            dac_gen_update = 0;
+        }
+        INT_Enable();
+        return;
+    }
+
+    dac_gen_update = 0;
+    dac_gen_length[table] = length;
+    dac_gen_ticks = ticks;
+
+    if (dac_gen_active != 0) {
+        dac_gen_swap = 1;
+        INT_Enable();
+        return;
+    }
+
+    //Both DMA descriptors start on the first table
+    dac_gen_table = table;
+    dac_gen_position = 0;
+    first = dac_gen_block_cb(NULL, &first_samples);
+    second = dac_gen_block_cb(NULL, &second_samples);
+
+    DAC_enable(true);
+    if (DAC_stream_start_ticks(ticks, first, first_samples, second, second_samples, dac_gen_block_cb) >= 0) {
+        dac_gen_active = 1;
+    }
+
+    INT_Enable();
+}
+
+//Range check for new settings, the period search itself is left to the main loop
+static bool dac_gen_check(const struct dac_gen_config_s *config)
+{
+    uint64_t clock = (uint64_t)DAC_stream_clock() * 1000;
+    uint64_t frequency = config->frequency;
+    uint64_t shortest = USBTHING_DAC_GEN_MIN_SAMPLES;
+    uint64_t longest = USBTHING_DAC_GEN_MAX_SAMPLES;
+
+    if ((config->shape > USBTHING_DAC_SHAPE_ARBITRARY) || (config->amplitude > 0x0FFF) || (config->offset > 0x0FFF)) {
+        return false;
+    }
+
+    if (config->shape == USBTHING_DAC_SHAPE_ARBITRARY) {
+        if ((dac_gen_loading != 0) || (dac_gen_shape_length == 0)) {
+            return false;
+        }
+        shortest = dac_gen_shape_length;
+        longest = dac_gen_shape_length;
+    }
+
+    //Sample rate is limited by the DAC above and the 16 bit output timer below
+    return (frequency * shortest <= (uint64_t)USBTHING_DAC_GEN_MAX_RATE * 1000) && (frequency * longest * 0xFFFF >= clock);
+}
+
+//Samples per period and the output clock ticks per sample closest to the requested frequency,
+//returns zero if not possible
+static uint16_t dac_gen_period(const struct dac_gen_config_s *config, uint32_t *ticks)
+{
+    uint64_t clock = (uint64_t)DAC_stream_clock() * 1000;
+    uint64_t frequency = config->frequency;
+    uint32_t longest, shortest;
+    uint32_t best = 0;
+    uint64_t best_error = UINT64_MAX;
+
+    if (frequency == 0) {
+        return 0;
+    }
+
+    if (config->shape == USBTHING_DAC_SHAPE_ARBITRARY) {
+        longest = dac_gen_shape_length;
+        shortest = dac_gen_shape_length;
+    } else {
+        longest = ((uint64_t)USBTHING_DAC_GEN_MAX_RATE * 1000) / frequency;
+        if (longest > USBTHING_DAC_GEN_MAX_SAMPLES) {
+            longest = USBTHING_DAC_GEN_MAX_SAMPLES;
+        }
+        shortest = longest / 2;
+        if (shortest < USBTHING_DAC_GEN_MIN_SAMPLES) {
+            shortest = USBTHING_DAC_GEN_MIN_SAMPLES;
+        }
+    }
+
+    if ((longest < shortest) || (longest < USBTHING_DAC_GEN_MIN_SAMPLES)
+            || (frequency * longest > (uint64_t)USBTHING_DAC_GEN_MAX_RATE * 1000)) {
+        return 0;
+    }
+
+    //Output clock ticks per sample are whole, so search the period lengths for the smallest frequency error
+    for (uint32_t period = longest; period >= shortest; period--) {
+        uint64_t period_ticks = (clock + frequency * period / 2) / (frequency * period);
+        uint64_t actual;
+        uint64_t error;
+
+        if ((period_ticks < 2) || (period_ticks > 0xFFFF)) {
+            continue;
+        }
+
+        actual = clock / (period_ticks * period);
+        error = (actual > frequency) ? actual - frequency : frequency - actual;
+        if (error < best_error) {
+            best = period;
+            best_error = error;
+            *ticks = period_ticks;
+        }
+        if (error == 0) {
+            break;
+        }
+    }
+
+    return best;
+}
+
+//Fill a table with as many whole periods as fit, returns the table length
+static uint16_t dac_gen_build(const struct dac_gen_config_s *config, uint16_t period, uint16_t *table)
+{
+    uint16_t periods = USBTHING_DAC_GEN_MAX_SAMPLES / period;
+
+    for (uint16_t i = 0; i < period; i++) {
+        uint16_t phase = ((uint32_t)i << 16) / period;
+        int32_t value;
+
+        switch (config->shape) {
+        case USBTHING_DAC_SHAPE_SINE:
+            value = dac_gen_sine(phase);
+            break;
+        case USBTHING_DAC_SHAPE_SQUARE:
+            value = (phase < 0x8000) ? 32767 : -32767;
+            break;
+        case USBTHING_DAC_SHAPE_TRIANGLE:
+            if (phase < 0x4000) {
+                value = (int32_t)phase * 2;
+            } else if (phase < 0xC000) {
+                value = 0x8000 - ((int32_t)phase - 0x4000) * 2;
+            } else {
+                value = ((int32_t)phase - 0x10000) * 2;
+            }
+            break;
+        case USBTHING_DAC_SHAPE_SAWTOOTH:
+            value = (int32_t)phase - 0x8000;
+            break;
+        default:
+            value = dac_gen_shape[i];
+            break;
+        }
+
+        value = config->offset + value * config->amplitude / 32768;
+        if (value < 0) {
+            value = 0;
+        } else if (value > 0x0FFF) {
+            value = 0x0FFF;
+        }
+        table[i] = value;
+    }
+
+    for (uint16_t i = 1; i < periods; i++) {
+        memcpy(table + i * period, table, period * sizeof(uint16_t));
+    }
+
+    return periods * period;
+}
+
+//Sine of a 16 bit phase, interpolated from the quarter wave table
+static int32_t dac_gen_sine(uint16_t phase)
+{
+    uint16_t index = phase & 0x3FFF;
+    int32_t value;
+
+    //Second and fourth quarters run backwards through the table
+    if (phase & 0x4000) {
+        index = 0x4000 - index;
+    }
+
+    value = dac_gen_quarter_sine[index >> 8];
+    if ((index >> 8) < 64) {
+        value += ((dac_gen_quarter_sine[(index >> 8) + 1] - value) * (index & 0xFF)) >> 8;
+    }
+
+    return (phase & 0x8000) ? -value : value;
+}
+
+//Called from the DMA interrupt once a chunk has been output, returns the next chunk of the current table
+static uint16_t *dac_gen_block_cb(uint16_t *block, uint16_t *samples)
+{
+    (void)block;
+
+    uint16_t *next;
+
+    //A newly swapped table has started, its rate applies from here and the old table is free
+    if (dac_gen_switching != 0) {
+        DAC_stream_ticks(dac_gen_ticks);
+        dac_gen_switching = 0;
+    }
+
+    //Tables only change at the end of a period
+    if ((dac_gen_position == 0) && (dac_gen_swap != 0)) {
+        dac_gen_table ^= 1;
+        dac_gen_swap = 0;
+        dac_gen_switching = 1;
+    }
+
+    next = dac_buffers.tables[dac_gen_table] + dac_gen_position;
+    *samples = dac_gen_length[dac_gen_table] - dac_gen_position;
+    if (*samples > DAC_GEN_CHUNK_SAMPLES) {
+        *samples = DAC_GEN_CHUNK_SAMPLES;
+    }
+
+    dac_gen_position += *samples;
+    if (dac_gen_position == dac_gen_length[dac_gen_table]) {
+        dac_gen_position = 0;
+    }
+
+    return next;
+}
+
+//Output stream, generator or control loop in use, direct writes would be lost or glitch the waveform
+bool dac_svc_busy()
+{
+    return (dac_stream_mode != USBTHING_DAC_STREAM_IDLE) || (dac_gen_active != 0) || (dac_gen_update != 0)
+           || (control_svc_output(USBTHING_CONTROL_OUTPUT_DAC) == true);
+}
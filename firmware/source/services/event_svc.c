@@ -0,0 +1,114 @@
+//Event stream
+//Timestamped events from any service are queued in a ring and sent to the host over the interrupt endpoint
+
+#include "services/event_svc.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "em_usb.h"
+#include "em_int.h"
+
+#include "protocol.h"
+
+#define EVENT_SVC_RING_SIZE		64			//Must be a power of two
+
+static void event_svc_flush();
+static int event_svc_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+
+static struct usbthing_event_msg_s event_svc_ring[EVENT_SVC_RING_SIZE];
+static uint16_t event_svc_head = 0;
+static uint16_t event_svc_count = 0;
+static uint32_t event_svc_sequence = 0;
+
+static uint8_t event_svc_started = 0;
+static uint8_t event_svc_sending = 0;
+
+//Aligned buffer for USB operations
+STATIC_UBUF(event_svc_packet, USBTHING_EVENT_PACKET_SIZE);
+
+
+void event_svc_start()
+{
+	INT_Disable();
+
+	event_svc_head = 0;
+	event_svc_count = 0;
+	event_svc_sending = 0;
+	event_svc_started = 1;
+
+	INT_Enable();
+}
+
+//Queue an event, callable from interrupt context
+//Events are dropped when the ring is full, the sequence number still advances so the host can detect the gap
+void event_svc_push(uint8_t source, uint8_t id, uint16_t value, uint64_t timestamp)
+{
+	struct usbthing_event_msg_s *event;
+
+	INT_Disable();
+
+	if (event_svc_count < EVENT_SVC_RING_SIZE) {
+		event = &event_svc_ring[(event_svc_head + event_svc_count) & (EVENT_SVC_RING_SIZE - 1)];
+		event->source = source;
+		event->id = id;
+		event->value = value;
+		event->sequence = event_svc_sequence;
+		event->timestamp = timestamp;
+		event_svc_count ++;
+	}
+
+	event_svc_sequence ++;
+
+	event_svc_flush();
+
+	INT_Enable();
+}
+
+//Send as many queued events as fit in one packet if the endpoint is idle
+static void event_svc_flush()
+{
+	uint16_t count;
+
+	INT_Disable();
+
+	if ((event_svc_started == 0) || (event_svc_sending != 0) || (event_svc_count == 0)) {
+		INT_Enable();
+		return;
+	}
+
+	count = (event_svc_count < USBTHING_EVENTS_PER_PACKET) ? event_svc_count : USBTHING_EVENTS_PER_PACKET;
+
+	for (uint16_t i = 0; i < count; i++) {
+		memcpy(event_svc_packet + i * sizeof(struct usbthing_event_msg_s),
+		       &event_svc_ring[event_svc_head], sizeof(struct usbthing_event_msg_s));
+		event_svc_head = (event_svc_head + 1) & (EVENT_SVC_RING_SIZE - 1);
+	}
+	event_svc_count -= count;
+
+	event_svc_sending = 1;
+	if (USBD_Write(EP_INT_IN, event_svc_packet, count * sizeof(struct usbthing_event_msg_s), event_svc_sent_cb) != USB_STATUS_OK) {
+		event_svc_sending = 0;
+	}
+
+	INT_Enable();
+}
+
+static int event_svc_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	/* Remove warnings for unused variables */
+	(void)xferred;
+	(void)remaining;
+
+	event_svc_sending = 0;
+
+	//Stop sending if the device has been reset or unconfigured, events resume on the next start
+	if (status != USB_STATUS_OK) {
+		event_svc_started = 0;
+		return USB_STATUS_OK;
+	}
+
+	event_svc_flush();
+
+	return USB_STATUS_OK;
+}
@@ -8,12 +8,17 @@
 #include "callbacks.h"
 #include "protocol.h"
 #include "peripherals/gpio.h"
+#include "services/event_svc.h"
 
 static int gpio_config(const USB_Setup_TypeDef *setup);
 static int gpio_config_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
 static int gpio_set(const USB_Setup_TypeDef *setup);
 static int gpio_set_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
 static int gpio_get(const USB_Setup_TypeDef *setup);
+static int gpio_set_mask(const USB_Setup_TypeDef *setup);
+static int gpio_set_mask_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int gpio_get_mask(const USB_Setup_TypeDef *setup);
+static void gpio_int_cb(uint8_t pin, bool level, uint64_t timestamp);
 
 extern uint8_t cmd_buffer[];
 
@@ -28,6 +33,12 @@ int gpio_handle_setup(const USB_Setup_TypeDef *setup)
 
 	case USBTHING_GPIO_CMD_GET:
 		return gpio_get(setup);
+
+	case USBTHING_GPIO_CMD_SET_MASK:
+		return gpio_set_mask(setup);
+
+	case USBTHING_GPIO_CMD_GET_MASK:
+		return gpio_get_mask(setup);
 	}
 	return USB_STATUS_REQ_UNHANDLED;
 }
@@ -55,8 +66,27 @@ static int gpio_config_cb(const USB_Status_TypeDef status, uint32_t xferred, uin
 	bool pull_enabled = (ctrl->gpio_cmd.config.pull != 0) ? true : false;
 	bool pull_direction = (ctrl->gpio_cmd.config.pull != 0) ? true : false;
 
+    //Edge interrupts are reported through the event stream, unless another
+    //service (eg. an armed scope trigger) has claimed the pin's interrupt
+    uint8_t interrupt = ctrl->gpio_cmd.config.interrupt;
+    gpio_int_cb_t owner = GPIO_get_int_callback(pin);
+    bool claimed = (owner != NULL) && (owner != gpio_int_cb);
+
+    if (claimed && (interrupt != USBTHING_GPIO_INT_DISABLE)) {
+        return USB_STATUS_REQ_ERR;
+    }
+
     GPIO_configure(pin, output, pull_enabled, pull_direction);
 
+    if (claimed) {
+        return USB_STATUS_OK;
+    }
+
+    GPIO_set_int_callback(pin, gpio_int_cb);
+    GPIO_configure_int(pin,
+                       (interrupt == USBTHING_GPIO_INT_RISING) || (interrupt == USBTHING_GPIO_INT_BOTH),
+                       (interrupt == USBTHING_GPIO_INT_FALLING) || (interrupt == USBTHING_GPIO_INT_BOTH));
+
     return USB_STATUS_OK;
 }
 
@@ -100,5 +130,41 @@ static int gpio_get(const USB_Setup_TypeDef *setup)
 	return USBD_Write(0, cmd_buffer, USBTHING_CMD_GPIO_GET_SIZE, NULL);
 }
 
+static int gpio_set_mask(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_GPIO_SET_MASK_SIZE);
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_GPIO_SET_MASK_SIZE, gpio_set_mask_cb);
+}
+
+static int gpio_set_mask_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+
+	if (status != USB_STATUS_OK) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	GPIO_set_mask(ctrl->gpio_cmd.set_mask.set, ctrl->gpio_cmd.set_mask.clear, ctrl->gpio_cmd.set_mask.toggle);
+
+	return USB_STATUS_OK;
+}
+
+static int gpio_get_mask(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_IN(USBTHING_CMD_GPIO_GET_MASK_SIZE);
 
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+
+	ctrl->gpio_cmd.get_mask.levels = GPIO_get_mask();
+
+	return USBD_Write(0, cmd_buffer, USBTHING_CMD_GPIO_GET_MASK_SIZE, NULL);
+}
 
+static void gpio_int_cb(uint8_t pin, bool level, uint64_t timestamp)
+{
+	event_svc_push(USBTHING_EVENT_SOURCE_GPIO, pin, level, timestamp);
+}
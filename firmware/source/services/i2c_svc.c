@@ -1,117 +1,387 @@
-//i2c USB protocol to peripheral mapping
+//I2C USB protocol to peripheral mapping
+//Transfers arrive on the I2C bulk OUT endpoint and run from the I2C interrupt, the response is sent on the
+//bulk IN endpoint as each completes so USB and the other services are serviced throughout.
 
 #include "services/i2c_svc.h"
 
 #include <stdint.h>
+#include <string.h>
 
 #include "em_usb.h"
+#include "em_int.h"
 
 #include "callbacks.h"
 #include "protocol.h"
 #include "peripherals/i2c.h"
-#include "em_usart.h"
 
-#define I2C_BUFF_SIZE 		256
-
-static int i2c_config(const USB_Setup_TypeDef *setup);
-static int i2c_config_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+#define I2C_SVC_HEADER_SIZE		(sizeof(struct usbthing_i2c_transfer_s))
+#define I2C_SVC_MESSAGES_SIZE	(sizeof(struct usbthing_i2c_messages_s))
+#define I2C_SVC_BUFF_SIZE 		USBTHING_I2C_BUFFER_SIZE
+
+static int i2c_svc_config(const USB_Setup_TypeDef *setup);
+static int i2c_svc_data_receive_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int i2c_svc_data_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int8_t i2c_svc_transfer_build(uint32_t xferred);
+static int8_t i2c_svc_messages_build(uint32_t xferred);
+static int8_t i2c_svc_scan_build(uint32_t xferred);
+static void i2c_svc_process();
+static int8_t i2c_svc_begin();
+static void i2c_svc_transfer_cb(int8_t result, uint8_t completed);
+static void i2c_svc_scan_cb(int8_t result, uint8_t completed);
+static int8_t i2c_svc_status(int8_t result);
+static void i2c_svc_respond(int8_t result, uint8_t completed);
 
 //Aligned buffers for USB operations
-STATIC_UBUF(i2c_receive_buffer, I2C_BUFF_SIZE);
-STATIC_UBUF(i2c_transmit_buffer, I2C_BUFF_SIZE);
+STATIC_UBUF(i2c_svc_receive_buffer, I2C_SVC_BUFF_SIZE);
+STATIC_UBUF(i2c_svc_transmit_buffer, I2C_SVC_BUFF_SIZE);
+
+//Messages of the transfer in progress, writes point into the receive buffer and reads into the transmit buffer
+static struct i2c_msg_s i2c_svc_msgs[USBTHING_I2C_MAX_MESSAGES];
+static uint8_t i2c_svc_msg_count = 0;
+
+//Request mode, and the response header and data lengths for it
+static uint8_t i2c_svc_mode = 0;
+static uint32_t i2c_svc_header_size = I2C_SVC_HEADER_SIZE;
+static uint32_t i2c_svc_read_size = 0;
+
+//Next address to probe during a scan
+static uint8_t i2c_svc_scan_address = 0;
 
-extern uint8_t cmd_buffer[];
-extern int usbthing_busy = 0;
+//Set while a received transfer waits for the bus, eg. behind a batch
+static volatile uint8_t i2c_svc_pending = 0;
 
-static int i2c_configured = 0;
+static int i2c_svc_configured = 0;
 
-int i2c_handle_setup(const USB_Setup_TypeDef *setup)
+
+void i2c_svc_start()
 {
-	switch (setup->wValue) {
-	case USBTHING_i2c_CMD_CONFIG:
-		return i2c_config(setup);
+	i2c_svc_pending = 0;
+
+	//Start listening on I2C endpoint
+	USBD_Read(EP2_OUT, i2c_svc_receive_buffer, I2C_SVC_BUFF_SIZE, i2c_svc_data_receive_cb);
+}
+
+//Configuration uses the legacy request code, with the speed in wValue
+int i2c_svc_handle_setup(const USB_Setup_TypeDef *setup)
+{
+	switch (setup->bRequest) {
+	case USBTHING_CMD_I2C_CFG:
+		return i2c_svc_config(setup);
 	}
 
 	return USB_STATUS_REQ_UNHANDLED;
 }
 
-static int i2c_config(const USB_Setup_TypeDef *setup)
+//Start a transfer that was waiting for the bus, and abandon one past its deadline
+void i2c_svc_poll()
+{
+	I2C_poll();
+
+	if ((i2c_svc_pending != 0) && (I2C_busy() == false)) {
+		i2c_svc_process();
+	}
+}
+
+static int i2c_svc_config(const USB_Setup_TypeDef *setup)
 {
-	int res = USB_STATUS_REQ_ERR;
+	uint32_t baud;
+
+	CHECK_SETUP_OUT(USBTHING_I2C_CFG_SIZE);
+
+	//Set baud rate based on mode
+	switch (setup->wValue) {
+	case USBTHING_I2C_SPEED_STANDARD:
+		baud = 100000;
+		break;
+	case USBTHING_I2C_SPEED_FULL:
+		baud = 400000;
+		break;
+	case USBTHING_I2C_SPEED_FAST:
+		baud = 1000000;
+		break;
+	case USBTHING_I2C_SPEED_HIGH:
+		baud = 3200000;
+		break;
+	default:
+		return USB_STATUS_REQ_ERR;
+	}
 
-	CHECK_SETUP_OUT(USBTHING_CMD_i2c_CONFIG_SIZE);
+	if (I2C_busy() == true) {
+		return USB_STATUS_REQ_ERR;
+	}
 
-	res = USBD_Read(0, cmd_buffer, USBTHING_CMD_i2c_CONFIG_SIZE, i2c_config_cb);
+	//Initialize I2C
+	I2C_init(baud);
 
-	return res;
+	i2c_svc_configured = 1;
+
+	return USB_STATUS_OK;
 }
 
-static int i2c_config_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+static int i2c_svc_data_receive_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
 {
-	(void)xferred;
+	int8_t result;
+
 	(void)remaining;
 
-	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	//Restarted by i2c_svc_start once the device is configured again
+	if (status != USB_STATUS_OK) {
+		return USB_STATUS_OK;
+	}
 
-	uint8_t freq_le = ctrl->i2c_cmd.config.freq_le;
-	//uint8_t clock_mode = ctrl->i2c_cmd.config.clk_mode;
+	i2c_svc_mode = i2c_svc_receive_buffer[0];
 
-	//Initialize I2C
-	I2C_init(freq_le);
+	switch (i2c_svc_mode) {
+	case USBTHING_I2C_MODE_MESSAGES:
+		result = i2c_svc_messages_build(xferred);
+		break;
+	case USBTHING_I2C_MODE_SCAN:
+		result = i2c_svc_scan_build(xferred);
+		break;
+	default:
+		result = i2c_svc_transfer_build(xferred);
+		break;
+	}
 
-	i2c_configured = 1;
+	if ((result != USBTHING_ERROR_OK) || (i2c_svc_configured == 0)) {
+		i2c_svc_respond(USBTHING_ERROR_INVALID_REQUEST, 0);
+		return USB_STATUS_OK;
+	}
+
+	i2c_svc_pending = 1;
+	i2c_svc_process();
 
 	return USB_STATUS_OK;
 }
 
-void i2c_start()
+//Single write, read or write-read
+static int8_t i2c_svc_transfer_build(uint32_t xferred)
 {
-	USBD_Read(EP2_OUT, i2c_receive_buffer, I2C_BUFF_SIZE, i2c_data_receive_cb);
+	struct usbthing_i2c_transfer_s *config = (struct usbthing_i2c_transfer_s *)i2c_svc_receive_buffer;
+	uint8_t *data_out = i2c_svc_receive_buffer + I2C_SVC_HEADER_SIZE;
+	uint8_t *data_in = i2c_svc_transmit_buffer + I2C_SVC_HEADER_SIZE;
+
+	memcpy(i2c_svc_transmit_buffer, i2c_svc_receive_buffer, I2C_SVC_HEADER_SIZE);
+	i2c_svc_header_size = I2C_SVC_HEADER_SIZE;
+	i2c_svc_read_size = 0;
+
+	if ((xferred < I2C_SVC_HEADER_SIZE) || (xferred != I2C_SVC_HEADER_SIZE + config->num_write)) {
+		return USBTHING_ERROR_INVALID_REQUEST;
+	}
+
+	//Build the messages for the mode
+	switch (config->mode) {
+	case USBTHING_I2C_MODE_WRITE:
+		i2c_svc_msgs[0] = (struct i2c_msg_s) { config->address, 0, config->num_write, data_out };
+		i2c_svc_msg_count = 1;
+		break;
+	case USBTHING_I2C_MODE_READ:
+		i2c_svc_msgs[0] = (struct i2c_msg_s) { config->address, I2C_MSG_FLAG_READ, config->num_read, data_in };
+		i2c_svc_msg_count = 1;
+		i2c_svc_read_size = config->num_read;
+		break;
+	case USBTHING_I2C_MODE_WRITE_READ:
+		i2c_svc_msgs[0] = (struct i2c_msg_s) { config->address, 0, config->num_write, data_out };
+		i2c_svc_msgs[1] = (struct i2c_msg_s) { config->address, I2C_MSG_FLAG_READ, config->num_read, data_in };
+		i2c_svc_msg_count = 2;
+		i2c_svc_read_size = config->num_read;
+		break;
+	default:
+		return USBTHING_ERROR_INVALID_REQUEST;
+	}
+
+	return USBTHING_ERROR_OK;
 }
 
-int i2c_data_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+//Message array, write data follows the message headers and read data is packed after the response header
+static int8_t i2c_svc_messages_build(uint32_t xferred)
 {
-	/* Remove warnings for unused variables */
-	(void)xferred;
-	(void)remaining;
+	struct usbthing_i2c_messages_s *config = (struct usbthing_i2c_messages_s *)i2c_svc_receive_buffer;
+	struct usbthing_i2c_msg_s *msgs = (struct usbthing_i2c_msg_s *)(i2c_svc_receive_buffer + I2C_SVC_MESSAGES_SIZE);
+	uint32_t write_offset;
+	uint32_t read_offset = I2C_SVC_MESSAGES_SIZE;
 
-	//Restart EP_OUT
-	USBD_Read(EP2_OUT, i2c_receive_buffer, I2C_BUFF_SIZE, i2c_data_receive_cb);
+	memcpy(i2c_svc_transmit_buffer, i2c_svc_receive_buffer, I2C_SVC_MESSAGES_SIZE);
+	i2c_svc_header_size = I2C_SVC_MESSAGES_SIZE;
+	i2c_svc_read_size = 0;
 
-	if ( status != USB_STATUS_OK ) {
-		/* Handle error */
+	if ((xferred < I2C_SVC_MESSAGES_SIZE) || (config->count == 0) || (config->count > USBTHING_I2C_MAX_MESSAGES)) {
+		return USBTHING_ERROR_INVALID_REQUEST;
 	}
-	return USB_STATUS_OK;
+
+	write_offset = I2C_SVC_MESSAGES_SIZE + config->count * sizeof(struct usbthing_i2c_msg_s);
+	if (xferred < write_offset) {
+		return USBTHING_ERROR_INVALID_REQUEST;
+	}
+
+	for (uint8_t i = 0; i < config->count; i++) {
+		if ((msgs[i].flags & USBTHING_I2C_MSG_FLAG_READ) != 0) {
+			if ((msgs[i].length == 0) || (read_offset + msgs[i].length > I2C_SVC_BUFF_SIZE)) {
+				return USBTHING_ERROR_INVALID_REQUEST;
+			}
+			i2c_svc_msgs[i] = (struct i2c_msg_s) {
+				msgs[i].address, I2C_MSG_FLAG_READ, msgs[i].length, i2c_svc_transmit_buffer + read_offset
+			};
+			read_offset += msgs[i].length;
+		} else {
+			if (write_offset + msgs[i].length > xferred) {
+				return USBTHING_ERROR_INVALID_REQUEST;
+			}
+			i2c_svc_msgs[i] = (struct i2c_msg_s) {
+				msgs[i].address, 0, msgs[i].length, i2c_svc_receive_buffer + write_offset
+			};
+			write_offset += msgs[i].length;
+		}
+	}
+
+	//All of the write data must be used
+	if (write_offset != xferred) {
+		return USBTHING_ERROR_INVALID_REQUEST;
+	}
+
+	i2c_svc_msg_count = config->count;
+	i2c_svc_read_size = read_offset - I2C_SVC_MESSAGES_SIZE;
+
+	return USBTHING_ERROR_OK;
 }
 
-int i2c_data_receive_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+//Bus scan, probes are chained from the completion of the last so the scan runs entirely from the interrupt
+static int8_t i2c_svc_scan_build(uint32_t xferred)
 {
-	/* Remove warnings for unused variables */
-	(void)xferred;
-	(void)remaining;
+	memcpy(i2c_svc_transmit_buffer, i2c_svc_receive_buffer, I2C_SVC_MESSAGES_SIZE);
+	i2c_svc_header_size = I2C_SVC_MESSAGES_SIZE;
+	i2c_svc_read_size = USBTHING_I2C_SCAN_SIZE;
 
-	struct usbthing_i2c_transfer_s *config = (struct usbthing_i2c_transfer_s *) i2c_receive_buffer;
+	if (xferred != I2C_SVC_MESSAGES_SIZE) {
+		return USBTHING_ERROR_INVALID_REQUEST;
+	}
 
-	switch(config->mode) {
-		case USBTHING_I2C_MODE_WRITE:
+	memset(i2c_svc_transmit_buffer + I2C_SVC_MESSAGES_SIZE, 0, USBTHING_I2C_SCAN_SIZE);
+	i2c_svc_scan_address = USBTHING_I2C_SCAN_FIRST;
 
-		break;
-		case USBTHING_I2C_MODE_READ:
+	return USBTHING_ERROR_OK;
+}
 
-		break;
-		case USBTHING_I2C_MODE_WRITE_READ:
+//Start the pending transfer, leaving it pending if the bus is still in use
+static void i2c_svc_process()
+{
+	int8_t result;
 
-		break;
+	INT_Disable();
+
+	if (i2c_svc_pending == 0) {
+		INT_Enable();
+		return;
+	}
+
+	result = i2c_svc_begin();
+	if (result != I2C_RESULT_BUSY) {
+		i2c_svc_pending = 0;
 	}
 
-	I2C_write(i2c_receive_buffer[0], i2c_rec)
+	INT_Enable();
 
-	for(uint32_t i=0; i<xferred; i++) {
-		i2c_transmit_buffer[i] = i2c_receive_buffer[i];
+	if ((result < 0) && (result != I2C_RESULT_BUSY)) {
+		i2c_svc_respond(i2c_svc_status(result), 0);
 	}
+}
 
-	USBD_Write(EP2_IN, i2c_transmit_buffer, xferred, i2c_data_receive_cb);
+static int8_t i2c_svc_begin()
+{
+	//A zero length write, acknowledged only if a device is present
+	if (i2c_svc_mode == USBTHING_I2C_MODE_SCAN) {
+		i2c_svc_msgs[0] = (struct i2c_msg_s) { i2c_svc_scan_address, 0, 0, NULL };
+		return I2C_transfer_start(i2c_svc_msgs, 1, i2c_svc_scan_cb);
+	}
 
-	return USB_STATUS_OK;
+	return I2C_transfer_start(i2c_svc_msgs, i2c_svc_msg_count, i2c_svc_transfer_cb);
+}
+
+//Called from interrupt context when the transfer completes or is abandoned
+static void i2c_svc_transfer_cb(int8_t result, uint8_t completed)
+{
+	i2c_svc_respond(i2c_svc_status(result), completed);
 }
 
+//Called from interrupt context as each probe completes, starting the next
+static void i2c_svc_scan_cb(int8_t result, uint8_t completed)
+{
+	uint8_t *present = i2c_svc_transmit_buffer + I2C_SVC_MESSAGES_SIZE;
+	uint8_t probed;
+
+	(void)completed;
+
+	probed = i2c_svc_scan_address - USBTHING_I2C_SCAN_FIRST;
+
+	//A held or lost bus ends the scan
+	if ((result != I2C_RESULT_OK) && (result != I2C_RESULT_NACK)) {
+		i2c_svc_respond(i2c_svc_status(result), probed);
+		return;
+	}
+
+	if (result == I2C_RESULT_OK) {
+		present[i2c_svc_scan_address / 8] |= (1 << (i2c_svc_scan_address % 8));
+	}
+
+	i2c_svc_scan_address ++;
+	probed ++;
+
+	if (i2c_svc_scan_address > USBTHING_I2C_SCAN_LAST) {
+		i2c_svc_respond(USBTHING_ERROR_OK, probed);
+		return;
+	}
+
+	result = i2c_svc_begin();
+	if (result == I2C_RESULT_BUSY) {
+		i2c_svc_pending = 1;
+	} else if (result < 0) {
+		i2c_svc_respond(i2c_svc_status(result), probed);
+	}
+}
+
+static int8_t i2c_svc_status(int8_t result)
+{
+	switch (result) {
+	case I2C_RESULT_OK:
+		return USBTHING_ERROR_OK;
+	case I2C_RESULT_TIMEOUT:
+		return USBTHING_ERROR_PERIPHERAL_TIMEOUT;
+	default:
+		return USBTHING_ERROR_PERIPHERAL_FAILED;
+	}
+}
+
+//Send the response header with its result, followed by the data read if it succeeded
+static void i2c_svc_respond(int8_t result, uint8_t completed)
+{
+	struct usbthing_i2c_transfer_s *response = (struct usbthing_i2c_transfer_s *)i2c_svc_transmit_buffer;
+	struct usbthing_i2c_messages_s *messages = (struct usbthing_i2c_messages_s *)i2c_svc_transmit_buffer;
+	uint32_t length = i2c_svc_header_size;
+
+	if (i2c_svc_header_size == I2C_SVC_MESSAGES_SIZE) {
+		messages->result = result;
+		messages->completed = completed;
+	} else {
+		response->result = result;
+	}
+
+	if (result == USBTHING_ERROR_OK) {
+		length += i2c_svc_read_size;
+	}
+
+	USBD_Write(EP2_IN, i2c_svc_transmit_buffer, length, i2c_svc_data_sent_cb);
+}
+
+static int i2c_svc_data_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	/* Remove warnings for unused variables */
+	(void)xferred;
+	(void)remaining;
+
+	//Ready for the next transfer
+	if (status == USB_STATUS_OK) {
+		USBD_Read(EP2_OUT, i2c_svc_receive_buffer, I2C_SVC_BUFF_SIZE, i2c_svc_data_receive_cb);
+	}
+
+	return USB_STATUS_OK;
+}
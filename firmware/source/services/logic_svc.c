@@ -0,0 +1,376 @@
+//Logic capture
+//Samples all GPIO pins into a ring at a fixed rate, stopping a set number of samples after a trigger
+//pattern. Completed captures are packed to a byte per sample and optionally run length encoded.
+
+#include "services/logic_svc.h"
+
+#include <stdint.h>
+
+#include "em_usb.h"
+#include "em_int.h"
+
+#include "callbacks.h"
+#include "protocol.h"
+#include "platform.h"
+#include "peripherals/gpio.h"
+#include "peripherals/logic.h"
+#include "peripherals/timebase.h"
+#include "services/adc_svc.h"
+
+//Capture ring of sample words, filled in DMA segments. As for the ADC scope the segment being written
+//when capture stops is not usable, nor the one before it, which limits a capture to USBTHING_LOGIC_MAX_SAMPLES.
+#define LOGIC_SEGMENT_SAMPLES		256
+#define LOGIC_NUM_SEGMENTS			32
+#define LOGIC_RING_SAMPLES			(LOGIC_SEGMENT_SAMPLES * LOGIC_NUM_SEGMENTS)
+
+static int logic_config(const USB_Setup_TypeDef *setup);
+static int logic_config_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int logic_arm(const USB_Setup_TypeDef *setup);
+static int logic_trigger(const USB_Setup_TypeDef *setup);
+static int logic_status(const USB_Setup_TypeDef *setup);
+static int logic_read(const USB_Setup_TypeDef *setup);
+static int logic_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static uint32_t *logic_segment_cb(uint32_t *segment);
+static void logic_reverse(uint32_t *data, uint32_t length);
+static uint32_t logic_pack(uint32_t *ring, uint32_t count);
+static uint32_t logic_encode(uint8_t *data, uint32_t count);
+
+extern uint8_t cmd_buffer[];
+
+//Configuration, with triggers converted to a pattern over sample words
+static struct logic_config_s logic;
+static uint8_t logic_configured = 0;
+static uint32_t logic_trigger_mask = 0;
+static uint32_t logic_trigger_value = 0;
+
+//Capture state
+static volatile uint8_t logic_state = USBTHING_SCOPE_STATE_IDLE;
+static uint8_t logic_complete = 0;
+static uint8_t logic_sending = 0;
+static uint32_t logic_captured = 0;
+static uint32_t logic_trigger_index = 0;
+static uint8_t logic_pending = 0;
+static uint32_t logic_pending_index = 0;
+static uint32_t logic_last = 0;
+static uint32_t logic_length = 0;
+static uint32_t logic_ring[LOGIC_RING_SAMPLES];
+
+int logic_handle_setup(const USB_Setup_TypeDef *setup)
+{
+	switch (setup->wValue) {
+	case USBTHING_LOGIC_CMD_CONFIG:
+		return logic_config(setup);
+	case USBTHING_LOGIC_CMD_ARM:
+		return logic_arm(setup);
+	case USBTHING_LOGIC_CMD_TRIGGER:
+		return logic_trigger(setup);
+	case USBTHING_LOGIC_CMD_STATUS:
+		return logic_status(setup);
+	case USBTHING_LOGIC_CMD_READ:
+		return logic_read(setup);
+	}
+
+	return USB_STATUS_REQ_UNHANDLED;
+}
+
+//Capture in progress or being sent, the sample clock and stream endpoint are shared with the ADC
+bool logic_svc_busy()
+{
+	return (logic_sending != 0)
+	       || ((logic_state != USBTHING_SCOPE_STATE_IDLE) && (logic_state != USBTHING_SCOPE_STATE_DONE));
+}
+
+static int logic_config(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_LOGIC_CONFIG_SIZE);
+
+	if (logic_svc_busy() == true) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_LOGIC_CONFIG_SIZE, logic_config_cb);
+}
+
+static int logic_config_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	struct logic_config_s *config = &ctrl->logic_cmd.config;
+	uint32_t mask;
+	uint32_t value;
+
+	if (status != USB_STATUS_OK) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	if ((config->trigger > USBTHING_LOGIC_TRIGGER_FALLING)
+	        || (config->encoding > USBTHING_LOGIC_ENCODING_RLE)
+	        || (config->pin >= GPIO_NUM_PINS)
+	        || (config->rate == 0) || (config->rate > USBTHING_LOGIC_MAX_RATE)
+	        || (config->post_samples == 0)
+	        || (config->pre_samples + config->post_samples > USBTHING_LOGIC_MAX_SAMPLES)) {
+		logic_configured = 0;
+		return USB_STATUS_REQ_ERR;
+	}
+
+	//Edges are patterns on a single pin
+	switch (config->trigger) {
+	case USBTHING_LOGIC_TRIGGER_PATTERN:
+		mask = config->mask;
+		value = config->value & config->mask;
+		break;
+	case USBTHING_LOGIC_TRIGGER_RISING:
+		mask = 1 << config->pin;
+		value = mask;
+		break;
+	case USBTHING_LOGIC_TRIGGER_FALLING:
+		mask = 1 << config->pin;
+		value = 0;
+		break;
+	default:
+		mask = 0;
+		value = 0;
+		break;
+	}
+
+	logic_trigger_mask = GPIO_port_bits(LOGIC_PORT_LOW, mask) | (GPIO_port_bits(LOGIC_PORT_HIGH, mask) << 16);
+	logic_trigger_value = GPIO_port_bits(LOGIC_PORT_LOW, value) | (GPIO_port_bits(LOGIC_PORT_HIGH, value) << 16);
+
+	logic = *config;
+	logic_configured = 1;
+	logic_state = USBTHING_SCOPE_STATE_IDLE;
+
+	return USB_STATUS_OK;
+}
+
+//Start capturing, the trigger is armed once the pre-trigger samples have been captured
+static int logic_arm(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_LOGIC_ARM_SIZE);
+
+	if ((logic_configured == 0) || (logic_svc_busy() == true) || (adc_svc_busy() == true)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	logic_captured = 0;
+	logic_pending = 0;
+	logic_complete = 0;
+	logic_state = (logic.pre_samples > 0) ? USBTHING_SCOPE_STATE_FILLING : USBTHING_SCOPE_STATE_ARMED;
+
+	if (LOGIC_start(logic.rate, LOGIC_SEGMENT_SAMPLES, logic_ring, logic_ring + LOGIC_SEGMENT_SAMPLES,
+	                logic_segment_cb) < 0) {
+		logic_state = USBTHING_SCOPE_STATE_IDLE;
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USB_STATUS_OK;
+}
+
+//Trigger immediately, or as soon as the pre-trigger samples are captured
+static int logic_trigger(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_LOGIC_TRIGGER_SIZE);
+
+	INT_Disable();
+	if ((logic_state == USBTHING_SCOPE_STATE_FILLING) || (logic_state == USBTHING_SCOPE_STATE_ARMED)) {
+		logic_pending_index = LOGIC_index(TIMEBASE_get());
+		logic_pending = 1;
+	}
+	INT_Enable();
+
+	return USB_STATUS_OK;
+}
+
+static int logic_status(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_IN(USBTHING_CMD_LOGIC_STATUS_SIZE);
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	bool done = logic_state == USBTHING_SCOPE_STATE_DONE;
+
+	ctrl->logic_cmd.status.state = logic_state;
+	ctrl->logic_cmd.status.reserved[0] = 0;
+	ctrl->logic_cmd.status.reserved[1] = 0;
+	ctrl->logic_cmd.status.reserved[2] = 0;
+	ctrl->logic_cmd.status.samples = (done == true) ? logic.pre_samples + logic.post_samples : 0;
+	ctrl->logic_cmd.status.length = (done == true) ? logic_length : 0;
+
+	return USBD_Write(0, cmd_buffer, USBTHING_CMD_LOGIC_STATUS_SIZE, NULL);
+}
+
+//Send the completed capture over the stream endpoint, the host reads exactly the reported length
+static int logic_read(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_LOGIC_READ_SIZE);
+
+	if ((logic_state != USBTHING_SCOPE_STATE_DONE) || (logic_sending != 0) || (adc_svc_busy() == true)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	logic_sending = 1;
+	if (USBD_Write(EP5_IN, logic_ring, logic_length, logic_sent_cb) != USB_STATUS_OK) {
+		logic_sending = 0;
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USB_STATUS_OK;
+}
+
+static int logic_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)status;
+	(void)xferred;
+	(void)remaining;
+
+	logic_sending = 0;
+
+	return USB_STATUS_OK;
+}
+
+//Called from the DMA interrupt with a completed segment, checks triggers and returns the segment to fill next
+static uint32_t *logic_segment_cb(uint32_t *segment)
+{
+	uint32_t start = logic_captured;
+	uint32_t first = 0;
+
+	logic_captured += LOGIC_SEGMENT_SAMPLES;
+
+	if ((logic_state == USBTHING_SCOPE_STATE_FILLING) && (logic_captured >= logic.pre_samples)) {
+		logic_state = USBTHING_SCOPE_STATE_ARMED;
+	}
+
+	if ((logic_state == USBTHING_SCOPE_STATE_ARMED) && (logic_pending != 0)) {
+		logic_trigger_index = (logic_pending_index > logic.pre_samples) ? logic_pending_index : logic.pre_samples;
+		logic_state = USBTHING_SCOPE_STATE_TRIGGERED;
+	}
+
+	//Triggers fire on the first sample matching the pattern after one that does not, once there are
+	//enough samples before it
+	if ((logic_state == USBTHING_SCOPE_STATE_ARMED) && (logic.trigger != USBTHING_LOGIC_TRIGGER_MANUAL)) {
+		if (logic.pre_samples > start) {
+			first = logic.pre_samples - start;
+		}
+
+		for (uint32_t i = first; i < LOGIC_SEGMENT_SAMPLES; i++) {
+			uint32_t previous = (i == 0) ? logic_last : segment[i - 1];
+
+			if (((start + i) > 0)
+			        && ((segment[i] & logic_trigger_mask) == logic_trigger_value)
+			        && ((previous & logic_trigger_mask) != logic_trigger_value)) {
+				logic_trigger_index = start + i;
+				logic_state = USBTHING_SCOPE_STATE_TRIGGERED;
+				break;
+			}
+		}
+	}
+	logic_last = segment[LOGIC_SEGMENT_SAMPLES - 1];
+
+	//Capture complete, the ring is reordered and packed from the main loop
+	if ((logic_state == USBTHING_SCOPE_STATE_TRIGGERED)
+	        && (logic_captured >= logic_trigger_index + logic.post_samples)) {
+		LOGIC_stop();
+		logic_complete = 1;
+		return segment;
+	}
+
+	//Each descriptor skips over the segment being filled by the other
+	return logic_ring + ((((segment - logic_ring) / LOGIC_SEGMENT_SAMPLES) + 2) % LOGIC_NUM_SEGMENTS)
+	       * LOGIC_SEGMENT_SAMPLES;
+}
+
+//Finish a completed capture outside of interrupt context, called from the main loop
+void logic_svc_poll()
+{
+	uint32_t start;
+	uint32_t count;
+
+	if (logic_complete == 0) {
+		return;
+	}
+	logic_complete = 0;
+
+	//Rotate the ring so the capture starts at the beginning of the buffer
+	start = (logic_trigger_index - logic.pre_samples) % LOGIC_RING_SAMPLES;
+
+	logic_reverse(logic_ring, start);
+	logic_reverse(logic_ring + start, LOGIC_RING_SAMPLES - start);
+	logic_reverse(logic_ring, LOGIC_RING_SAMPLES);
+
+	count = logic.pre_samples + logic.post_samples;
+	logic_length = logic_pack(logic_ring, count);
+	if (logic.encoding == USBTHING_LOGIC_ENCODING_RLE) {
+		logic_length = logic_encode((uint8_t *)logic_ring, count);
+	}
+
+	logic_state = USBTHING_SCOPE_STATE_DONE;
+}
+
+static void logic_reverse(uint32_t *data, uint32_t length)
+{
+	uint32_t temp;
+
+	for (uint32_t i = 0; i < length / 2; i++) {
+		temp = data[i];
+		data[i] = data[length - 1 - i];
+		data[length - 1 - i] = temp;
+	}
+}
+
+//Convert sample words in place to a byte per sample with bit n holding GPIOn, returns the length in bytes
+static uint32_t logic_pack(uint32_t *ring, uint32_t count)
+{
+	uint8_t *out = (uint8_t *)ring;
+	uint32_t bits[GPIO_NUM_PINS];
+
+	for (int i = 0; i < GPIO_NUM_PINS; i++) {
+		bits[i] = GPIO_port_bits(LOGIC_PORT_LOW, 1 << i) | (GPIO_port_bits(LOGIC_PORT_HIGH, 1 << i) << 16);
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t sample = ring[i];
+		uint8_t levels = 0;
+
+		for (int j = 0; j < GPIO_NUM_PINS; j++) {
+			if (sample & bits[j]) {
+				levels |= (1 << j);
+			}
+		}
+		out[i] = levels;
+	}
+
+	return count;
+}
+
+//Run length encode packed samples in place (see usbthing_logic_encoding_e), returns the encoded length.
+//No run encodes to more bytes than it covers, so output never overtakes the samples still to be read.
+static uint32_t logic_encode(uint8_t *data, uint32_t count)
+{
+	uint32_t length = 0;
+	uint32_t i = 0;
+
+	while (i < count) {
+		uint8_t levels = data[i];
+		uint32_t run = 1;
+
+		while ((i + run < count) && (data[i + run] == levels)) {
+			run ++;
+		}
+		i += run;
+
+		if (run < 4) {
+			data[length ++] = levels | ((run - 1) << 6);
+		} else {
+			data[length ++] = levels | 0xC0;
+			run -= 4;
+			while (run >= 0x80) {
+				data[length ++] = (run & 0x7F) | 0x80;
+				run >>= 7;
+			}
+			data[length ++] = run;
+		}
+	}
+
+	return length;
+}
@@ -0,0 +1,214 @@
+//Stepper motion
+//Moves to absolute step positions on a trapezoidal profile, generated on the device from the PWM timer.
+//Completion and periodic positions while moving are reported over the event stream.
+#include "services/motion_svc.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "em_usb.h"
+#include "em_cmu.h"
+
+#include "callbacks.h"
+#include "protocol.h"
+#include "peripherals/motion.h"
+#include "peripherals/timebase.h"
+#include "services/control_svc.h"
+#include "services/event_svc.h"
+
+static int motion_config(const USB_Setup_TypeDef *setup);
+static int motion_config_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int motion_move(const USB_Setup_TypeDef *setup);
+static int motion_move_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int motion_stop(const USB_Setup_TypeDef *setup);
+static int motion_status(const USB_Setup_TypeDef *setup);
+static int motion_position(const USB_Setup_TypeDef *setup);
+static int motion_position_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static void motion_done(bool reached, int32_t position);
+
+extern uint8_t cmd_buffer[];
+
+//Reports are made from the main loop while moving
+static uint64_t motion_report_ticks = 0;
+static uint64_t motion_report_next = 0;
+
+int motion_handle_setup(const USB_Setup_TypeDef *setup)
+{
+	switch (setup->wValue) {
+	case USBTHING_MOTION_CMD_CONFIG:
+		return motion_config(setup);
+
+	case USBTHING_MOTION_CMD_MOVE:
+		return motion_move(setup);
+
+	case USBTHING_MOTION_CMD_STOP:
+		return motion_stop(setup);
+
+	case USBTHING_MOTION_CMD_STATUS:
+		return motion_status(setup);
+
+	case USBTHING_MOTION_CMD_POSITION:
+		return motion_position(setup);
+	}
+	return USB_STATUS_REQ_UNHANDLED;
+}
+
+bool motion_svc_busy()
+{
+	return MOTION_busy();
+}
+
+static int motion_config(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_MOTION_CONFIG_SIZE);
+
+	if (MOTION_busy()) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_MOTION_CONFIG_SIZE, motion_config_cb);
+}
+
+static int motion_config_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	struct motion_config_s *config = &ctrl->motion_cmd.config;
+
+	if (status != USB_STATUS_OK) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	if (MOTION_configure(config->step_pin, config->dir_pin, config->invert != 0) < 0) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	//The timebase counts core clock cycles
+	motion_report_ticks = (uint64_t)config->report_ms * (CMU_ClockFreqGet(cmuClock_CORE) / 1000);
+
+	return USB_STATUS_OK;
+}
+
+static int motion_move(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_MOTION_MOVE_SIZE);
+
+	//Moves borrow the PWM timer, which the control loop may be driving
+	if (MOTION_busy() || (control_svc_output(USBTHING_CONTROL_OUTPUT_PWM) == true)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_MOTION_MOVE_SIZE, motion_move_cb);
+}
+
+static int motion_move_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	struct motion_move_s *move = &ctrl->motion_cmd.move;
+
+	if ((status != USB_STATUS_OK)
+	        || (move->speed == 0) || (move->speed > USBTHING_MOTION_MAX_SPEED)
+	        || (move->acceleration == 0) || (move->acceleration > USBTHING_MOTION_MAX_ACCELERATION)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	motion_report_next = TIMEBASE_get() + motion_report_ticks;
+
+	if (MOTION_start(move->target, move->speed, move->acceleration, motion_done) < 0) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USB_STATUS_OK;
+}
+
+static int motion_stop(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_MOTION_STOP_SIZE);
+
+	if (setup->wIndex > USBTHING_MOTION_STOP_HALT) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	MOTION_stop(setup->wIndex == USBTHING_MOTION_STOP_HALT);
+
+	return USB_STATUS_OK;
+}
+
+static int motion_status(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_IN(USBTHING_CMD_MOTION_STATUS_SIZE);
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	struct motion_status_s *motion = &ctrl->motion_cmd.status;
+
+	motion->moving = MOTION_busy();
+	motion->reserved[0] = 0;
+	motion->reserved[1] = 0;
+	motion->reserved[2] = 0;
+	motion->position = MOTION_position();
+	motion->target = MOTION_target();
+	motion->speed = MOTION_speed();
+
+	return USBD_Write(0, cmd_buffer, USBTHING_CMD_MOTION_STATUS_SIZE, NULL);
+}
+
+static int motion_position(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_MOTION_POSITION_SIZE);
+
+	if (MOTION_busy()) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_MOTION_POSITION_SIZE, motion_position_cb);
+}
+
+static int motion_position_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+
+	if ((status != USB_STATUS_OK) || (MOTION_set_position(ctrl->motion_cmd.position.position) < 0)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USB_STATUS_OK;
+}
+
+//Called from the timer interrupt as the last step ends, or on a halt
+static void motion_done(bool reached, int32_t position)
+{
+	uint8_t id = (reached == true) ? USBTHING_MOTION_EVENT_DONE : USBTHING_MOTION_EVENT_STOPPED;
+
+	event_svc_push(USBTHING_EVENT_SOURCE_MOTION, id, (uint16_t)position, TIMEBASE_get());
+}
+
+//Report the position at the configured interval while moving
+void motion_svc_poll()
+{
+	uint64_t now;
+
+	if ((motion_report_ticks == 0) || (MOTION_busy() == false)) {
+		return;
+	}
+
+	now = TIMEBASE_get();
+	if (now < motion_report_next) {
+		return;
+	}
+
+	event_svc_push(USBTHING_EVENT_SOURCE_MOTION, USBTHING_MOTION_EVENT_POSITION, (uint16_t)MOTION_position(), now);
+
+	//Keep to the interval unless the main loop has fallen a whole interval behind
+	motion_report_next += motion_report_ticks;
+	if (motion_report_next <= now) {
+		motion_report_next = now + motion_report_ticks;
+	}
+}
@@ -0,0 +1,220 @@
+//PWM USB protocol to peripheral mapping
+//Duty changes are buffered by the timer so they always land on a period boundary, an update of all
+//channels lands on the same boundary. The same timer measures an input in capture mode.
+#include "services/pwm_svc.h"
+
+#include <stdint.h>
+
+#include "em_usb.h"
+
+#include "callbacks.h"
+#include "protocol.h"
+#include "peripherals/pwm.h"
+#include "services/control_svc.h"
+#include "services/motion_svc.h"
+
+static int pwm_config(const USB_Setup_TypeDef *setup);
+static int pwm_config_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int pwm_enable(const USB_Setup_TypeDef *setup);
+static int pwm_enable_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int pwm_set(const USB_Setup_TypeDef *setup);
+static int pwm_set_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int pwm_update(const USB_Setup_TypeDef *setup);
+static int pwm_update_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int pwm_get(const USB_Setup_TypeDef *setup);
+static bool pwm_outputs_ready();
+
+extern uint8_t cmd_buffer[];
+
+//Set only in output mode, capture leaves the outputs unusable until reconfigured
+static uint8_t pwm_configured = 0;
+static uint16_t pwm_capture_channel = 0;
+
+int pwm_handle_setup(const USB_Setup_TypeDef *setup)
+{
+	switch (setup->wValue) {
+	case USBTHING_CMD_PWM_CFG:
+		return pwm_config(setup);
+
+	case USBTHING_CMD_PWM_EN:
+		return pwm_enable(setup);
+
+	case USBTHING_CMD_PWM_SET:
+		return pwm_set(setup);
+
+	case USBTHING_CMD_PWM_UPDATE:
+		return pwm_update(setup);
+
+	case USBTHING_CMD_PWM_GET:
+		return pwm_get(setup);
+	}
+	return USB_STATUS_REQ_UNHANDLED;
+}
+
+static int pwm_config(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_PWM_CFG_SIZE);
+
+	//The timer is lent to the motion generator for each move, and its period is fixed under the control loop
+	if ((motion_svc_busy() == true) || (control_svc_output(USBTHING_CONTROL_OUTPUT_PWM) == true)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	pwm_capture_channel = setup->wIndex;
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_PWM_CFG_SIZE, pwm_config_cb);
+}
+
+static int pwm_config_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	struct pwm_cfg_s *config = &ctrl->pwm_cmd.pwm_cfg;
+
+	if (status != USB_STATUS_OK) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	switch (config->mode) {
+	case PWM_MODE_OUTPUT:
+		if ((config->output.freq < USBTHING_PWM_MIN_FREQUENCY) || (config->output.freq > USBTHING_PWM_MAX_FREQUENCY)) {
+			return USB_STATUS_REQ_ERR;
+		}
+		pwm_configured = 0;
+		if (PWM_init(config->output.freq) < 0) {
+			return USB_STATUS_REQ_ERR;
+		}
+		pwm_configured = 1;
+		return USB_STATUS_OK;
+
+	case PWM_MODE_CAPTURE:
+		if ((pwm_capture_channel >= USBTHING_PWM_NUM_CHANNELS)
+		        || (config->capture.num_waves == 0) || (config->capture.num_waves > USBTHING_PWM_CAPTURE_MAX_WAVES)
+		        || (config->capture.timeout_ms == 0) || (config->capture.timeout_ms > USBTHING_PWM_CAPTURE_MAX_TIMEOUT)) {
+			return USB_STATUS_REQ_ERR;
+		}
+		pwm_configured = 0;
+		if (PWM_capture_start(pwm_capture_channel, config->capture.num_waves, config->capture.timeout_ms) < 0) {
+			return USB_STATUS_REQ_ERR;
+		}
+		return USB_STATUS_OK;
+	}
+
+	return USB_STATUS_REQ_ERR;
+}
+
+//Configured for output and not since lent to the motion generator, whose moves leave the timer claimed
+bool pwm_svc_ready()
+{
+	return (pwm_configured != 0) && (PWM_timer_claimed() == false);
+}
+
+//Commands are refused while the control loop drives a channel, it would overwrite them on its next iteration
+static bool pwm_outputs_ready()
+{
+	return (pwm_svc_ready() == true) && (control_svc_output(USBTHING_CONTROL_OUTPUT_PWM) == false);
+}
+
+static int pwm_enable(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_PWM_EN_SIZE);
+
+	if (pwm_outputs_ready() == false) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_PWM_EN_SIZE, pwm_enable_cb);
+}
+
+static int pwm_enable_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+
+	if ((status != USB_STATUS_OK) || (ctrl->pwm_cmd.enable.channel >= USBTHING_PWM_NUM_CHANNELS)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	PWM_enable(ctrl->pwm_cmd.enable.channel, ctrl->pwm_cmd.enable.enable != 0);
+
+	return USB_STATUS_OK;
+}
+
+static int pwm_set(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_PWM_SET_SIZE);
+
+	if (pwm_outputs_ready() == false) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_PWM_SET_SIZE, pwm_set_cb);
+}
+
+static int pwm_set_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+
+	if ((status != USB_STATUS_OK) || (ctrl->pwm_cmd.set.channel >= USBTHING_PWM_NUM_CHANNELS)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	PWM_set(ctrl->pwm_cmd.set.channel, ctrl->pwm_cmd.set.duty_cycle);
+
+	return USB_STATUS_OK;
+}
+
+static int pwm_update(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_PWM_UPDATE_SIZE);
+
+	if (pwm_outputs_ready() == false) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_PWM_UPDATE_SIZE, pwm_update_cb);
+}
+
+static int pwm_update_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	uint16_t duty[USBTHING_PWM_NUM_CHANNELS];
+
+	if (status != USB_STATUS_OK) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	//Copied out of the packed message for alignment
+	for (uint8_t i = 0; i < USBTHING_PWM_NUM_CHANNELS; i++) {
+		duty[i] = ctrl->pwm_cmd.update.duty_cycle[i];
+	}
+	PWM_update(duty);
+
+	return USB_STATUS_OK;
+}
+
+static int pwm_get(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_IN(USBTHING_CMD_PWM_GET_SIZE);
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	uint32_t frequency, duty, waves;
+
+	ctrl->pwm_cmd.get.state = PWM_capture_result(&frequency, &duty, &waves);
+	ctrl->pwm_cmd.get.reserved = 0;
+	ctrl->pwm_cmd.get.waves = waves;
+	ctrl->pwm_cmd.get.frequency = frequency;
+	ctrl->pwm_cmd.get.duty_cycle = duty;
+
+	return USBD_Write(0, cmd_buffer, USBTHING_CMD_PWM_GET_SIZE, NULL);
+}
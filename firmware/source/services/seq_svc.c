@@ -0,0 +1,345 @@
+//Command sequencer
+//Stores small programs in the batch op encoding and runs them from a timer interrupt,
+//giving deterministic device side timing for delays and pin waits
+
+#include "services/seq_svc.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "em_device.h"
+#include "em_cmu.h"
+#include "em_timer.h"
+#include "em_usb.h"
+#include "em_int.h"
+
+#include "callbacks.h"
+#include "protocol.h"
+#include "platform.h"
+#include "services/batch_svc.h"
+#include "peripherals/gpio.h"
+#include "peripherals/timebase.h"
+
+#define SEQ_TICKS_PER_US		3			//HFPERCLK (48MHz) / 16
+#define SEQ_MAX_SHOT_US			20000		//Longest single timer period, longer delays are chained
+#define SEQ_WAIT_POLL_US		10			//Pin wait polling interval
+#define SEQ_MAX_LOOP_DEPTH		4
+#define SEQ_SLICE_US			1000		//Longest run of ops in one interrupt before yielding
+#define SEQ_YIELD_US			100			//Pause between slices, left to the main loop
+#define SEQ_SCRATCH_SIZE		USBTHING_SEQ_PROGRAM_MAX_SIZE
+
+//Lower priority than USB and DMA so peripheral operations can complete from the timer interrupt
+#define SEQ_IRQ_PRIORITY		4
+
+static int seq_svc_store(const USB_Setup_TypeDef *setup);
+static int seq_svc_store_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int seq_svc_run(const USB_Setup_TypeDef *setup);
+static int seq_svc_stop(const USB_Setup_TypeDef *setup);
+static int seq_svc_status(const USB_Setup_TypeDef *setup);
+static void seq_svc_schedule(uint32_t delay_us);
+static void seq_svc_finish(uint8_t state, int8_t result);
+static void seq_svc_step();
+
+struct seq_svc_program_s {
+	uint16_t length;
+	uint8_t data[USBTHING_SEQ_PROGRAM_MAX_SIZE];
+};
+
+struct seq_svc_loop_s {
+	uint16_t start;
+	uint16_t remaining;
+};
+
+//Program storage, uploads are staged so a running program is never modified
+static struct seq_svc_program_s seq_svc_programs[USBTHING_SEQ_MAX_PROGRAMS];
+STATIC_UBUF(seq_svc_upload, USBTHING_SEQ_PROGRAM_MAX_SIZE);
+static uint8_t seq_svc_upload_id;
+static uint16_t seq_svc_upload_length;
+
+//Interpreter state
+static volatile uint8_t seq_svc_state = USBTHING_SEQ_STATE_IDLE;
+static uint8_t seq_svc_program = 0;
+static int8_t seq_svc_result = 0;
+static uint16_t seq_svc_pc = 0;
+static uint32_t seq_svc_ops_executed = 0;
+static uint32_t seq_svc_delay_remaining = 0;
+static uint32_t seq_svc_wait_remaining = 0;
+static uint8_t seq_svc_waiting = 0;
+static struct seq_svc_loop_s seq_svc_loops[SEQ_MAX_LOOP_DEPTH];
+static uint8_t seq_svc_loop_depth = 0;
+
+//Results of peripheral ops are discarded
+static uint8_t seq_svc_scratch[SEQ_SCRATCH_SIZE];
+
+extern uint8_t cmd_buffer[];
+
+
+void seq_svc_init()
+{
+	CMU_ClockEnable(SEQ_TIMER_CLOCK, true);
+
+	//One shot timer, each period ends with an overflow interrupt
+	TIMER_Init_TypeDef timer_init = TIMER_INIT_DEFAULT;
+	timer_init.enable = false;
+	timer_init.prescale = timerPrescale16;
+	timer_init.oneShot = true;
+
+	TIMER_Init(SEQ_TIMER, &timer_init);
+
+	TIMER_IntClear(SEQ_TIMER, TIMER_IF_OF);
+	TIMER_IntEnable(SEQ_TIMER, TIMER_IF_OF);
+
+	NVIC_SetPriority(SEQ_TIMER_IRQ, SEQ_IRQ_PRIORITY);
+	NVIC_EnableIRQ(SEQ_TIMER_IRQ);
+}
+
+int seq_handle_setup(const USB_Setup_TypeDef *setup)
+{
+	switch (setup->wValue) {
+	case USBTHING_SEQ_CMD_STORE:
+		return seq_svc_store(setup);
+	case USBTHING_SEQ_CMD_RUN:
+		return seq_svc_run(setup);
+	case USBTHING_SEQ_CMD_STOP:
+		return seq_svc_stop(setup);
+	case USBTHING_SEQ_CMD_STATUS:
+		return seq_svc_status(setup);
+	}
+
+	return USB_STATUS_REQ_UNHANDLED;
+}
+
+static int seq_svc_store(const USB_Setup_TypeDef *setup)
+{
+	//Programs are variable length, so the generic size check does not apply
+	if ((setup->Direction != USB_SETUP_DIR_OUT)
+	        || (setup->Recipient != USB_SETUP_RECIPIENT_DEVICE)
+	        || (setup->wIndex >= USBTHING_SEQ_MAX_PROGRAMS)
+	        || (setup->wLength < sizeof(struct usbthing_batch_header_s))
+	        || (setup->wLength > USBTHING_SEQ_PROGRAM_MAX_SIZE)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	//Programs cannot be replaced while running
+	if ((seq_svc_state == USBTHING_SEQ_STATE_RUNNING) && (seq_svc_program == setup->wIndex)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	seq_svc_upload_id = setup->wIndex;
+	seq_svc_upload_length = setup->wLength;
+
+	return USBD_Read(0, seq_svc_upload, setup->wLength, seq_svc_store_cb);
+}
+
+static int seq_svc_store_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)remaining;
+
+	const struct usbthing_batch_header_s *header = (const struct usbthing_batch_header_s *)seq_svc_upload;
+
+	if ((status != USB_STATUS_OK) || (xferred != seq_svc_upload_length) || (header->length != xferred)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	memcpy(seq_svc_programs[seq_svc_upload_id].data, seq_svc_upload, xferred);
+	seq_svc_programs[seq_svc_upload_id].length = xferred;
+
+	return USB_STATUS_OK;
+}
+
+static int seq_svc_run(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_SEQ_RUN_SIZE);
+
+	if ((setup->wIndex >= USBTHING_SEQ_MAX_PROGRAMS)
+	        || (seq_svc_programs[setup->wIndex].length == 0)
+	        || (seq_svc_state == USBTHING_SEQ_STATE_RUNNING)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	seq_svc_program = setup->wIndex;
+	seq_svc_pc = sizeof(struct usbthing_batch_header_s);
+	seq_svc_ops_executed = 0;
+	seq_svc_result = 0;
+	seq_svc_delay_remaining = 0;
+	seq_svc_waiting = 0;
+	seq_svc_loop_depth = 0;
+	seq_svc_state = USBTHING_SEQ_STATE_RUNNING;
+
+	//Start from the timer interrupt rather than the USB callback
+	seq_svc_schedule(0);
+
+	return USB_STATUS_OK;
+}
+
+static int seq_svc_stop(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_SEQ_STOP_SIZE);
+
+	INT_Disable();
+	if (seq_svc_state == USBTHING_SEQ_STATE_RUNNING) {
+		seq_svc_finish(USBTHING_SEQ_STATE_IDLE, 0);
+	}
+	INT_Enable();
+
+	return USB_STATUS_OK;
+}
+
+static int seq_svc_status(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_IN(USBTHING_CMD_SEQ_STATUS_SIZE);
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+
+	ctrl->seq_cmd.status.state = seq_svc_state;
+	ctrl->seq_cmd.status.program = seq_svc_program;
+	ctrl->seq_cmd.status.result = seq_svc_result;
+	ctrl->seq_cmd.status.reserved = 0;
+	ctrl->seq_cmd.status.ops_executed = seq_svc_ops_executed;
+
+	return USBD_Write(0, cmd_buffer, USBTHING_CMD_SEQ_STATUS_SIZE, NULL);
+}
+
+//Start a timer period, the interpreter continues from the overflow interrupt
+static void seq_svc_schedule(uint32_t delay_us)
+{
+	uint32_t period = (delay_us > SEQ_MAX_SHOT_US) ? SEQ_MAX_SHOT_US : delay_us;
+
+	seq_svc_delay_remaining = delay_us - period;
+
+	TIMER_Enable(SEQ_TIMER, false);
+	TIMER_CounterSet(SEQ_TIMER, 0);
+	TIMER_TopSet(SEQ_TIMER, (period > 0) ? (period * SEQ_TICKS_PER_US) : 1);
+	TIMER_Enable(SEQ_TIMER, true);
+}
+
+static void seq_svc_finish(uint8_t state, int8_t result)
+{
+	TIMER_Enable(SEQ_TIMER, false);
+
+	seq_svc_result = result;
+	seq_svc_state = state;
+}
+
+//Run program ops until the program ends, fails, or waits on the timer. Long runs without a delay, such as
+//loops of peripheral ops, are split into slices so the main loop is not starved (I2C, streams, events).
+static void seq_svc_step()
+{
+	const struct seq_svc_program_s *program = &seq_svc_programs[seq_svc_program];
+	uint64_t start = TIMEBASE_get();
+	int res;
+
+	while (seq_svc_state == USBTHING_SEQ_STATE_RUNNING) {
+		const struct usbthing_batch_op_s *op = (const struct usbthing_batch_op_s *)&program->data[seq_svc_pc];
+		const uint8_t *payload = &program->data[seq_svc_pc + sizeof(struct usbthing_batch_op_s)];
+		uint16_t next;
+
+		if (TIMEBASE_get() - start >= (uint64_t)SEQ_SLICE_US * (USBTHING_TIMEBASE_HZ / 1000000)) {
+			seq_svc_schedule(SEQ_YIELD_US);
+			return;
+		}
+
+		if (seq_svc_pc >= program->length) {
+			seq_svc_finish(USBTHING_SEQ_STATE_DONE, 0);
+			return;
+		}
+
+		next = seq_svc_pc + sizeof(struct usbthing_batch_op_s) + op->length;
+		if ((seq_svc_pc + sizeof(struct usbthing_batch_op_s) > program->length) || (next > program->length)) {
+			seq_svc_finish(USBTHING_SEQ_STATE_ERROR, USBTHING_ERROR_INVALID_REQUEST);
+			return;
+		}
+
+		switch (op->op) {
+		case USBTHING_BATCH_OP_DELAY_US:
+			seq_svc_pc = next;
+			seq_svc_ops_executed ++;
+			seq_svc_schedule(op->value);
+			return;
+
+		case USBTHING_BATCH_OP_WAIT_PIN:
+			if (seq_svc_waiting == 0) {
+				seq_svc_wait_remaining = 0;
+				if (op->length >= sizeof(uint32_t)) {
+					memcpy(&seq_svc_wait_remaining, payload, sizeof(uint32_t));
+				}
+				seq_svc_waiting = (seq_svc_wait_remaining > 0) ? 1 : 2;
+			}
+
+			if (GPIO_get(op->arg) == (op->value != 0)) {
+				seq_svc_waiting = 0;
+				seq_svc_pc = next;
+				seq_svc_ops_executed ++;
+				break;
+			}
+
+			//Waits with a timeout count down, others poll until stopped
+			if (seq_svc_waiting == 1) {
+				if (seq_svc_wait_remaining <= SEQ_WAIT_POLL_US) {
+					seq_svc_finish(USBTHING_SEQ_STATE_ERROR, USBTHING_ERROR_PERIPHERAL_TIMEOUT);
+					return;
+				}
+				seq_svc_wait_remaining -= SEQ_WAIT_POLL_US;
+			}
+
+			seq_svc_schedule(SEQ_WAIT_POLL_US);
+			return;
+
+		case USBTHING_BATCH_OP_LOOP_START:
+			if (seq_svc_loop_depth >= SEQ_MAX_LOOP_DEPTH) {
+				seq_svc_finish(USBTHING_SEQ_STATE_ERROR, USBTHING_ERROR_INVALID_REQUEST);
+				return;
+			}
+			seq_svc_loops[seq_svc_loop_depth].start = next;
+			seq_svc_loops[seq_svc_loop_depth].remaining = op->value;
+			seq_svc_loop_depth ++;
+			seq_svc_pc = next;
+			seq_svc_ops_executed ++;
+			break;
+
+		case USBTHING_BATCH_OP_LOOP_END:
+			if (seq_svc_loop_depth == 0) {
+				seq_svc_finish(USBTHING_SEQ_STATE_ERROR, USBTHING_ERROR_INVALID_REQUEST);
+				return;
+			}
+			seq_svc_ops_executed ++;
+
+			//Zero iteration loops repeat until the program is stopped
+			struct seq_svc_loop_s *loop = &seq_svc_loops[seq_svc_loop_depth - 1];
+			if ((loop->remaining == 0) || (--loop->remaining > 0)) {
+				seq_svc_pc = loop->start;
+			} else {
+				seq_svc_loop_depth --;
+				seq_svc_pc = next;
+			}
+			break;
+
+		default:
+			res = batch_svc_run_op(op, payload, seq_svc_scratch, SEQ_SCRATCH_SIZE);
+			if (res < 0) {
+				seq_svc_finish(USBTHING_SEQ_STATE_ERROR, res);
+				return;
+			}
+			seq_svc_pc = next;
+			seq_svc_ops_executed ++;
+			break;
+		}
+	}
+}
+
+void TIMER3_IRQHandler(void)
+{
+	TIMER_IntClear(SEQ_TIMER, TIMER_IF_OF);
+
+	if (seq_svc_state != USBTHING_SEQ_STATE_RUNNING) {
+		return;
+	}
+
+	//Continue chained delays before resuming the program
+	if (seq_svc_delay_remaining > 0) {
+		seq_svc_schedule(seq_svc_delay_remaining);
+		return;
+	}
+
+	seq_svc_step();
+}
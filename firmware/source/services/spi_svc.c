@@ -5,39 +5,97 @@
 #include <stdint.h>
 
 #include "em_usb.h"
+#include "em_int.h"
 
 #include "callbacks.h"
 #include "protocol.h"
 #include "peripherals/spi.h"
 #include "em_usart.h"
 
-#define SPI_BUFF_SIZE 		512
-
+#define SPI_BUFF_SIZE 		USBTHING_SPI_MAX_SIZE
+#define SPI_NUM_BUFFERS		2
 
 static int spi_svc_config(const USB_Setup_TypeDef *setup);
 static int spi_svc_config_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
-static int spi_svc_config_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
 static int spi_svc_data_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
 static int spi_svc_data_receive_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
 static int spi_svc_close(const USB_Setup_TypeDef *setup);
+static int spi_svc_xfer_init(const USB_Setup_TypeDef *setup);
+static int spi_svc_xfer_init_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static void spi_svc_receive_next();
+static void spi_svc_process();
+static void spi_svc_transfer_cb(int8_t result, uint16_t length);
 
 
 //Aligned buffers for USB operations
-STATIC_UBUF(spi_svc_receive_buffer, SPI_BUFF_SIZE);
-STATIC_UBUF(spi_svc_transmit_buffer, SPI_BUFF_SIZE);
+STATIC_UBUF(spi_svc_receive_buffer_a, SPI_BUFF_SIZE);
+STATIC_UBUF(spi_svc_receive_buffer_b, SPI_BUFF_SIZE);
+STATIC_UBUF(spi_svc_transmit_buffer_a, SPI_BUFF_SIZE);
+STATIC_UBUF(spi_svc_transmit_buffer_b, SPI_BUFF_SIZE);
+
+//Buffer pair states, each pair moves through these in order
+enum spi_svc_buffer_state_e {
+	SPI_BUFFER_FREE = 0,			//Available for USB OUT
+	SPI_BUFFER_RECEIVING = 1,		//USB OUT in progress
+	SPI_BUFFER_READY = 2,			//Awaiting SPI transfer
+	SPI_BUFFER_TRANSFERRING = 3,	//SPI transfer in progress
+	SPI_BUFFER_DONE = 4,			//Awaiting USB IN
+	SPI_BUFFER_SENDING = 5			//USB IN in progress
+};
+
+struct spi_svc_buffer_s {
+	uint8_t *receive;
+	uint8_t *transmit;
+	volatile uint8_t state;
+	uint8_t flags;
+	uint16_t length;
+};
+
+//Ping-pong buffer pairs, allowing transfer k+1 to arrive over USB while transfer k is on the wire
+static struct spi_svc_buffer_s spi_svc_buffers[SPI_NUM_BUFFERS] = {
+	{ spi_svc_receive_buffer_a, spi_svc_transmit_buffer_a, SPI_BUFFER_FREE, 0, 0 },
+	{ spi_svc_receive_buffer_b, spi_svc_transmit_buffer_b, SPI_BUFFER_FREE, 0, 0 }
+};
+
+//Next buffer pair for each stage, pairs are always used in order
+static uint8_t spi_svc_receive_index = 0;
+static uint8_t spi_svc_transfer_index = 0;
+static uint8_t spi_svc_send_index = 0;
+
+static uint8_t spi_svc_receiving = 0;
+static uint8_t spi_svc_transferring = 0;
+static uint8_t spi_svc_sending = 0;
+
+//Bytes remaining in a chunked transaction, CS is held between chunks until this reaches zero
+static uint32_t spi_svc_xfer_remaining = 0;
+
+//Set when a transaction is aborted while a chunk holding CS is on the wire
+static uint8_t spi_svc_xfer_abort = 0;
 
 
 extern uint8_t cmd_buffer[];
 extern int usbthing_busy;
 
 static int spi_svc_configured = 0;
-static int zlp_required = 0;
 
 
 void spi_svc_start()
 {
+	//Reset pipeline
+	for (int i = 0; i < SPI_NUM_BUFFERS; i++) {
+		spi_svc_buffers[i].state = SPI_BUFFER_FREE;
+	}
+	spi_svc_receive_index = 0;
+	spi_svc_transfer_index = 0;
+	spi_svc_send_index = 0;
+	spi_svc_receiving = 0;
+	spi_svc_transferring = 0;
+	spi_svc_sending = 0;
+	spi_svc_xfer_remaining = 0;
+	spi_svc_xfer_abort = 0;
+
 	//Start listening on SPI endpoint
-	USBD_Read(EP1_OUT, spi_svc_receive_buffer, SPI_BUFF_SIZE, spi_svc_data_receive_cb);
+	spi_svc_receive_next();
 }
 
 int spi_svc_handle_setup(const USB_Setup_TypeDef *setup)
@@ -47,6 +105,8 @@ int spi_svc_handle_setup(const USB_Setup_TypeDef *setup)
 		return spi_svc_config(setup);
 	case USBTHING_SPI_CMD_CLOSE:
 		return spi_svc_close(setup);
+	case USBTHING_SPI_CMD_XFER_INIT:
+		return spi_svc_xfer_init(setup);
 	}
 
 	return USB_STATUS_REQ_UNHANDLED;
@@ -63,6 +123,17 @@ static int spi_svc_config(const USB_Setup_TypeDef *setup)
 	return res;
 }
 
+static int spi_svc_xfer_init(const USB_Setup_TypeDef *setup)
+{
+	int res = USB_STATUS_REQ_ERR;
+
+	CHECK_SETUP_OUT(USBTHING_CMD_SPI_XFER_INIT_SIZE);
+
+	res = USBD_Read(0, cmd_buffer, USBTHING_CMD_SPI_XFER_INIT_SIZE, spi_svc_xfer_init_cb);
+
+	return res;
+}
+
 static int spi_svc_close(const USB_Setup_TypeDef *setup)
 {
 	int res = USB_STATUS_OK;
@@ -90,62 +161,187 @@ static int spi_svc_config_cb(USB_Status_TypeDef status, uint32_t xferred, uint32
 	return USB_STATUS_OK;
 }
 
-static int spi_svc_data_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+static int spi_svc_xfer_init_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
 {
-	int res;
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+
+	if (status != USB_STATUS_OK) {
+		return status;
+	}
+
+	//SPI is full duplex, every byte out clocks a byte in
+	if (ctrl->spi_cmd.xfer_init.bytes_out != ctrl->spi_cmd.xfer_init.bytes_in) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	INT_Disable();
+
+	spi_svc_xfer_remaining = ctrl->spi_cmd.xfer_init.bytes_out;
+
+	//A zero length transaction aborts any transaction in progress. Queued chunks no longer hold CS, and a
+	//chunk already on the wire releases it as it completes.
+	if (spi_svc_xfer_remaining == 0) {
+		for (int i = 0; i < SPI_NUM_BUFFERS; i++) {
+			if (spi_svc_buffers[i].state == SPI_BUFFER_READY) {
+				spi_svc_buffers[i].flags &= ~SPI_XFER_FLAG_HOLD_CS;
+			}
+		}
+
+		if (spi_svc_transferring == 0) {
+			SPI_cs_release();
+		} else {
+			spi_svc_xfer_abort = 1;
+		}
+	}
+
+	INT_Enable();
+
+	return USB_STATUS_OK;
+}
+
+//Arm the OUT endpoint if the next buffer pair is free
+static void spi_svc_receive_next()
+{
+	struct spi_svc_buffer_s *buffer = &spi_svc_buffers[spi_svc_receive_index];
+
+	if ((spi_svc_receiving != 0) || (buffer->state != SPI_BUFFER_FREE)) {
+		return;
+	}
 
+	buffer->state = SPI_BUFFER_RECEIVING;
+	spi_svc_receiving = 1;
+
+	USBD_Read(EP1_OUT, buffer->receive, SPI_BUFF_SIZE, spi_svc_data_receive_cb);
+}
+
+//Advance the SPI and USB IN stages of the pipeline, called from USB and DMA interrupts
+static void spi_svc_process()
+{
+	struct spi_svc_buffer_s *buffer;
+
+	INT_Disable();
+
+	//Start the next SPI transfer, completion is signalled by spi_svc_transfer_cb
+	buffer = &spi_svc_buffers[spi_svc_transfer_index];
+	if ((spi_svc_transferring == 0) && (buffer->state == SPI_BUFFER_READY)) {
+		buffer->state = SPI_BUFFER_TRANSFERRING;
+		spi_svc_transferring = 1;
+
+		if (SPI_transfer_start(buffer->length, buffer->receive, buffer->transmit, buffer->flags, spi_svc_transfer_cb) < 0) {
+			//Respond with no data, which the host reports as a failed transfer, so it is not left waiting
+			buffer->length = 0;
+			buffer->state = SPI_BUFFER_DONE;
+			spi_svc_transferring = 0;
+			spi_svc_transfer_index = (spi_svc_transfer_index + 1) % SPI_NUM_BUFFERS;
+		}
+	}
+
+	//Return the next completed transfer to the host
+	buffer = &spi_svc_buffers[spi_svc_send_index];
+	if ((spi_svc_sending == 0) && (buffer->state == SPI_BUFFER_DONE)) {
+		buffer->state = SPI_BUFFER_SENDING;
+		spi_svc_sending = 1;
+
+		USBD_Write(EP1_IN, buffer->transmit, buffer->length, spi_svc_data_sent_cb);
+	}
+
+	usbthing_busy = (spi_svc_buffers[0].state != SPI_BUFFER_FREE)
+	                || (spi_svc_buffers[1].state != SPI_BUFFER_FREE);
+
+	INT_Enable();
+}
+
+static void spi_svc_transfer_cb(int8_t result, uint16_t length)
+{
+	struct spi_svc_buffer_s *buffer = &spi_svc_buffers[spi_svc_transfer_index];
+
+	(void)length;
+
+	if (result < 0) {
+		buffer->length = 0;
+	}
+
+	//The transaction was aborted while this chunk was running with CS held
+	if (spi_svc_xfer_abort != 0) {
+		spi_svc_xfer_abort = 0;
+		SPI_cs_release();
+	}
+
+	buffer->state = SPI_BUFFER_DONE;
+	spi_svc_transferring = 0;
+	spi_svc_transfer_index = (spi_svc_transfer_index + 1) % SPI_NUM_BUFFERS;
+
+	spi_svc_process();
+}
+
+static int spi_svc_data_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
 	/* Remove warnings for unused variables */
 	(void)xferred;
 	(void)remaining;
 
+	spi_svc_sending = 0;
+
 	if ( status != USB_STATUS_OK ) {
 		/* Handle error */
 		return status;
 	}
 
-	//if ((xferred != 0) && (xferred % USB_MAX_EP_SIZE == 0)) {
-	//	//Send zero length packet to signify completion
-	//	res = USBD_Write(EP1_IN, NULL, 0, spi_svc_data_sent_cb);
-	//}
+	//Release buffer pair
+	spi_svc_buffers[spi_svc_send_index].state = SPI_BUFFER_FREE;
+	spi_svc_send_index = (spi_svc_send_index + 1) % SPI_NUM_BUFFERS;
 
-	//Restart EP_OUT
-	res = USBD_Read(EP1_OUT, spi_svc_receive_buffer, SPI_BUFF_SIZE, spi_svc_data_receive_cb);
+	//Restart EP_OUT if it was waiting on this pair, and continue the pipeline
+	spi_svc_receive_next();
+	spi_svc_process();
 
-	return res;
+	return USB_STATUS_OK;
 }
 
 static int spi_svc_data_receive_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
 {
-	int res;
+	struct spi_svc_buffer_s *buffer = &spi_svc_buffers[spi_svc_receive_index];
 
 	/* Remove warnings for unused variables */
-	(void)xferred;
 	(void)remaining;
 
+	spi_svc_receiving = 0;
+
 	/* Check status to verify that the transfer has completed successfully */
 	if ( status != USB_STATUS_OK ) {
 		//TODO: handle errors
+		buffer->state = SPI_BUFFER_FREE;
 		return status;
 	}
 
-	//Ensure SPI is initialized
-	if (spi_svc_configured == 0) {
-		return USB_STATUS_DEVICE_UNCONFIGURED;
+	//Discard zero length termination packets and transfers prior to configuration
+	if ((xferred == 0) || (spi_svc_configured == 0)) {
+		buffer->state = SPI_BUFFER_FREE;
+		spi_svc_receive_next();
+		return (spi_svc_configured == 0) ? USB_STATUS_DEVICE_UNCONFIGURED : USB_STATUS_OK;
 	}
 
-	usbthing_busy = 1;
+	buffer->length = xferred;
+	buffer->flags = 0;
+
+	//Hold CS after this chunk if the transaction has further bytes to come
+	if (spi_svc_xfer_remaining > 0) {
+		spi_svc_xfer_remaining -= (xferred < spi_svc_xfer_remaining) ? xferred : spi_svc_xfer_remaining;
+		if (spi_svc_xfer_remaining > 0) {
+			buffer->flags = SPI_XFER_FLAG_HOLD_CS;
+		}
+	}
 
-	//Check whether a zero length termination packet is required
-	//if ((xferred != 0) && (xferred % USB_MAX_EP_SIZE == 0)) {
-	//	res = USBD_Read(EP1_OUT, NULL, 0, NULL);
-	//}
+	buffer->state = SPI_BUFFER_READY;
+	spi_svc_receive_index = (spi_svc_receive_index + 1) % SPI_NUM_BUFFERS;
 
-	//Perform SPI transfer
-	SPI_transfer(xferred, spi_svc_receive_buffer, spi_svc_transmit_buffer);
+	//Immediately receive the next transfer into the other buffer pair
+	spi_svc_receive_next();
 
-	//Write result back to host
-	res = USBD_Write(EP1_IN, spi_svc_transmit_buffer, xferred, spi_svc_data_sent_cb);
+	spi_svc_process();
 
-	return res;
+	return USB_STATUS_OK;
 }
-
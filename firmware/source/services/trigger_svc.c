@@ -0,0 +1,125 @@
+//Trigger routing
+//Links a host selected source signal to a peripheral action over the peripheral reflex system (PRS),
+//each sink consuming its own PRS channel. Routes act in hardware, the CPU is only involved in setting them.
+#include "services/trigger_svc.h"
+
+#include <stdint.h>
+
+#include "em_usb.h"
+#include "em_cmu.h"
+#include "em_prs.h"
+
+#include "callbacks.h"
+#include "protocol.h"
+#include "platform.h"
+#include "peripherals/gpio.h"
+#include "peripherals/dac.h"
+
+static int trigger_route(const USB_Setup_TypeDef *setup);
+static int trigger_route_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int trigger_clear(const USB_Setup_TypeDef *setup);
+
+extern uint8_t cmd_buffer[];
+
+//PRS channel consumed by each sink, indexed by usbthing_trigger_sink_e
+static const uint8_t trigger_channels[USBTHING_TRIGGER_NUM_SINKS] = {
+	TRIGGER_ADC_PRS_CHANNEL,
+	TRIGGER_DAC_PRS_CHANNEL
+};
+
+int trigger_handle_setup(const USB_Setup_TypeDef *setup)
+{
+	switch (setup->wValue) {
+	case USBTHING_TRIGGER_CMD_ROUTE:
+		return trigger_route(setup);
+
+	case USBTHING_TRIGGER_CMD_CLEAR:
+		return trigger_clear(setup);
+	}
+	return USB_STATUS_REQ_UNHANDLED;
+}
+
+static int trigger_route(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_TRIGGER_ROUTE_SIZE);
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_TRIGGER_ROUTE_SIZE, trigger_route_cb);
+}
+
+static int trigger_route_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	struct trigger_route_s *route = &ctrl->trigger_cmd.route;
+	PRS_Edge_TypeDef edge = prsEdgeOff;
+	uint32_t source;
+	uint32_t signal;
+
+	if ((status != USB_STATUS_OK) || (route->sink >= USBTHING_TRIGGER_NUM_SINKS)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	//Clock sources are already single cycle pulses, pin levels are turned into pulses on the chosen edges
+	switch (route->source) {
+	case USBTHING_TRIGGER_SOURCE_GPIO:
+		if (GPIO_prs_signal(route->pin, &source, &signal) < 0) {
+			return USB_STATUS_REQ_ERR;
+		}
+		switch (route->edge) {
+		case USBTHING_TRIGGER_EDGE_RISING:
+			edge = prsEdgePos;
+			break;
+		case USBTHING_TRIGGER_EDGE_FALLING:
+			edge = prsEdgeNeg;
+			break;
+		case USBTHING_TRIGGER_EDGE_BOTH:
+			edge = prsEdgeBoth;
+			break;
+		default:
+			return USB_STATUS_REQ_ERR;
+		}
+		break;
+
+	case USBTHING_TRIGGER_SOURCE_SAMPLE_CLOCK:
+		source = SAMPLE_PRS_SOURCE;
+		signal = SAMPLE_PRS_SIGNAL;
+		break;
+
+	case USBTHING_TRIGGER_SOURCE_OUTPUT_CLOCK:
+		source = OUTPUT_PRS_SOURCE;
+		signal = OUTPUT_PRS_SIGNAL;
+		break;
+
+	default:
+		return USB_STATUS_REQ_ERR;
+	}
+
+	CMU_ClockEnable(cmuClock_PRS, true);
+	PRS_SourceSignalSet(trigger_channels[route->sink], source, signal, edge);
+
+	//ADC scans only use the route once a triggered stream is started
+	if (route->sink == USBTHING_TRIGGER_SINK_DAC) {
+		DAC_trigger(true);
+	}
+
+	return USB_STATUS_OK;
+}
+
+static int trigger_clear(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_TRIGGER_CLEAR_SIZE);
+
+	if (setup->wIndex >= USBTHING_TRIGGER_NUM_SINKS) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	if (setup->wIndex == USBTHING_TRIGGER_SINK_DAC) {
+		DAC_trigger(false);
+	}
+
+	PRS_SourceSignalSet(trigger_channels[setup->wIndex], PRS_CH_CTRL_SOURCESEL_NONE, 0, prsEdgeOff);
+
+	return USB_STATUS_OK;
+}
@@ -0,0 +1,370 @@
+//UART bridge
+//Received bytes are collected by DMA into a ring and forwarded to the host on the UART bulk IN endpoint from
+//the main loop, transmit data from the bulk OUT endpoint is queued in blocks and sent to the USART by DMA.
+//Lost bytes and line errors are reported over the event stream.
+#include "services/uart_svc.h"
+
+#include <stdint.h>
+
+#include "em_usb.h"
+#include "em_int.h"
+
+#include "callbacks.h"
+#include "protocol.h"
+#include "peripherals/uart.h"
+#include "peripherals/timebase.h"
+#include "services/adc_svc.h"
+#include "services/control_svc.h"
+#include "services/event_svc.h"
+
+#define UART_USB_PACKET_SIZE		64
+
+enum uart_block_state_e {
+	UART_BLOCK_FREE = 0,
+	UART_BLOCK_RECEIVING,
+	UART_BLOCK_READY,
+	UART_BLOCK_SENDING
+};
+
+static int uart_config(const USB_Setup_TypeDef *setup);
+static int uart_config_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static int uart_status(const USB_Setup_TypeDef *setup);
+static int uart_stop(const USB_Setup_TypeDef *setup);
+static void uart_halt();
+static void uart_tx_receive();
+static int uart_tx_received_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+static void uart_tx_send();
+static void uart_tx_sent_cb();
+static void uart_rx_send();
+static int uart_rx_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+
+extern uint8_t cmd_buffer[];
+static volatile uint8_t uart_active = 0;
+
+//Transmit blocks cycle free -> receiving (USB) -> ready -> sending (DMA) -> free
+static uint8_t uart_tx_blocks[USBTHING_UART_TX_BLOCKS][USBTHING_UART_BLOCK_SIZE] __attribute__ ((aligned(4)));
+static uint16_t uart_tx_length[USBTHING_UART_TX_BLOCKS];
+static uint8_t uart_tx_state[USBTHING_UART_TX_BLOCKS];
+static uint8_t uart_tx_ready[USBTHING_UART_TX_BLOCKS];
+static uint8_t uart_tx_ready_head = 0;
+static uint8_t uart_tx_ready_count = 0;
+static uint8_t uart_tx_receiving = 0;
+static volatile uint32_t uart_tx_transmitted = 0;
+
+//Received bytes are copied out of the ring to be sent, the USB core needs word aligned buffers
+static uint8_t uart_rx_block[USBTHING_UART_BLOCK_SIZE] __attribute__ ((aligned(4)));
+static volatile uint8_t uart_rx_sending = 0;
+
+//Counts at the last event reports
+static uint32_t uart_report_lost = 0;
+static uint32_t uart_report_errors = 0;
+
+int uart_handle_setup(const USB_Setup_TypeDef *setup)
+{
+	switch (setup->wValue) {
+	case USBTHING_CMD_UART_CFG:
+		return uart_config(setup);
+
+	case USBTHING_CMD_UART_STATUS:
+		return uart_status(setup);
+
+	case USBTHING_CMD_UART_STOP:
+		return uart_stop(setup);
+	}
+	return USB_STATUS_REQ_UNHANDLED;
+}
+
+static int uart_config(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_UART_CFG_SIZE);
+
+	//The pins are ADC inputs, driving TX would disturb whatever is being measured there
+	if (((adc_svc_channels() | control_svc_channels()) & USBTHING_UART_ADC_CHANNELS) != 0) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	return USBD_Read(0, cmd_buffer, USBTHING_CMD_UART_CFG_SIZE, uart_config_cb);
+}
+
+static int uart_config_cb(const USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	struct uart_config_s *config = &ctrl->uart_cmd.config;
+
+	if ((status != USB_STATUS_OK)
+	        || (config->baud < USBTHING_UART_MIN_BAUD) || (config->baud > USBTHING_UART_MAX_BAUD)) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	//Reconfiguring drops anything queued in either direction
+	uart_halt();
+
+	if (UART_init(config->baud, config->data_bits, config->parity, config->stop_bits) < 0) {
+		return USB_STATUS_REQ_ERR;
+	}
+
+	uart_tx_transmitted = 0;
+	uart_report_lost = 0;
+	uart_report_errors = 0;
+	uart_active = 1;
+
+	uart_tx_receive();
+
+	return USB_STATUS_OK;
+}
+
+//Pins are claimed from the ADC while open
+bool uart_svc_busy()
+{
+	return uart_active != 0;
+}
+
+static int uart_status(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_IN(USBTHING_CMD_UART_STATUS_SIZE);
+
+	struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s*)&cmd_buffer;
+	struct uart_status_s *uart = &ctrl->uart_cmd.status;
+	uint32_t queued = 0;
+
+	INT_Disable();
+	for (uint8_t i = 0; i < USBTHING_UART_TX_BLOCKS; i++) {
+		if ((uart_tx_state[i] == UART_BLOCK_READY) || (uart_tx_state[i] == UART_BLOCK_SENDING)) {
+			queued += uart_tx_length[i];
+		}
+	}
+	INT_Enable();
+
+	uart->received = UART_rx_received();
+	uart->transmitted = uart_tx_transmitted;
+	uart->lost = UART_rx_lost();
+	uart->errors = UART_rx_errors();
+	uart->rx_queued = UART_rx_queued();
+	uart->tx_queued = queued;
+
+	return USBD_Write(0, cmd_buffer, USBTHING_CMD_UART_STATUS_SIZE, NULL);
+}
+
+static int uart_stop(const USB_Setup_TypeDef *setup)
+{
+	CHECK_SETUP_OUT(USBTHING_CMD_UART_STOP_SIZE);
+
+	uart_halt();
+
+	return USB_STATUS_OK;
+}
+
+static void uart_halt()
+{
+	INT_Disable();
+	UART_close();
+	if (uart_tx_receiving != 0) {
+		USBD_AbortTransfer(EP6_OUT);
+	}
+	if (uart_rx_sending != 0) {
+		USBD_AbortTransfer(EP6_IN);
+	}
+	for (uint8_t i = 0; i < USBTHING_UART_TX_BLOCKS; i++) {
+		uart_tx_state[i] = UART_BLOCK_FREE;
+	}
+	uart_tx_ready_count = 0;
+	uart_tx_receiving = 0;
+	uart_rx_sending = 0;
+	uart_active = 0;
+	INT_Enable();
+}
+
+//Receive into the next free block if the endpoint is idle. The endpoint is only read while a block is
+//free, so the host is held off by NAKs when the transmit queue is full.
+static void uart_tx_receive()
+{
+	uint8_t index;
+
+	INT_Disable();
+
+	if ((uart_active == 0) || (uart_tx_receiving != 0)) {
+		INT_Enable();
+		return;
+	}
+
+	for (index = 0; index < USBTHING_UART_TX_BLOCKS; index++) {
+		if (uart_tx_state[index] == UART_BLOCK_FREE) {
+			break;
+		}
+	}
+	if (index == USBTHING_UART_TX_BLOCKS) {
+		INT_Enable();
+		return;
+	}
+
+	uart_tx_state[index] = UART_BLOCK_RECEIVING;
+	uart_tx_receiving = 1;
+
+	if (USBD_Read(EP6_OUT, uart_tx_blocks[index], USBTHING_UART_BLOCK_SIZE, uart_tx_received_cb) != USB_STATUS_OK) {
+		uart_tx_state[index] = UART_BLOCK_FREE;
+		uart_tx_receiving = 0;
+	}
+
+	INT_Enable();
+}
+
+static int uart_tx_received_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)remaining;
+
+	uint8_t index;
+
+	for (index = 0; index < USBTHING_UART_TX_BLOCKS; index++) {
+		if (uart_tx_state[index] == UART_BLOCK_RECEIVING) {
+			break;
+		}
+	}
+	uart_tx_receiving = 0;
+
+	//Stop the bridge if the device has been reset or unconfigured
+	if (status != USB_STATUS_OK) {
+		uart_halt();
+		return USB_STATUS_OK;
+	}
+
+	if (index == USBTHING_UART_TX_BLOCKS) {
+		return USB_STATUS_OK;
+	}
+
+	//Zero length transfers only end a write that filled its last packet
+	INT_Disable();
+	uart_tx_length[index] = xferred;
+	if (xferred == 0) {
+		uart_tx_state[index] = UART_BLOCK_FREE;
+	} else {
+		uart_tx_state[index] = UART_BLOCK_READY;
+		uart_tx_ready[(uart_tx_ready_head + uart_tx_ready_count) % USBTHING_UART_TX_BLOCKS] = index;
+		uart_tx_ready_count ++;
+	}
+	INT_Enable();
+
+	uart_tx_send();
+	uart_tx_receive();
+
+	return USB_STATUS_OK;
+}
+
+//Start the oldest ready block on the USART if it is idle
+static void uart_tx_send()
+{
+	uint8_t index;
+
+	INT_Disable();
+
+	if ((uart_active == 0) || (UART_tx_busy() == true) || (uart_tx_ready_count == 0)) {
+		INT_Enable();
+		return;
+	}
+
+	index = uart_tx_ready[uart_tx_ready_head];
+	uart_tx_ready_head = (uart_tx_ready_head + 1) % USBTHING_UART_TX_BLOCKS;
+	uart_tx_ready_count --;
+
+	uart_tx_state[index] = UART_BLOCK_SENDING;
+
+	if (UART_write(uart_tx_blocks[index], uart_tx_length[index], uart_tx_sent_cb) < 0) {
+		uart_tx_state[index] = UART_BLOCK_FREE;
+	}
+
+	INT_Enable();
+}
+
+//Called from the DMA interrupt once a block has been written to the USART
+static void uart_tx_sent_cb()
+{
+	for (uint8_t i = 0; i < USBTHING_UART_TX_BLOCKS; i++) {
+		if (uart_tx_state[i] == UART_BLOCK_SENDING) {
+			uart_tx_transmitted += uart_tx_length[i];
+			uart_tx_state[i] = UART_BLOCK_FREE;
+		}
+	}
+
+	uart_tx_send();
+	uart_tx_receive();
+}
+
+//Send what has been received if the endpoint is idle. Transfers are kept off a multiple of the packet size
+//unless full, so the host sees each one end without waiting for a zero length packet.
+static void uart_rx_send()
+{
+	uint16_t length;
+
+	INT_Disable();
+
+	if ((uart_active == 0) || (uart_rx_sending != 0)) {
+		INT_Enable();
+		return;
+	}
+
+	uart_rx_sending = 1;
+	INT_Enable();
+
+	length = UART_rx_queued();
+	if (length > USBTHING_UART_BLOCK_SIZE) {
+		length = USBTHING_UART_BLOCK_SIZE;
+	} else if ((length > 0) && (length < USBTHING_UART_BLOCK_SIZE) && ((length % UART_USB_PACKET_SIZE) == 0)) {
+		length --;
+	}
+
+	if (length > 0) {
+		length = UART_rx_read(uart_rx_block, length);
+	}
+
+	INT_Disable();
+	if ((length == 0) || (uart_active == 0)
+	        || (USBD_Write(EP6_IN, uart_rx_block, length, uart_rx_sent_cb) != USB_STATUS_OK)) {
+		uart_rx_sending = 0;
+	}
+	INT_Enable();
+}
+
+static int uart_rx_sent_cb(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining)
+{
+	(void)xferred;
+	(void)remaining;
+
+	uart_rx_sending = 0;
+
+	//Stop the bridge if the device has been reset or unconfigured
+	if (status != USB_STATUS_OK) {
+		uart_halt();
+	}
+
+	return USB_STATUS_OK;
+}
+
+//Forward received bytes and report losses and line errors, saturating each report to the event value
+void uart_svc_poll()
+{
+	uint32_t lost, errors, change;
+
+	if (uart_active == 0) {
+		return;
+	}
+
+	uart_rx_send();
+
+	lost = UART_rx_lost();
+	if (lost != uart_report_lost) {
+		change = lost - uart_report_lost;
+		event_svc_push(USBTHING_EVENT_SOURCE_UART, USBTHING_UART_EVENT_LOST,
+		               (change > 0xFFFF) ? 0xFFFF : change, TIMEBASE_get());
+		uart_report_lost = lost;
+	}
+
+	errors = UART_rx_errors();
+	if (errors != uart_report_errors) {
+		change = errors - uart_report_errors;
+		event_svc_push(USBTHING_EVENT_SOURCE_UART, USBTHING_UART_EVENT_ERROR,
+		               (change > 0xFFFF) ? 0xFFFF : change, TIMEBASE_get());
+		uart_report_errors = errors;
+	}
+}
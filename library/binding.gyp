@@ -3,7 +3,7 @@
     {
       "target_name": "binding",
       "include_dirs": [ "include", "../common/include", "<!(node -e \"require('nan')\")" ],
-      "sources": [ "source/usbthing.cpp", "source/usbthing.c"  ]
+      "sources": [ "source/usbthing.cpp", "source/usbthing.c", "source/async.c", "source/batch.c", "source/event.c", "source/stream.c", "source/logic.c", "source/control.c", "source/uart.c"  ]
     }
   ]
 }
\ No newline at end of file
@@ -12,6 +12,68 @@ extern "C" {
 
 typedef struct usbthing_s * usbthing_t;
 
+typedef struct usbthing_xfer_s * usbthing_xfer_t;
+
+typedef struct usbthing_batch_s * usbthing_batch_t;
+
+/**
+ * Device event, timestamped on the device in ticks of USBTHING_TIMEBASE_HZ
+ * Sources and values are defined by usbthing_event_source_e in protocol.h
+ */
+struct usbthing_event_s {
+  int source;
+  int id;
+  int value;
+  uint32_t sequence;
+  uint64_t timestamp;
+};
+
+/**
+ * Event callback, called from the library event thread. Callbacks must not block.
+ */
+typedef void (*usbthing_event_cb_t)(const struct usbthing_event_s *event, void *context);
+
+/**
+ * Block of streamed ADC samples. Samples are raw 12 bit conversions (value / 4096 * reference),
+ * interleaved one per enabled channel per scan in ascending channel order.
+ */
+struct usbthing_adc_block_s {
+  int channels;                 //Channel mask, bit n set for USBTHING_ADC_CHn
+  int count;                    //Channels per scan
+  int samples;                  //Total samples in the block
+  uint32_t sequence;
+  uint64_t timestamp;           //Device time of the last scan, USBTHING_TIMEBASE_HZ ticks
+  const uint16_t *data;
+};
+
+/**
+ * ADC block callback, called from the library event thread. Callbacks must not block.
+ */
+typedef void (*usbthing_adc_block_cb_t)(const struct usbthing_adc_block_s *block, void *context);
+
+/**
+ * UART high-water callback, called from the library event thread with the number of received bytes
+ * buffered on the host. Callbacks must not block.
+ */
+typedef void (*usbthing_uart_cb_t)(int available, void *context);
+
+/**
+ * I2C message, flags are USBTHING_I2C_MSG_FLAG_x from protocol.h
+ */
+struct usbthing_i2c_message_s {
+  int address;
+  int flags;
+  int length;
+  unsigned char *data;
+};
+
+/**
+ * Asynchronous completion callback
+ * Called from the library event thread when an operation completes, result is zero on success
+ * or a negative usbthing error code. Callbacks must not block.
+ */
+typedef void (*usbthing_xfer_cb_t)(usbthing_xfer_t xfer, int result, void *context);
+
 int USBTHING_init();
 void USBTHING_close();
 
@@ -27,34 +89,263 @@ int USBTHING_led_set(usbthing_t usbthing, int led, int value);
 
 int USBTHING_gpio_configure(usbthing_t usbthing, int pin, int output, int pull_enabled, int pull_up);
 
+/**
+ * Configure a pin as an input generating edge events, edge is a usbthing_gpio_int_e value.
+ * Events are delivered via the event API or USBTHING_gpio_get_int.
+ * Refused while another capture (eg. an armed scope trigger) owns the pin's edges.
+ */
+int USBTHING_gpio_configure_int(usbthing_t usbthing, int pin, int pull_enabled, int pull_up, int edge);
+
 int USBTHING_gpio_set(usbthing_t usbthing, int pin, int value);
 
 int USBTHING_gpio_get(usbthing_t usbthing, int pin, int *value);
 
+/**
+ * Set, clear and toggle multiple pins in a single transfer, bit n of each mask selects GPIO n.
+ * Masks are applied in that order, pins on the same port change simultaneously.
+ */
+int USBTHING_gpio_write_mask(usbthing_t usbthing, uint32_t set, uint32_t clear, uint32_t toggle);
+
+/**
+ * Read the levels of all pins in a single transfer, bit n is the level of GPIO n.
+ */
+int USBTHING_gpio_read_mask(usbthing_t usbthing, uint32_t *levels);
+
+/**
+ * Fetch the next queued edge event for a pin configured with interrupts enabled.
+ * Returns 1 and the level after the edge if an event was pending, 0 if not.
+ * Starts the event stream (in queue mode) if it is not already running.
+ */
 int USBTHING_gpio_get_int(usbthing_t usbthing, int pin, int *value);
 
+/**
+ * Start the PWM timer at frequency Hz, shared by all USBTHING_PWM_NUM_CHANNELS channels. Channels start
+ * disabled at zero duty, and are disabled again when reconfigured.
+ */
 int USBTHING_pwm_configure(usbthing_t usbthing, unsigned int frequency);
 
+/**
+ * Connect a channel to its pin, disabled channels are driven low.
+ */
 int USBTHING_pwm_enable(usbthing_t usbthing, int channel, int enable);
 
-int USBTHING_pwm_set(usbthing_t usbthing, int channel, int duty_cycle);
+/**
+ * Set the duty cycle of a channel (0.0 to 1.0), taking effect at the start of the next period.
+ */
+int USBTHING_pwm_set(usbthing_t usbthing, int channel, float duty_cycle);
+
+/**
+ * Set the duty cycles of all channels in one request, duty_cycles holds USBTHING_PWM_NUM_CHANNELS values.
+ * All channels change at the start of the same period.
+ */
+int USBTHING_pwm_update(usbthing_t usbthing, const float *duty_cycles);
+
+/**
+ * Measure the signal on a channel pin, averaged over num_waves periods from its first rising edge. The
+ * channel stops driving its pin and outputs are disabled until USBTHING_pwm_configure is called again.
+ * Inputs up to USBTHING_PWM_CAPTURE_MAX_FREQUENCY are supported. Results are read with
+ * USBTHING_pwm_capture_status.
+ */
+int USBTHING_pwm_capture(usbthing_t usbthing, int channel, int num_waves, unsigned int timeout_ms);
+
+/**
+ * Capture state (usbthing_pwm_capture_state_e), frequency in Hz, duty cycle (0.0 to 1.0) and the number
+ * of whole periods measured. On timeout the results cover the periods seen, with none the frequency is
+ * zero and the duty cycle is the pin level. If an edge was lost the capture stops with no periods measured.
+ */
+int USBTHING_pwm_capture_status(usbthing_t usbthing, int *state, float *frequency, float *duty_cycle, int *waves);
 
 int USBTHING_dac_configure(usbthing_t usbthing);
 
 int USBTHING_dac_set(usbthing_t usbthing, unsigned int enable, float value);
 
+/**
+ * Output a stream of raw 12 bit DAC codes at rate samples per second (up to USBTHING_DAC_STREAM_MAX_RATE),
+ * evenly spaced by a device timer. Output starts once the device has two blocks buffered or the stream is
+ * flushed, and the last value is held whenever the device runs out of samples.
+ * Runs alongside ADC streaming and captures, direct DAC writes are refused while streaming.
+ */
+int USBTHING_dac_stream_start(usbthing_t usbthing, unsigned int rate);
+
+/**
+ * Queue up to count samples for output, waiting up to timeout_ms (zero waits forever) for buffer space.
+ * Samples are sent in blocks as the device makes room. Returns the number of samples queued.
+ */
+int USBTHING_dac_stream_write(usbthing_t usbthing, const uint16_t *samples, int count, int timeout_ms);
+
+/**
+ * Send queued samples that do not fill a whole block, eg. at the end of a waveform.
+ */
+int USBTHING_dac_stream_flush(usbthing_t usbthing);
+
+/**
+ * Samples queued (on the host and device) but not yet output, samples output, and the number of times
+ * output ran out of samples, including at the end of the stream. Returns the usbthing_dac_stream_state_e.
+ */
+int USBTHING_dac_stream_status(usbthing_t usbthing, int *queued, unsigned int *played, unsigned int *underruns);
+
+int USBTHING_dac_stream_stop(usbthing_t usbthing);
+
+/**
+ * Load one period of an arbitrary waveform for USBTHING_DAC_SHAPE_ARBITRARY, count values scaled to +/-32767
+ * (USBTHING_DAC_GEN_MIN_SAMPLES to USBTHING_DAC_GEN_MAX_SAMPLES). Not available while streaming.
+ */
+int USBTHING_dac_gen_load(usbthing_t usbthing, const int16_t *shape, int count);
+
+/**
+ * Start the device function generator (usbthing_dac_shape_e), or change the running waveform at the end of
+ * the current period. Frequency is in Hz, amplitude (peak) and offset are in volts.
+ * Output loops on the device with no further USB traffic, direct DAC writes and streaming are refused while
+ * it runs.
+ */
+int USBTHING_dac_gen_set(usbthing_t usbthing, int shape, float frequency, float amplitude, float offset);
+
+/**
+ * Stop the function generator, holding the last value output.
+ */
+int USBTHING_dac_gen_stop(usbthing_t usbthing);
+
 int USBTHING_adc_configure(usbthing_t usbthing, unsigned int reference);
 
 int USBTHING_adc_get(usbthing_t usbthing, int channel, float *value);
 
+/**
+ * Average 1 << shift conversions (up to USBTHING_ADC_OVERSAMPLE_MAX) in hardware for each single read,
+ * including batch and asynchronous reads. Resolution rises to 16 bits at shift 4, shift 5 further reduces
+ * noise. Each conversion takes around 6us and reads are answered from the USB interrupt, so the ratio is
+ * limited to keep the other peripherals serviced. Zero disables oversampling. Applies to the next read.
+ */
+int USBTHING_adc_oversample(usbthing_t usbthing, int shift);
+
+/**
+ * Continuously sample a set of channels (mask of 1 << USBTHING_ADC_CHn) at rate scans per second.
+ * Blocks are passed to the callback if provided, otherwise buffered for USBTHING_adc_stream_read.
+ * The sample rate summed over channels is limited to USBTHING_ADC_STREAM_MAX_RATE, or
+ * USBTHING_ADC_STREAM_MAX_RATE_DELTA with USBTHING_ADC_ENCODING_DELTA, which compresses blocks on the
+ * device to around half their size. Encoded blocks are decoded by the library, callbacks and reads see
+ * the same samples for either encoding.
+ * At rate zero a scan is taken on each pulse of the USBTHING_TRIGGER_SINK_ADC route, and each scan is
+ * sent as its own block timestamped as it completes.
+ */
+int USBTHING_adc_stream_start(usbthing_t usbthing, int channels, unsigned int rate, int encoding,
+                              usbthing_adc_block_cb_t callback, void *context);
+
+/**
+ * Read up to count buffered samples, waiting up to timeout_ms (zero waits forever) for the first.
+ * Returns the number of samples read, always a whole number of scans.
+ */
+int USBTHING_adc_stream_read(usbthing_t usbthing, uint16_t *samples, int count, int timeout_ms);
+
+/**
+ * Blocks received and blocks lost (dropped on the device or overflowing the host buffer) since start.
+ */
+int USBTHING_adc_stream_stats(usbthing_t usbthing, unsigned int *blocks, unsigned int *lost);
+
+int USBTHING_adc_stream_stop(usbthing_t usbthing);
+
+/**
+ * Burst capture of one channel at up to USBTHING_ADC_SCOPE_MAX_RATE samples per second into device memory.
+ * The capture holds pre_samples before and post_samples after the trigger (usbthing_scope_trigger_e).
+ * Level triggers compare raw 12 bit samples against level, GPIO triggers use an edge on pin.
+ */
+int USBTHING_adc_scope_configure(usbthing_t usbthing, int channel, unsigned int rate,
+                                 int pre_samples, int post_samples, int trigger, int pin, int level);
+
+/**
+ * Start capturing, the trigger is armed once the pre-trigger samples have been captured.
+ */
+int USBTHING_adc_scope_arm(usbthing_t usbthing);
+
+/**
+ * Trigger the capture now, or as soon as it is armed.
+ */
+int USBTHING_adc_scope_trigger(usbthing_t usbthing);
+
+/**
+ * Capture state (usbthing_scope_state_e), and the number of samples available once done.
+ */
+int USBTHING_adc_scope_status(usbthing_t usbthing, int *state, int *samples);
+
+/**
+ * Read a completed capture, samples must hold pre_samples + post_samples values.
+ * The trigger point is at samples[pre_samples]. Returns the number of samples read.
+ */
+int USBTHING_adc_scope_read(usbthing_t usbthing, uint16_t *samples, int count);
+
+/**
+ * Set the window monitored on a channel, low and high are raw 12 bit samples. Samples leaving the window
+ * generate USBTHING_EVENT_SOURCE_ADC_LOW/HIGH events, returning inside it by at least hysteresis generates
+ * USBTHING_EVENT_SOURCE_ADC_INSIDE. Events are delivered via the event API.
+ */
+int USBTHING_adc_monitor_configure(usbthing_t usbthing, int channel, int enable, int low, int high, int hysteresis);
+
+/**
+ * Sample enabled channels at rate scans per second (up to USBTHING_ADC_MONITOR_MAX_RATE).
+ * Shares the sample clock with streaming and the scope, only one may run at a time.
+ */
+int USBTHING_adc_monitor_start(usbthing_t usbthing, unsigned int rate);
+
+int USBTHING_adc_monitor_stop(usbthing_t usbthing);
+
+/**
+ * Capture all GPIO pins at up to USBTHING_LOGIC_MAX_RATE samples per second into device memory, holding
+ * pre_samples before and post_samples after the trigger (usbthing_logic_trigger_e). Pattern triggers fire
+ * when the pins in mask change to match value, edge triggers use pin. Captures are run length encoded
+ * for upload with USBTHING_LOGIC_ENCODING_RLE. Shares the sample clock with ADC streaming and the scope.
+ */
+int USBTHING_logic_configure(usbthing_t usbthing, unsigned int rate, int pre_samples, int post_samples,
+                             int trigger, int pin, int mask, int value, int encoding);
+
+/**
+ * Start capturing, the trigger is armed once the pre-trigger samples have been captured.
+ */
+int USBTHING_logic_arm(usbthing_t usbthing);
+
+/**
+ * Trigger the capture now, or as soon as it is armed.
+ */
+int USBTHING_logic_trigger(usbthing_t usbthing);
+
+/**
+ * Capture state (usbthing_scope_state_e), and the number of samples available once done.
+ */
+int USBTHING_logic_status(usbthing_t usbthing, int *state, int *samples);
+
+/**
+ * Read a completed capture, one byte per sample with bit n holding GPIOn. The trigger point is at
+ * samples[pre_samples]. Returns the number of samples read.
+ */
+int USBTHING_logic_read(usbthing_t usbthing, uint8_t *samples, int count);
+
+/**
+ * Write a capture to a Value Change Dump file, readable by sigrok/PulseView and GTKWave.
+ */
+int USBTHING_logic_write_vcd(const char *path, const uint8_t *samples, int count, unsigned int rate);
+
 int USBTHING_spi_configure(usbthing_t usbthing, unsigned int speed, int mode);
 
+/**
+ * Full duplex SPI transfer with CS asserted throughout.
+ * Transfers longer than USBTHING_SPI_MAX_SIZE are split into chunks internally, CS is held between chunks.
+ */
 int USBTHING_spi_transfer(usbthing_t usbthing, int length, unsigned char *data_out, unsigned char *data_in);
 
+/**
+ * Stream count back to back SPI transfers of length bytes each through contiguous buffers,
+ * keeping up to depth transfers queued on the device. CS is toggled between transfers.
+ */
+int USBTHING_spi_stream(usbthing_t usbthing, int depth, int count, int length,
+                        unsigned char *data_out, unsigned char *data_in);
+
 int USBTHING_spi_close(usbthing_t usbthing);
 
 int USBTHING_i2c_configure(usbthing_t usbthing, int mode);
 
+/**
+ * I2C transfers of up to USBTHING_I2C_MAX_SIZE bytes each way, a write-read joins the two with a repeated start.
+ * Returns USBTHING_ERROR_PERIPHERAL_FAILED if the address or data is not acknowledged or the bus is lost, and
+ * USBTHING_ERROR_PERIPHERAL_TIMEOUT if a device stretches the clock beyond USBTHING_I2C_STRETCH_TIMEOUT_MS.
+ */
 int USBTHING_i2c_write(usbthing_t usbthing,
                        int address,
                        int length_out, unsigned char *data_out);
@@ -68,6 +359,314 @@ int USBTHING_i2c_write_read(usbthing_t usbthing,
                             int length_out, unsigned char *data_out,
                             int length_in, unsigned char *data_in);
 
+/**
+ * Run count messages as a single transaction joined by repeated starts, in one USB round trip, as Linux
+ * I2C_RDWR. Up to USBTHING_I2C_MAX_MESSAGES messages of at most USBTHING_I2C_MAX_SIZE bytes, with the write data
+ * and the read data each fitting USBTHING_I2C_BUFFER_SIZE along with their headers. Read messages must take at
+ * least one byte. Results are as the single transfers, the transaction stops at the first failing message.
+ */
+int USBTHING_i2c_transfer(usbthing_t usbthing, int count, struct usbthing_i2c_message_s *messages);
+
+/**
+ * Probe each address from USBTHING_I2C_SCAN_FIRST to USBTHING_I2C_SCAN_LAST with a zero length write on the
+ * device, storing up to length acknowledging addresses. Returns the number found, which may exceed length.
+ */
+int USBTHING_i2c_scan(usbthing_t usbthing, int length, int *addresses);
+
+/*****       Event API       *****/
+
+/**
+ * Events (eg. GPIO edges) are streamed from the device over the interrupt endpoint. If a callback is
+ * provided each event is passed to it, otherwise events are queued for USBTHING_event_get.
+ * Starting the event stream starts the asynchronous engine if required.
+ */
+
+int USBTHING_event_start(usbthing_t usbthing, usbthing_event_cb_t callback, void *context);
+
+int USBTHING_event_stop(usbthing_t usbthing);
+
+/**
+ * Fetch the next queued event, waiting up to timeout_ms (zero waits forever).
+ */
+int USBTHING_event_get(usbthing_t usbthing, struct usbthing_event_s *event, int timeout_ms);
+
+/**
+ * Number of events lost, either dropped on the device or overflowing the host queue.
+ */
+int USBTHING_event_lost(usbthing_t usbthing);
+
+/*****       Batch API       *****/
+
+/**
+ * A batch records a list of operations on the host, then executes them all on the device in a single
+ * USB round trip. Output data is copied when each operation is added, input pointers must remain valid
+ * until USBTHING_batch_execute returns. Execution stops at the first failed operation; results are written
+ * for every operation completed before it. Peripherals must be configured before the batch is executed.
+ */
+
+usbthing_batch_t USBTHING_batch_create();
+
+void USBTHING_batch_destroy(usbthing_batch_t batch);
+
+void USBTHING_batch_clear(usbthing_batch_t batch);
+
+int USBTHING_batch_gpio_set(usbthing_batch_t batch, int pin, int value);
+
+int USBTHING_batch_gpio_get(usbthing_batch_t batch, int pin, int *value);
+
+int USBTHING_batch_gpio_write_mask(usbthing_batch_t batch, uint32_t set, uint32_t clear, uint32_t toggle);
+
+int USBTHING_batch_gpio_read_mask(usbthing_batch_t batch, uint32_t *levels);
+
+int USBTHING_batch_spi_transfer(usbthing_batch_t batch, int length, unsigned char *data_out, unsigned char *data_in);
+
+int USBTHING_batch_i2c_write(usbthing_batch_t batch, int address, int length_out, unsigned char *data_out);
+
+int USBTHING_batch_i2c_read(usbthing_batch_t batch, int address, int length_in, unsigned char *data_in);
+
+int USBTHING_batch_i2c_write_read(usbthing_batch_t batch, int address,
+                                  int length_out, unsigned char *data_out,
+                                  int length_in, unsigned char *data_in);
+
+int USBTHING_batch_delay_us(usbthing_batch_t batch, unsigned int delay_us);
+
+int USBTHING_batch_adc_get(usbthing_batch_t batch, int channel, float *value);
+
+int USBTHING_batch_dac_set(usbthing_batch_t batch, int enable, float value);
+
+int USBTHING_batch_execute(usbthing_t usbthing, usbthing_batch_t batch);
+
+/*****       Sequencer API       *****/
+
+/**
+ * Sequencer programs are recorded with the batch API and stored on the device by ID, then run
+ * from a device timer so delays and pin waits have device side timing. Loops and pin waits are
+ * only valid in stored programs, and the results of operations in a program are discarded.
+ */
+
+int USBTHING_batch_loop_start(usbthing_batch_t batch, unsigned int iterations);
+
+int USBTHING_batch_loop_end(usbthing_batch_t batch);
+
+int USBTHING_batch_wait_pin(usbthing_batch_t batch, int pin, int level, unsigned int timeout_us);
+
+int USBTHING_seq_store(usbthing_t usbthing, int program, usbthing_batch_t batch);
+
+int USBTHING_seq_run(usbthing_t usbthing, int program);
+
+int USBTHING_seq_stop(usbthing_t usbthing);
+
+int USBTHING_seq_status(usbthing_t usbthing, int *state, int *result, unsigned int *ops_executed);
+
+/**
+ * Link a source (usbthing_trigger_source_e) to a sink (usbthing_trigger_sink_e) in hardware, replacing any
+ * existing route to the sink. The sink responds within a few clock cycles with no USB round trip.
+ * GPIO sources use pin and edge (usbthing_trigger_edge_e), and the pin must be configured as an input.
+ * The ADC sink paces an ADC stream started at rate zero. The DAC sink holds each direct DAC write until
+ * the next trigger.
+ */
+int USBTHING_trigger_route(usbthing_t usbthing, int sink, int source, int pin, int edge);
+
+/**
+ * Remove the route to a sink, DAC writes take effect immediately again.
+ */
+int USBTHING_trigger_clear(usbthing_t usbthing, int sink);
+
+/**
+ * Count edges in hardware on GPIO pin_a, pins must be configured as inputs. In quadrature mode pin_b is the
+ * encoder's second channel and the count follows the direction. In single mode rising (or falling) edges
+ * on pin_a are counted, down while pin_b is high, or always up if pin_b is negative. Counting restarts
+ * from zero. A non-zero report_ms sends a USBTHING_EVENT_SOURCE_COUNTER event holding the change in count
+ * every report_ms milliseconds, limited to +/-32767.
+ */
+int USBTHING_counter_configure(usbthing_t usbthing, int mode, int pin_a, int pin_b, int falling,
+                               unsigned int report_ms);
+
+/**
+ * Read the 32 bit count and the device time it was read (timestamp may be NULL). Latching restarts the
+ * count from zero in the same request, so no edges are lost between reads.
+ */
+int USBTHING_counter_read(usbthing_t usbthing, int latch, int32_t *count, uint64_t *timestamp);
+
+/**
+ * Stop counting, the final count remains readable.
+ */
+int USBTHING_counter_stop(usbthing_t usbthing);
+
+/**
+ * Drive a step/direction stepper driver from GPIO step_pin and dir_pin, which become outputs. The direction
+ * pin is high for moves towards larger positions, or low if invert is set. A non-zero report_ms sends a
+ * USBTHING_EVENT_SOURCE_MOTION position event every report_ms milliseconds while moving. Refused while moving.
+ */
+int USBTHING_motion_configure(usbthing_t usbthing, int step_pin, int dir_pin, int invert, unsigned int report_ms);
+
+/**
+ * Move to an absolute target position (in steps), accelerating at acceleration steps/s^2 up to speed steps/s
+ * and decelerating to stop on the target. Steps are timed on the device, up to USBTHING_MOTION_MAX_SPEED.
+ * The move borrows the PWM timer, stopping any PWM output or capture. PWM outputs are refused until
+ * USBTHING_pwm_configure is called again. A USBTHING_MOTION_EVENT_DONE event is sent when the target is
+ * reached. Refused while moving.
+ */
+int USBTHING_motion_move(usbthing_t usbthing, int32_t target, unsigned int speed, unsigned int acceleration);
+
+/**
+ * Stop the current move, decelerating as it accelerated, or at once if halt is set.
+ * A USBTHING_MOTION_EVENT_STOPPED event is sent once stopped short of the target.
+ */
+int USBTHING_motion_stop(usbthing_t usbthing, int halt);
+
+/**
+ * Read whether a move is running, the current position, the target (may be NULL) and the current step rate
+ * in steps per second (may be NULL).
+ */
+int USBTHING_motion_status(usbthing_t usbthing, int *moving, int32_t *position, int32_t *target,
+                           unsigned int *speed);
+
+/**
+ * Redefine the current position, for example zero after homing. Refused while moving.
+ */
+int USBTHING_motion_set_position(usbthing_t usbthing, int32_t position);
+
+/**
+ * Open the UART bridge at baud (USBTHING_UART_MIN_BAUD to USBTHING_UART_MAX_BAUD) with data_bits of 7 or 8,
+ * parity (usbthing_uart_parity_e) and stop_bits of 1 or 2. Received bytes are collected by DMA on the device
+ * and streamed to a host buffer (64KiB) as they arrive, the oldest bytes are dropped if it overflows. Calling again while open changes the framing, dropping
+ * anything queued on the device. The UART pins are ADC channels CH2 and CH3 (USBTHING_UART_ADC_CHANNELS), so it
+ * cannot be opened while the ADC samples either channel, and those channels cannot be read while it is open.
+ */
+int USBTHING_uart_configure(usbthing_t usbthing, unsigned int baud, int data_bits, int parity, int stop_bits);
+
+/**
+ * Read up to size received bytes without waiting. Returns the number of bytes read, which may be zero.
+ */
+int USBTHING_uart_read(usbthing_t usbthing, uint8_t *data, int size);
+
+/**
+ * Queue up to length bytes for transmission without waiting. Returns the number of bytes queued, which is
+ * less than length once the host buffer (64KiB) is full.
+ */
+int USBTHING_uart_write(usbthing_t usbthing, const uint8_t *data, int length);
+
+/**
+ * Call callback once the host buffer holds high_water or more received bytes. The callback is made again
+ * after reads have taken the buffer back below high_water. A NULL callback disables notification.
+ */
+int USBTHING_uart_notify(usbthing_t usbthing, int high_water, usbthing_uart_cb_t callback, void *context);
+
+/**
+ * Received bytes waiting to be read and bytes waiting to be transmitted (on the host and device), received
+ * bytes lost to full buffers and framing or parity errors since configured. Pointers may be NULL.
+ */
+int USBTHING_uart_status(usbthing_t usbthing, int *rx_available, int *tx_queued, unsigned int *lost,
+                         unsigned int *errors);
+
+/**
+ * Close the bridge, dropping anything not yet transmitted or read.
+ */
+int USBTHING_uart_close(usbthing_t usbthing);
+
+/**
+ * Configure the device control loop, reading ADC input (usbthing_adc_channel_e) rate times per second and
+ * driving the DAC to hold the input at the setpoint. Gains are in volts of output per volt of error
+ * (kp), per volt second (ki) and per volt per second (kd). The output and the integral are held within
+ * output_min and output_max volts. Every telemetry iterations a USBTHING_EVENT_SOURCE_CONTROL event pair is
+ * sent, the input as a 16 bit result and the output as a DAC code, zero disables telemetry.
+ * May be called while running to retune the loop. The ADC must be configured first. Each iteration waits
+ * on a single ADC read, so rates where that read (see USBTHING_adc_oversample) would take more than half
+ * of the loop period are refused.
+ */
+int USBTHING_control_configure(usbthing_t usbthing, int input, unsigned int rate, float kp, float ki, float kd,
+                               float output_min, float output_max, int telemetry);
+
+/**
+ * Configure the control loop as USBTHING_control_configure, driving the duty cycle of a PWM channel in place
+ * of the DAC. Gains are in duty cycle (0.0 to 1.0) per volt of error, per volt second and per volt per
+ * second, and the output and integral are held within duty_min and duty_max. Telemetry outputs are
+ * fractions of USBTHING_PWM_DUTY_FULL. PWM must be configured as an output first, and PWM commands and
+ * motion moves are refused while the loop runs. The output cannot be changed while running.
+ */
+int USBTHING_control_configure_pwm(usbthing_t usbthing, int input, unsigned int rate, int channel, float kp,
+                                   float ki, float kd, float duty_min, float duty_max, int telemetry);
+
+/**
+ * Set the control loop setpoint in volts. A non-zero ramp moves the working setpoint at ramp volts
+ * per second while the loop runs.
+ */
+int USBTHING_control_setpoint(usbthing_t usbthing, float setpoint, float ramp);
+
+/**
+ * Start the control loop. Direct ADC reads, and for a DAC output DAC writes, DAC streams or the function
+ * generator, are refused until it is stopped. A PWM output channel is enabled. Fails if oversampling has since been raised beyond what the loop
+ * rate allows.
+ */
+int USBTHING_control_start(usbthing_t usbthing);
+
+/**
+ * Stop the control loop, the DAC or PWM channel holds its last output.
+ */
+int USBTHING_control_stop(usbthing_t usbthing);
+
+/**
+ * Control loop state (usbthing_control_state_e), whether the last output was limited, the working
+ * setpoint, last input in volts, output in volts for the DAC or duty cycle (0.0 to 1.0) for PWM, and
+ * iterations since it was started.
+ */
+int USBTHING_control_status(usbthing_t usbthing, int *state, int *saturated, float *setpoint, float *input,
+                            float *output, unsigned int *iterations);
+
+/*****       Asynchronous API       *****/
+
+/**
+ * Asynchronous operations are queued on the device and completed by a dedicated event thread.
+ * Operations are ordered per peripheral, and data pointers must remain valid until completion.
+ * If an xfer handle is requested the caller owns it and must call USBTHING_async_release,
+ * otherwise the operation is released automatically after the callback is called.
+ */
+
+int USBTHING_async_start(usbthing_t usbthing);
+
+int USBTHING_async_stop(usbthing_t usbthing);
+
+int USBTHING_async_gpio_set(usbthing_t usbthing, int pin, int value,
+                            usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *xfer);
+
+int USBTHING_async_gpio_get(usbthing_t usbthing, int pin, int *value,
+                            usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *xfer);
+
+int USBTHING_async_adc_get(usbthing_t usbthing, int channel, float *value,
+                           usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *xfer);
+
+int USBTHING_async_spi_transfer(usbthing_t usbthing, int length, unsigned char *data_out, unsigned char *data_in,
+                                usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *xfer);
+
+/**
+ * Asynchronous I2C transfers, completing with the same results as the blocking calls.
+ * Writes are limited to the 72 byte operation buffer less the transfer header, reads to USBTHING_I2C_MAX_SIZE.
+ */
+int USBTHING_async_i2c_write(usbthing_t usbthing,
+                             int address,
+                             int length_out, unsigned char *data_out,
+                             usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *xfer);
+
+int USBTHING_async_i2c_read(usbthing_t usbthing,
+                            int address,
+                            int length_in, unsigned char *data_in,
+                            usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *xfer);
+
+int USBTHING_async_i2c_write_read(usbthing_t usbthing,
+                                  int address,
+                                  int length_out, unsigned char *data_out,
+                                  int length_in, unsigned char *data_in,
+                                  usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *xfer);
+
+int USBTHING_async_poll(usbthing_xfer_t xfer);
+
+int USBTHING_async_wait(usbthing_xfer_t xfer, int timeout_ms);
+
+int USBTHING_async_cancel(usbthing_xfer_t xfer);
+
+void USBTHING_async_release(usbthing_xfer_t xfer);
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,6 +4,13 @@ include(${CMAKE_CURRENT_LIST_DIR}/../common/common.cmake)
 #Add usbthing driver sources
 set(USBTHING_SOURCES 
 	${CMAKE_CURRENT_LIST_DIR}/source/usbthing.c
+	${CMAKE_CURRENT_LIST_DIR}/source/async.c
+	${CMAKE_CURRENT_LIST_DIR}/source/batch.c
+	${CMAKE_CURRENT_LIST_DIR}/source/event.c
+	${CMAKE_CURRENT_LIST_DIR}/source/stream.c
+	${CMAKE_CURRENT_LIST_DIR}/source/logic.c
+	${CMAKE_CURRENT_LIST_DIR}/source/control.c
+	${CMAKE_CURRENT_LIST_DIR}/source/uart.c
 	)
 
 #Add required inclusions
@@ -13,4 +20,4 @@ include_directories(${CMAKE_CURRENT_LIST_DIR}/include)
 add_library(usbthing-driver ${USBTHING_SOURCES})
 
 #Add to convenience variable
-set(LIBS ${LIBS} usbthing-driver usb-1.0)
\ No newline at end of file
+set(LIBS ${LIBS} usbthing-driver usb-1.0 pthread)
\ No newline at end of file
@@ -0,0 +1,621 @@
+/**
+ * @brief USB Thing asynchronous transfer engine
+ * @details Operations are built from preallocated libusb transfers and completed by a
+ * dedicated per device event thread, allowing many operations to be in flight at once.
+ *
+ * see: http://libusb.sourceforge.net/api-1.0/group__asyncio.html
+ */
+
+#include "usbthing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "libusb-1.0/libusb.h"
+
+#include "protocol.h"
+#include "usbthing_internal.h"
+
+static void *event_thread(void *arg);
+static void async_free(struct usbthing_async_s *async);
+static struct usbthing_xfer_s *xfer_acquire(usbthing_t usbthing, usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *handle);
+static void xfer_abort(struct usbthing_xfer_s *xfer);
+static void xfer_add_control(struct usbthing_xfer_s *xfer, uint8_t request_type, uint8_t request,
+                             uint16_t value, uint16_t index, uint16_t size, const uint8_t *data);
+static void xfer_add_bulk(struct usbthing_xfer_s *xfer, uint8_t endpoint, int length, uint8_t *data);
+static int xfer_submit(struct usbthing_xfer_s *xfer, usbthing_xfer_t *handle);
+static void LIBUSB_CALL xfer_part_cb(struct libusb_transfer *transfer);
+
+int USBTHING_async_start(usbthing_t usbthing)
+{
+  struct usbthing_async_s *async;
+  int res;
+
+  //Already running
+  if (usbthing->async != NULL) {
+    return 0;
+  }
+
+  async = calloc(1, sizeof(struct usbthing_async_s));
+  if (async == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_init(&async->lock, NULL);
+  pthread_cond_init(&async->cond, NULL);
+
+  //Preallocate transfers so no allocation occurs on the submission path
+  for (int i = 0; i < USBTHING_ASYNC_POOL_SIZE; i++) {
+    async->xfers[i].usbthing = usbthing;
+    for (int j = 0; j < USBTHING_ASYNC_MAX_PARTS; j++) {
+      async->xfers[i].parts[j] = libusb_alloc_transfer(0);
+      if (async->xfers[i].parts[j] == NULL) {
+        async_free(async);
+        return -2;
+      }
+    }
+  }
+
+  //Start event thread
+  async->running = 1;
+  res = pthread_create(&async->thread, NULL, event_thread, async);
+  if (res != 0) {
+    async_free(async);
+    return -3;
+  }
+
+  usbthing->async = async;
+
+  USBTHING_DEBUG_PRINT("Async engine started\r\n");
+
+  return 0;
+}
+
+int USBTHING_async_stop(usbthing_t usbthing)
+{
+  struct usbthing_async_s *async = usbthing->async;
+
+  if (async == NULL) {
+    return -1;
+  }
+
+  //Streams depend on the event thread
+  if (usbthing->adc_stream != NULL) {
+    USBTHING_adc_stream_stop(usbthing);
+  }
+  if (usbthing->events != NULL) {
+    USBTHING_event_stop(usbthing);
+  }
+
+  //Cancel outstanding operations and wait for them to be returned
+  pthread_mutex_lock(&async->lock);
+  for (int i = 0; i < USBTHING_ASYNC_POOL_SIZE; i++) {
+    if ((async->xfers[i].in_use != 0) && (async->xfers[i].complete == 0)) {
+      xfer_abort(&async->xfers[i]);
+    }
+  }
+  while (async->in_flight > 0) {
+    pthread_cond_wait(&async->cond, &async->lock);
+  }
+  pthread_mutex_unlock(&async->lock);
+
+  //Stop event thread
+  async->running = 0;
+  pthread_join(async->thread, NULL);
+
+  usbthing->async = NULL;
+  async_free(async);
+
+  USBTHING_DEBUG_PRINT("Async engine stopped\r\n");
+
+  return 0;
+}
+
+int USBTHING_async_poll(usbthing_xfer_t xfer)
+{
+  struct usbthing_async_s *async = xfer->usbthing->async;
+  int complete;
+
+  pthread_mutex_lock(&async->lock);
+  complete = (xfer->complete != 0) ? 1 : 0;
+  pthread_mutex_unlock(&async->lock);
+
+  return complete;
+}
+
+int USBTHING_async_wait(usbthing_xfer_t xfer, int timeout_ms)
+{
+  struct usbthing_async_s *async = xfer->usbthing->async;
+  struct timespec deadline;
+  int res = 0;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec += 1;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&async->lock);
+  while ((xfer->complete == 0) && (res != ETIMEDOUT)) {
+    if (timeout_ms == 0) {
+      pthread_cond_wait(&async->cond, &async->lock);
+    } else {
+      res = pthread_cond_timedwait(&async->cond, &async->lock, &deadline);
+    }
+  }
+  res = (xfer->complete != 0) ? xfer->result : USBTHING_ERROR_USB_TIMEOUT;
+  pthread_mutex_unlock(&async->lock);
+
+  return res;
+}
+
+int USBTHING_async_cancel(usbthing_xfer_t xfer)
+{
+  struct usbthing_async_s *async = xfer->usbthing->async;
+
+  pthread_mutex_lock(&async->lock);
+  if (xfer->complete == 0) {
+    xfer_abort(xfer);
+  }
+  pthread_mutex_unlock(&async->lock);
+
+  return 0;
+}
+
+void USBTHING_async_release(usbthing_xfer_t xfer)
+{
+  struct usbthing_async_s *async = xfer->usbthing->async;
+
+  pthread_mutex_lock(&async->lock);
+  if (xfer->complete != 0) {
+    xfer->in_use = 0;
+    pthread_cond_broadcast(&async->cond);
+  } else {
+    //Released by the event thread on completion
+    xfer->owned = 0;
+  }
+  pthread_mutex_unlock(&async->lock);
+}
+
+/*****       Operations       *****/
+
+int USBTHING_async_gpio_set(usbthing_t usbthing, int pin, int value,
+                            usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *handle)
+{
+  struct usbthing_xfer_s *xfer;
+  struct usbthing_ctrl_s cmd;
+
+  xfer = xfer_acquire(usbthing, callback, context, handle);
+  if (xfer == NULL) {
+    return USBTHING_ERROR_BUSY;
+  }
+
+  cmd.gpio_cmd.set.pin = pin;
+  cmd.gpio_cmd.set.level = value;
+
+  xfer_add_control(xfer, CONTROL_REQUEST_TYPE_OUT,
+                   USBTHING_MODULE_GPIO, USBTHING_GPIO_CMD_SET, 0,
+                   USBTHING_CMD_GPIO_SET_SIZE, cmd.data);
+
+  return xfer_submit(xfer, handle);
+}
+
+static void gpio_get_finish(struct usbthing_xfer_s *xfer)
+{
+  struct usbthing_ctrl_s *cmd = (struct usbthing_ctrl_s *)libusb_control_transfer_get_data(xfer->parts[0]);
+
+  *((int *)xfer->finish_data) = (cmd->gpio_cmd.get.level == 0) ? 0 : 1;
+}
+
+int USBTHING_async_gpio_get(usbthing_t usbthing, int pin, int *value,
+                            usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *handle)
+{
+  struct usbthing_xfer_s *xfer;
+
+  xfer = xfer_acquire(usbthing, callback, context, handle);
+  if (xfer == NULL) {
+    return USBTHING_ERROR_BUSY;
+  }
+
+  xfer->finish = gpio_get_finish;
+  xfer->finish_data = value;
+
+  xfer_add_control(xfer, CONTROL_REQUEST_TYPE_IN,
+                   USBTHING_MODULE_GPIO, USBTHING_GPIO_CMD_GET, pin,
+                   USBTHING_CMD_GPIO_GET_SIZE, NULL);
+
+  return xfer_submit(xfer, handle);
+}
+
+static void adc_get_finish(struct usbthing_xfer_s *xfer)
+{
+  struct usbthing_ctrl_s *ctrl = (struct usbthing_ctrl_s *)libusb_control_transfer_get_data(xfer->parts[0]);
+
+  *((float *)xfer->finish_data) = (float)ctrl->adc_cmd.get.value / USBTHING_ADC_FULL_SCALE * 3.3;
+}
+
+int USBTHING_async_adc_get(usbthing_t usbthing, int channel, float *value,
+                           usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *handle)
+{
+  struct usbthing_xfer_s *xfer;
+
+  xfer = xfer_acquire(usbthing, callback, context, handle);
+  if (xfer == NULL) {
+    return USBTHING_ERROR_BUSY;
+  }
+
+  xfer->finish = adc_get_finish;
+  xfer->finish_data = value;
+
+  xfer_add_control(xfer, CONTROL_REQUEST_TYPE_IN,
+                   USBTHING_MODULE_ADC, USBTHING_ADC_CMD_GET, channel,
+                   USBTHING_CMD_ADC_GET_SIZE, NULL);
+
+  return xfer_submit(xfer, handle);
+}
+
+int USBTHING_async_spi_transfer(usbthing_t usbthing, int length, unsigned char *data_out, unsigned char *data_in,
+                                usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *handle)
+{
+  struct usbthing_xfer_s *xfer;
+
+  xfer = xfer_acquire(usbthing, callback, context, handle);
+  if (xfer == NULL) {
+    return USBTHING_ERROR_BUSY;
+  }
+
+  //Outgoing data, response is queued at the same time so the bus is never idle
+  xfer_add_bulk(xfer, USBTHING_EP_SPI_OUT, length, data_out);
+
+  //ZLP to signify end of transfer (Required if length is multiple of endpoint size
+  //and does not fill the device buffer)
+  if ((length > 0) && (length % USBTHING_BUFFER_SIZE == 0) && (length < USBTHING_SPI_MAX_SIZE)) {
+    xfer_add_bulk(xfer, USBTHING_EP_SPI_OUT, 0, NULL);
+  }
+
+  xfer_add_bulk(xfer, USBTHING_EP_SPI_IN, length, data_in);
+
+  return xfer_submit(xfer, handle);
+}
+
+//Set the operation result from the response header, and copy out any data read
+static void i2c_finish(struct usbthing_xfer_s *xfer)
+{
+  struct usbthing_i2c_transfer_s *response = (struct usbthing_i2c_transfer_s *)xfer->scratch;
+  struct libusb_transfer *in = xfer->parts[xfer->num_parts - 1];
+
+  if (in->actual_length < (int)sizeof(struct usbthing_i2c_transfer_s)) {
+    xfer->result = USBTHING_ERROR_USB_FAILED;
+    return;
+  }
+
+  if (response->result != USBTHING_ERROR_OK) {
+    xfer->result = response->result;
+    return;
+  }
+
+  if (response->mode == USBTHING_I2C_MODE_WRITE) {
+    return;
+  }
+
+  if (in->actual_length != (int)sizeof(struct usbthing_i2c_transfer_s) + response->num_read) {
+    xfer->result = USBTHING_ERROR_USB_FAILED;
+    return;
+  }
+
+  memcpy(xfer->finish_data, xfer->scratch + sizeof(struct usbthing_i2c_transfer_s), response->num_read);
+}
+
+static int async_i2c(usbthing_t usbthing, int mode, int address,
+                     int length_out, unsigned char *data_out,
+                     int length_in, unsigned char *data_in,
+                     usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *handle)
+{
+  struct usbthing_xfer_s *xfer;
+  struct usbthing_i2c_transfer_s *config;
+  int output_length = sizeof(struct usbthing_i2c_transfer_s) + length_out;
+  int input_length = sizeof(struct usbthing_i2c_transfer_s);
+
+  if ((length_out < 0) || (length_in < 0) || (length_in > USBTHING_I2C_MAX_SIZE)
+      || (output_length > USBTHING_ASYNC_BUFFER_SIZE)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  xfer = xfer_acquire(usbthing, callback, context, handle);
+  if (xfer == NULL) {
+    return USBTHING_ERROR_BUSY;
+  }
+
+  //Build transfer header and data in the operation buffer
+  config = (struct usbthing_i2c_transfer_s *)xfer->buffer;
+  config->mode = mode;
+  config->address = address;
+  config->num_write = length_out;
+  config->num_read = length_in;
+  config->result = 0;
+  if (length_out > 0) {
+    memcpy(xfer->buffer + sizeof(struct usbthing_i2c_transfer_s), data_out, length_out);
+  }
+
+  xfer_add_bulk(xfer, USBTHING_EP_I2C_OUT, output_length, xfer->buffer);
+
+  if (output_length % USBTHING_BUFFER_SIZE == 0) {
+    xfer_add_bulk(xfer, USBTHING_EP_I2C_OUT, 0, NULL);
+  }
+
+  //The response header carries the result, followed by the data read on success
+  if (mode != USBTHING_I2C_MODE_WRITE) {
+    input_length += length_in;
+  }
+
+  xfer->finish = i2c_finish;
+  xfer->finish_data = data_in;
+
+  xfer_add_bulk(xfer, USBTHING_EP_I2C_IN, input_length, xfer->scratch);
+
+  //Failed transfers are answered with the header alone, checked by i2c_finish
+  xfer->parts[xfer->num_parts - 1]->flags = 0;
+
+  return xfer_submit(xfer, handle);
+}
+
+int USBTHING_async_i2c_write(usbthing_t usbthing,
+                             int address,
+                             int length_out, unsigned char *data_out,
+                             usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *handle)
+{
+  return async_i2c(usbthing, USBTHING_I2C_MODE_WRITE, address,
+                   length_out, data_out, 0, NULL,
+                   callback, context, handle);
+}
+
+int USBTHING_async_i2c_read(usbthing_t usbthing,
+                            int address,
+                            int length_in, unsigned char *data_in,
+                            usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *handle)
+{
+  return async_i2c(usbthing, USBTHING_I2C_MODE_READ, address,
+                   0, NULL, length_in, data_in,
+                   callback, context, handle);
+}
+
+int USBTHING_async_i2c_write_read(usbthing_t usbthing,
+                                  int address,
+                                  int length_out, unsigned char *data_out,
+                                  int length_in, unsigned char *data_in,
+                                  usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *handle)
+{
+  return async_i2c(usbthing, USBTHING_I2C_MODE_WRITE_READ, address,
+                   length_out, data_out, length_in, data_in,
+                   callback, context, handle);
+}
+
+int usbthing_async_status(enum libusb_transfer_status status)
+{
+  switch (status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    return USBTHING_ERROR_OK;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    return USBTHING_ERROR_USB_TIMEOUT;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    return USBTHING_ERROR_USB_DISCONNECT;
+  case LIBUSB_TRANSFER_CANCELLED:
+    return USBTHING_ERROR_USB_CANCELLED;
+  default:
+    return USBTHING_ERROR_USB_FAILED;
+  }
+}
+
+/*****       Internal functions       *****/
+
+static void *event_thread(void *arg)
+{
+  struct usbthing_async_s *async = (struct usbthing_async_s *)arg;
+  struct timeval timeout;
+
+  while (async->running != 0) {
+    timeout.tv_sec = 0;
+    timeout.tv_usec = USBTHING_ASYNC_EVENT_TIMEOUT_US;
+    libusb_handle_events_timeout_completed(NULL, &timeout, NULL);
+  }
+
+  return NULL;
+}
+
+static void async_free(struct usbthing_async_s *async)
+{
+  for (int i = 0; i < USBTHING_ASYNC_POOL_SIZE; i++) {
+    for (int j = 0; j < USBTHING_ASYNC_MAX_PARTS; j++) {
+      if (async->xfers[i].parts[j] != NULL) {
+        libusb_free_transfer(async->xfers[i].parts[j]);
+      }
+    }
+  }
+
+  pthread_cond_destroy(&async->cond);
+  pthread_mutex_destroy(&async->lock);
+
+  free(async);
+}
+
+static struct usbthing_xfer_s *xfer_acquire(usbthing_t usbthing, usbthing_xfer_cb_t callback, void *context, usbthing_xfer_t *handle)
+{
+  struct usbthing_async_s *async = usbthing->async;
+  struct usbthing_xfer_s *xfer = NULL;
+
+  if (async == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&async->lock);
+  while (xfer == NULL) {
+    for (int i = 0; i < USBTHING_ASYNC_POOL_SIZE; i++) {
+      if (async->xfers[i].in_use == 0) {
+        xfer = &async->xfers[i];
+        break;
+      }
+    }
+
+    if (xfer == NULL) {
+      //Pool exhausted, operations can not complete if the event thread blocks here
+      if (pthread_equal(pthread_self(), async->thread)) {
+        break;
+      }
+      pthread_cond_wait(&async->cond, &async->lock);
+    }
+  }
+
+  if (xfer != NULL) {
+    xfer->in_use = 1;
+    xfer->complete = 0;
+    xfer->result = USBTHING_ERROR_OK;
+    xfer->pending = 0;
+    xfer->num_parts = 0;
+    xfer->owned = (handle != NULL) ? 1 : 0;
+    xfer->callback = callback;
+    xfer->context = context;
+    xfer->finish = NULL;
+    xfer->finish_data = NULL;
+  }
+  pthread_mutex_unlock(&async->lock);
+
+  return xfer;
+}
+
+//Cancel all parts of an operation, must be called with the lock held
+static void xfer_abort(struct usbthing_xfer_s *xfer)
+{
+  for (int i = 0; i < xfer->num_parts; i++) {
+    //Parts that have already completed return LIBUSB_ERROR_NOT_FOUND
+    libusb_cancel_transfer(xfer->parts[i]);
+  }
+}
+
+static void xfer_add_control(struct usbthing_xfer_s *xfer, uint8_t request_type, uint8_t request,
+                             uint16_t value, uint16_t index, uint16_t size, const uint8_t *data)
+{
+  struct libusb_transfer *transfer = xfer->parts[xfer->num_parts++];
+
+  libusb_fill_control_setup(xfer->buffer, request_type, request, value, index, size);
+
+  if (((request_type & LIBUSB_ENDPOINT_IN) == 0) && (size > 0)) {
+    memcpy(xfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, size);
+  }
+
+  libusb_fill_control_transfer(transfer, xfer->usbthing->handle, xfer->buffer,
+                               xfer_part_cb, xfer, USBTHING_TIMEOUT);
+  transfer->flags = 0;
+}
+
+static void xfer_add_bulk(struct usbthing_xfer_s *xfer, uint8_t endpoint, int length, uint8_t *data)
+{
+  struct libusb_transfer *transfer = xfer->parts[xfer->num_parts++];
+
+  libusb_fill_bulk_transfer(transfer, xfer->usbthing->handle, endpoint, data, length,
+                            xfer_part_cb, xfer, USBTHING_TIMEOUT);
+
+  //Incomplete responses are errors
+  transfer->flags = (endpoint & LIBUSB_ENDPOINT_IN) ? LIBUSB_TRANSFER_SHORT_NOT_OK : 0;
+}
+
+static int xfer_submit(struct usbthing_xfer_s *xfer, usbthing_xfer_t *handle)
+{
+  struct usbthing_async_s *async = xfer->usbthing->async;
+  int requests = 0;
+  int res;
+
+  if (handle != NULL) {
+    *handle = xfer;
+  }
+
+  //Responses are queued ahead of the requests that produce them, so a request that fails to submit
+  //never leaves an unread response on the device for the next operation on the endpoint
+  pthread_mutex_lock(&async->lock);
+  for (int pass = 0; (pass < 2) && (xfer->result == USBTHING_ERROR_OK); pass++) {
+    for (int i = 0; i < xfer->num_parts; i++) {
+      struct libusb_transfer *part = xfer->parts[i];
+      int response = ((part->type == LIBUSB_TRANSFER_TYPE_BULK) && (part->endpoint & LIBUSB_ENDPOINT_IN)) ? 1 : 0;
+
+      if (response != ((pass == 0) ? 1 : 0)) {
+        continue;
+      }
+
+      res = libusb_submit_transfer(part);
+      if (res < 0) {
+        xfer->result = USBTHING_ERROR_USB_FAILED;
+        //Responses are only abandoned if no request reached the device, otherwise they are left
+        //queued to drain whatever it sends, and the error is reported on completion
+        if (requests == 0) {
+          xfer_abort(xfer);
+        }
+        break;
+      }
+
+      xfer->pending ++;
+      requests += (response == 0) ? 1 : 0;
+    }
+  }
+
+  if (xfer->pending == 0) {
+    //Nothing was queued, no callback will be issued
+    xfer->in_use = 0;
+    pthread_cond_broadcast(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+
+    if (handle != NULL) {
+      *handle = NULL;
+    }
+    return USBTHING_ERROR_USB_FAILED;
+  }
+
+  async->in_flight ++;
+  pthread_mutex_unlock(&async->lock);
+
+  return 0;
+}
+
+static void LIBUSB_CALL xfer_part_cb(struct libusb_transfer *transfer)
+{
+  struct usbthing_xfer_s *xfer = (struct usbthing_xfer_s *)transfer->user_data;
+  struct usbthing_async_s *async = xfer->usbthing->async;
+  int done;
+
+  pthread_mutex_lock(&async->lock);
+  if ((transfer->status != LIBUSB_TRANSFER_COMPLETED) && (xfer->result == USBTHING_ERROR_OK)) {
+    xfer->result = usbthing_async_status(transfer->status);
+    //Remaining parts can not succeed once one has failed
+    xfer_abort(xfer);
+  }
+  xfer->pending --;
+  done = (xfer->pending == 0) ? 1 : 0;
+  pthread_mutex_unlock(&async->lock);
+
+  if (done == 0) {
+    return;
+  }
+
+  if ((xfer->result == USBTHING_ERROR_OK) && (xfer->finish != NULL)) {
+    xfer->finish(xfer);
+  }
+
+  if (xfer->callback != NULL) {
+    xfer->callback(xfer, xfer->result, xfer->context);
+  }
+
+  pthread_mutex_lock(&async->lock);
+  xfer->complete = 1;
+  async->in_flight --;
+  if (xfer->owned == 0) {
+    xfer->in_use = 0;
+  }
+  pthread_cond_broadcast(&async->cond);
+  pthread_mutex_unlock(&async->lock);
+}
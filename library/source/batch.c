@@ -0,0 +1,334 @@
+/**
+ * @brief USB Thing batch operations
+ * @details Records lists of operations on the host, executes them on the device in a single
+ * bulk round trip and scatters the packed results back to the caller's buffers
+ */
+
+#include "usbthing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "libusb-1.0/libusb.h"
+
+#include "protocol.h"
+#include "usbthing_internal.h"
+
+//Internal helpers
+static struct usbthing_batch_entry_s *batch_add(usbthing_batch_t batch, uint8_t op, uint8_t arg, uint16_t value,
+                                                int length, const void *payload, int result_length);
+static void batch_scatter(usbthing_batch_t batch, const uint8_t *response, int completed);
+
+usbthing_batch_t USBTHING_batch_create()
+{
+  usbthing_batch_t batch = malloc(sizeof(struct usbthing_batch_s));
+  if (batch == NULL) {
+    return NULL;
+  }
+
+  batch->id = 0;
+  USBTHING_batch_clear(batch);
+
+  return batch;
+}
+
+void USBTHING_batch_destroy(usbthing_batch_t batch)
+{
+  free(batch);
+}
+
+void USBTHING_batch_clear(usbthing_batch_t batch)
+{
+  batch->count = 0;
+  batch->request_length = sizeof(struct usbthing_batch_header_s);
+  batch->response_length = sizeof(struct usbthing_batch_result_s);
+}
+
+int USBTHING_batch_gpio_set(usbthing_batch_t batch, int pin, int value)
+{
+  if (batch_add(batch, USBTHING_BATCH_OP_GPIO_SET, pin, value, 0, NULL, 0) == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int USBTHING_batch_gpio_get(usbthing_batch_t batch, int pin, int *value)
+{
+  struct usbthing_batch_entry_s *entry = batch_add(batch, USBTHING_BATCH_OP_GPIO_GET, pin, 0, 0, NULL, 1);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  entry->gpio_value = value;
+
+  return 0;
+}
+
+int USBTHING_batch_gpio_write_mask(usbthing_batch_t batch, uint32_t set, uint32_t clear, uint32_t toggle)
+{
+  struct gpio_set_mask_s mask;
+
+  mask.set = set;
+  mask.clear = clear;
+  mask.toggle = toggle;
+
+  if (batch_add(batch, USBTHING_BATCH_OP_GPIO_SET_MASK, 0, 0,
+                sizeof(struct gpio_set_mask_s), &mask, 0) == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int USBTHING_batch_gpio_read_mask(usbthing_batch_t batch, uint32_t *levels)
+{
+  struct usbthing_batch_entry_s *entry = batch_add(batch, USBTHING_BATCH_OP_GPIO_GET_MASK, 0, 0, 0, NULL,
+                                                   sizeof(uint32_t));
+  if (entry == NULL) {
+    return -1;
+  }
+
+  entry->data = (unsigned char *)levels;
+
+  return 0;
+}
+
+int USBTHING_batch_spi_transfer(usbthing_batch_t batch, int length, unsigned char *data_out, unsigned char *data_in)
+{
+  struct usbthing_batch_entry_s *entry;
+
+  if ((length < 1) || (length > USBTHING_SPI_MAX_SIZE)) {
+    return -1;
+  }
+
+  entry = batch_add(batch, USBTHING_BATCH_OP_SPI_TRANSFER, 0, 0, length, data_out, length);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  entry->data = data_in;
+
+  return 0;
+}
+
+int USBTHING_batch_i2c_write(usbthing_batch_t batch, int address, int length_out, unsigned char *data_out)
+{
+  if (batch_add(batch, USBTHING_BATCH_OP_I2C_WRITE, address, 0, length_out, data_out, 0) == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int USBTHING_batch_i2c_read(usbthing_batch_t batch, int address, int length_in, unsigned char *data_in)
+{
+  struct usbthing_batch_entry_s *entry = batch_add(batch, USBTHING_BATCH_OP_I2C_READ, address, length_in,
+                                                   0, NULL, length_in);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  entry->data = data_in;
+
+  return 0;
+}
+
+int USBTHING_batch_i2c_write_read(usbthing_batch_t batch, int address,
+                                  int length_out, unsigned char *data_out,
+                                  int length_in, unsigned char *data_in)
+{
+  struct usbthing_batch_entry_s *entry = batch_add(batch, USBTHING_BATCH_OP_I2C_WRITE_READ, address, length_in,
+                                                   length_out, data_out, length_in);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  entry->data = data_in;
+
+  return 0;
+}
+
+int USBTHING_batch_delay_us(usbthing_batch_t batch, unsigned int delay_us)
+{
+  if ((delay_us > UINT16_MAX)
+      || (batch_add(batch, USBTHING_BATCH_OP_DELAY_US, 0, delay_us, 0, NULL, 0) == NULL)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int USBTHING_batch_adc_get(usbthing_batch_t batch, int channel, float *value)
+{
+  struct usbthing_batch_entry_s *entry = batch_add(batch, USBTHING_BATCH_OP_ADC_GET, channel, 0,
+                                                   0, NULL, sizeof(uint32_t));
+  if (entry == NULL) {
+    return -1;
+  }
+
+  entry->adc_value = value;
+
+  return 0;
+}
+
+int USBTHING_batch_dac_set(usbthing_batch_t batch, int enable, float value)
+{
+  if (batch_add(batch, USBTHING_BATCH_OP_DAC_SET, enable, (uint16_t)(value * 4096 / 3.3), 0, NULL, 0) == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int USBTHING_batch_loop_start(usbthing_batch_t batch, unsigned int iterations)
+{
+  if ((iterations > UINT16_MAX)
+      || (batch_add(batch, USBTHING_BATCH_OP_LOOP_START, 0, iterations, 0, NULL, 0) == NULL)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int USBTHING_batch_loop_end(usbthing_batch_t batch)
+{
+  if (batch_add(batch, USBTHING_BATCH_OP_LOOP_END, 0, 0, 0, NULL, 0) == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int USBTHING_batch_wait_pin(usbthing_batch_t batch, int pin, int level, unsigned int timeout_us)
+{
+  uint32_t timeout = timeout_us;
+
+  if (batch_add(batch, USBTHING_BATCH_OP_WAIT_PIN, pin, level, sizeof(uint32_t), &timeout, 0) == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int USBTHING_batch_execute(usbthing_t usbthing, usbthing_batch_t batch)
+{
+  struct usbthing_batch_result_s *result = (struct usbthing_batch_result_s *)batch->response;
+  int transferred;
+  int res;
+
+  batch->id ++;
+  usbthing_batch_encode(batch);
+
+  res = libusb_bulk_transfer(usbthing->handle, USBTHING_EP_BATCH_OUT, batch->request, batch->request_length,
+                             &transferred, USBTHING_TIMEOUT);
+  if (res < 0) {
+    perror("USBTHING batch outgoing error");
+    return -1;
+  }
+
+  //Terminate packet-multiple requests that do not fill the device buffer
+  if ((batch->request_length % 64 == 0) && (batch->request_length < USBTHING_BATCH_MAX_SIZE)) {
+    libusb_bulk_transfer(usbthing->handle, USBTHING_EP_BATCH_OUT, NULL, 0, &transferred, USBTHING_TIMEOUT);
+  }
+
+  //The device terminates short results the same way, so a full sized read is always safe
+  res = libusb_bulk_transfer(usbthing->handle, USBTHING_EP_BATCH_IN, batch->response, USBTHING_BATCH_MAX_SIZE,
+                             &transferred, USBTHING_TIMEOUT);
+  if (res < 0) {
+    perror("USBTHING batch incoming error");
+    return -2;
+  }
+
+  if ((transferred < (int)sizeof(struct usbthing_batch_result_s))
+      || (result->id != batch->id) || (result->length != transferred)) {
+    printf("Batch response error: received %d bytes for batch %d\r\n", transferred, batch->id);
+    return -3;
+  }
+
+  USBTHING_DEBUG_PRINT("Batch %d complete: %d of %d operations\r\n", result->id, result->completed, batch->count);
+
+  //Results are valid for every operation completed before any failure
+  batch_scatter(batch, batch->response, result->completed);
+
+  return result->result;
+}
+
+/*****       Internal functions       *****/
+
+//Fill in the request header, returns the encoded request length
+int usbthing_batch_encode(usbthing_batch_t batch)
+{
+  struct usbthing_batch_header_s *header = (struct usbthing_batch_header_s *)batch->request;
+
+  header->id = batch->id;
+  header->count = batch->count;
+  header->length = batch->request_length;
+
+  return batch->request_length;
+}
+
+//Append an operation and its payload, returns the result entry or NULL if the batch is full
+static struct usbthing_batch_entry_s *batch_add(usbthing_batch_t batch, uint8_t op, uint8_t arg, uint16_t value,
+                                                int length, const void *payload, int result_length)
+{
+  struct usbthing_batch_op_s *header;
+  struct usbthing_batch_entry_s *entry;
+
+  if ((batch->count >= USBTHING_BATCH_MAX_OPS) || (length < 0)
+      || (batch->request_length + (int)sizeof(struct usbthing_batch_op_s) + length > USBTHING_BATCH_MAX_SIZE)
+      || (batch->response_length + result_length > USBTHING_BATCH_MAX_SIZE)) {
+    return NULL;
+  }
+
+  header = (struct usbthing_batch_op_s *)(batch->request + batch->request_length);
+  header->op = op;
+  header->arg = arg;
+  header->value = value;
+  header->length = length;
+  batch->request_length += sizeof(struct usbthing_batch_op_s);
+
+  if (length > 0) {
+    memcpy(batch->request + batch->request_length, payload, length);
+    batch->request_length += length;
+  }
+
+  entry = &batch->entries[batch->count];
+  entry->op = op;
+  entry->result_length = result_length;
+  entry->data = NULL;
+  batch->response_length += result_length;
+  batch->count ++;
+
+  return entry;
+}
+
+//Copy packed results out to the buffers registered with each operation
+static void batch_scatter(usbthing_batch_t batch, const uint8_t *response, int completed)
+{
+  int offset = sizeof(struct usbthing_batch_result_s);
+  uint32_t adc_value;
+
+  for (int i = 0; (i < completed) && (i < batch->count); i++) {
+    struct usbthing_batch_entry_s *entry = &batch->entries[i];
+
+    switch (entry->op) {
+    case USBTHING_BATCH_OP_GPIO_GET:
+      *entry->gpio_value = response[offset];
+      break;
+    case USBTHING_BATCH_OP_ADC_GET:
+      memcpy(&adc_value, response + offset, sizeof(uint32_t));
+      *entry->adc_value = (float)adc_value / USBTHING_ADC_FULL_SCALE * 3.3;
+      break;
+    default:
+      if (entry->data != NULL) {
+        memcpy(entry->data, response + offset, entry->result_length);
+      }
+      break;
+    }
+
+    offset += entry->result_length;
+  }
+}
@@ -0,0 +1,200 @@
+/**
+ * @brief USB Thing control loop
+ * @details Device resident PID loop, gains and levels are converted here from volts to device units
+ */
+
+#include "usbthing.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "protocol.h"
+#include "usbthing_internal.h"
+
+#define CONTROL_VREF            3.3
+#define CONTROL_DAC_CODES       4096
+#define CONTROL_DAC_MAX         4095
+#define CONTROL_GAIN_SCALE      65536.0
+
+//Internal helpers
+static int control_configure(usbthing_t usbthing, int input, unsigned int rate, int output, int channel, double scale,
+                             float kp, float ki, float kd, int min, int max, int telemetry);
+static int control_gain(double gain, int32_t *raw);
+static int control_level(float volts, double scale, int max, int *raw);
+
+int USBTHING_control_configure(usbthing_t usbthing, int input, unsigned int rate, float kp, float ki, float kd,
+                               float output_min, float output_max, int telemetry)
+{
+  int min, max;
+
+  //Inputs are 16 bit and outputs DAC codes, so a gain of one volt per volt is 1/16 code per input unit
+  double scale = (double)CONTROL_DAC_CODES / USBTHING_ADC_FULL_SCALE * CONTROL_GAIN_SCALE;
+
+  if ((output_min > output_max)
+      || (control_level(output_min, CONTROL_DAC_CODES / CONTROL_VREF, CONTROL_DAC_MAX, &min) != 0)
+      || (control_level(output_max, CONTROL_DAC_CODES / CONTROL_VREF, CONTROL_DAC_MAX, &max) != 0)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  return control_configure(usbthing, input, rate, USBTHING_CONTROL_OUTPUT_DAC, 0, scale, kp, ki, kd,
+                           min, max, telemetry);
+}
+
+int USBTHING_control_configure_pwm(usbthing_t usbthing, int input, unsigned int rate, int channel, float kp,
+                                   float ki, float kd, float duty_min, float duty_max, int telemetry)
+{
+  int min, max;
+
+  //Outputs are fractions of USBTHING_PWM_DUTY_FULL, so a gain of full duty per volt is that per volt of input
+  double scale = (double)USBTHING_PWM_DUTY_FULL * CONTROL_VREF / USBTHING_ADC_FULL_SCALE * CONTROL_GAIN_SCALE;
+
+  if ((channel < 0) || (channel >= USBTHING_PWM_NUM_CHANNELS) || (duty_min > duty_max) || (duty_max > 1.0)
+      || (control_level(duty_min, USBTHING_PWM_DUTY_FULL, USBTHING_PWM_DUTY_FULL, &min) != 0)
+      || (control_level(duty_max, USBTHING_PWM_DUTY_FULL, USBTHING_PWM_DUTY_FULL, &max) != 0)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  return control_configure(usbthing, input, rate, USBTHING_CONTROL_OUTPUT_PWM, channel, scale, kp, ki, kd,
+                           min, max, telemetry);
+}
+
+int USBTHING_control_setpoint(usbthing_t usbthing, float setpoint, float ramp)
+{
+  struct usbthing_ctrl_s cmd;
+  int value;
+
+  if ((ramp < 0) || (ramp * USBTHING_ADC_FULL_SCALE / CONTROL_VREF > UINT32_MAX)
+      || (control_level(setpoint, USBTHING_ADC_FULL_SCALE / CONTROL_VREF, UINT16_MAX, &value) != 0)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  memset(&cmd.control_cmd.setpoint, 0, sizeof(cmd.control_cmd.setpoint));
+  cmd.control_cmd.setpoint.setpoint = value;
+  cmd.control_cmd.setpoint.ramp = (uint32_t)(ramp * USBTHING_ADC_FULL_SCALE / CONTROL_VREF + 0.5);
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_CONTROL,
+                              USBTHING_CONTROL_CMD_SETPOINT,
+                              0,
+                              USBTHING_CMD_CONTROL_SETPOINT_SIZE,
+                              cmd.data);
+}
+
+int USBTHING_control_start(usbthing_t usbthing)
+{
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_CONTROL,
+                              USBTHING_CONTROL_CMD_START,
+                              0,
+                              USBTHING_CMD_CONTROL_START_SIZE,
+                              NULL);
+}
+
+int USBTHING_control_stop(usbthing_t usbthing)
+{
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_CONTROL,
+                              USBTHING_CONTROL_CMD_STOP,
+                              0,
+                              USBTHING_CMD_CONTROL_STOP_SIZE,
+                              NULL);
+}
+
+int USBTHING_control_status(usbthing_t usbthing, int *state, int *saturated, float *setpoint, float *input,
+                            float *output, unsigned int *iterations)
+{
+  struct usbthing_ctrl_s cmd;
+  int res;
+
+  res = usbthing_control_get(usbthing,
+                             USBTHING_MODULE_CONTROL,
+                             USBTHING_CONTROL_CMD_STATUS,
+                             0,
+                             USBTHING_CMD_CONTROL_STATUS_SIZE,
+                             cmd.data);
+
+  if (res >= 0) {
+    *state = cmd.control_cmd.status.state;
+    *saturated = cmd.control_cmd.status.saturated;
+    *setpoint = (float)cmd.control_cmd.status.setpoint / USBTHING_ADC_FULL_SCALE * CONTROL_VREF;
+    *input = (float)cmd.control_cmd.status.input / USBTHING_ADC_FULL_SCALE * CONTROL_VREF;
+    if (cmd.control_cmd.status.output_device == USBTHING_CONTROL_OUTPUT_PWM) {
+      *output = (float)cmd.control_cmd.status.output / USBTHING_PWM_DUTY_FULL;
+    } else {
+      *output = (float)cmd.control_cmd.status.output / CONTROL_DAC_CODES * CONTROL_VREF;
+    }
+    *iterations = cmd.control_cmd.status.iterations;
+  }
+
+  return res;
+}
+
+//Send a configuration with limits already in output codes, scale converts volt gains to 16.16 codes per input unit
+static int control_configure(usbthing_t usbthing, int input, unsigned int rate, int output, int channel, double scale,
+                             float kp, float ki, float kd, int min, int max, int telemetry)
+{
+  struct usbthing_ctrl_s cmd;
+  int32_t p, i, d;
+  int res;
+
+  if ((input < USBTHING_ADC_CH0) || (input > USBTHING_ADC_CH3)
+      || (rate == 0) || (rate > USBTHING_CONTROL_MAX_RATE)
+      || (telemetry < 0) || (telemetry > UINT16_MAX) || (min > max)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  memset(&cmd.control_cmd.config, 0, sizeof(cmd.control_cmd.config));
+
+  //Integral gain is applied per iteration, derivative gain per change between iterations
+  res = control_gain(kp * scale, &p);
+  res |= control_gain(ki * scale / rate, &i);
+  res |= control_gain(kd * scale * rate, &d);
+
+  if (res != 0) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  cmd.control_cmd.config.input = input;
+  cmd.control_cmd.config.output = output;
+  cmd.control_cmd.config.channel = channel;
+  cmd.control_cmd.config.telemetry = telemetry;
+  cmd.control_cmd.config.rate = rate;
+  cmd.control_cmd.config.kp = p;
+  cmd.control_cmd.config.ki = i;
+  cmd.control_cmd.config.kd = d;
+  cmd.control_cmd.config.output_min = min;
+  cmd.control_cmd.config.output_max = max;
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_CONTROL,
+                              USBTHING_CONTROL_CMD_CONFIG,
+                              0,
+                              USBTHING_CMD_CONTROL_CONFIG_SIZE,
+                              cmd.data);
+}
+
+//Round a 16.16 gain, returns non-zero if it does not fit
+static int control_gain(double gain, int32_t *raw)
+{
+  gain = (gain < 0) ? gain - 0.5 : gain + 0.5;
+
+  if ((gain > INT32_MAX) || (gain < INT32_MIN)) {
+    return 1;
+  }
+
+  *raw = (int32_t)gain;
+  return 0;
+}
+
+//Convert a level in volts to device units, returns non-zero if it is out of range
+static int control_level(float volts, double scale, int max, int *raw)
+{
+  double value = volts * scale + 0.5;
+
+  if (value < 0) {
+    return 1;
+  }
+
+  *raw = (value > max) ? max : (int)value;
+  return 0;
+}
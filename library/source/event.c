@@ -0,0 +1,287 @@
+/**
+ * @brief USB Thing event stream
+ * @details Receives timestamped device events over the interrupt endpoint on the async event thread,
+ * delivering them to a callback or queueing them for USBTHING_event_get
+ */
+
+#include "usbthing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "libusb-1.0/libusb.h"
+
+#include "protocol.h"
+#include "usbthing_internal.h"
+
+//Internal helpers
+static void LIBUSB_CALL event_transfer_cb(struct libusb_transfer *transfer);
+static void event_dispatch(struct usbthing_events_s *events, const struct usbthing_event_msg_s *msg);
+static void events_free(struct usbthing_events_s *events);
+
+int USBTHING_event_start(usbthing_t usbthing, usbthing_event_cb_t callback, void *context)
+{
+  struct usbthing_events_s *events;
+  int res;
+
+  //Already running
+  if (usbthing->events != NULL) {
+    return 0;
+  }
+
+  //Transfers complete on the async event thread
+  res = USBTHING_async_start(usbthing);
+  if (res < 0) {
+    return -1;
+  }
+
+  events = calloc(1, sizeof(struct usbthing_events_s));
+  if (events == NULL) {
+    return -2;
+  }
+
+  pthread_mutex_init(&events->lock, NULL);
+  pthread_cond_init(&events->cond, NULL);
+  events->usbthing = usbthing;
+  events->callback = callback;
+  events->context = context;
+  events->active = 1;
+
+  for (int i = 0; i < USBTHING_EVENT_TRANSFERS; i++) {
+    events->transfers[i] = libusb_alloc_transfer(0);
+    if (events->transfers[i] == NULL) {
+      events_free(events);
+      return -3;
+    }
+  }
+
+  usbthing->events = events;
+
+  //Keep multiple reads outstanding so events are never waiting on a resubmission
+  pthread_mutex_lock(&events->lock);
+  for (int i = 0; i < USBTHING_EVENT_TRANSFERS; i++) {
+    libusb_fill_interrupt_transfer(events->transfers[i], usbthing->handle, USBTHING_EP_EVENT_IN,
+                                   events->buffers[i], USBTHING_EVENT_PACKET_SIZE,
+                                   event_transfer_cb, events, 0);
+    if (libusb_submit_transfer(events->transfers[i]) == 0) {
+      events->pending ++;
+    }
+  }
+  pthread_mutex_unlock(&events->lock);
+
+  if (events->pending == 0) {
+    USBTHING_event_stop(usbthing);
+    return -4;
+  }
+
+  USBTHING_DEBUG_PRINT("Event stream started\r\n");
+
+  return 0;
+}
+
+int USBTHING_event_stop(usbthing_t usbthing)
+{
+  struct usbthing_events_s *events = usbthing->events;
+
+  if (events == NULL) {
+    return -1;
+  }
+
+  //Cancel reads and wait for them to be returned by the event thread
+  pthread_mutex_lock(&events->lock);
+  events->active = 0;
+  for (int i = 0; i < USBTHING_EVENT_TRANSFERS; i++) {
+    libusb_cancel_transfer(events->transfers[i]);
+  }
+  while (events->pending > 0) {
+    pthread_cond_wait(&events->cond, &events->lock);
+  }
+  pthread_mutex_unlock(&events->lock);
+
+  usbthing->events = NULL;
+  events_free(events);
+
+  USBTHING_DEBUG_PRINT("Event stream stopped\r\n");
+
+  return 0;
+}
+
+int USBTHING_event_get(usbthing_t usbthing, struct usbthing_event_s *event, int timeout_ms)
+{
+  struct usbthing_events_s *events = usbthing->events;
+  struct timespec deadline;
+  struct timeval now;
+  int res = 0;
+
+  if (events == NULL) {
+    return -1;
+  }
+
+  if (timeout_ms > 0) {
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 + (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec ++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+
+  pthread_mutex_lock(&events->lock);
+  while ((events->count == 0) && (res == 0)) {
+    if (timeout_ms > 0) {
+      res = pthread_cond_timedwait(&events->cond, &events->lock, &deadline);
+    } else {
+      res = pthread_cond_wait(&events->cond, &events->lock);
+    }
+  }
+
+  if (events->count == 0) {
+    pthread_mutex_unlock(&events->lock);
+    return USBTHING_ERROR_USB_TIMEOUT;
+  }
+
+  *event = events->queue[events->head];
+  events->head = (events->head + 1) % USBTHING_EVENT_QUEUE_SIZE;
+  events->count --;
+  pthread_mutex_unlock(&events->lock);
+
+  return 0;
+}
+
+int USBTHING_event_lost(usbthing_t usbthing)
+{
+  struct usbthing_events_s *events = usbthing->events;
+  int lost;
+
+  if (events == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&events->lock);
+  lost = events->lost;
+  pthread_mutex_unlock(&events->lock);
+
+  return lost;
+}
+
+//Remove the oldest queued event from the given source and id, returns 1 if an event was found
+int usbthing_event_take(usbthing_t usbthing, int source, int id, struct usbthing_event_s *event)
+{
+  struct usbthing_events_s *events = usbthing->events;
+  int found = 0;
+
+  if (events == NULL) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&events->lock);
+  for (int i = 0; i < events->count; i++) {
+    int index = (events->head + i) % USBTHING_EVENT_QUEUE_SIZE;
+
+    if ((events->queue[index].source != source) || (events->queue[index].id != id)) {
+      continue;
+    }
+
+    *event = events->queue[index];
+
+    //Close the gap, preserving the order of the remaining events
+    for (int j = i; j > 0; j--) {
+      events->queue[(events->head + j) % USBTHING_EVENT_QUEUE_SIZE] =
+        events->queue[(events->head + j - 1) % USBTHING_EVENT_QUEUE_SIZE];
+    }
+    events->head = (events->head + 1) % USBTHING_EVENT_QUEUE_SIZE;
+    events->count --;
+    found = 1;
+    break;
+  }
+  pthread_mutex_unlock(&events->lock);
+
+  return found;
+}
+
+/*****       Internal functions       *****/
+
+//Called on the event thread for each completed interrupt read
+static void LIBUSB_CALL event_transfer_cb(struct libusb_transfer *transfer)
+{
+  struct usbthing_events_s *events = (struct usbthing_events_s *)transfer->user_data;
+  int count;
+
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+    count = transfer->actual_length / sizeof(struct usbthing_event_msg_s);
+    for (int i = 0; i < count; i++) {
+      event_dispatch(events, (const struct usbthing_event_msg_s *)transfer->buffer + i);
+    }
+  }
+
+  pthread_mutex_lock(&events->lock);
+
+  //Resubmit unless stopping or the device has gone
+  if ((events->active != 0)
+      && (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+      && (transfer->status != LIBUSB_TRANSFER_NO_DEVICE)
+      && (libusb_submit_transfer(transfer) == 0)) {
+    pthread_mutex_unlock(&events->lock);
+    return;
+  }
+
+  events->pending --;
+  pthread_cond_broadcast(&events->cond);
+  pthread_mutex_unlock(&events->lock);
+}
+
+//Deliver an event to the callback or queue, tracking events lost on the device or host
+static void event_dispatch(struct usbthing_events_s *events, const struct usbthing_event_msg_s *msg)
+{
+  struct usbthing_event_s event;
+
+  event.source = msg->source;
+  event.id = msg->id;
+  event.value = msg->value;
+  event.sequence = msg->sequence;
+  event.timestamp = msg->timestamp;
+
+  pthread_mutex_lock(&events->lock);
+
+  if ((events->started != 0) && (msg->sequence != events->next_sequence)) {
+    events->lost += msg->sequence - events->next_sequence;
+  }
+  events->next_sequence = msg->sequence + 1;
+  events->started = 1;
+
+  if (events->callback == NULL) {
+    if (events->count < USBTHING_EVENT_QUEUE_SIZE) {
+      events->queue[(events->head + events->count) % USBTHING_EVENT_QUEUE_SIZE] = event;
+      events->count ++;
+      pthread_cond_broadcast(&events->cond);
+    } else {
+      events->lost ++;
+    }
+  }
+
+  pthread_mutex_unlock(&events->lock);
+
+  if (events->callback != NULL) {
+    events->callback(&event, events->context);
+  }
+}
+
+static void events_free(struct usbthing_events_s *events)
+{
+  for (int i = 0; i < USBTHING_EVENT_TRANSFERS; i++) {
+    if (events->transfers[i] != NULL) {
+      libusb_free_transfer(events->transfers[i]);
+    }
+  }
+
+  pthread_mutex_destroy(&events->lock);
+  pthread_cond_destroy(&events->cond);
+
+  free(events);
+}
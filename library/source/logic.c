@@ -0,0 +1,244 @@
+/**
+ * @brief USB Thing logic capture
+ * @details Triggered captures of all GPIO pins, read back over the stream endpoint and exported as VCD
+ */
+
+#include "usbthing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "libusb-1.0/libusb.h"
+
+#include "protocol.h"
+#include "usbthing_internal.h"
+
+#define LOGIC_NUM_PINS          6
+
+//Internal helpers
+static int logic_decode(const uint8_t *data, int length, uint8_t *samples, int count);
+
+int USBTHING_logic_configure(usbthing_t usbthing, unsigned int rate, int pre_samples, int post_samples,
+                             int trigger, int pin, int mask, int value, int encoding)
+{
+  struct usbthing_ctrl_s cmd;
+
+  if ((pre_samples < 0) || (post_samples < 1)
+      || (pre_samples + post_samples > USBTHING_LOGIC_MAX_SAMPLES)
+      || (rate == 0) || (rate > USBTHING_LOGIC_MAX_RATE)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  memset(&cmd.logic_cmd.config, 0, sizeof(cmd.logic_cmd.config));
+  cmd.logic_cmd.config.trigger = trigger;
+  cmd.logic_cmd.config.pin = pin;
+  cmd.logic_cmd.config.mask = mask;
+  cmd.logic_cmd.config.value = value;
+  cmd.logic_cmd.config.encoding = encoding;
+  cmd.logic_cmd.config.rate = rate;
+  cmd.logic_cmd.config.pre_samples = pre_samples;
+  cmd.logic_cmd.config.post_samples = post_samples;
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_LOGIC,
+                              USBTHING_LOGIC_CMD_CONFIG,
+                              0,
+                              USBTHING_CMD_LOGIC_CONFIG_SIZE,
+                              cmd.data);
+}
+
+int USBTHING_logic_arm(usbthing_t usbthing)
+{
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_LOGIC,
+                              USBTHING_LOGIC_CMD_ARM,
+                              0,
+                              USBTHING_CMD_LOGIC_ARM_SIZE,
+                              NULL);
+}
+
+int USBTHING_logic_trigger(usbthing_t usbthing)
+{
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_LOGIC,
+                              USBTHING_LOGIC_CMD_TRIGGER,
+                              0,
+                              USBTHING_CMD_LOGIC_TRIGGER_SIZE,
+                              NULL);
+}
+
+static int logic_status(usbthing_t usbthing, int *state, int *samples, int *length)
+{
+  struct usbthing_ctrl_s cmd;
+  int res;
+
+  res = usbthing_control_get(usbthing,
+                             USBTHING_MODULE_LOGIC,
+                             USBTHING_LOGIC_CMD_STATUS,
+                             0,
+                             USBTHING_CMD_LOGIC_STATUS_SIZE,
+                             cmd.data);
+
+  if (res >= 0) {
+    *state = cmd.logic_cmd.status.state;
+    *samples = cmd.logic_cmd.status.samples;
+    *length = cmd.logic_cmd.status.length;
+  }
+
+  return res;
+}
+
+int USBTHING_logic_status(usbthing_t usbthing, int *state, int *samples)
+{
+  int length;
+
+  return logic_status(usbthing, state, samples, &length);
+}
+
+int USBTHING_logic_read(usbthing_t usbthing, uint8_t *samples, int count)
+{
+  uint8_t *data;
+  int state, available, length;
+  int transferred;
+  int res;
+
+  res = logic_status(usbthing, &state, &available, &length);
+  if (res < 0) {
+    return res;
+  }
+
+  if ((state != USBTHING_SCOPE_STATE_DONE) || (count < available)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  data = malloc(length);
+  if (data == NULL) {
+    return -1;
+  }
+
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_LOGIC,
+                             USBTHING_LOGIC_CMD_READ,
+                             0,
+                             USBTHING_CMD_LOGIC_READ_SIZE,
+                             NULL);
+  if (res < 0) {
+    free(data);
+    return res;
+  }
+
+  //Capture is returned in one bulk transfer of the reported length
+  res = libusb_bulk_transfer(usbthing->handle, USBTHING_EP_STREAM_IN, data, length, &transferred, USBTHING_TIMEOUT);
+  if (res < 0) {
+    perror("USBTHING logic read error");
+    free(data);
+    return res;
+  }
+
+  //Raw captures are a byte per sample. Encoded captures are shorter unless every run is a single sample,
+  //in which case the encoding is identical to the raw capture.
+  if (transferred == available) {
+    memcpy(samples, data, available);
+    res = available;
+  } else {
+    res = logic_decode(data, transferred, samples, available);
+  }
+
+  free(data);
+
+  return res;
+}
+
+int USBTHING_logic_write_vcd(const char *path, const uint8_t *samples, int count, unsigned int rate)
+{
+  FILE *file;
+  uint8_t previous;
+
+  if ((samples == NULL) || (count < 1) || (rate == 0)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  file = fopen(path, "w");
+  if (file == NULL) {
+    return -1;
+  }
+
+  fprintf(file, "$version USB Thing logic capture $end\n");
+  fprintf(file, "$timescale 1 ns $end\n");
+  fprintf(file, "$scope module usbthing $end\n");
+  for (int i = 0; i < LOGIC_NUM_PINS; i++) {
+    fprintf(file, "$var wire 1 %c GPIO%d $end\n", '!' + i, i);
+  }
+  fprintf(file, "$upscope $end\n");
+  fprintf(file, "$enddefinitions $end\n");
+
+  //Initial levels, then only pins that change
+  fprintf(file, "#0\n$dumpvars\n");
+  for (int i = 0; i < LOGIC_NUM_PINS; i++) {
+    fprintf(file, "%d%c\n", (samples[0] >> i) & 1, '!' + i);
+  }
+  fprintf(file, "$end\n");
+
+  previous = samples[0];
+  for (int s = 1; s < count; s++) {
+    uint8_t changed = samples[s] ^ previous;
+
+    if (changed == 0) {
+      continue;
+    }
+
+    fprintf(file, "#%llu\n", (unsigned long long)s * 1000000000ULL / rate);
+    for (int i = 0; i < LOGIC_NUM_PINS; i++) {
+      if (changed & (1 << i)) {
+        fprintf(file, "%d%c\n", (samples[s] >> i) & 1, '!' + i);
+      }
+    }
+    previous = samples[s];
+  }
+
+  //Mark the end of the capture so the final levels have a duration
+  fprintf(file, "#%llu\n", (unsigned long long)count * 1000000000ULL / rate);
+
+  if (fclose(file) != 0) {
+    return -2;
+  }
+
+  return 0;
+}
+
+//Expand a run length encoded capture (see usbthing_logic_encoding_e), returns the number of samples
+static int logic_decode(const uint8_t *data, int length, uint8_t *samples, int count)
+{
+  int in = 0;
+  int out = 0;
+
+  while ((in < length) && (out < count)) {
+    uint8_t levels = data[in] & 0x3F;
+    uint32_t run = (data[in] >> 6) + 1;
+    int shift = 0;
+
+    in ++;
+
+    //Long runs carry their length less four
+    if (run == 4) {
+      do {
+        if ((in >= length) || (shift > 28)) {
+          return USBTHING_ERROR_PERIPHERAL_FAILED;
+        }
+        run += (uint32_t)(data[in] & 0x7F) << shift;
+        shift += 7;
+      } while (data[in ++] & 0x80);
+    }
+
+    if (run > (uint32_t)(count - out)) {
+      return USBTHING_ERROR_PERIPHERAL_FAILED;
+    }
+
+    memset(samples + out, levels, run);
+    out += run;
+  }
+
+  return out;
+}
@@ -0,0 +1,944 @@
+/**
+ * @brief USB Thing sample streams
+ * @details Continuous block reads from the stream endpoint on the async event thread, and the ADC
+ * streaming API built on them. DAC samples are queued on the host and written to the stream OUT endpoint.
+ */
+
+#include "usbthing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "libusb-1.0/libusb.h"
+
+#include "protocol.h"
+#include "usbthing_internal.h"
+
+//Internal helpers
+static void LIBUSB_CALL stream_transfer_cb(struct libusb_transfer *transfer);
+static void stream_free(struct usbthing_stream_s *stream);
+static void adc_stream_block(struct usbthing_stream_s *stream, const uint8_t *data, int length);
+static int adc_stream_decode(const uint8_t *data, int length, uint16_t *samples, int count, int scan);
+static void dac_stream_submit(struct usbthing_dac_stream_s *dac);
+static void LIBUSB_CALL dac_stream_transfer_cb(struct libusb_transfer *transfer);
+static void dac_stream_free(struct usbthing_dac_stream_s *dac);
+
+/*****       Bulk IN streams       *****/
+
+int usbthing_stream_start(struct usbthing_s *usbthing, struct usbthing_stream_s *stream, uint8_t endpoint,
+                          int block_size, usbthing_stream_block_t handler, void *context)
+{
+  int res;
+
+  //Transfers complete on the async event thread
+  res = USBTHING_async_start(usbthing);
+  if (res < 0) {
+    return -1;
+  }
+
+  memset(stream->transfers, 0, sizeof(stream->transfers));
+  pthread_mutex_init(&stream->lock, NULL);
+  pthread_cond_init(&stream->cond, NULL);
+  stream->usbthing = usbthing;
+  stream->endpoint = endpoint;
+  stream->block_size = block_size;
+  stream->handler = handler;
+  stream->context = context;
+  stream->active = 1;
+  stream->pending = 0;
+
+  stream->buffers = malloc(USBTHING_STREAM_TRANSFERS * block_size);
+  if (stream->buffers == NULL) {
+    stream_free(stream);
+    return -2;
+  }
+
+  for (int i = 0; i < USBTHING_STREAM_TRANSFERS; i++) {
+    stream->transfers[i] = libusb_alloc_transfer(0);
+    if (stream->transfers[i] == NULL) {
+      stream_free(stream);
+      return -3;
+    }
+  }
+
+  //Keep several reads queued so the device can always send the next block
+  pthread_mutex_lock(&stream->lock);
+  for (int i = 0; i < USBTHING_STREAM_TRANSFERS; i++) {
+    libusb_fill_bulk_transfer(stream->transfers[i], usbthing->handle, endpoint,
+                              stream->buffers + i * block_size, block_size,
+                              stream_transfer_cb, stream, 0);
+    if (libusb_submit_transfer(stream->transfers[i]) == 0) {
+      stream->pending ++;
+    }
+  }
+  pthread_mutex_unlock(&stream->lock);
+
+  if (stream->pending == 0) {
+    usbthing_stream_stop(stream);
+    return -4;
+  }
+
+  return 0;
+}
+
+void usbthing_stream_stop(struct usbthing_stream_s *stream)
+{
+  //Cancel reads and wait for them to be returned by the event thread
+  pthread_mutex_lock(&stream->lock);
+  stream->active = 0;
+  for (int i = 0; i < USBTHING_STREAM_TRANSFERS; i++) {
+    if (stream->transfers[i] != NULL) {
+      libusb_cancel_transfer(stream->transfers[i]);
+    }
+  }
+  while (stream->pending > 0) {
+    pthread_cond_wait(&stream->cond, &stream->lock);
+  }
+  pthread_mutex_unlock(&stream->lock);
+
+  stream_free(stream);
+}
+
+//Called on the event thread for each completed block read
+static void LIBUSB_CALL stream_transfer_cb(struct libusb_transfer *transfer)
+{
+  struct usbthing_stream_s *stream = (struct usbthing_stream_s *)transfer->user_data;
+
+  if ((transfer->status == LIBUSB_TRANSFER_COMPLETED) && (transfer->actual_length > 0)) {
+    stream->handler(stream, transfer->buffer, transfer->actual_length);
+  }
+
+  pthread_mutex_lock(&stream->lock);
+
+  //Resubmit unless stopping or the device has gone
+  if ((stream->active != 0)
+      && (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+      && (transfer->status != LIBUSB_TRANSFER_NO_DEVICE)
+      && (libusb_submit_transfer(transfer) == 0)) {
+    pthread_mutex_unlock(&stream->lock);
+    return;
+  }
+
+  stream->pending --;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->lock);
+}
+
+static void stream_free(struct usbthing_stream_s *stream)
+{
+  for (int i = 0; i < USBTHING_STREAM_TRANSFERS; i++) {
+    if (stream->transfers[i] != NULL) {
+      libusb_free_transfer(stream->transfers[i]);
+      stream->transfers[i] = NULL;
+    }
+  }
+
+  free(stream->buffers);
+  stream->buffers = NULL;
+
+  pthread_mutex_destroy(&stream->lock);
+  pthread_cond_destroy(&stream->cond);
+}
+
+/*****       ADC streaming       *****/
+
+int USBTHING_adc_stream_start(usbthing_t usbthing, int channels, unsigned int rate, int encoding,
+                              usbthing_adc_block_cb_t callback, void *context)
+{
+  struct usbthing_adc_stream_s *adc;
+  struct usbthing_ctrl_s cmd;
+  int scan = 0;
+  int res;
+
+  for (int i = 0; i < 4; i++) {
+    if (channels & (1 << i)) {
+      scan ++;
+    }
+  }
+
+  if ((usbthing->adc_stream != NULL) || (scan == 0) || (channels & ~0x0F)
+      || ((encoding == USBTHING_ADC_ENCODING_RAW) && (rate > USBTHING_ADC_STREAM_MAX_RATE / scan))
+      || ((encoding == USBTHING_ADC_ENCODING_DELTA) && (rate > USBTHING_ADC_STREAM_MAX_RATE_DELTA / scan))
+      || ((encoding != USBTHING_ADC_ENCODING_RAW) && (encoding != USBTHING_ADC_ENCODING_DELTA))) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  adc = calloc(1, sizeof(struct usbthing_adc_stream_s));
+  if (adc == NULL) {
+    return -1;
+  }
+
+  adc->callback = callback;
+  adc->context = context;
+  adc->channels = channels;
+  adc->scan = scan;
+
+  usbthing->adc_stream = adc;
+
+  //Queue reads before starting the device so no block waits on the host
+  res = usbthing_stream_start(usbthing, &adc->stream, USBTHING_EP_STREAM_IN, USBTHING_ADC_BLOCK_SIZE,
+                              adc_stream_block, adc);
+  if (res < 0) {
+    usbthing->adc_stream = NULL;
+    free(adc);
+    return res;
+  }
+
+  cmd.adc_cmd.stream_start.channels = channels;
+  cmd.adc_cmd.stream_start.encoding = encoding;
+  memset(cmd.adc_cmd.stream_start.reserved, 0, sizeof(cmd.adc_cmd.stream_start.reserved));
+  cmd.adc_cmd.stream_start.rate = rate;
+
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_ADC,
+                             USBTHING_ADC_CMD_STREAM_START,
+                             0,
+                             USBTHING_CMD_ADC_STREAM_START_SIZE,
+                             cmd.data);
+  if (res < 0) {
+    usbthing_stream_stop(&adc->stream);
+    usbthing->adc_stream = NULL;
+    free(adc);
+    return res;
+  }
+
+  USBTHING_DEBUG_PRINT("ADC stream started, channels 0x%x rate %u\r\n", channels, rate);
+
+  return 0;
+}
+
+int USBTHING_adc_stream_read(usbthing_t usbthing, uint16_t *samples, int count, int timeout_ms)
+{
+  struct usbthing_adc_stream_s *adc = usbthing->adc_stream;
+  struct timespec deadline;
+  struct timeval now;
+  int res = 0;
+
+  if ((adc == NULL) || (adc->callback != NULL)) {
+    return -1;
+  }
+
+  //Whole scans only, so channel alignment is kept between reads
+  count -= count % adc->scan;
+  if (count <= 0) {
+    return 0;
+  }
+
+  if (timeout_ms > 0) {
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 + (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec ++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+
+  pthread_mutex_lock(&adc->stream.lock);
+  while ((adc->count == 0) && (res == 0)) {
+    if (timeout_ms > 0) {
+      res = pthread_cond_timedwait(&adc->stream.cond, &adc->stream.lock, &deadline);
+    } else {
+      res = pthread_cond_wait(&adc->stream.cond, &adc->stream.lock);
+    }
+  }
+
+  if (count > adc->count) {
+    count = adc->count;
+  }
+  for (int i = 0; i < count; i++) {
+    samples[i] = adc->ring[(adc->head + i) % USBTHING_ADC_STREAM_RING_SIZE];
+  }
+  adc->head = (adc->head + count) % USBTHING_ADC_STREAM_RING_SIZE;
+  adc->count -= count;
+  pthread_mutex_unlock(&adc->stream.lock);
+
+  if (count == 0) {
+    return USBTHING_ERROR_USB_TIMEOUT;
+  }
+
+  return count;
+}
+
+int USBTHING_adc_stream_stats(usbthing_t usbthing, unsigned int *blocks, unsigned int *lost)
+{
+  struct usbthing_adc_stream_s *adc = usbthing->adc_stream;
+
+  if (adc == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&adc->stream.lock);
+  *blocks = adc->blocks;
+  *lost = adc->lost;
+  pthread_mutex_unlock(&adc->stream.lock);
+
+  return 0;
+}
+
+int USBTHING_adc_stream_stop(usbthing_t usbthing)
+{
+  struct usbthing_adc_stream_s *adc = usbthing->adc_stream;
+  int res;
+
+  if (adc == NULL) {
+    return -1;
+  }
+
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_ADC,
+                             USBTHING_ADC_CMD_STREAM_STOP,
+                             0,
+                             USBTHING_CMD_ADC_STREAM_STOP_SIZE,
+                             NULL);
+
+  usbthing_stream_stop(&adc->stream);
+  usbthing->adc_stream = NULL;
+  free(adc);
+
+  USBTHING_DEBUG_PRINT("ADC stream stopped\r\n");
+
+  return res;
+}
+
+/*****       ADC scope       *****/
+
+int USBTHING_adc_scope_configure(usbthing_t usbthing, int channel, unsigned int rate,
+                                 int pre_samples, int post_samples, int trigger, int pin, int level)
+{
+  struct usbthing_ctrl_s cmd;
+
+  if ((pre_samples < 0) || (post_samples < 1)
+      || (pre_samples + post_samples > USBTHING_ADC_SCOPE_MAX_SAMPLES)
+      || (rate == 0) || (rate > USBTHING_ADC_SCOPE_MAX_RATE)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  memset(&cmd.adc_cmd.scope_config, 0, sizeof(cmd.adc_cmd.scope_config));
+  cmd.adc_cmd.scope_config.channel = channel;
+  cmd.adc_cmd.scope_config.trigger = trigger;
+  cmd.adc_cmd.scope_config.pin = pin;
+  cmd.adc_cmd.scope_config.level = level;
+  cmd.adc_cmd.scope_config.rate = rate;
+  cmd.adc_cmd.scope_config.pre_samples = pre_samples;
+  cmd.adc_cmd.scope_config.post_samples = post_samples;
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_ADC,
+                              USBTHING_ADC_CMD_SCOPE_CONFIG,
+                              0,
+                              USBTHING_CMD_ADC_SCOPE_CONFIG_SIZE,
+                              cmd.data);
+}
+
+int USBTHING_adc_scope_arm(usbthing_t usbthing)
+{
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_ADC,
+                              USBTHING_ADC_CMD_SCOPE_ARM,
+                              0,
+                              USBTHING_CMD_ADC_SCOPE_ARM_SIZE,
+                              NULL);
+}
+
+int USBTHING_adc_scope_trigger(usbthing_t usbthing)
+{
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_ADC,
+                              USBTHING_ADC_CMD_SCOPE_TRIGGER,
+                              0,
+                              USBTHING_CMD_ADC_SCOPE_TRIGGER_SIZE,
+                              NULL);
+}
+
+int USBTHING_adc_scope_status(usbthing_t usbthing, int *state, int *samples)
+{
+  struct usbthing_ctrl_s cmd;
+  int res;
+
+  res = usbthing_control_get(usbthing,
+                             USBTHING_MODULE_ADC,
+                             USBTHING_ADC_CMD_SCOPE_STATUS,
+                             0,
+                             USBTHING_CMD_ADC_SCOPE_STATUS_SIZE,
+                             cmd.data);
+
+  if (res >= 0) {
+    *state = cmd.adc_cmd.scope_status.state;
+    *samples = cmd.adc_cmd.scope_status.samples;
+  }
+
+  return res;
+}
+
+int USBTHING_adc_scope_read(usbthing_t usbthing, uint16_t *samples, int count)
+{
+  int state, available;
+  int transferred = 0;
+  int res;
+
+  //Streaming uses the same endpoint
+  if (usbthing->adc_stream != NULL) {
+    return USBTHING_ERROR_BUSY;
+  }
+
+  res = USBTHING_adc_scope_status(usbthing, &state, &available);
+  if (res < 0) {
+    return res;
+  }
+
+  if ((state != USBTHING_SCOPE_STATE_DONE) || (count < available)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_ADC,
+                             USBTHING_ADC_CMD_SCOPE_READ,
+                             0,
+                             USBTHING_CMD_ADC_SCOPE_READ_SIZE,
+                             NULL);
+  if (res < 0) {
+    return res;
+  }
+
+  //Capture is returned in one bulk transfer
+  res = libusb_bulk_transfer(usbthing->handle, USBTHING_EP_STREAM_IN, (unsigned char *)samples,
+                             available * sizeof(uint16_t), &transferred, USBTHING_TIMEOUT);
+  if (res < 0) {
+    perror("USBTHING scope read error");
+    return res;
+  }
+
+  return transferred / sizeof(uint16_t);
+}
+
+/*****       ADC monitor       *****/
+
+int USBTHING_adc_monitor_configure(usbthing_t usbthing, int channel, int enable, int low, int high, int hysteresis)
+{
+  struct usbthing_ctrl_s cmd;
+
+  if ((channel < USBTHING_ADC_CH0) || (channel > USBTHING_ADC_CH3)
+      || (low < 0) || (high > 0x0FFF) || (low > high) || (hysteresis < 0) || (hysteresis > 0x0FFF)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  cmd.adc_cmd.monitor_config.channel = channel;
+  cmd.adc_cmd.monitor_config.enable = (enable != 0) ? 1 : 0;
+  cmd.adc_cmd.monitor_config.low = low;
+  cmd.adc_cmd.monitor_config.high = high;
+  cmd.adc_cmd.monitor_config.hysteresis = hysteresis;
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_ADC,
+                              USBTHING_ADC_CMD_MONITOR_CONFIG,
+                              0,
+                              USBTHING_CMD_ADC_MONITOR_CONFIG_SIZE,
+                              cmd.data);
+}
+
+int USBTHING_adc_monitor_start(usbthing_t usbthing, unsigned int rate)
+{
+  struct usbthing_ctrl_s cmd;
+
+  if ((rate == 0) || (rate > USBTHING_ADC_MONITOR_MAX_RATE)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  cmd.adc_cmd.monitor_start.rate = rate;
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_ADC,
+                              USBTHING_ADC_CMD_MONITOR_START,
+                              0,
+                              USBTHING_CMD_ADC_MONITOR_START_SIZE,
+                              cmd.data);
+}
+
+int USBTHING_adc_monitor_stop(usbthing_t usbthing)
+{
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_ADC,
+                              USBTHING_ADC_CMD_MONITOR_STOP,
+                              0,
+                              USBTHING_CMD_ADC_MONITOR_STOP_SIZE,
+                              NULL);
+}
+
+/*****       DAC streaming       *****/
+
+int USBTHING_dac_stream_start(usbthing_t usbthing, unsigned int rate)
+{
+  struct usbthing_dac_stream_s *dac;
+  struct usbthing_ctrl_s cmd;
+  int res;
+
+  if ((usbthing->dac_stream != NULL) || (rate == 0) || (rate > USBTHING_DAC_STREAM_MAX_RATE)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  //Transfers complete on the async event thread
+  res = USBTHING_async_start(usbthing);
+  if (res < 0) {
+    return -1;
+  }
+
+  dac = calloc(1, sizeof(struct usbthing_dac_stream_s));
+  if (dac == NULL) {
+    return -2;
+  }
+
+  pthread_mutex_init(&dac->lock, NULL);
+  pthread_cond_init(&dac->cond, NULL);
+  dac->usbthing = usbthing;
+
+  for (int i = 0; i < USBTHING_STREAM_TRANSFERS; i++) {
+    dac->transfers[i] = libusb_alloc_transfer(0);
+    if (dac->transfers[i] == NULL) {
+      dac_stream_free(dac);
+      return -3;
+    }
+  }
+
+  cmd.dac_cmd.stream_start.rate = rate;
+
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_DAC,
+                             USBTHING_CMD_DAC_STREAM_START,
+                             0,
+                             USBTHING_CMD_DAC_STREAM_START_SIZE,
+                             cmd.data);
+  if (res < 0) {
+    dac_stream_free(dac);
+    return res;
+  }
+
+  dac->active = 1;
+  usbthing->dac_stream = dac;
+
+  USBTHING_DEBUG_PRINT("DAC stream started, rate %u\r\n", rate);
+
+  return 0;
+}
+
+int USBTHING_dac_stream_write(usbthing_t usbthing, const uint16_t *samples, int count, int timeout_ms)
+{
+  struct usbthing_dac_stream_s *dac = usbthing->dac_stream;
+  struct timespec deadline;
+  struct timeval now;
+  int space;
+  int res = 0;
+
+  if ((dac == NULL) || (count < 0)) {
+    return -1;
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  if (timeout_ms > 0) {
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 + (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec ++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+
+  pthread_mutex_lock(&dac->lock);
+  while ((dac->count == USBTHING_DAC_STREAM_RING_SIZE) && (dac->failed == 0) && (res == 0)) {
+    if (timeout_ms > 0) {
+      res = pthread_cond_timedwait(&dac->cond, &dac->lock, &deadline);
+    } else {
+      res = pthread_cond_wait(&dac->cond, &dac->lock);
+    }
+  }
+
+  if (dac->failed != 0) {
+    pthread_mutex_unlock(&dac->lock);
+    return USBTHING_ERROR_USB_FAILED;
+  }
+
+  space = USBTHING_DAC_STREAM_RING_SIZE - dac->count;
+  if (count > space) {
+    count = space;
+  }
+  for (int i = 0; i < count; i++) {
+    dac->ring[(dac->head + dac->count + i) % USBTHING_DAC_STREAM_RING_SIZE] = samples[i];
+  }
+  dac->count += count;
+
+  dac_stream_submit(dac);
+  pthread_mutex_unlock(&dac->lock);
+
+  if (count == 0) {
+    return USBTHING_ERROR_USB_TIMEOUT;
+  }
+
+  return count;
+}
+
+int USBTHING_dac_stream_flush(usbthing_t usbthing)
+{
+  struct usbthing_dac_stream_s *dac = usbthing->dac_stream;
+
+  if (dac == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&dac->lock);
+  dac->flush = 1;
+  dac_stream_submit(dac);
+  pthread_mutex_unlock(&dac->lock);
+
+  return 0;
+}
+
+int USBTHING_dac_stream_status(usbthing_t usbthing, int *queued, unsigned int *played, unsigned int *underruns)
+{
+  struct usbthing_dac_stream_s *dac = usbthing->dac_stream;
+  struct usbthing_ctrl_s cmd;
+  int res;
+
+  if (dac == NULL) {
+    return -1;
+  }
+
+  res = usbthing_control_get(usbthing,
+                             USBTHING_MODULE_DAC,
+                             USBTHING_CMD_DAC_STREAM_STATUS,
+                             0,
+                             USBTHING_CMD_DAC_STREAM_STATUS_SIZE,
+                             cmd.data);
+  if (res < 0) {
+    return res;
+  }
+
+  pthread_mutex_lock(&dac->lock);
+  *queued = dac->count + dac->in_flight + cmd.dac_cmd.stream_status.queued;
+  pthread_mutex_unlock(&dac->lock);
+  *played = cmd.dac_cmd.stream_status.played;
+  *underruns = cmd.dac_cmd.stream_status.underruns;
+
+  return cmd.dac_cmd.stream_status.state;
+}
+
+int USBTHING_dac_stream_stop(usbthing_t usbthing)
+{
+  struct usbthing_dac_stream_s *dac = usbthing->dac_stream;
+  int res;
+
+  if (dac == NULL) {
+    return -1;
+  }
+
+  //Stop the device first so it no longer accepts blocks, then cancel anything still queued
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_DAC,
+                             USBTHING_CMD_DAC_STREAM_STOP,
+                             0,
+                             USBTHING_CMD_DAC_STREAM_STOP_SIZE,
+                             NULL);
+
+  pthread_mutex_lock(&dac->lock);
+  dac->active = 0;
+  for (int i = 0; i < USBTHING_STREAM_TRANSFERS; i++) {
+    if (dac->busy[i] != 0) {
+      libusb_cancel_transfer(dac->transfers[i]);
+    }
+  }
+  while (dac->pending > 0) {
+    pthread_cond_wait(&dac->cond, &dac->lock);
+  }
+  pthread_mutex_unlock(&dac->lock);
+
+  usbthing->dac_stream = NULL;
+  dac_stream_free(dac);
+
+  USBTHING_DEBUG_PRINT("DAC stream stopped\r\n");
+
+  return res;
+}
+
+/*****       DAC function generator       *****/
+
+int USBTHING_dac_gen_load(usbthing_t usbthing, const int16_t *shape, int count)
+{
+  int transferred;
+  int res;
+
+  //The period is sent over the stream endpoint, so cannot be loaded while streaming
+  if ((shape == NULL) || (count < USBTHING_DAC_GEN_MIN_SAMPLES) || (count > USBTHING_DAC_GEN_MAX_SAMPLES)
+      || (usbthing->dac_stream != NULL)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_DAC,
+                             USBTHING_CMD_DAC_GEN_LOAD,
+                             count,
+                             USBTHING_CMD_DAC_GEN_LOAD_SIZE,
+                             NULL);
+  if (res < 0) {
+    return res;
+  }
+
+  res = libusb_bulk_transfer(usbthing->handle, USBTHING_EP_STREAM_OUT, (unsigned char *)shape,
+                             count * sizeof(int16_t), &transferred, USBTHING_TIMEOUT);
+  if (res < 0) {
+    perror("USBTHING DAC generator load error");
+    return res;
+  }
+
+  return 0;
+}
+
+int USBTHING_dac_gen_set(usbthing_t usbthing, int shape, float frequency, float amplitude, float offset)
+{
+  struct usbthing_ctrl_s cmd;
+  float amplitude_code = amplitude * 4096 / 3.3;
+  float offset_code = offset * 4096 / 3.3;
+
+  if ((shape < USBTHING_DAC_SHAPE_SINE) || (shape > USBTHING_DAC_SHAPE_ARBITRARY)
+      || (frequency <= 0) || (frequency > USBTHING_DAC_GEN_MAX_RATE / USBTHING_DAC_GEN_MIN_SAMPLES)
+      || (amplitude_code < 0) || (amplitude_code > 0x0FFF) || (offset_code < 0) || (offset_code > 0x0FFF)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  memset(&cmd.dac_cmd.gen_config, 0, sizeof(cmd.dac_cmd.gen_config));
+  cmd.dac_cmd.gen_config.shape = shape;
+  cmd.dac_cmd.gen_config.amplitude = (uint16_t)amplitude_code;
+  cmd.dac_cmd.gen_config.offset = (uint16_t)offset_code;
+  cmd.dac_cmd.gen_config.frequency = (uint32_t)(frequency * 1000 + 0.5);
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_DAC,
+                              USBTHING_CMD_DAC_GEN_SET,
+                              0,
+                              USBTHING_CMD_DAC_GEN_SET_SIZE,
+                              cmd.data);
+}
+
+int USBTHING_dac_gen_stop(usbthing_t usbthing)
+{
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_DAC,
+                              USBTHING_CMD_DAC_GEN_STOP,
+                              0,
+                              USBTHING_CMD_DAC_GEN_STOP_SIZE,
+                              NULL);
+}
+
+//Unpack a block, reordering each scan from device (descending) to ascending channel order
+static void adc_stream_block(struct usbthing_stream_s *stream, const uint8_t *data, int length)
+{
+  struct usbthing_adc_stream_s *adc = (struct usbthing_adc_stream_s *)stream->context;
+  const struct usbthing_adc_block_header_s *header = (const struct usbthing_adc_block_header_s *)data;
+  const uint16_t *raw = (const uint16_t *)(data + sizeof(struct usbthing_adc_block_header_s));
+  uint16_t decoded[USBTHING_ADC_BLOCK_MAX_SAMPLES];
+  uint16_t samples[USBTHING_ADC_BLOCK_MAX_SAMPLES];
+  struct usbthing_adc_block_s block;
+  int count;
+
+  if ((length < (int)sizeof(struct usbthing_adc_block_header_s)) || (header->samples > USBTHING_ADC_BLOCK_MAX_SAMPLES)) {
+    return;
+  }
+
+  count = header->samples - header->samples % adc->scan;
+
+  if (header->encoding == USBTHING_ADC_ENCODING_DELTA) {
+    if (adc_stream_decode(data + sizeof(struct usbthing_adc_block_header_s),
+                          length - sizeof(struct usbthing_adc_block_header_s), decoded, count, adc->scan) < 0) {
+      return;
+    }
+    raw = decoded;
+  } else if (length != USBTHING_ADC_BLOCK_SIZE) {
+    return;
+  }
+
+  for (int i = 0; i < count; i += adc->scan) {
+    for (int j = 0; j < adc->scan; j++) {
+      samples[i + j] = raw[i + adc->scan - 1 - j];
+    }
+  }
+
+  pthread_mutex_lock(&stream->lock);
+
+  //Sequence gaps are blocks dropped on the device
+  if ((adc->started != 0) && (header->sequence != adc->next_sequence)) {
+    adc->lost += header->sequence - adc->next_sequence;
+  }
+  adc->next_sequence = header->sequence + 1;
+  adc->started = 1;
+  adc->blocks ++;
+
+  if (adc->callback == NULL) {
+    if (adc->count + count <= USBTHING_ADC_STREAM_RING_SIZE) {
+      for (int i = 0; i < count; i++) {
+        adc->ring[(adc->head + adc->count + i) % USBTHING_ADC_STREAM_RING_SIZE] = samples[i];
+      }
+      adc->count += count;
+      pthread_cond_broadcast(&stream->cond);
+    } else {
+      adc->lost ++;
+    }
+  }
+
+  pthread_mutex_unlock(&stream->lock);
+
+  if (adc->callback != NULL) {
+    block.channels = header->channels;
+    block.count = adc->scan;
+    block.samples = count;
+    block.sequence = header->sequence;
+    block.timestamp = header->timestamp;
+    block.data = samples;
+
+    adc->callback(&block, adc->context);
+  }
+}
+
+//Decode a delta encoded block (see usbthing_adc_encoding_e) in device scan order, returns the bytes used.
+//Slowly varying signals encode almost entirely to single bytes, so eight bytes are checked at once
+//and decoded without per byte branching when none continue into a second byte.
+static int adc_stream_decode(const uint8_t *data, int length, uint16_t *samples, int count, int scan)
+{
+  uint16_t previous[USBTHING_ADC_CH3 + 1] = {0};
+  uint64_t word;
+  uint32_t zigzag;
+  int channel = 0;
+  int in = 0;
+  int i = 0;
+
+  while (i < count) {
+    if ((in + 8 <= length) && (i + 8 <= count)) {
+      memcpy(&word, data + in, sizeof(word));
+      if ((word & 0x8080808080808080ULL) == 0) {
+        for (int j = 0; j < 8; j++) {
+          zigzag = data[in + j];
+          previous[channel] += (uint16_t)((zigzag >> 1) ^ -(zigzag & 1));
+          samples[i + j] = previous[channel];
+          channel = (channel + 1 == scan) ? 0 : channel + 1;
+        }
+        in += 8;
+        i += 8;
+        continue;
+      }
+    }
+
+    if (in >= length) {
+      return -1;
+    }
+    zigzag = data[in ++];
+    if (zigzag & 0x80) {
+      if (in >= length) {
+        return -1;
+      }
+      zigzag = (zigzag & 0x7F) | ((uint32_t)data[in ++] << 7);
+    }
+    previous[channel] += (uint16_t)((zigzag >> 1) ^ -(zigzag & 1));
+    samples[i ++] = previous[channel];
+    channel = (channel + 1 == scan) ? 0 : channel + 1;
+  }
+
+  return in;
+}
+
+//Send queued samples in full blocks while transfers are free, and the remainder once flushed.
+//Called with the stream lock held.
+static void dac_stream_submit(struct usbthing_dac_stream_s *dac)
+{
+  while ((dac->active != 0) && (dac->failed == 0)) {
+    int index = -1;
+    int count;
+
+    for (int i = 0; i < USBTHING_STREAM_TRANSFERS; i++) {
+      if (dac->busy[i] == 0) {
+        index = i;
+        break;
+      }
+    }
+    if (index < 0) {
+      return;
+    }
+
+    count = (dac->count < (int)USBTHING_DAC_BLOCK_SAMPLES) ? dac->count : (int)USBTHING_DAC_BLOCK_SAMPLES;
+    if ((count < (int)USBTHING_DAC_BLOCK_SAMPLES) && (dac->flush == 0)) {
+      return;
+    }
+
+    for (int i = 0; i < count; i++) {
+      ((uint16_t *)dac->buffers[index])[i] = dac->ring[(dac->head + i) % USBTHING_DAC_STREAM_RING_SIZE];
+    }
+
+    //Short blocks end the device read, one filling whole packets needs a ZLP to do so.
+    //A flush with nothing left still sends the ZLP so the device starts on what it has.
+    libusb_fill_bulk_transfer(dac->transfers[index], dac->usbthing->handle, USBTHING_EP_STREAM_OUT,
+                              dac->buffers[index], count * sizeof(uint16_t),
+                              dac_stream_transfer_cb, dac, 0);
+    dac->transfers[index]->flags = (count < (int)USBTHING_DAC_BLOCK_SAMPLES) ? LIBUSB_TRANSFER_ADD_ZERO_PACKET : 0;
+
+    if (libusb_submit_transfer(dac->transfers[index]) != 0) {
+      dac->failed = 1;
+      pthread_cond_broadcast(&dac->cond);
+      return;
+    }
+
+    dac->busy[index] = 1;
+    dac->pending ++;
+    dac->in_flight += count;
+    dac->head = (dac->head + count) % USBTHING_DAC_STREAM_RING_SIZE;
+    dac->count -= count;
+
+    if (count < (int)USBTHING_DAC_BLOCK_SAMPLES) {
+      dac->flush = 0;
+    }
+
+    //Ring space has been freed for writers
+    pthread_cond_broadcast(&dac->cond);
+  }
+}
+
+//Called on the event thread for each completed block write
+static void LIBUSB_CALL dac_stream_transfer_cb(struct libusb_transfer *transfer)
+{
+  struct usbthing_dac_stream_s *dac = (struct usbthing_dac_stream_s *)transfer->user_data;
+
+  pthread_mutex_lock(&dac->lock);
+
+  for (int i = 0; i < USBTHING_STREAM_TRANSFERS; i++) {
+    if (dac->transfers[i] == transfer) {
+      dac->busy[i] = 0;
+    }
+  }
+  dac->pending --;
+  dac->in_flight -= transfer->length / sizeof(uint16_t);
+
+  if ((transfer->status != LIBUSB_TRANSFER_COMPLETED) && (transfer->status != LIBUSB_TRANSFER_CANCELLED)) {
+    dac->failed = 1;
+  }
+
+  dac_stream_submit(dac);
+
+  pthread_cond_broadcast(&dac->cond);
+  pthread_mutex_unlock(&dac->lock);
+}
+
+static void dac_stream_free(struct usbthing_dac_stream_s *dac)
+{
+  for (int i = 0; i < USBTHING_STREAM_TRANSFERS; i++) {
+    if (dac->transfers[i] != NULL) {
+      libusb_free_transfer(dac->transfers[i]);
+    }
+  }
+
+  pthread_mutex_destroy(&dac->lock);
+  pthread_cond_destroy(&dac->cond);
+
+  free(dac);
+}
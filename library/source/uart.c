@@ -0,0 +1,367 @@
+/**
+ * @brief USB Thing UART bridge
+ * @details Received bytes are streamed from the UART IN endpoint into a host ring on the async event thread,
+ * written bytes are queued in a second ring and sent to the UART OUT endpoint as transfers complete.
+ */
+
+#include "usbthing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "libusb-1.0/libusb.h"
+
+#include "protocol.h"
+#include "usbthing_internal.h"
+
+//Internal helpers
+static void uart_rx_block(struct usbthing_stream_s *stream, const uint8_t *data, int length);
+static void uart_tx_submit(struct usbthing_uart_s *uart);
+static void LIBUSB_CALL uart_tx_transfer_cb(struct libusb_transfer *transfer);
+static void uart_free(struct usbthing_uart_s *uart);
+
+int USBTHING_uart_configure(usbthing_t usbthing, unsigned int baud, int data_bits, int parity, int stop_bits)
+{
+  struct usbthing_uart_s *uart = usbthing->uart;
+  struct usbthing_ctrl_s cmd;
+  int res;
+
+  if ((baud < USBTHING_UART_MIN_BAUD) || (baud > USBTHING_UART_MAX_BAUD)
+      || ((data_bits != 7) && (data_bits != 8))
+      || (parity < USBTHING_UART_PARITY_NONE) || (parity > USBTHING_UART_PARITY_ODD)
+      || ((stop_bits != 1) && (stop_bits != 2))) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  memset(&cmd.uart_cmd.config, 0, sizeof(cmd.uart_cmd.config));
+  cmd.uart_cmd.config.baud = baud;
+  cmd.uart_cmd.config.data_bits = data_bits;
+  cmd.uart_cmd.config.parity = parity;
+  cmd.uart_cmd.config.stop_bits = stop_bits;
+
+  //Already open, only the framing changes
+  if (uart != NULL) {
+    return usbthing_control_set(usbthing,
+                                USBTHING_MODULE_UART,
+                                USBTHING_CMD_UART_CFG,
+                                0,
+                                USBTHING_CMD_UART_CFG_SIZE,
+                                cmd.data);
+  }
+
+  uart = calloc(1, sizeof(struct usbthing_uart_s));
+  if (uart == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_init(&uart->lock, NULL);
+  pthread_cond_init(&uart->cond, NULL);
+  uart->usbthing = usbthing;
+
+  for (int i = 0; i < USBTHING_STREAM_TRANSFERS; i++) {
+    uart->transfers[i] = libusb_alloc_transfer(0);
+    if (uart->transfers[i] == NULL) {
+      uart_free(uart);
+      return -2;
+    }
+  }
+
+  //Reads are queued before the device starts sending, also starting the async event thread
+  res = usbthing_stream_start(usbthing, &uart->rx, USBTHING_EP_UART_IN, USBTHING_UART_BLOCK_SIZE,
+                              uart_rx_block, uart);
+  if (res < 0) {
+    uart_free(uart);
+    return -3;
+  }
+
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_UART,
+                             USBTHING_CMD_UART_CFG,
+                             0,
+                             USBTHING_CMD_UART_CFG_SIZE,
+                             cmd.data);
+  if (res < 0) {
+    usbthing_stream_stop(&uart->rx);
+    uart_free(uart);
+    return res;
+  }
+
+  uart->active = 1;
+  usbthing->uart = uart;
+
+  USBTHING_DEBUG_PRINT("UART opened, baud %u\r\n", baud);
+
+  return 0;
+}
+
+int USBTHING_uart_read(usbthing_t usbthing, uint8_t *data, int size)
+{
+  struct usbthing_uart_s *uart = usbthing->uart;
+  int count;
+
+  if ((uart == NULL) || (size < 0)) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&uart->lock);
+  count = (size < uart->rx_count) ? size : uart->rx_count;
+  for (int i = 0; i < count; i++) {
+    data[i] = uart->rx_ring[(uart->rx_head + i) % USBTHING_UART_HOST_BUFFER_SIZE];
+  }
+  uart->rx_head = (uart->rx_head + count) % USBTHING_UART_HOST_BUFFER_SIZE;
+  uart->rx_count -= count;
+
+  //Re-arm the notification once back below the high-water mark
+  if (uart->rx_count < uart->high_water) {
+    uart->notified = 0;
+  }
+  pthread_mutex_unlock(&uart->lock);
+
+  return count;
+}
+
+int USBTHING_uart_write(usbthing_t usbthing, const uint8_t *data, int length)
+{
+  struct usbthing_uart_s *uart = usbthing->uart;
+  int space;
+
+  if ((uart == NULL) || (length < 0)) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&uart->lock);
+  if (uart->failed != 0) {
+    pthread_mutex_unlock(&uart->lock);
+    return USBTHING_ERROR_USB_FAILED;
+  }
+
+  space = USBTHING_UART_HOST_BUFFER_SIZE - uart->tx_count;
+  if (length > space) {
+    length = space;
+  }
+  for (int i = 0; i < length; i++) {
+    uart->tx_ring[(uart->tx_head + uart->tx_count + i) % USBTHING_UART_HOST_BUFFER_SIZE] = data[i];
+  }
+  uart->tx_count += length;
+
+  uart_tx_submit(uart);
+  pthread_mutex_unlock(&uart->lock);
+
+  return length;
+}
+
+int USBTHING_uart_notify(usbthing_t usbthing, int high_water, usbthing_uart_cb_t callback, void *context)
+{
+  struct usbthing_uart_s *uart = usbthing->uart;
+
+  if ((uart == NULL) || (high_water < 1) || (high_water > USBTHING_UART_HOST_BUFFER_SIZE)) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&uart->lock);
+  uart->high_water = high_water;
+  uart->callback = callback;
+  uart->context = context;
+  uart->notified = 0;
+  pthread_mutex_unlock(&uart->lock);
+
+  return 0;
+}
+
+int USBTHING_uart_status(usbthing_t usbthing, int *rx_available, int *tx_queued, unsigned int *lost,
+                         unsigned int *errors)
+{
+  struct usbthing_uart_s *uart = usbthing->uart;
+  struct usbthing_ctrl_s cmd;
+  int res;
+
+  if (uart == NULL) {
+    return -1;
+  }
+
+  res = usbthing_control_get(usbthing,
+                             USBTHING_MODULE_UART,
+                             USBTHING_CMD_UART_STATUS,
+                             0,
+                             USBTHING_CMD_UART_STATUS_SIZE,
+                             cmd.data);
+  if (res < 0) {
+    return res;
+  }
+
+  pthread_mutex_lock(&uart->lock);
+  if (rx_available != NULL) {
+    *rx_available = uart->rx_count + cmd.uart_cmd.status.rx_queued;
+  }
+  if (tx_queued != NULL) {
+    *tx_queued = uart->tx_count + uart->in_flight + cmd.uart_cmd.status.tx_queued;
+  }
+  if (lost != NULL) {
+    *lost = uart->lost + cmd.uart_cmd.status.lost;
+  }
+  pthread_mutex_unlock(&uart->lock);
+  if (errors != NULL) {
+    *errors = cmd.uart_cmd.status.errors;
+  }
+
+  return 0;
+}
+
+int USBTHING_uart_close(usbthing_t usbthing)
+{
+  struct usbthing_uart_s *uart = usbthing->uart;
+  int res;
+
+  if (uart == NULL) {
+    return -1;
+  }
+
+  //Stop the device first so it no longer accepts blocks, then cancel anything still queued
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_UART,
+                             USBTHING_CMD_UART_STOP,
+                             0,
+                             USBTHING_CMD_UART_STOP_SIZE,
+                             NULL);
+
+  pthread_mutex_lock(&uart->lock);
+  uart->active = 0;
+  for (int i = 0; i < USBTHING_STREAM_TRANSFERS; i++) {
+    if (uart->busy[i] != 0) {
+      libusb_cancel_transfer(uart->transfers[i]);
+    }
+  }
+  while (uart->pending > 0) {
+    pthread_cond_wait(&uart->cond, &uart->lock);
+  }
+  pthread_mutex_unlock(&uart->lock);
+
+  usbthing_stream_stop(&uart->rx);
+  usbthing->uart = NULL;
+  uart_free(uart);
+
+  USBTHING_DEBUG_PRINT("UART closed\r\n");
+
+  return res;
+}
+
+//Buffer a received block, dropping the oldest bytes if the ring is full, and notify once past the mark
+static void uart_rx_block(struct usbthing_stream_s *stream, const uint8_t *data, int length)
+{
+  struct usbthing_uart_s *uart = (struct usbthing_uart_s *)stream->context;
+  usbthing_uart_cb_t callback = NULL;
+  void *context = NULL;
+  int available = 0;
+  int overflow;
+
+  pthread_mutex_lock(&uart->lock);
+
+  overflow = uart->rx_count + length - USBTHING_UART_HOST_BUFFER_SIZE;
+  if (overflow > 0) {
+    uart->rx_head = (uart->rx_head + overflow) % USBTHING_UART_HOST_BUFFER_SIZE;
+    uart->rx_count -= overflow;
+    uart->lost += overflow;
+  }
+
+  for (int i = 0; i < length; i++) {
+    uart->rx_ring[(uart->rx_head + uart->rx_count + i) % USBTHING_UART_HOST_BUFFER_SIZE] = data[i];
+  }
+  uart->rx_count += length;
+
+  if ((uart->callback != NULL) && (uart->notified == 0) && (uart->rx_count >= uart->high_water)) {
+    uart->notified = 1;
+    callback = uart->callback;
+    context = uart->context;
+    available = uart->rx_count;
+  }
+
+  pthread_mutex_unlock(&uart->lock);
+
+  //Outside the lock so the callback may read
+  if (callback != NULL) {
+    callback(available, context);
+  }
+}
+
+//Send queued bytes while transfers are free, partial blocks are sent at once rather than waiting to fill.
+//Called with the bridge lock held.
+static void uart_tx_submit(struct usbthing_uart_s *uart)
+{
+  while ((uart->active != 0) && (uart->failed == 0) && (uart->tx_count > 0)) {
+    int index = -1;
+    int count;
+
+    for (int i = 0; i < USBTHING_STREAM_TRANSFERS; i++) {
+      if (uart->busy[i] == 0) {
+        index = i;
+        break;
+      }
+    }
+    if (index < 0) {
+      return;
+    }
+
+    count = (uart->tx_count < USBTHING_UART_BLOCK_SIZE) ? uart->tx_count : USBTHING_UART_BLOCK_SIZE;
+    for (int i = 0; i < count; i++) {
+      uart->buffers[index][i] = uart->tx_ring[(uart->tx_head + i) % USBTHING_UART_HOST_BUFFER_SIZE];
+    }
+
+    //Short blocks end the device read, one filling whole packets needs a ZLP to do so
+    libusb_fill_bulk_transfer(uart->transfers[index], uart->usbthing->handle, USBTHING_EP_UART_OUT,
+                              uart->buffers[index], count,
+                              uart_tx_transfer_cb, uart, 0);
+    uart->transfers[index]->flags = (count < USBTHING_UART_BLOCK_SIZE) ? LIBUSB_TRANSFER_ADD_ZERO_PACKET : 0;
+
+    if (libusb_submit_transfer(uart->transfers[index]) != 0) {
+      uart->failed = 1;
+      return;
+    }
+
+    uart->busy[index] = 1;
+    uart->pending ++;
+    uart->in_flight += count;
+    uart->tx_head = (uart->tx_head + count) % USBTHING_UART_HOST_BUFFER_SIZE;
+    uart->tx_count -= count;
+  }
+}
+
+//Called on the event thread for each completed block write
+static void LIBUSB_CALL uart_tx_transfer_cb(struct libusb_transfer *transfer)
+{
+  struct usbthing_uart_s *uart = (struct usbthing_uart_s *)transfer->user_data;
+
+  pthread_mutex_lock(&uart->lock);
+
+  for (int i = 0; i < USBTHING_STREAM_TRANSFERS; i++) {
+    if (uart->transfers[i] == transfer) {
+      uart->busy[i] = 0;
+    }
+  }
+  uart->pending --;
+  uart->in_flight -= transfer->length;
+
+  if ((transfer->status != LIBUSB_TRANSFER_COMPLETED) && (transfer->status != LIBUSB_TRANSFER_CANCELLED)) {
+    uart->failed = 1;
+  }
+
+  uart_tx_submit(uart);
+
+  pthread_cond_broadcast(&uart->cond);
+  pthread_mutex_unlock(&uart->lock);
+}
+
+static void uart_free(struct usbthing_uart_s *uart)
+{
+  for (int i = 0; i < USBTHING_STREAM_TRANSFERS; i++) {
+    if (uart->transfers[i] != NULL) {
+      libusb_free_transfer(uart->transfers[i]);
+    }
+  }
+
+  pthread_mutex_destroy(&uart->lock);
+  pthread_cond_destroy(&uart->cond);
+
+  free(uart);
+}
@@ -15,27 +15,20 @@
 #include "libusb-1.0/libusb.h"
 
 #include "protocol.h"
-
-#define CONTROL_REQUEST_TYPE_IN  (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE)
-#define CONTROL_REQUEST_TYPE_OUT  (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE)
-#define USBTHING_TIMEOUT        0       //Zero for debug purposes (no timeout)
-#define USBTHING_BUFFER_SIZE    64
-
-//#define DEBUG_USBTHING
-
-#ifdef DEBUG_USBTHING
-#define USBTHING_DEBUG_PRINT(...) printf(__VA_ARGS__)
-#else
-#define USBTHING_DEBUG_PRINT(...)
-#endif
-
-//USBThing storage structure
-struct usbthing_s {
-  libusb_device_handle *handle;
-};
+#include "usbthing_internal.h"
 
 static void print_buffer(uint8_t length, uint8_t *buffer);
 static void print_devs(libusb_device **devs, uint16_t vid_filter, uint16_t pid_filter);
+static int spi_queue(usbthing_t usbthing, int depth, int total, int chunk,
+                     unsigned char *data_out, unsigned char *data_in);
+static int spi_transaction(usbthing_t usbthing, int length, unsigned char *data_out, unsigned char *data_in);
+static int i2c_transfer(usbthing_t usbthing, int mode, int address,
+                        int length_out, unsigned char *data_out,
+                        int length_in, unsigned char *data_in);
+static int i2c_exchange(usbthing_t usbthing, uint8_t *request, int request_length,
+                        uint8_t *response, int response_length);
+static int gpio_configure(usbthing_t usbthing, int pin, int output, int pull_enabled, int pull_up, int edge);
+static uint16_t pwm_duty(float duty_cycle);
 
 int USBTHING_init()
 {
@@ -75,6 +68,12 @@ int USBTHING_connect(usbthing_t *usbthing, uint16_t vid_filter, uint16_t pid_fil
     return -1;
   }
 
+  (*usbthing)->async = NULL;
+  (*usbthing)->events = NULL;
+  (*usbthing)->adc_stream = NULL;
+  (*usbthing)->dac_stream = NULL;
+  (*usbthing)->uart = NULL;
+
   //Connect to device
   (*usbthing)->handle = libusb_open_device_with_vid_pid(NULL, vid_filter, pid_filter);
 
@@ -103,6 +102,23 @@ int USBTHING_disconnect(usbthing_t *usbthing)
     return -1;
   }
 
+  //Stop streams and asynchronous engine if running
+  if ((*usbthing)->adc_stream != NULL) {
+    USBTHING_adc_stream_stop(*usbthing);
+  }
+  if ((*usbthing)->dac_stream != NULL) {
+    USBTHING_dac_stream_stop(*usbthing);
+  }
+  if ((*usbthing)->uart != NULL) {
+    USBTHING_uart_close(*usbthing);
+  }
+  if ((*usbthing)->events != NULL) {
+    USBTHING_event_stop(*usbthing);
+  }
+  if ((*usbthing)->async != NULL) {
+    USBTHING_async_stop(*usbthing);
+  }
+
   libusb_close((*usbthing)->handle);
 
   (*usbthing)->handle = NULL;
@@ -112,7 +128,7 @@ int USBTHING_disconnect(usbthing_t *usbthing)
   return 0;
 }
 
-static int control_set(usbthing_t usbthing, uint32_t service, uint32_t operation, uint32_t index, uint8_t size, uint8_t* data) {
+int usbthing_control_set(usbthing_t usbthing, uint32_t service, uint32_t operation, uint32_t index, uint16_t size, uint8_t* data) {
   int res;
 
   int response_length;
@@ -137,7 +153,7 @@ static int control_set(usbthing_t usbthing, uint32_t service, uint32_t operation
   return res;
 }
 
-static int control_get(usbthing_t usbthing, uint32_t service, uint32_t operation, uint32_t index, uint8_t size, uint8_t* data) {
+int usbthing_control_get(usbthing_t usbthing, uint32_t service, uint32_t operation, uint32_t index, uint16_t size, uint8_t* data) {
   int res;
 
   int response_length;
@@ -168,12 +184,12 @@ int USBTHING_get_firmware_version(usbthing_t usbthing, int length, char *version
 
   struct usbthing_ctrl_s cmd;
 
-  res = control_get(usbthing,
-                    USBTHING_MODULE_BASE,
-                    BASE_CMD_FIRMWARE_GET,
-                    0,
-                    USBTHING_CMD_FIRMWARE_GET_SIZE,
-                    cmd.data);
+  res = usbthing_control_get(usbthing,
+                             USBTHING_MODULE_BASE,
+                             BASE_CMD_FIRMWARE_GET,
+                             0,
+                             USBTHING_CMD_FIRMWARE_GET_SIZE,
+                             cmd.data);
 
   if (res >= 0) {
     USBTHING_DEBUG_PRINT("firmware: %s\n", cmd.base_cmd.firmware_get.version);
@@ -193,12 +209,12 @@ int USBTHING_led_set(usbthing_t usbthing, int led, int enable)
   cmd.base_cmd.led_set.pin = led;
   cmd.base_cmd.led_set.enable = enable;
 
-  res = control_set(usbthing,
-                    USBTHING_MODULE_BASE,
-                    BASE_CMD_LED_SET,
-                    0,
-                    USBTHING_CMD_LED_SET_SIZE,
-                    cmd.data);
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_BASE,
+                             BASE_CMD_LED_SET,
+                             0,
+                             USBTHING_CMD_LED_SET_SIZE,
+                             cmd.data);
 
   return res;
 }
@@ -207,17 +223,27 @@ int USBTHING_reset(usbthing_t usbthing)
 {
   int res;
 
-  res = control_set(usbthing,
-                    USBTHING_MODULE_BASE,
-                    BASE_CMD_RESET,
-                    0,
-                    USBTHING_CMD_RESET_SIZE,
-                    NULL);
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_BASE,
+                             BASE_CMD_RESET,
+                             0,
+                             USBTHING_CMD_RESET_SIZE,
+                             NULL);
 
   return res;
 }
 
 int USBTHING_gpio_configure(usbthing_t usbthing, int pin, int output, int pull_enabled, int pull_up)
+{
+  return gpio_configure(usbthing, pin, output, pull_enabled, pull_up, USBTHING_GPIO_INT_DISABLE);
+}
+
+int USBTHING_gpio_configure_int(usbthing_t usbthing, int pin, int pull_enabled, int pull_up, int edge)
+{
+  return gpio_configure(usbthing, pin, 0, pull_enabled, pull_up, edge);
+}
+
+static int gpio_configure(usbthing_t usbthing, int pin, int output, int pull_enabled, int pull_up, int edge)
 {
   int res;
   struct usbthing_ctrl_s cmd;
@@ -230,14 +256,14 @@ int USBTHING_gpio_configure(usbthing_t usbthing, int pin, int output, int pull_e
   } else {
     cmd.gpio_cmd.config.pull = (pull_up == 0) ? USBTHING_GPIO_PULL_LOW : USBTHING_GPIO_PULL_HIGH;
   }
-  cmd.gpio_cmd.config.interrupt = 0;
+  cmd.gpio_cmd.config.interrupt = edge;
 
-  res = control_set(usbthing,
-                    USBTHING_MODULE_GPIO,
-                    USBTHING_GPIO_CMD_CONFIG,
-                    0,
-                    USBTHING_CMD_GPIO_CFG_SIZE,
-                    cmd.data);
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_GPIO,
+                             USBTHING_GPIO_CMD_CONFIG,
+                             0,
+                             USBTHING_CMD_GPIO_CFG_SIZE,
+                             cmd.data);
 
   return res;
 }
@@ -252,12 +278,12 @@ int USBTHING_gpio_set(usbthing_t usbthing, int pin, int value)
   cmd.gpio_cmd.set.pin = pin;
   cmd.gpio_cmd.set.level = value;
 
-  res = control_set(usbthing,
-                    USBTHING_MODULE_GPIO,
-                    USBTHING_GPIO_CMD_SET,
-                    0,
-                    USBTHING_CMD_GPIO_SET_SIZE,
-                    cmd.data);
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_GPIO,
+                             USBTHING_GPIO_CMD_SET,
+                             0,
+                             USBTHING_CMD_GPIO_SET_SIZE,
+                             cmd.data);
 
   return res;
 }
@@ -269,12 +295,12 @@ int USBTHING_gpio_get(usbthing_t usbthing, int pin, int *value)
 
   //TODO: Sanity check mode and pin inputs?
 
-  res = control_get(usbthing,
-                    USBTHING_MODULE_GPIO,
-                    USBTHING_GPIO_CMD_GET,
-                    pin,
-                    USBTHING_CMD_GPIO_GET_SIZE,
-                    cmd.data);
+  res = usbthing_control_get(usbthing,
+                             USBTHING_MODULE_GPIO,
+                             USBTHING_GPIO_CMD_GET,
+                             pin,
+                             USBTHING_CMD_GPIO_GET_SIZE,
+                             cmd.data);
 
   if (res >= 0) {
     (*value) = (cmd.gpio_cmd.get.level == 0) ? 0 : 1;
@@ -284,24 +310,191 @@ int USBTHING_gpio_get(usbthing_t usbthing, int pin, int *value)
 }
 
 
+int USBTHING_gpio_write_mask(usbthing_t usbthing, uint32_t set, uint32_t clear, uint32_t toggle)
+{
+  struct usbthing_ctrl_s cmd;
+
+  cmd.gpio_cmd.set_mask.set = set;
+  cmd.gpio_cmd.set_mask.clear = clear;
+  cmd.gpio_cmd.set_mask.toggle = toggle;
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_GPIO,
+                              USBTHING_GPIO_CMD_SET_MASK,
+                              0,
+                              USBTHING_CMD_GPIO_SET_MASK_SIZE,
+                              cmd.data);
+}
+
+int USBTHING_gpio_read_mask(usbthing_t usbthing, uint32_t *levels)
+{
+  int res;
+  struct usbthing_ctrl_s cmd;
+
+  res = usbthing_control_get(usbthing,
+                             USBTHING_MODULE_GPIO,
+                             USBTHING_GPIO_CMD_GET_MASK,
+                             0,
+                             USBTHING_CMD_GPIO_GET_MASK_SIZE,
+                             cmd.data);
+
+  if (res >= 0) {
+    (*levels) = cmd.gpio_cmd.get_mask.levels;
+  }
+
+  return res;
+}
+
 int USBTHING_gpio_get_int(usbthing_t usbthing, int pin, int *value)
 {
-  return -1;
+  struct usbthing_event_s event;
+  int res;
+
+  if (usbthing->events == NULL) {
+    res = USBTHING_event_start(usbthing, NULL, NULL);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  if (usbthing_event_take(usbthing, USBTHING_EVENT_SOURCE_GPIO, pin, &event) == 0) {
+    return 0;
+  }
+
+  *value = event.value;
+
+  return 1;
+}
+
+//Duty cycle fraction to protocol units, clamped to the valid range
+static uint16_t pwm_duty(float duty_cycle)
+{
+  if (duty_cycle <= 0) {
+    return 0;
+  } else if (duty_cycle >= 1) {
+    return USBTHING_PWM_DUTY_FULL;
+  }
+  return (uint16_t)(duty_cycle * USBTHING_PWM_DUTY_FULL + 0.5);
 }
 
 int USBTHING_pwm_configure(usbthing_t usbthing, unsigned int frequency)
 {
-  return -1;
+  struct usbthing_ctrl_s cmd;
+
+  if ((frequency < USBTHING_PWM_MIN_FREQUENCY) || (frequency > USBTHING_PWM_MAX_FREQUENCY)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  memset(&cmd.pwm_cmd.pwm_cfg, 0, sizeof(cmd.pwm_cmd.pwm_cfg));
+  cmd.pwm_cmd.pwm_cfg.mode = PWM_MODE_OUTPUT;
+  cmd.pwm_cmd.pwm_cfg.output.freq = frequency;
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_PWM,
+                              USBTHING_CMD_PWM_CFG,
+                              0,
+                              USBTHING_CMD_PWM_CFG_SIZE,
+                              cmd.data);
 }
 
 int USBTHING_pwm_enable(usbthing_t usbthing, int channel, int enable)
 {
-  return -1;
+  struct usbthing_ctrl_s cmd;
+
+  if ((channel < 0) || (channel >= USBTHING_PWM_NUM_CHANNELS)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  cmd.pwm_cmd.enable.channel = channel;
+  cmd.pwm_cmd.enable.enable = (enable != 0);
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_PWM,
+                              USBTHING_CMD_PWM_EN,
+                              0,
+                              USBTHING_CMD_PWM_EN_SIZE,
+                              cmd.data);
+}
+
+int USBTHING_pwm_set(usbthing_t usbthing, int channel, float duty_cycle)
+{
+  struct usbthing_ctrl_s cmd;
+
+  if ((channel < 0) || (channel >= USBTHING_PWM_NUM_CHANNELS)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  memset(&cmd.pwm_cmd.set, 0, sizeof(cmd.pwm_cmd.set));
+  cmd.pwm_cmd.set.channel = channel;
+  cmd.pwm_cmd.set.duty_cycle = pwm_duty(duty_cycle);
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_PWM,
+                              USBTHING_CMD_PWM_SET,
+                              0,
+                              USBTHING_CMD_PWM_SET_SIZE,
+                              cmd.data);
+}
+
+int USBTHING_pwm_update(usbthing_t usbthing, const float *duty_cycles)
+{
+  struct usbthing_ctrl_s cmd;
+
+  for (int i = 0; i < USBTHING_PWM_NUM_CHANNELS; i++) {
+    cmd.pwm_cmd.update.duty_cycle[i] = pwm_duty(duty_cycles[i]);
+  }
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_PWM,
+                              USBTHING_CMD_PWM_UPDATE,
+                              0,
+                              USBTHING_CMD_PWM_UPDATE_SIZE,
+                              cmd.data);
+}
+
+int USBTHING_pwm_capture(usbthing_t usbthing, int channel, int num_waves, unsigned int timeout_ms)
+{
+  struct usbthing_ctrl_s cmd;
+
+  if ((channel < 0) || (channel >= USBTHING_PWM_NUM_CHANNELS)
+      || (num_waves < 1) || (num_waves > USBTHING_PWM_CAPTURE_MAX_WAVES)
+      || (timeout_ms == 0) || (timeout_ms > USBTHING_PWM_CAPTURE_MAX_TIMEOUT)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  memset(&cmd.pwm_cmd.pwm_cfg, 0, sizeof(cmd.pwm_cmd.pwm_cfg));
+  cmd.pwm_cmd.pwm_cfg.mode = PWM_MODE_CAPTURE;
+  cmd.pwm_cmd.pwm_cfg.capture.num_waves = num_waves;
+  cmd.pwm_cmd.pwm_cfg.capture.timeout_ms = timeout_ms;
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_PWM,
+                              USBTHING_CMD_PWM_CFG,
+                              channel,
+                              USBTHING_CMD_PWM_CFG_SIZE,
+                              cmd.data);
 }
 
-int USBTHING_pwm_set(usbthing_t usbthing, int channel, int duty_cycle)
+int USBTHING_pwm_capture_status(usbthing_t usbthing, int *state, float *frequency, float *duty_cycle, int *waves)
 {
-  return -1;
+  struct usbthing_ctrl_s cmd;
+  int res;
+
+  res = usbthing_control_get(usbthing,
+                             USBTHING_MODULE_PWM,
+                             USBTHING_CMD_PWM_GET,
+                             0,
+                             USBTHING_CMD_PWM_GET_SIZE,
+                             cmd.data);
+
+  if (res >= 0) {
+    *state = cmd.pwm_cmd.get.state;
+    *frequency = (float)cmd.pwm_cmd.get.frequency / 1000;
+    *duty_cycle = (float)cmd.pwm_cmd.get.duty_cycle / USBTHING_PWM_DUTY_FULL;
+    *waves = cmd.pwm_cmd.get.waves;
+  }
+
+  return res;
 }
 
 int USBTHING_dac_configure(usbthing_t usbthing)
@@ -309,12 +502,12 @@ int USBTHING_dac_configure(usbthing_t usbthing)
   int res;
   struct usbthing_ctrl_s cmd;
 
-  res = control_set(usbthing,
-                    USBTHING_MODULE_DAC,
-                    USBTHING_CMD_DAC_CFG,
-                    0,
-                    USBTHING_CMD_DAC_CFG_SIZE,
-                    cmd.data);
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_DAC,
+                             USBTHING_CMD_DAC_CFG,
+                             0,
+                             USBTHING_CMD_DAC_CFG_SIZE,
+                             cmd.data);
 
   return res;
 }
@@ -328,16 +521,267 @@ int USBTHING_dac_set(usbthing_t usbthing, unsigned int enable, float value)
   cmd.dac_cmd.set.enable = (uint8_t)enable;
   cmd.dac_cmd.set.value = (uint16_t)(value * 4096 / 3.3);
 
-  res = control_set(usbthing,
-                    USBTHING_MODULE_DAC,
-                    USBTHING_CMD_DAC_SET,
-                    0,
-                    USBTHING_CMD_DAC_SET_SIZE,
-                    cmd.data);
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_DAC,
+                             USBTHING_CMD_DAC_SET,
+                             0,
+                             USBTHING_CMD_DAC_SET_SIZE,
+                             cmd.data);
+
+  return res;
+}
+
+int USBTHING_seq_store(usbthing_t usbthing, int program, usbthing_batch_t batch)
+{
+  int length = usbthing_batch_encode(batch);
+
+  if ((program < 0) || (program >= USBTHING_SEQ_MAX_PROGRAMS) || (length > USBTHING_SEQ_PROGRAM_MAX_SIZE)) {
+    return -1;
+  }
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_SEQ,
+                              USBTHING_SEQ_CMD_STORE,
+                              program,
+                              length,
+                              batch->request);
+}
+
+int USBTHING_seq_run(usbthing_t usbthing, int program)
+{
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_SEQ,
+                              USBTHING_SEQ_CMD_RUN,
+                              program,
+                              USBTHING_CMD_SEQ_RUN_SIZE,
+                              NULL);
+}
+
+int USBTHING_seq_stop(usbthing_t usbthing)
+{
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_SEQ,
+                              USBTHING_SEQ_CMD_STOP,
+                              0,
+                              USBTHING_CMD_SEQ_STOP_SIZE,
+                              NULL);
+}
+
+int USBTHING_seq_status(usbthing_t usbthing, int *state, int *result, unsigned int *ops_executed)
+{
+  int res;
+
+  struct usbthing_ctrl_s ctrl;
+
+  res = usbthing_control_get(usbthing,
+                             USBTHING_MODULE_SEQ,
+                             USBTHING_SEQ_CMD_STATUS,
+                             0,
+                             USBTHING_CMD_SEQ_STATUS_SIZE,
+                             ctrl.data);
+  if (res < 0) {
+    return res;
+  }
+
+  *state = ctrl.seq_cmd.status.state;
+  *result = ctrl.seq_cmd.status.result;
+  *ops_executed = ctrl.seq_cmd.status.ops_executed;
+
+  return 0;
+}
+
+int USBTHING_trigger_route(usbthing_t usbthing, int sink, int source, int pin, int edge)
+{
+  struct usbthing_ctrl_s cmd;
+
+  if ((sink < 0) || (sink >= USBTHING_TRIGGER_NUM_SINKS)
+      || (source < USBTHING_TRIGGER_SOURCE_GPIO) || (source > USBTHING_TRIGGER_SOURCE_OUTPUT_CLOCK)
+      || ((source == USBTHING_TRIGGER_SOURCE_GPIO)
+          && ((pin < 0) || (pin > 5) || (edge < USBTHING_TRIGGER_EDGE_RISING) || (edge > USBTHING_TRIGGER_EDGE_BOTH)))) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  memset(&cmd.trigger_cmd.route, 0, sizeof(cmd.trigger_cmd.route));
+  cmd.trigger_cmd.route.sink = sink;
+  cmd.trigger_cmd.route.source = source;
+  cmd.trigger_cmd.route.pin = pin;
+  cmd.trigger_cmd.route.edge = edge;
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_TRIGGER,
+                              USBTHING_TRIGGER_CMD_ROUTE,
+                              0,
+                              USBTHING_CMD_TRIGGER_ROUTE_SIZE,
+                              cmd.data);
+}
+
+int USBTHING_trigger_clear(usbthing_t usbthing, int sink)
+{
+  if ((sink < 0) || (sink >= USBTHING_TRIGGER_NUM_SINKS)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_TRIGGER,
+                              USBTHING_TRIGGER_CMD_CLEAR,
+                              sink,
+                              USBTHING_CMD_TRIGGER_CLEAR_SIZE,
+                              NULL);
+}
+
+int USBTHING_counter_configure(usbthing_t usbthing, int mode, int pin_a, int pin_b, int falling,
+                               unsigned int report_ms)
+{
+  struct usbthing_ctrl_s cmd;
+
+  if (((mode != USBTHING_COUNTER_MODE_QUADRATURE) && (mode != USBTHING_COUNTER_MODE_SINGLE))
+      || (pin_a < 0) || (pin_a > 5) || (pin_b > 5) || (pin_a == pin_b)
+      || ((pin_b < 0) && (mode == USBTHING_COUNTER_MODE_QUADRATURE)) || (report_ms > UINT16_MAX)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  memset(&cmd.counter_cmd.config, 0, sizeof(cmd.counter_cmd.config));
+  cmd.counter_cmd.config.mode = mode;
+  cmd.counter_cmd.config.pin_a = pin_a;
+  cmd.counter_cmd.config.pin_b = (pin_b < 0) ? USBTHING_COUNTER_PIN_NONE : pin_b;
+  cmd.counter_cmd.config.falling = (falling != 0);
+  cmd.counter_cmd.config.report_ms = report_ms;
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_COUNTER,
+                              USBTHING_COUNTER_CMD_CONFIG,
+                              0,
+                              USBTHING_CMD_COUNTER_CONFIG_SIZE,
+                              cmd.data);
+}
+
+int USBTHING_counter_read(usbthing_t usbthing, int latch, int32_t *count, uint64_t *timestamp)
+{
+  struct usbthing_ctrl_s cmd;
+  int res;
+
+  res = usbthing_control_get(usbthing,
+                             USBTHING_MODULE_COUNTER,
+                             USBTHING_COUNTER_CMD_READ,
+                             (latch != 0) ? USBTHING_COUNTER_READ_LATCH : USBTHING_COUNTER_READ,
+                             USBTHING_CMD_COUNTER_READ_SIZE,
+                             cmd.data);
+
+  if (res >= 0) {
+    *count = cmd.counter_cmd.read.count;
+    if (timestamp != NULL) {
+      *timestamp = cmd.counter_cmd.read.timestamp;
+    }
+  }
+
+  return res;
+}
+
+int USBTHING_counter_stop(usbthing_t usbthing)
+{
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_COUNTER,
+                              USBTHING_COUNTER_CMD_STOP,
+                              0,
+                              USBTHING_CMD_COUNTER_STOP_SIZE,
+                              NULL);
+}
+
+int USBTHING_motion_configure(usbthing_t usbthing, int step_pin, int dir_pin, int invert, unsigned int report_ms)
+{
+  struct usbthing_ctrl_s cmd;
+
+  if ((step_pin < 0) || (step_pin > 5) || (dir_pin < 0) || (dir_pin > 5) || (step_pin == dir_pin)
+      || (report_ms > UINT16_MAX)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  memset(&cmd.motion_cmd.config, 0, sizeof(cmd.motion_cmd.config));
+  cmd.motion_cmd.config.step_pin = step_pin;
+  cmd.motion_cmd.config.dir_pin = dir_pin;
+  cmd.motion_cmd.config.invert = (invert != 0);
+  cmd.motion_cmd.config.report_ms = report_ms;
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_MOTION,
+                              USBTHING_MOTION_CMD_CONFIG,
+                              0,
+                              USBTHING_CMD_MOTION_CONFIG_SIZE,
+                              cmd.data);
+}
+
+int USBTHING_motion_move(usbthing_t usbthing, int32_t target, unsigned int speed, unsigned int acceleration)
+{
+  struct usbthing_ctrl_s cmd;
+
+  if ((speed == 0) || (speed > USBTHING_MOTION_MAX_SPEED)
+      || (acceleration == 0) || (acceleration > USBTHING_MOTION_MAX_ACCELERATION)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  cmd.motion_cmd.move.target = target;
+  cmd.motion_cmd.move.speed = speed;
+  cmd.motion_cmd.move.acceleration = acceleration;
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_MOTION,
+                              USBTHING_MOTION_CMD_MOVE,
+                              0,
+                              USBTHING_CMD_MOTION_MOVE_SIZE,
+                              cmd.data);
+}
+
+int USBTHING_motion_stop(usbthing_t usbthing, int halt)
+{
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_MOTION,
+                              USBTHING_MOTION_CMD_STOP,
+                              (halt != 0) ? USBTHING_MOTION_STOP_HALT : USBTHING_MOTION_STOP_DECELERATE,
+                              USBTHING_CMD_MOTION_STOP_SIZE,
+                              NULL);
+}
+
+int USBTHING_motion_status(usbthing_t usbthing, int *moving, int32_t *position, int32_t *target,
+                           unsigned int *speed)
+{
+  struct usbthing_ctrl_s cmd;
+  int res;
+
+  res = usbthing_control_get(usbthing,
+                             USBTHING_MODULE_MOTION,
+                             USBTHING_MOTION_CMD_STATUS,
+                             0,
+                             USBTHING_CMD_MOTION_STATUS_SIZE,
+                             cmd.data);
+
+  if (res >= 0) {
+    *moving = cmd.motion_cmd.status.moving;
+    *position = cmd.motion_cmd.status.position;
+    if (target != NULL) {
+      *target = cmd.motion_cmd.status.target;
+    }
+    if (speed != NULL) {
+      *speed = cmd.motion_cmd.status.speed;
+    }
+  }
 
   return res;
 }
 
+int USBTHING_motion_set_position(usbthing_t usbthing, int32_t position)
+{
+  struct usbthing_ctrl_s cmd;
+
+  cmd.motion_cmd.position.position = position;
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_MOTION,
+                              USBTHING_MOTION_CMD_POSITION,
+                              0,
+                              USBTHING_CMD_MOTION_POSITION_SIZE,
+                              cmd.data);
+}
+
 int USBTHING_adc_configure(usbthing_t usbthing, unsigned int reference)
 {
   int res;
@@ -346,12 +790,12 @@ int USBTHING_adc_configure(usbthing_t usbthing, unsigned int reference)
 
   ctrl.adc_cmd.config.ref = reference;
 
-  res = control_set(usbthing,
-                    USBTHING_MODULE_ADC,
-                    USBTHING_ADC_CMD_CONFIG,
-                    0,
-                    USBTHING_CMD_ADC_CONFIG_SIZE,
-                    ctrl.data);
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_ADC,
+                             USBTHING_ADC_CMD_CONFIG,
+                             0,
+                             USBTHING_CMD_ADC_CONFIG_SIZE,
+                             ctrl.data);
 
   return res;
 }
@@ -362,18 +806,36 @@ int USBTHING_adc_get(usbthing_t usbthing, int channel, float *value)
 
   struct usbthing_ctrl_s ctrl;
 
-  res = control_get(usbthing,
-                    USBTHING_MODULE_ADC,
-                    USBTHING_ADC_CMD_GET,
-                    channel,
-                    USBTHING_CMD_ADC_GET_SIZE,
-                    ctrl.data);
+  res = usbthing_control_get(usbthing,
+                             USBTHING_MODULE_ADC,
+                             USBTHING_ADC_CMD_GET,
+                             channel,
+                             USBTHING_CMD_ADC_GET_SIZE,
+                             ctrl.data);
 
-  *value = (float)ctrl.adc_cmd.get.value / 4096 * 3.3;
+  *value = (float)ctrl.adc_cmd.get.value / USBTHING_ADC_FULL_SCALE * 3.3;
 
   return res;
 }
 
+int USBTHING_adc_oversample(usbthing_t usbthing, int shift)
+{
+  struct usbthing_ctrl_s ctrl;
+
+  if ((shift < 0) || (shift > USBTHING_ADC_OVERSAMPLE_MAX)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  ctrl.adc_cmd.oversample.shift = shift;
+
+  return usbthing_control_set(usbthing,
+                              USBTHING_MODULE_ADC,
+                              USBTHING_ADC_CMD_OVERSAMPLE,
+                              0,
+                              USBTHING_CMD_ADC_OVERSAMPLE_SIZE,
+                              ctrl.data);
+}
+
 
 int USBTHING_spi_configure(usbthing_t usbthing, unsigned int speed, int mode)
 {
@@ -384,12 +846,12 @@ int USBTHING_spi_configure(usbthing_t usbthing, unsigned int speed, int mode)
   ctrl.spi_cmd.config.freq_le = speed;
   ctrl.spi_cmd.config.clk_mode = mode;
 
-  res = control_set(usbthing,
-                    USBTHING_MODULE_SPI,
-                    USBTHING_SPI_CMD_CONFIG,
-                    0,
-                    USBTHING_CMD_SPI_CONFIG_SIZE,
-                    ctrl.data);
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_SPI,
+                             USBTHING_SPI_CMD_CONFIG,
+                             0,
+                             USBTHING_CMD_SPI_CONFIG_SIZE,
+                             ctrl.data);
 
   return res;
 }
@@ -399,6 +861,10 @@ int USBTHING_spi_transfer(usbthing_t usbthing, int length, unsigned char *data_o
   int res;
   int transferred;
 
+  if (length > USBTHING_SPI_MAX_SIZE) {
+    return spi_transaction(usbthing, length, data_out, data_in);
+  }
+
   USBTHING_DEBUG_PRINT("SPI write: ");
   //print_buffer(length, data_out);
   USBTHING_DEBUG_PRINT("\r\n");
@@ -412,8 +878,8 @@ int USBTHING_spi_transfer(usbthing_t usbthing, int length, unsigned char *data_o
   }
 
   //Check if ZLP is required to signify end of transfer
-  //(Required if length is multiple of endpoint size)
-  if ((length > 0) && (length % 64 == 0)) {
+  //(Required if length is multiple of endpoint size and does not fill the device buffer)
+  if ((length > 0) && (length % 64 == 0) && (length < USBTHING_SPI_MAX_SIZE)) {
     res = libusb_bulk_transfer (usbthing->handle, 0x01, NULL, 0, &transferred, USBTHING_TIMEOUT);
   }
 
@@ -442,6 +908,108 @@ int USBTHING_spi_transfer(usbthing_t usbthing, int length, unsigned char *data_o
   return 0;
 }
 
+//Queue total bytes as back to back bulk transfers of at most chunk bytes, keeping up to depth in flight
+static int spi_queue(usbthing_t usbthing, int depth, int total, int chunk,
+                     unsigned char *data_out, unsigned char *data_in)
+{
+  usbthing_xfer_t xfers[USBTHING_SPI_STREAM_MAX_DEPTH];
+  int count = (total + chunk - 1) / chunk;
+  int submitted = 0;
+  int completed = 0;
+  int result = 0;
+  int res;
+
+  if (usbthing->async == NULL) {
+    res = USBTHING_async_start(usbthing);
+    if (res < 0) {
+      return -2;
+    }
+  }
+
+  while (completed < submitted || (submitted < count && result == 0)) {
+
+    //Keep the queue topped up so the device always has the next transfer waiting
+    while ((result == 0) && (submitted < count) && (submitted - completed < depth)) {
+      int offset = submitted * chunk;
+      int length = (total - offset < chunk) ? (total - offset) : chunk;
+
+      res = USBTHING_async_spi_transfer(usbthing, length,
+                                        data_out + offset,
+                                        data_in + offset,
+                                        NULL, NULL, &xfers[submitted % depth]);
+      if (res < 0) {
+        result = res;
+        break;
+      }
+      submitted ++;
+    }
+
+    if (completed == submitted) {
+      break;
+    }
+
+    //Wait for the oldest transfer, transfers complete in order
+    res = USBTHING_async_wait(xfers[completed % depth], 0);
+    USBTHING_async_release(xfers[completed % depth]);
+    completed ++;
+
+    //On failure, abandon queued transfers and drain the queue
+    if ((res < 0) && (result == 0)) {
+      result = res;
+      for (int i = completed; i < submitted; i++) {
+        USBTHING_async_cancel(xfers[i % depth]);
+      }
+    }
+  }
+
+  USBTHING_DEBUG_PRINT("SPI queue complete: %d of %d transfers\r\n", completed, count);
+
+  return (result < 0) ? result : 0;
+}
+
+int USBTHING_spi_stream(usbthing_t usbthing, int depth, int count, int length,
+                        unsigned char *data_out, unsigned char *data_in)
+{
+  if ((depth < 1) || (depth > USBTHING_SPI_STREAM_MAX_DEPTH)
+      || (length < 1) || (length > USBTHING_SPI_MAX_SIZE)) {
+    return -1;
+  }
+
+  return spi_queue(usbthing, depth, count * length, length, data_out, data_in);
+}
+
+//Transaction larger than a single device buffer, streamed in chunks with CS held throughout
+static int spi_transaction(usbthing_t usbthing, int length, unsigned char *data_out, unsigned char *data_in)
+{
+  int res;
+
+  struct usbthing_ctrl_s ctrl;
+
+  ctrl.spi_cmd.xfer_init.bytes_out = length;
+  ctrl.spi_cmd.xfer_init.bytes_in = length;
+
+  res = usbthing_control_set(usbthing,
+                             USBTHING_MODULE_SPI,
+                             USBTHING_SPI_CMD_XFER_INIT,
+                             0,
+                             USBTHING_CMD_SPI_XFER_INIT_SIZE,
+                             ctrl.data);
+  if (res < 0) {
+    return res;
+  }
+
+  res = spi_queue(usbthing, USBTHING_SPI_TRANSACTION_DEPTH, length, USBTHING_SPI_MAX_SIZE, data_out, data_in);
+  if (res < 0) {
+    //Release CS on the device
+    ctrl.spi_cmd.xfer_init.bytes_out = 0;
+    ctrl.spi_cmd.xfer_init.bytes_in = 0;
+    usbthing_control_set(usbthing, USBTHING_MODULE_SPI, USBTHING_SPI_CMD_XFER_INIT, 0,
+                         USBTHING_CMD_SPI_XFER_INIT_SIZE, ctrl.data);
+  }
+
+  return res;
+}
+
 int USBTHING_spi_close(usbthing_t usbthing)
 {
   int res;
@@ -484,194 +1052,259 @@ int USBTHING_i2c_write(usbthing_t usbthing,
                        int address,
                        int length_out, unsigned char *data_out)
 {
-  uint8_t output_buffer[USBTHING_BUFFER_SIZE];
-  uint8_t input_buffer[USBTHING_BUFFER_SIZE];
+  return i2c_transfer(usbthing, USBTHING_I2C_MODE_WRITE, address, length_out, data_out, 0, NULL);
+}
+
+int USBTHING_i2c_read(usbthing_t usbthing,
+                      int address,
+                      int length_in, unsigned char *data_in)
+{
+  return i2c_transfer(usbthing, USBTHING_I2C_MODE_READ, address, 0, NULL, length_in, data_in);
+}
+
+int USBTHING_i2c_write_read(usbthing_t usbthing,
+                            int address,
+                            int length_out, unsigned char *data_out,
+                            int length_in, unsigned char *data_in)
+{
+  return i2c_transfer(usbthing, USBTHING_I2C_MODE_WRITE_READ, address, length_out, data_out, length_in, data_in);
+}
+
+int USBTHING_i2c_transfer(usbthing_t usbthing, int count, struct usbthing_i2c_message_s *messages)
+{
+  uint8_t output_buffer[USBTHING_I2C_BUFFER_SIZE];
+  uint8_t input_buffer[USBTHING_I2C_BUFFER_SIZE];
+  struct usbthing_i2c_messages_s *config = (struct usbthing_i2c_messages_s *) output_buffer;
+  struct usbthing_i2c_messages_s *response = (struct usbthing_i2c_messages_s *) input_buffer;
+  struct usbthing_i2c_msg_s *msgs = (struct usbthing_i2c_msg_s *) (output_buffer + sizeof(struct usbthing_i2c_messages_s));
   int output_buffer_length;
+  int input_buffer_length = sizeof(struct usbthing_i2c_messages_s);
+  int read_offset;
   int res;
-  int transferred;
 
-  struct usbthing_i2c_transfer_s *config = (struct usbthing_i2c_transfer_s *) output_buffer;
+  if ((count <= 0) || (count > USBTHING_I2C_MAX_MESSAGES)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
 
-  //Configure transfer
-  config->mode = USBTHING_I2C_MODE_WRITE;
-  config->address = address;
-  config->num_write = length_out;
+  //Message headers, followed by the write data in order
+  config->mode = USBTHING_I2C_MODE_MESSAGES;
+  config->count = count;
+  config->completed = 0;
+  config->result = 0;
 
-  //Copy data
-  memcpy(output_buffer + sizeof(struct usbthing_i2c_transfer_s), data_out, length_out);
-  output_buffer_length = length_out + sizeof(struct usbthing_i2c_transfer_s);
+  output_buffer_length = sizeof(struct usbthing_i2c_messages_s) + count * sizeof(struct usbthing_i2c_msg_s);
 
-  USBTHING_DEBUG_PRINT("I2C write: ");
-  print_buffer(length_out, data_out);
+  for (int i = 0; i < count; i++) {
+    int read = ((messages[i].flags & USBTHING_I2C_MSG_FLAG_READ) != 0) ? 1 : 0;
 
-  res = libusb_bulk_transfer (usbthing->handle,
-                              0x02,
-                              output_buffer,
-                              output_buffer_length,
-                              &transferred,
-                              USBTHING_TIMEOUT);
+    if ((messages[i].length < 0) || (messages[i].length > USBTHING_I2C_MAX_SIZE)
+        || ((read != 0) && (messages[i].length == 0))) {
+      return USBTHING_ERROR_INVALID_REQUEST;
+    }
 
-  //TODO: check for complete transfer
+    msgs[i].address = messages[i].address;
+    msgs[i].flags = read ? USBTHING_I2C_MSG_FLAG_READ : 0;
+    msgs[i].length = messages[i].length;
+
+    if (read != 0) {
+      input_buffer_length += messages[i].length;
+    } else {
+      if (output_buffer_length + messages[i].length > USBTHING_I2C_BUFFER_SIZE) {
+        return USBTHING_ERROR_INVALID_REQUEST;
+      }
+      if (messages[i].length > 0) {
+        memcpy(output_buffer + output_buffer_length, messages[i].data, messages[i].length);
+      }
+      output_buffer_length += messages[i].length;
+    }
+  }
+
+  if (input_buffer_length > USBTHING_I2C_BUFFER_SIZE) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
+
+  res = i2c_exchange(usbthing, output_buffer, output_buffer_length, input_buffer, input_buffer_length);
   if (res < 0) {
-    perror("USBTHING i2c write outgoing error");
-    return -1;
+    return res;
   }
 
-  if (length_out % 64 == 0) {
-    res = libusb_bulk_transfer (usbthing->handle,
-                                0x02,
-                                NULL,
-                                0,
-                                &transferred,
-                                USBTHING_TIMEOUT);
+  if (res < (int)sizeof(struct usbthing_i2c_messages_s)) {
+    return USBTHING_ERROR_USB_FAILED;
   }
 
-  printf("I2C write complete\r\n");
+  if (response->result != USBTHING_ERROR_OK) {
+    USBTHING_DEBUG_PRINT("I2C messages failed after %d of %d\r\n", response->completed, count);
+    return response->result;
+  }
 
-  //Stub for write function response (written data)
-  res = libusb_bulk_transfer (usbthing->handle,
-                              0x82,
-                              input_buffer,
-                              sizeof(input_buffer),
-                              &transferred,
-                              USBTHING_TIMEOUT);
+  if (res != input_buffer_length) {
+    return USBTHING_ERROR_USB_FAILED;
+  }
 
-  //TODO: check for complete write
-  if (res < 0) {
-    perror("USBTHING i2c write incoming error");
-    return -2;
+  //Unpack read data in message order
+  read_offset = sizeof(struct usbthing_i2c_messages_s);
+  for (int i = 0; i < count; i++) {
+    if ((messages[i].flags & USBTHING_I2C_MSG_FLAG_READ) != 0) {
+      memcpy(messages[i].data, input_buffer + read_offset, messages[i].length);
+      read_offset += messages[i].length;
+    }
   }
 
-  return 0;
+  return USBTHING_ERROR_OK;
 }
 
-int USBTHING_i2c_read(usbthing_t usbthing,
-                      int address,
-                      int length_in, unsigned char *data_in)
+int USBTHING_i2c_scan(usbthing_t usbthing, int length, int *addresses)
 {
-  uint8_t output_buffer[USBTHING_BUFFER_SIZE];
-  int output_buffer_length;
+  uint8_t output_buffer[sizeof(struct usbthing_i2c_messages_s)];
+  uint8_t input_buffer[sizeof(struct usbthing_i2c_messages_s) + USBTHING_I2C_SCAN_SIZE];
+  struct usbthing_i2c_messages_s *config = (struct usbthing_i2c_messages_s *) output_buffer;
+  struct usbthing_i2c_messages_s *response = (struct usbthing_i2c_messages_s *) input_buffer;
+  uint8_t *present = input_buffer + sizeof(struct usbthing_i2c_messages_s);
+  int found = 0;
   int res;
-  int transferred;
-
-  struct usbthing_i2c_transfer_s *config;
-  config = (struct usbthing_i2c_transfer_s *) output_buffer;
 
-  //Configure transfer
-  config->mode = USBTHING_I2C_MODE_READ;
-  config->address = address;
-  config->num_read = length_in;
-
-  output_buffer_length = sizeof(struct usbthing_i2c_transfer_s);
-
-  res = libusb_bulk_transfer (usbthing->handle,
-                              0x02,
-                              output_buffer,
-                              output_buffer_length,
-                              &transferred,
-                              USBTHING_TIMEOUT);
+  config->mode = USBTHING_I2C_MODE_SCAN;
+  config->count = 0;
+  config->completed = 0;
+  config->result = 0;
 
-  //TODO: check for complete transfer
+  res = i2c_exchange(usbthing, output_buffer, sizeof(output_buffer), input_buffer, sizeof(input_buffer));
   if (res < 0) {
-    perror("USBTHING i2c read outgoing error");
-    return -1;
+    return res;
   }
 
-  if (output_buffer_length % 64 == 0) {
-    res = libusb_bulk_transfer (usbthing->handle,
-                                0x02,
-                                NULL,
-                                0,
-                                &transferred,
-                                USBTHING_TIMEOUT);
+  if (res < (int)sizeof(struct usbthing_i2c_messages_s)) {
+    return USBTHING_ERROR_USB_FAILED;
   }
 
+  if (response->result != USBTHING_ERROR_OK) {
+    return response->result;
+  }
 
-  res = libusb_bulk_transfer (usbthing->handle,
-                              0x82,
-                              data_in,
-                              length_in,
-                              &transferred,
-                              USBTHING_TIMEOUT);
-
-  //TODO: check for complete transfer
-  if (res < 0) {
-    perror("USBTHING i2c read incoming error");
-    return -2;
+  if (res != (int)sizeof(input_buffer)) {
+    return USBTHING_ERROR_USB_FAILED;
   }
 
-  USBTHING_DEBUG_PRINT("I2C Read: ");
-  print_buffer(transferred, data_in);
+  for (int address = USBTHING_I2C_SCAN_FIRST; address <= USBTHING_I2C_SCAN_LAST; address++) {
+    if ((present[address / 8] & (1 << (address % 8))) == 0) {
+      continue;
+    }
+    if ((addresses != NULL) && (found < length)) {
+      addresses[found] = address;
+    }
+    found ++;
+  }
 
-  return 0;
+  return found;
 }
 
-int USBTHING_i2c_write_read(usbthing_t usbthing,
-                            int address,
-                            int length_out, unsigned char *data_out,
-                            int length_in, unsigned char *data_in)
+//Single I2C transfer, the device responds with the header carrying the result and then any data read
+static int i2c_transfer(usbthing_t usbthing, int mode, int address,
+                        int length_out, unsigned char *data_out,
+                        int length_in, unsigned char *data_in)
 {
-  uint8_t output_buffer[USBTHING_BUFFER_SIZE];
+  uint8_t output_buffer[sizeof(struct usbthing_i2c_transfer_s) + USBTHING_I2C_MAX_SIZE];
+  uint8_t input_buffer[sizeof(struct usbthing_i2c_transfer_s) + USBTHING_I2C_MAX_SIZE];
+  struct usbthing_i2c_transfer_s *config = (struct usbthing_i2c_transfer_s *) output_buffer;
+  struct usbthing_i2c_transfer_s *response = (struct usbthing_i2c_transfer_s *) input_buffer;
   int output_buffer_length;
+  int input_buffer_length;
   int res;
-  int transferred;
 
-  struct usbthing_i2c_transfer_s *config;
-  config = (struct usbthing_i2c_transfer_s *) output_buffer;
+  if ((length_out < 0) || (length_out > USBTHING_I2C_MAX_SIZE)
+      || (length_in < 0) || (length_in > USBTHING_I2C_MAX_SIZE)) {
+    return USBTHING_ERROR_INVALID_REQUEST;
+  }
 
   //Configure transfer
-  config->mode = USBTHING_I2C_MODE_WRITE_READ;
+  config->mode = mode;
   config->address = address;
   config->num_write = length_out;
   config->num_read = length_in;
+  config->result = 0;
 
   //Copy data
-  memcpy(output_buffer + sizeof(struct usbthing_i2c_transfer_s), data_out, length_out);
+  if (length_out > 0) {
+    memcpy(output_buffer + sizeof(struct usbthing_i2c_transfer_s), data_out, length_out);
+  }
   output_buffer_length = length_out + sizeof(struct usbthing_i2c_transfer_s);
 
-  res = libusb_bulk_transfer (usbthing->handle,
-                              0x02,
-                              output_buffer,
-                              output_buffer_length,
-                              &transferred,
-                              USBTHING_TIMEOUT);
+  USBTHING_DEBUG_PRINT("I2C write: ");
+  print_buffer(length_out, data_out);
 
-  //TODO: check for complete transfer
+  //Failed transfers are answered with the header alone
+  input_buffer_length = sizeof(struct usbthing_i2c_transfer_s);
+  if (mode != USBTHING_I2C_MODE_WRITE) {
+    input_buffer_length += length_in;
+  }
+
+  res = i2c_exchange(usbthing, output_buffer, output_buffer_length, input_buffer, input_buffer_length);
   if (res < 0) {
-    perror("USBTHING i2c read write outgoing error");
-    return -1;
+    return res;
   }
 
-  if (length_out % 64 == 0) {
-    res = libusb_bulk_transfer (usbthing->handle,
-                                0x02,
-                                NULL,
-                                0,
-                                &transferred,
-                                USBTHING_TIMEOUT);
+  if (res < (int)sizeof(struct usbthing_i2c_transfer_s)) {
+    return USBTHING_ERROR_USB_FAILED;
   }
 
+  if (response->result != USBTHING_ERROR_OK) {
+    return response->result;
+  }
 
-  USBTHING_DEBUG_PRINT("I2C write: ");
-  print_buffer(length_out, data_out);
+  if (res != input_buffer_length) {
+    return USBTHING_ERROR_USB_FAILED;
+  }
+
+  if (mode != USBTHING_I2C_MODE_WRITE) {
+    memcpy(data_in, input_buffer + sizeof(struct usbthing_i2c_transfer_s), length_in);
+
+    USBTHING_DEBUG_PRINT("I2C Read: ");
+    print_buffer(length_in, data_in);
+  }
+
+  return USBTHING_ERROR_OK;
+}
+
+//Send an I2C request and receive its response, returning the response length
+static int i2c_exchange(usbthing_t usbthing, uint8_t *request, int request_length,
+                        uint8_t *response, int response_length)
+{
+  int res;
+  int transferred;
 
   res = libusb_bulk_transfer (usbthing->handle,
-                              0x82,
-                              data_in,
-                              length_in,
+                              USBTHING_EP_I2C_OUT,
+                              request,
+                              request_length,
                               &transferred,
                               USBTHING_TIMEOUT);
-
-  //TODO: check for complete transfer
   if (res < 0) {
-    perror("USBTHING i2c read write incoming error");
-    return -2;
+    perror("USBTHING i2c outgoing error");
+    return USBTHING_ERROR_USB_FAILED;
   }
 
-  USBTHING_DEBUG_PRINT("I2C Read: ");
-  print_buffer(transferred, data_in);
+  //Terminate packet-multiple requests that do not fill the device buffer
+  if ((request_length % 64 == 0) && (request_length < USBTHING_I2C_BUFFER_SIZE)) {
+    libusb_bulk_transfer (usbthing->handle,
+                          USBTHING_EP_I2C_OUT,
+                          NULL,
+                          0,
+                          &transferred,
+                          USBTHING_TIMEOUT);
+  }
 
-  return 0;
+  res = libusb_bulk_transfer (usbthing->handle,
+                              USBTHING_EP_I2C_IN,
+                              response,
+                              response_length,
+                              &transferred,
+                              USBTHING_TIMEOUT);
+  if (res < 0) {
+    perror("USBTHING i2c incoming error");
+    return USBTHING_ERROR_USB_FAILED;
+  }
+
+  return transferred;
 }
 
 static void print_buffer(uint8_t length, uint8_t *buffer)
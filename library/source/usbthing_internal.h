@@ -0,0 +1,261 @@
+/**
+ * @brief USB Thing Interface Library internals
+ * @details Definitions shared between the library source files, not installed
+ */
+
+#ifndef USBTHING_INTERNAL_H
+#define USBTHING_INTERNAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libusb-1.0/libusb.h"
+
+#include "usbthing.h"
+#include "protocol.h"
+
+#define CONTROL_REQUEST_TYPE_IN  (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE)
+#define CONTROL_REQUEST_TYPE_OUT  (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE)
+#define USBTHING_TIMEOUT        0       //Zero for debug purposes (no timeout)
+#define USBTHING_BUFFER_SIZE    64
+
+#define USBTHING_EP_SPI_OUT     0x01
+#define USBTHING_EP_SPI_IN      0x81
+#define USBTHING_EP_I2C_OUT     0x02
+#define USBTHING_EP_I2C_IN      0x82
+#define USBTHING_EP_EVENT_IN    0x83
+#define USBTHING_EP_BATCH_OUT   0x04
+#define USBTHING_EP_BATCH_IN    0x84
+#define USBTHING_EP_STREAM_IN   0x85
+#define USBTHING_EP_STREAM_OUT  0x05
+#define USBTHING_EP_UART_IN     0x86
+#define USBTHING_EP_UART_OUT    0x06
+
+//#define DEBUG_USBTHING
+
+#ifdef DEBUG_USBTHING
+#define USBTHING_DEBUG_PRINT(...) printf(__VA_ARGS__)
+#else
+#define USBTHING_DEBUG_PRINT(...)
+#endif
+
+/*****       Asynchronous transfer engine       *****/
+
+#define USBTHING_ASYNC_POOL_SIZE        32      //Preallocated operations per device
+#define USBTHING_ASYNC_MAX_PARTS        3       //libusb transfers per operation (eg. OUT, ZLP, IN)
+#define USBTHING_ASYNC_BUFFER_SIZE      (LIBUSB_CONTROL_SETUP_SIZE + USBTHING_BUFFER_SIZE)
+#define USBTHING_ASYNC_SCRATCH_SIZE     (sizeof(struct usbthing_i2c_transfer_s) + USBTHING_I2C_MAX_SIZE)
+#define USBTHING_ASYNC_EVENT_TIMEOUT_US 100000
+
+#define USBTHING_SPI_STREAM_MAX_DEPTH   16      //Maximum queued transfers for SPI streaming
+#define USBTHING_SPI_TRANSACTION_DEPTH  4       //Queued chunks for transactions over USBTHING_SPI_MAX_SIZE
+
+struct usbthing_xfer_s;
+
+//Called on the event thread once all parts of an operation have completed successfully
+typedef void (*usbthing_xfer_finish_t)(struct usbthing_xfer_s *xfer);
+
+//Single asynchronous operation, composed of one or more libusb transfers
+struct usbthing_xfer_s {
+  struct usbthing_s *usbthing;
+  struct libusb_transfer *parts[USBTHING_ASYNC_MAX_PARTS];
+  int num_parts;
+  int pending;
+  int result;
+  int in_use;
+  int complete;
+  int owned;
+  usbthing_xfer_cb_t callback;
+  void *context;
+  usbthing_xfer_finish_t finish;
+  void *finish_data;
+  uint8_t buffer[USBTHING_ASYNC_BUFFER_SIZE];
+  uint8_t scratch[USBTHING_ASYNC_SCRATCH_SIZE];     //Responses unpacked by finish, eg. I2C
+};
+
+//Per device asynchronous engine state
+struct usbthing_async_s {
+  pthread_t thread;
+  volatile int running;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int in_flight;
+  struct usbthing_xfer_s xfers[USBTHING_ASYNC_POOL_SIZE];
+};
+
+/*****       Event stream       *****/
+
+#define USBTHING_EVENT_TRANSFERS        2       //Interrupt reads kept outstanding
+#define USBTHING_EVENT_QUEUE_SIZE       1024    //Events queued on the host when no callback is set
+
+//Per device event stream state
+struct usbthing_events_s {
+  struct usbthing_s *usbthing;
+  struct libusb_transfer *transfers[USBTHING_EVENT_TRANSFERS];
+  uint8_t buffers[USBTHING_EVENT_TRANSFERS][USBTHING_EVENT_PACKET_SIZE];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int active;
+  int pending;
+  usbthing_event_cb_t callback;
+  void *context;
+  int started;
+  uint32_t next_sequence;
+  int lost;
+  struct usbthing_event_s queue[USBTHING_EVENT_QUEUE_SIZE];
+  int head;
+  int count;
+};
+
+//Remove the oldest queued event from the given source and id, returns 1 if an event was found
+int usbthing_event_take(struct usbthing_s *usbthing, int source, int id, struct usbthing_event_s *event);
+
+/*****       Bulk IN streams       *****/
+
+#define USBTHING_STREAM_TRANSFERS       4       //Block reads kept outstanding
+#define USBTHING_ADC_STREAM_RING_SIZE   65536   //Samples buffered on the host when no callback is set
+
+struct usbthing_stream_s;
+
+//Called on the event thread for each block received
+typedef void (*usbthing_stream_block_t)(struct usbthing_stream_s *stream, const uint8_t *data, int length);
+
+//Continuous fixed size block reads from a bulk IN endpoint
+struct usbthing_stream_s {
+  struct usbthing_s *usbthing;
+  uint8_t endpoint;
+  int block_size;
+  struct libusb_transfer *transfers[USBTHING_STREAM_TRANSFERS];
+  uint8_t *buffers;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int active;
+  int pending;
+  usbthing_stream_block_t handler;
+  void *context;
+};
+
+int usbthing_stream_start(struct usbthing_s *usbthing, struct usbthing_stream_s *stream, uint8_t endpoint,
+                          int block_size, usbthing_stream_block_t handler, void *context);
+void usbthing_stream_stop(struct usbthing_stream_s *stream);
+
+//ADC stream state, blocks go to the callback if set, otherwise into the sample ring
+struct usbthing_adc_stream_s {
+  struct usbthing_stream_s stream;
+  usbthing_adc_block_cb_t callback;
+  void *context;
+  int channels;
+  int scan;
+  int started;
+  uint32_t next_sequence;
+  unsigned int blocks;
+  unsigned int lost;
+  uint16_t ring[USBTHING_ADC_STREAM_RING_SIZE];
+  int head;
+  int count;
+};
+
+/*****       Bulk OUT streams       *****/
+
+#define USBTHING_DAC_STREAM_RING_SIZE   65536   //Samples queued on the host
+#define USBTHING_DAC_BLOCK_SAMPLES      (USBTHING_DAC_BLOCK_SIZE / sizeof(uint16_t))
+
+//DAC stream state, written samples are queued in the ring and sent in blocks as transfers complete
+struct usbthing_dac_stream_s {
+  struct usbthing_s *usbthing;
+  struct libusb_transfer *transfers[USBTHING_STREAM_TRANSFERS];
+  uint8_t buffers[USBTHING_STREAM_TRANSFERS][USBTHING_DAC_BLOCK_SIZE];
+  int busy[USBTHING_STREAM_TRANSFERS];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int active;
+  int pending;
+  int flush;
+  int failed;
+  int in_flight;
+  uint16_t ring[USBTHING_DAC_STREAM_RING_SIZE];
+  int head;
+  int count;
+};
+
+/*****       UART bridge       *****/
+
+#define USBTHING_UART_HOST_BUFFER_SIZE  65536   //Bytes buffered on the host in each direction
+
+//UART bridge state, received blocks are buffered in the receive ring and written bytes are queued in the
+//transmit ring then sent in blocks as transfers complete
+struct usbthing_uart_s {
+  struct usbthing_stream_s rx;
+  struct usbthing_s *usbthing;
+  struct libusb_transfer *transfers[USBTHING_STREAM_TRANSFERS];
+  uint8_t buffers[USBTHING_STREAM_TRANSFERS][USBTHING_UART_BLOCK_SIZE];
+  int busy[USBTHING_STREAM_TRANSFERS];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int active;
+  int pending;
+  int failed;
+  int in_flight;
+  usbthing_uart_cb_t callback;
+  void *context;
+  int high_water;
+  int notified;
+  unsigned int lost;
+  uint8_t rx_ring[USBTHING_UART_HOST_BUFFER_SIZE];
+  int rx_head;
+  int rx_count;
+  uint8_t tx_ring[USBTHING_UART_HOST_BUFFER_SIZE];
+  int tx_head;
+  int tx_count;
+};
+
+/*****       Batch operations       *****/
+
+#define USBTHING_BATCH_MAX_OPS  ((USBTHING_BATCH_MAX_SIZE - sizeof(struct usbthing_batch_header_s)) \
+                                 / sizeof(struct usbthing_batch_op_s))
+
+//Destination for the results of a single batch operation
+struct usbthing_batch_entry_s {
+  uint8_t op;
+  int result_length;
+  union {
+    unsigned char *data;
+    int *gpio_value;
+    float *adc_value;
+  };
+};
+
+//Recorded batch, the request is encoded as operations are added
+struct usbthing_batch_s {
+  uint8_t id;
+  int count;
+  int request_length;
+  int response_length;
+  uint8_t request[USBTHING_BATCH_MAX_SIZE];
+  uint8_t response[USBTHING_BATCH_MAX_SIZE];
+  struct usbthing_batch_entry_s entries[USBTHING_BATCH_MAX_OPS];
+};
+
+//Fill in the request header, returns the encoded request length
+int usbthing_batch_encode(struct usbthing_batch_s *batch);
+
+//USBThing storage structure
+struct usbthing_s {
+  libusb_device_handle *handle;
+  struct usbthing_async_s *async;
+  struct usbthing_events_s *events;
+  struct usbthing_adc_stream_s *adc_stream;
+  struct usbthing_dac_stream_s *dac_stream;
+  struct usbthing_uart_s *uart;
+};
+
+//Blocking vendor control requests to a device service
+int usbthing_control_set(struct usbthing_s *usbthing, uint32_t service, uint32_t operation, uint32_t index,
+                         uint16_t size, uint8_t *data);
+int usbthing_control_get(struct usbthing_s *usbthing, uint32_t service, uint32_t operation, uint32_t index,
+                         uint16_t size, uint8_t *data);
+
+//Convert a libusb transfer status into a usbthing error code
+int usbthing_async_status(enum libusb_transfer_status status);
+
+#endif
@@ -7,18 +7,86 @@
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
+#include <sys/time.h>
 
 #include "usbthing.h"
 #include "protocol.h"
 
 #define SPI_BULK_TEST_SIZE		128
+#define SPI_STREAM_TEST_SIZE	256
+#define SPI_STREAM_TEST_COUNT	64
+#define SPI_STREAM_TEST_DEPTH	4
+#define ASYNC_TEST_COUNT		8
+#define ASYNC_TEST_SIZE			32
+#define ASYNC_TEST_TIMEOUT_MS	1000
+#define BATCH_TEST_SIZE			16
+#define BATCH_TEST_COUNT		8
+#define GPIO_EVENT_TEST_COUNT	8
+#define ADC_STREAM_TEST_RATE	50000
+#define ADC_STREAM_TEST_SECONDS	2
+#define ADC_STREAM_DELTA_TEST_RATE	40000
+#define ADC_SCOPE_TEST_RATE		500000
+#define ADC_SCOPE_TEST_PRE		1000
+#define ADC_SCOPE_TEST_POST		4000
+#define ADC_MONITOR_TEST_RATE	1000
+#define ADC_OVERSAMPLE_TEST_SHIFT	4
+#define DAC_STREAM_TEST_RATE	10000
+#define DAC_STREAM_TEST_SAMPLES	2000
+#define DAC_GEN_TEST_FREQUENCY	2
+#define DAC_GEN_TEST_READS		100
+#define TRIGGER_TEST_EDGES		16
+#define COUNTER_TEST_EDGES		50
+#define CONTROL_TEST_RATE		1000
+#define CONTROL_TEST_SETPOINT	1.65
+#define PWM_TEST_FREQUENCY		1000
+#define PWM_TEST_SAMPLES		4000
+#define PWM_CAPTURE_TEST_FREQUENCY	1000
+#define PWM_CAPTURE_TEST_WAVES	20
+#define MOTION_TEST_STEPS		400
+#define MOTION_TEST_SPEED		4000
+#define MOTION_TEST_ACCELERATION	20000
+#define UART_TEST_BAUD			921600
+#define UART_TEST_SIZE			4096
+#define I2C_TEST_ADDRESS		0x7F	//Reserved, so nothing should acknowledge it
+#define I2C_TEST_SIZE			16
+#define I2C_TEST_MAX_MS			100
+#define LOGIC_TEST_RATE			1000000
+#define LOGIC_TEST_PRE			1000
+#define LOGIC_TEST_POST			4000
+#define SEQ_TEST_LOOPS			10
+#define SEQ_TEST_DELAY_US		500
+#define SPI_LONG_TEST_SIZE		(16 * 1024 + 100)
+#define SPI_SPEED_TEST_SIZE		USBTHING_SPI_MAX_SIZE
+#define SPI_SPEED_TEST_COUNT	128
 
 static int test_adc(usbthing_t usbthing, int interactive);
 static int test_dac_adc(usbthing_t usbthing, int interactive);
+static int test_dac_stream(usbthing_t usbthing, int interactive);
+static int test_dac_gen(usbthing_t usbthing, int interactive);
+static int test_trigger(usbthing_t usbthing, int interactive);
+static int test_counter(usbthing_t usbthing, int interactive);
+static int test_control(usbthing_t usbthing, int interactive);
+static int test_pwm(usbthing_t usbthing, int interactive);
+static int test_pwm_capture(usbthing_t usbthing, int interactive);
+static int test_motion(usbthing_t usbthing, int interactive);
+static int test_uart(usbthing_t usbthing, int interactive);
+static int test_adc_monitor(usbthing_t usbthing, int interactive);
+static int test_adc_oversample(usbthing_t usbthing, int interactive);
+static int test_adc_stream(usbthing_t usbthing, int interactive);
+static int test_adc_scope(usbthing_t usbthing, int interactive);
 static int test_gpio(usbthing_t usbthing, int interactive);
 static int test_spi(usbthing_t usbthing, int interactive);
 static int test_spi_bulk(usbthing_t usbthing, int interactive);
+static int test_spi_stream(usbthing_t usbthing, int interactive);
+static int test_async(usbthing_t usbthing, int interactive);
+static int test_spi_throughput(usbthing_t usbthing, int interactive);
+static int test_spi_long(usbthing_t usbthing, int interactive);
 static int test_i2c(usbthing_t usbthing, int interactive);
+static int test_gpio_mask(usbthing_t usbthing, int interactive);
+static int test_gpio_events(usbthing_t usbthing, int interactive);
+static int test_logic(usbthing_t usbthing, int interactive);
+static int test_batch(usbthing_t usbthing, int interactive);
+static int test_seq(usbthing_t usbthing, int interactive);
 
 int self_test(usbthing_t usbthing, int interactive)
 {
@@ -31,6 +99,27 @@ int self_test(usbthing_t usbthing, int interactive)
 		printf("GPIO test OK\r\n");
 	}
 
+	res = test_gpio_mask(usbthing, interactive);
+	if (res < 0) {
+		printf("GPIO mask test failed: %d\r\n", res);
+	} else {
+		printf("GPIO mask test OK\r\n");
+	}
+
+	res = test_gpio_events(usbthing, interactive);
+	if (res < 0) {
+		printf("GPIO event test failed: %d\r\n", res);
+	} else {
+		printf("GPIO event test OK\r\n");
+	}
+
+	res = test_logic(usbthing, interactive);
+	if (res < 0) {
+		printf("Logic capture test failed: %d\r\n", res);
+	} else {
+		printf("Logic capture test OK\r\n");
+	}
+
 	res = test_spi(usbthing, interactive);
 	if (res < 0) {
 		printf("SPI test failed: %d\r\n", res);
@@ -45,6 +134,48 @@ int self_test(usbthing_t usbthing, int interactive)
 		printf("SPI test OK\r\n");
 	}
 
+	res = test_spi_stream(usbthing, interactive);
+	if (res < 0) {
+		printf("SPI stream test failed: %d\r\n", res);
+	} else {
+		printf("SPI stream test OK\r\n");
+	}
+
+	res = test_async(usbthing, interactive);
+	if (res < 0) {
+		printf("Async test failed: %d\r\n", res);
+	} else {
+		printf("Async test OK\r\n");
+	}
+
+	res = test_spi_long(usbthing, interactive);
+	if (res < 0) {
+		printf("SPI long transfer test failed: %d\r\n", res);
+	} else {
+		printf("SPI long transfer test OK\r\n");
+	}
+
+	res = test_spi_throughput(usbthing, interactive);
+	if (res < 0) {
+		printf("SPI throughput test failed: %d\r\n", res);
+	} else {
+		printf("SPI throughput test OK\r\n");
+	}
+
+	res = test_batch(usbthing, interactive);
+	if (res < 0) {
+		printf("Batch test failed: %d\r\n", res);
+	} else {
+		printf("Batch test OK\r\n");
+	}
+
+	res = test_seq(usbthing, interactive);
+	if (res < 0) {
+		printf("Sequencer test failed: %d\r\n", res);
+	} else {
+		printf("Sequencer test OK\r\n");
+	}
+
 	res = test_adc(usbthing, interactive);
 	if (res < 0) {
 		printf("ADC test failed: %d\r\n", res);
@@ -52,12 +183,110 @@ int self_test(usbthing_t usbthing, int interactive)
 		printf("ADC test OK\r\n");
 	}
 
+	res = test_adc_stream(usbthing, interactive);
+	if (res < 0) {
+		printf("ADC stream test failed: %d\r\n", res);
+	} else {
+		printf("ADC stream test OK\r\n");
+	}
+
+	res = test_adc_scope(usbthing, interactive);
+	if (res < 0) {
+		printf("ADC scope test failed: %d\r\n", res);
+	} else {
+		printf("ADC scope test OK\r\n");
+	}
+
 	res = test_dac_adc(usbthing, interactive);
 	if (res < 0) {
 		printf("DAC -> ADC test failed: %d\r\n", res);
 		return -1;
 	}
 
+	res = test_dac_stream(usbthing, interactive);
+	if (res < 0) {
+		printf("DAC stream test failed: %d\r\n", res);
+	} else {
+		printf("DAC stream test OK\r\n");
+	}
+
+	res = test_dac_gen(usbthing, interactive);
+	if (res < 0) {
+		printf("DAC generator test failed: %d\r\n", res);
+	} else {
+		printf("DAC generator test OK\r\n");
+	}
+
+	res = test_trigger(usbthing, interactive);
+	if (res < 0) {
+		printf("Trigger routing test failed: %d\r\n", res);
+	} else {
+		printf("Trigger routing test OK\r\n");
+	}
+
+	res = test_counter(usbthing, interactive);
+	if (res < 0) {
+		printf("Counter test failed: %d\r\n", res);
+	} else {
+		printf("Counter test OK\r\n");
+	}
+
+	res = test_control(usbthing, interactive);
+	if (res < 0) {
+		printf("Control loop test failed: %d\r\n", res);
+	} else {
+		printf("Control loop test OK\r\n");
+	}
+
+	res = test_pwm(usbthing, interactive);
+	if (res < 0) {
+		printf("PWM test failed: %d\r\n", res);
+	} else {
+		printf("PWM test OK\r\n");
+	}
+
+	res = test_pwm_capture(usbthing, interactive);
+	if (res < 0) {
+		printf("PWM capture test failed: %d\r\n", res);
+	} else {
+		printf("PWM capture test OK\r\n");
+	}
+
+	res = test_motion(usbthing, interactive);
+	if (res < 0) {
+		printf("Motion test failed: %d\r\n", res);
+	} else {
+		printf("Motion test OK\r\n");
+	}
+
+	res = test_uart(usbthing, interactive);
+	if (res < 0) {
+		printf("UART test failed: %d\r\n", res);
+	} else {
+		printf("UART test OK\r\n");
+	}
+
+	res = test_i2c(usbthing, interactive);
+	if (res < 0) {
+		printf("I2C test failed: %d\r\n", res);
+	} else {
+		printf("I2C test OK\r\n");
+	}
+
+	res = test_adc_monitor(usbthing, interactive);
+	if (res < 0) {
+		printf("ADC monitor test failed: %d\r\n", res);
+	} else {
+		printf("ADC monitor test OK\r\n");
+	}
+
+	res = test_adc_oversample(usbthing, interactive);
+	if (res < 0) {
+		printf("ADC oversample test failed: %d\r\n", res);
+	} else {
+		printf("ADC oversample test OK\r\n");
+	}
+
 	return 0;
 }
 
@@ -138,6 +367,107 @@ static int test_gpio(usbthing_t usbthing, int interactive)
 
 #define TEST_DATA_SIZE	32
 
+//Drive every combination of the odd pins with single mask writes and check the looped back even pins
+static int test_gpio_mask(usbthing_t usbthing, int interactive)
+{
+	uint32_t outputs = (1 << 1) | (1 << 3) | (1 << 5);
+	uint32_t pattern, expected, levels;
+	int res;
+
+	printf("GPIO mask test\r\n");
+
+	for (int i = 0; i < 6; i++) {
+		USBTHING_gpio_configure(usbthing, i, i % 2, 0, 0);
+	}
+
+	for (int i = 0; i < 8; i++) {
+		pattern = ((i & 1) << 1) | ((i & 2) << 2) | ((i & 4) << 3);
+
+		res = USBTHING_gpio_write_mask(usbthing, pattern, outputs & ~pattern, 0);
+		if (res < 0) {
+			printf("GPIO mask write error: %d\r\n", res);
+			return -1;
+		}
+
+		res = USBTHING_gpio_read_mask(usbthing, &levels);
+		if (res < 0) {
+			printf("GPIO mask read error: %d\r\n", res);
+			return -2;
+		}
+
+		//Each even input follows the odd output above it
+		expected = pattern | (pattern >> 1);
+		if ((levels & 0x3F) != expected) {
+			printf("GPIO mask read 0x%.2x expected 0x%.2x\r\n", levels & 0x3F, expected);
+			return -3;
+		}
+	}
+
+	//Toggling all outputs from the last pattern (all high) should read all low
+	USBTHING_gpio_write_mask(usbthing, 0, 0, outputs);
+	USBTHING_gpio_read_mask(usbthing, &levels);
+	if ((levels & 0x3F) != 0) {
+		printf("GPIO mask toggle read 0x%.2x expected 0x00\r\n", levels & 0x3F);
+		return -4;
+	}
+
+	return 0;
+}
+
+//Toggle an output looped back to an interrupt input and check an event arrives for each edge
+static int test_gpio_events(usbthing_t usbthing, int interactive)
+{
+	struct usbthing_event_s event;
+	uint64_t last_timestamp = 0;
+	int res;
+
+	printf("GPIO event test\r\n");
+
+	USBTHING_gpio_configure(usbthing, 1, 1, 0, 0);
+	USBTHING_gpio_set(usbthing, 1, 0);
+	USBTHING_gpio_configure_int(usbthing, 0, 0, 0, USBTHING_GPIO_INT_BOTH);
+
+	res = USBTHING_event_start(usbthing, NULL, NULL);
+	if (res < 0) {
+		printf("Event start error: %d\r\n", res);
+		return -1;
+	}
+
+	for (int i = 0; i < GPIO_EVENT_TEST_COUNT; i++) {
+		USBTHING_gpio_set(usbthing, 1, (i + 1) % 2);
+
+		res = USBTHING_event_get(usbthing, &event, 100);
+		if (res < 0) {
+			printf("No event for edge %d\r\n", i);
+			res = -2;
+			break;
+		}
+
+		if ((event.source != USBTHING_EVENT_SOURCE_GPIO) || (event.id != 0) || (event.value != (i + 1) % 2)) {
+			printf("Unexpected event %d: source %d id %d value %d\r\n", i, event.source, event.id, event.value);
+			res = -3;
+			break;
+		}
+
+		if (event.timestamp <= last_timestamp) {
+			printf("Event timestamp did not advance\r\n");
+			res = -4;
+			break;
+		}
+		last_timestamp = event.timestamp;
+	}
+
+	if ((res >= 0) && (USBTHING_event_lost(usbthing) != 0)) {
+		printf("Lost %d events\r\n", USBTHING_event_lost(usbthing));
+		res = -5;
+	}
+
+	USBTHING_event_stop(usbthing);
+	USBTHING_gpio_configure(usbthing, 0, 0, 0, 0);
+
+	return (res < 0) ? res : 0;
+}
+
 static int test_spi(usbthing_t usbthing, int interactive)
 {
 	uint8_t data_out[TEST_DATA_SIZE];
@@ -236,76 +566,1409 @@ static int test_spi_bulk(usbthing_t usbthing, int interactive)
 	return 0;
 }
 
-static int test_adc(usbthing_t usbthing, int interactive)
+static int test_spi_stream(usbthing_t usbthing, int interactive)
 {
-	float val;
+	static uint8_t data_out[SPI_STREAM_TEST_SIZE * SPI_STREAM_TEST_COUNT];
+	static uint8_t data_in[SPI_STREAM_TEST_SIZE * SPI_STREAM_TEST_COUNT];
+	int res;
 
-	printf("ADC test\r\n");
+	printf("SPI stream test\r\n");
 	if (interactive != 0) {
-		printf("Connect ADC ch 0 to 3V3, ADC ch 3 to GND, and press any key to continue\r\n");
-		printf("Note that the ADC GND and 3V3 are incorrectly labeled on the v0.2.0 board\r\n");
+		printf("Connect SPI MISO and MOSI pins and press any key to continue\r\n");
 		getchar();
 	}
 
-	USBTHING_adc_configure(usbthing, USBTHING_ADC_REF_VDD);
+	//Configure SPI device
+	USBTHING_spi_configure(usbthing, USBTHING_SPI_SPEED_1MHZ, USBTHING_SPI_CLOCK_MODE0);
 
-	USBTHING_adc_get(usbthing, 0, &val);
-	float expected_low = (3.3 * 0.005);
-	if (val > expected_low) {
-		printf("Error: channel 0 expected: < %.1f actual: %.1f\r\n", expected_low, val);
-		return -1;
+	for (int i = 0; i < sizeof(data_out); i++) {
+		data_out[i] = rand();
 	}
 
-	USBTHING_adc_get(usbthing, 3, &val);
-	float expected_high = (3.3 * 0.995);
-	if (val < expected_high) {
-		printf("Channel 3 expected: > %.1f actual: %.1f\r\n", expected_high, val);
+	res = USBTHING_spi_stream(usbthing, SPI_STREAM_TEST_DEPTH, SPI_STREAM_TEST_COUNT, SPI_STREAM_TEST_SIZE,
+	                          data_out, data_in);
+	if (res < 0) {
+		printf("SPI stream error: %d\r\n", res);
 		return -1;
 	}
 
+	//Compare sent and received values
+	if (memcmp(data_out, data_in, sizeof(data_out)) != 0) {
+		printf("SPI stream test data mismatch\r\n");
+		return -2;
+	}
+
+	printf("SPI stream transfers complete\r\n");
+
+	USBTHING_spi_close(usbthing);
+
 	return 0;
 }
 
-static int test_dac_adc(usbthing_t usbthing, int interactive)
+struct async_test_s {
+	int completed;
+	int failed;
+};
+
+static void test_async_cb(usbthing_xfer_t xfer, int result, void *context)
 {
-	char c;
-	float val;
-	float out;
+	struct async_test_s *test = (struct async_test_s *)context;
 
-	printf("DAC to ADC test\r\n");
+	(void)xfer;
+
+	test->completed ++;
+	if (result < 0) {
+		test->failed ++;
+	}
+}
+
+//SPI loopback transfers queued together through the async engine, the last with a handle to wait on
+static int test_async(usbthing_t usbthing, int interactive)
+{
+	uint8_t data_out[ASYNC_TEST_COUNT][ASYNC_TEST_SIZE];
+	uint8_t data_in[ASYNC_TEST_COUNT][ASYNC_TEST_SIZE];
+	struct async_test_s test = { 0, 0 };
+	usbthing_xfer_t xfer = NULL;
+	float value;
+	int res;
+
+	printf("Async test\r\n");
 	if (interactive != 0) {
-		printf("Connect DAC to ADC ch 2 and press any key to continue\r\n");
+		printf("Connect SPI MISO and MOSI pins and press any key to continue\r\n");
 		getchar();
 	}
 
-	USBTHING_adc_configure(usbthing, USBTHING_ADC_REF_VDD);
-	USBTHING_dac_configure(usbthing);
-
-	USBTHING_dac_set(usbthing, 1, 3.3);
-	usleep(1000);
-	USBTHING_adc_get(usbthing, 1, &val);
-	if (val < (3.3 * 0.990)) {
-		printf("DAC->ADC test error, expected: %.4f got: %.4f\r\n", 3.3, val);
+	res = USBTHING_async_start(usbthing);
+	if (res < 0) {
+		printf("Error %d starting async engine\r\n", res);
 		return -1;
 	}
 
-	USBTHING_dac_set(usbthing, 1, 0.0);
-	usleep(1000);
-	USBTHING_adc_get(usbthing, 1, &val);
-	if (val > (3.3 * 0.010)) {
-		printf("DAC->ADC test error, expected: %.4f got: %.4f\r\n", 0.0, val);
+	USBTHING_spi_configure(usbthing, USBTHING_SPI_SPEED_1MHZ, USBTHING_SPI_CLOCK_MODE0);
+
+	for (int i = 0; i < ASYNC_TEST_COUNT; i++) {
+		for (int j = 0; j < ASYNC_TEST_SIZE; j++) {
+			data_out[i][j] = rand();
+		}
+
+		res = USBTHING_async_spi_transfer(usbthing, ASYNC_TEST_SIZE, data_out[i], data_in[i], test_async_cb, &test,
+		                                  (i == ASYNC_TEST_COUNT - 1) ? &xfer : NULL);
+		if (res < 0) {
+			printf("Error %d queueing async SPI transfer %d\r\n", res, i);
+			return -2;
+		}
+	}
+
+	//Operations complete in order, so all have once the last has
+	res = USBTHING_async_wait(xfer, ASYNC_TEST_TIMEOUT_MS);
+	if ((res < 0) || (USBTHING_async_poll(xfer) != 1)) {
+		printf("Async SPI transfers did not complete: %d\r\n", res);
+		USBTHING_async_cancel(xfer);
+		USBTHING_async_release(xfer);
+		return -3;
+	}
+	USBTHING_async_release(xfer);
+
+	if ((test.completed != ASYNC_TEST_COUNT) || (test.failed != 0)) {
+		printf("Async SPI completed %d of %d with %d failures\r\n", test.completed, ASYNC_TEST_COUNT, test.failed);
+		return -4;
+	}
+
+	if (memcmp(data_out, data_in, sizeof(data_out)) != 0) {
+		printf("Async SPI test data mismatch\r\n");
+		return -5;
+	}
+
+	USBTHING_spi_close(usbthing);
+
+	//Control operations complete through the same engine
+	res = USBTHING_async_adc_get(usbthing, 0, &value, NULL, NULL, &xfer);
+	if (res < 0) {
+		printf("Error %d queueing async ADC read\r\n", res);
+		return -6;
+	}
+
+	res = USBTHING_async_wait(xfer, ASYNC_TEST_TIMEOUT_MS);
+	USBTHING_async_release(xfer);
+	if (res < 0) {
+		printf("Async ADC read failed: %d\r\n", res);
+		return -7;
+	}
+
+	if ((value < 0.0) || (value > 3.3)) {
+		printf("Async ADC read out of range: %f\r\n", value);
+		return -8;
+	}
+
+	return 0;
+}
+
+//SPI loopback and GPIO reads issued as a single batch
+//Capture a rising edge driven from an output looped back to GPIO0, run length encoded
+static int test_logic(usbthing_t usbthing, int interactive)
+{
+	uint8_t samples[LOGIC_TEST_PRE + LOGIC_TEST_POST];
+	int state, available;
+	int res;
+
+	printf("Logic capture test\r\n");
+
+	USBTHING_gpio_configure(usbthing, 1, 1, 0, 0);
+	USBTHING_gpio_set(usbthing, 1, 0);
+	USBTHING_gpio_configure(usbthing, 0, 0, 0, 0);
+
+	res = USBTHING_logic_configure(usbthing, LOGIC_TEST_RATE, LOGIC_TEST_PRE, LOGIC_TEST_POST,
+	                               USBTHING_LOGIC_TRIGGER_RISING, 0, 0, 0, USBTHING_LOGIC_ENCODING_RLE);
+	if (res < 0) {
+		printf("Logic configure error: %d\r\n", res);
 		return -1;
 	}
 
-	printf("DAC to ADC test complete\r\n");
+	res = USBTHING_logic_arm(usbthing);
+	if (res < 0) {
+		printf("Logic arm error: %d\r\n", res);
+		return -2;
+	}
+
+	//Edges are only considered once the pre-trigger samples are captured
+	for (int i = 0; i < 100; i++) {
+		res = USBTHING_logic_status(usbthing, &state, &available);
+		if ((res < 0) || (state == USBTHING_SCOPE_STATE_ARMED)) {
+			break;
+		}
+		usleep(1000);
+	}
+
+	USBTHING_gpio_set(usbthing, 1, 1);
+
+	for (int i = 0; i < 100; i++) {
+		res = USBTHING_logic_status(usbthing, &state, &available);
+		if ((res < 0) || (state == USBTHING_SCOPE_STATE_DONE)) {
+			break;
+		}
+		usleep(1000);
+	}
+
+	USBTHING_gpio_set(usbthing, 1, 0);
+
+	if ((res < 0) || (state != USBTHING_SCOPE_STATE_DONE) || (available != LOGIC_TEST_PRE + LOGIC_TEST_POST)) {
+		printf("Logic capture did not complete: state %d samples %d\r\n", state, available);
+		return -3;
+	}
+
+	res = USBTHING_logic_read(usbthing, samples, LOGIC_TEST_PRE + LOGIC_TEST_POST);
+	if (res != LOGIC_TEST_PRE + LOGIC_TEST_POST) {
+		printf("Logic read error: %d\r\n", res);
+		return -4;
+	}
+
+	if (((samples[LOGIC_TEST_PRE - 1] & 0x01) != 0) || ((samples[LOGIC_TEST_PRE] & 0x01) == 0)) {
+		printf("Logic trigger not at the edge: 0x%.2x 0x%.2x\r\n",
+		       samples[LOGIC_TEST_PRE - 1], samples[LOGIC_TEST_PRE]);
+		return -5;
+	}
 
 	return 0;
 }
 
-static int test_i2c(usbthing_t usbthing, int interactive)
+static int test_batch(usbthing_t usbthing, int interactive)
 {
+	uint8_t data_out[BATCH_TEST_COUNT][BATCH_TEST_SIZE];
+	uint8_t data_in[BATCH_TEST_COUNT][BATCH_TEST_SIZE];
+	int levels[BATCH_TEST_COUNT];
+	usbthing_batch_t batch;
+	int res;
+
+	printf("Batch test\r\n");
+	if (interactive != 0) {
+		printf("Connect SPI MISO and MOSI pins and press any key to continue\r\n");
+		getchar();
+	}
 
-	//I don't even know how to start this
+	batch = USBTHING_batch_create();
+	if (batch == NULL) {
+		return -1;
+	}
+
+	USBTHING_spi_configure(usbthing, USBTHING_SPI_SPEED_1MHZ, USBTHING_SPI_CLOCK_MODE0);
+
+	for (int i = 0; i < BATCH_TEST_COUNT; i++) {
+		for (int j = 0; j < BATCH_TEST_SIZE; j++) {
+			data_out[i][j] = rand();
+		}
+		USBTHING_batch_spi_transfer(batch, BATCH_TEST_SIZE, data_out[i], data_in[i]);
+		USBTHING_batch_gpio_get(batch, 0, &levels[i]);
+		USBTHING_batch_delay_us(batch, 10);
+	}
+
+	res = USBTHING_batch_execute(usbthing, batch);
+
+	USBTHING_spi_close(usbthing);
+	USBTHING_batch_destroy(batch);
+
+	if (res < 0) {
+		printf("Batch execute error: %d\r\n", res);
+		return -2;
+	}
+
+	if (memcmp(data_out, data_in, sizeof(data_out)) != 0) {
+		printf("Batch SPI data mismatch\r\n");
+		return -3;
+	}
+
+	return 0;
+}
+
+//Store and run a GPIO pulse train program, checking it runs to completion
+static int test_seq(usbthing_t usbthing, int interactive)
+{
+	usbthing_batch_t program;
+	int state, result;
+	unsigned int ops;
+	int res;
+
+	printf("Sequencer test\r\n");
+
+	program = USBTHING_batch_create();
+	if (program == NULL) {
+		return -1;
+	}
+
+	USBTHING_gpio_configure(usbthing, 0, 1, 0, 0);
+
+	USBTHING_batch_loop_start(program, SEQ_TEST_LOOPS);
+	USBTHING_batch_gpio_set(program, 0, 1);
+	USBTHING_batch_delay_us(program, SEQ_TEST_DELAY_US);
+	USBTHING_batch_gpio_set(program, 0, 0);
+	USBTHING_batch_delay_us(program, SEQ_TEST_DELAY_US);
+	USBTHING_batch_loop_end(program);
+
+	res = USBTHING_seq_store(usbthing, 0, program);
+	USBTHING_batch_destroy(program);
+	if (res < 0) {
+		printf("Sequencer store error: %d\r\n", res);
+		return -2;
+	}
+
+	res = USBTHING_seq_run(usbthing, 0);
+	if (res < 0) {
+		printf("Sequencer run error: %d\r\n", res);
+		return -3;
+	}
+
+	do {
+		usleep(1000);
+		res = USBTHING_seq_status(usbthing, &state, &result, &ops);
+	} while ((res >= 0) && (state == USBTHING_SEQ_STATE_RUNNING));
+
+	if ((res < 0) || (state != USBTHING_SEQ_STATE_DONE)) {
+		printf("Sequencer did not complete: state %d result %d\r\n", state, result);
+		return -4;
+	}
+
+	//Loop start, then four ops and the loop end per iteration
+	if (ops != 1 + SEQ_TEST_LOOPS * 5) {
+		printf("Sequencer executed %u ops, expected %d\r\n", ops, 1 + SEQ_TEST_LOOPS * 5);
+		return -5;
+	}
+
+	return 0;
+}
+
+//Single transfer larger than the device buffers, chunked by the library with CS held
+static int test_spi_long(usbthing_t usbthing, int interactive)
+{
+	static uint8_t data_out[SPI_LONG_TEST_SIZE];
+	static uint8_t data_in[SPI_LONG_TEST_SIZE];
+	int res;
+
+	printf("SPI long transfer test\r\n");
+	if (interactive != 0) {
+		printf("Connect SPI MISO and MOSI pins and press any key to continue\r\n");
+		getchar();
+	}
+
+	USBTHING_spi_configure(usbthing, USBTHING_SPI_SPEED_5MHZ, USBTHING_SPI_CLOCK_MODE0);
+
+	for (int i = 0; i < sizeof(data_out); i++) {
+		data_out[i] = rand();
+	}
+
+	res = USBTHING_spi_transfer(usbthing, SPI_LONG_TEST_SIZE, data_out, data_in);
+	if (res < 0) {
+		printf("SPI long transfer error: %d\r\n", res);
+		USBTHING_spi_close(usbthing);
+		return -1;
+	}
+
+	if (memcmp(data_out, data_in, sizeof(data_out)) != 0) {
+		printf("SPI long transfer data mismatch\r\n");
+		USBTHING_spi_close(usbthing);
+		return -2;
+	}
+
+	USBTHING_spi_close(usbthing);
+
+	return 0;
+}
+
+//Measure streamed SPI throughput (bytes/s) against the configured clock
+static int test_spi_throughput(usbthing_t usbthing, int interactive)
+{
+	static uint8_t data_out[SPI_SPEED_TEST_SIZE * SPI_SPEED_TEST_COUNT];
+	static uint8_t data_in[SPI_SPEED_TEST_SIZE * SPI_SPEED_TEST_COUNT];
+	const unsigned int speeds[] = {
+		USBTHING_SPI_SPEED_1MHZ,
+		USBTHING_SPI_SPEED_5MHZ,
+		USBTHING_SPI_SPEED_12MHZ,
+		USBTHING_SPI_SPEED_24MHZ
+	};
+	struct timeval start, end;
+	int res;
+
+	printf("SPI throughput test\r\n");
+	if (interactive != 0) {
+		printf("Connect SPI MISO and MOSI pins and press any key to continue\r\n");
+		getchar();
+	}
+
+	for (int i = 0; i < sizeof(data_out); i++) {
+		data_out[i] = rand();
+	}
+
+	printf("%10s %12s %12s %8s\r\n", "clock (Hz)", "line (B/s)", "actual (B/s)", "eff (%)");
+
+	for (int i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+		USBTHING_spi_configure(usbthing, speeds[i], USBTHING_SPI_CLOCK_MODE0);
+
+		memset(data_in, 0, sizeof(data_in));
+
+		gettimeofday(&start, NULL);
+		res = USBTHING_spi_stream(usbthing, SPI_STREAM_TEST_DEPTH, SPI_SPEED_TEST_COUNT, SPI_SPEED_TEST_SIZE,
+		                          data_out, data_in);
+		gettimeofday(&end, NULL);
+
+		if (res < 0) {
+			printf("SPI throughput stream error at %u Hz: %d\r\n", speeds[i], res);
+			USBTHING_spi_close(usbthing);
+			return -1;
+		}
+
+		if (memcmp(data_out, data_in, sizeof(data_out)) != 0) {
+			printf("SPI throughput data mismatch at %u Hz\r\n", speeds[i]);
+			USBTHING_spi_close(usbthing);
+			return -2;
+		}
+
+		double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+		double line_rate = speeds[i] / 8.0;
+		double rate = sizeof(data_out) / elapsed;
+
+		printf("%10u %12.0f %12.0f %8.1f\r\n", speeds[i], line_rate, rate, rate / line_rate * 100.0);
+	}
+
+	USBTHING_spi_close(usbthing);
+
+	return 0;
+}
+
+static int test_adc(usbthing_t usbthing, int interactive)
+{
+	float val;
+
+	printf("ADC test\r\n");
+	if (interactive != 0) {
+		printf("Connect ADC ch 0 to 3V3, ADC ch 3 to GND, and press any key to continue\r\n");
+		printf("Note that the ADC GND and 3V3 are incorrectly labeled on the v0.2.0 board\r\n");
+		getchar();
+	}
+
+	USBTHING_adc_configure(usbthing, USBTHING_ADC_REF_VDD);
+
+	USBTHING_adc_get(usbthing, 0, &val);
+	float expected_low = (3.3 * 0.005);
+	if (val > expected_low) {
+		printf("Error: channel 0 expected: < %.1f actual: %.1f\r\n", expected_low, val);
+		return -1;
+	}
+
+	USBTHING_adc_get(usbthing, 3, &val);
+	float expected_high = (3.3 * 0.995);
+	if (val < expected_high) {
+		printf("Channel 3 expected: > %.1f actual: %.1f\r\n", expected_high, val);
+		return -1;
+	}
+
+	return 0;
+}
+
+//Stream channels and check the sustained rate with no lost blocks or out of range samples
+static int test_adc_stream_run(usbthing_t usbthing, int channels, int scan, unsigned int rate, int encoding)
+{
+	uint16_t samples[1024];
+	unsigned int blocks, lost;
+	struct timeval start, end;
+	long total = 0;
+	double elapsed;
+	int res;
+
+	res = USBTHING_adc_stream_start(usbthing, channels, rate, encoding, NULL, NULL);
+	if (res < 0) {
+		printf("ADC stream start error: %d\r\n", res);
+		return -1;
+	}
+
+	gettimeofday(&start, NULL);
+	while (total < (long)rate * scan * ADC_STREAM_TEST_SECONDS) {
+		res = USBTHING_adc_stream_read(usbthing, samples, sizeof(samples) / sizeof(samples[0]), 1000);
+		if (res < 0) {
+			printf("ADC stream read error: %d\r\n", res);
+			break;
+		}
+		for (int i = 0; i < res; i++) {
+			if (samples[i] > 0x0FFF) {
+				printf("ADC stream sample out of range: 0x%.4x\r\n", samples[i]);
+				res = -1;
+				break;
+			}
+		}
+		if (res < 0) {
+			break;
+		}
+		total += res;
+	}
+	gettimeofday(&end, NULL);
+
+	USBTHING_adc_stream_stats(usbthing, &blocks, &lost);
+	USBTHING_adc_stream_stop(usbthing);
+
+	if (res < 0) {
+		return -2;
+	}
+
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	printf("ADC stream: %ld samples in %.2f s (%.0f samples/s), %u blocks, %u lost\r\n",
+	       total, elapsed, total / elapsed, blocks, lost);
+
+	if (lost != 0) {
+		return -3;
+	}
+
+	return 0;
+}
+
+//Stream a single channel raw, then all channels delta encoded at a combined rate beyond the raw limit
+static int test_adc_stream(usbthing_t usbthing, int interactive)
+{
+	int res;
+
+	printf("ADC stream test\r\n");
+
+	USBTHING_adc_configure(usbthing, USBTHING_ADC_REF_VDD);
+
+	res = test_adc_stream_run(usbthing, 1 << USBTHING_ADC_CH0, 1, ADC_STREAM_TEST_RATE, USBTHING_ADC_ENCODING_RAW);
+	if (res < 0) {
+		return res;
+	}
+
+	res = test_adc_stream_run(usbthing, 0x0F, 4, ADC_STREAM_DELTA_TEST_RATE, USBTHING_ADC_ENCODING_DELTA);
+	if (res < 0) {
+		return res - 3;
+	}
+
+	return 0;
+}
+
+//Manually triggered burst capture, read back in full
+static int test_adc_scope(usbthing_t usbthing, int interactive)
+{
+	uint16_t samples[ADC_SCOPE_TEST_PRE + ADC_SCOPE_TEST_POST];
+	int state, available;
+	int res;
+
+	printf("ADC scope test\r\n");
+
+	USBTHING_adc_configure(usbthing, USBTHING_ADC_REF_VDD);
+
+	res = USBTHING_adc_scope_configure(usbthing, USBTHING_ADC_CH0, ADC_SCOPE_TEST_RATE,
+	                                   ADC_SCOPE_TEST_PRE, ADC_SCOPE_TEST_POST,
+	                                   USBTHING_SCOPE_TRIGGER_MANUAL, 0, 0);
+	if (res < 0) {
+		printf("ADC scope configure error: %d\r\n", res);
+		return -1;
+	}
+
+	res = USBTHING_adc_scope_arm(usbthing);
+	if (res < 0) {
+		printf("ADC scope arm error: %d\r\n", res);
+		return -2;
+	}
+
+	USBTHING_adc_scope_trigger(usbthing);
+
+	for (int i = 0; i < 100; i++) {
+		res = USBTHING_adc_scope_status(usbthing, &state, &available);
+		if ((res < 0) || (state == USBTHING_SCOPE_STATE_DONE)) {
+			break;
+		}
+		usleep(1000);
+	}
+
+	if ((res < 0) || (state != USBTHING_SCOPE_STATE_DONE) || (available != ADC_SCOPE_TEST_PRE + ADC_SCOPE_TEST_POST)) {
+		printf("ADC scope did not complete: state %d samples %d\r\n", state, available);
+		return -3;
+	}
+
+	res = USBTHING_adc_scope_read(usbthing, samples, ADC_SCOPE_TEST_PRE + ADC_SCOPE_TEST_POST);
+	if (res != ADC_SCOPE_TEST_PRE + ADC_SCOPE_TEST_POST) {
+		printf("ADC scope read error: %d\r\n", res);
+		return -4;
+	}
+
+	for (int i = 0; i < res; i++) {
+		if (samples[i] > 0x0FFF) {
+			printf("ADC scope sample %d out of range: 0x%.4x\r\n", i, samples[i]);
+			return -5;
+		}
+	}
+
+	return 0;
+}
+
+//Wait for a window monitor event on ADC ch 2
+static int test_adc_monitor_expect(usbthing_t usbthing, int source)
+{
+	struct usbthing_event_s event;
+	int res;
+
+	res = USBTHING_event_get(usbthing, &event, 100);
+	if (res < 0) {
+		printf("No ADC monitor event, expected source %d\r\n", source);
+		return -1;
+	}
+
+	if ((event.source != source) || (event.id != USBTHING_ADC_CH1)) {
+		printf("Unexpected event: source %d id %d value %d\r\n", event.source, event.id, event.value);
+		return -2;
+	}
+
+	return 0;
+}
+
+//Drive the DAC (looped to ADC ch 2) across a window and check only crossings are reported
+static int test_adc_monitor(usbthing_t usbthing, int interactive)
+{
+	struct usbthing_event_s event;
+	int res;
+
+	printf("ADC monitor test\r\n");
+
+	USBTHING_dac_set(usbthing, 1, 1.65);
+	usleep(1000);
+
+	USBTHING_adc_monitor_configure(usbthing, USBTHING_ADC_CH1, 1, 1024, 3072, 64);
+
+	res = USBTHING_event_start(usbthing, NULL, NULL);
+	if (res < 0) {
+		printf("Event start error: %d\r\n", res);
+		return -1;
+	}
+
+	res = USBTHING_adc_monitor_start(usbthing, ADC_MONITOR_TEST_RATE);
+	if (res < 0) {
+		printf("ADC monitor start error: %d\r\n", res);
+		USBTHING_event_stop(usbthing);
+		return -2;
+	}
+
+	//Starting inside the window must not generate an event
+	if (USBTHING_event_get(usbthing, &event, 20) >= 0) {
+		printf("Unexpected event: source %d id %d value %d\r\n", event.source, event.id, event.value);
+		res = -3;
+	}
+
+	if (res >= 0) {
+		USBTHING_dac_set(usbthing, 1, 3.3);
+		res = test_adc_monitor_expect(usbthing, USBTHING_EVENT_SOURCE_ADC_HIGH);
+	}
+	if (res >= 0) {
+		USBTHING_dac_set(usbthing, 1, 0.0);
+		res = test_adc_monitor_expect(usbthing, USBTHING_EVENT_SOURCE_ADC_LOW);
+	}
+	if (res >= 0) {
+		USBTHING_dac_set(usbthing, 1, 1.65);
+		res = test_adc_monitor_expect(usbthing, USBTHING_EVENT_SOURCE_ADC_INSIDE);
+	}
+
+	USBTHING_adc_monitor_stop(usbthing);
+	USBTHING_adc_monitor_configure(usbthing, USBTHING_ADC_CH1, 0, 0, 0x0FFF, 0);
+	USBTHING_event_stop(usbthing);
+
+	return (res < 0) ? res : 0;
+}
+
+//Oversampled reads of the DAC (looped to ADC ch 2) should agree with single conversions
+static int test_adc_oversample(usbthing_t usbthing, int interactive)
+{
+	float single, averaged;
+	int res;
+
+	printf("ADC oversample test\r\n");
+
+	USBTHING_dac_set(usbthing, 1, 1.65);
+	usleep(1000);
+	USBTHING_adc_get(usbthing, 1, &single);
+
+	res = USBTHING_adc_oversample(usbthing, ADC_OVERSAMPLE_TEST_SHIFT);
+	if (res < 0) {
+		printf("ADC oversample error: %d\r\n", res);
+		return -1;
+	}
+
+	res = USBTHING_adc_get(usbthing, 1, &averaged);
+	USBTHING_adc_oversample(usbthing, 0);
+	if (res < 0) {
+		printf("ADC oversampled read error: %d\r\n", res);
+		return -2;
+	}
+
+	if ((averaged < single - 3.3 * 0.010) || (averaged > single + 3.3 * 0.010)) {
+		printf("ADC oversample error, single: %.4f oversampled: %.4f\r\n", single, averaged);
+		return -3;
+	}
+
+	return 0;
+}
+
+static int test_dac_adc(usbthing_t usbthing, int interactive)
+{
+	char c;
+	float val;
+	float out;
+
+	printf("DAC to ADC test\r\n");
+	if (interactive != 0) {
+		printf("Connect DAC to ADC ch 2 and press any key to continue\r\n");
+		getchar();
+	}
+
+	USBTHING_adc_configure(usbthing, USBTHING_ADC_REF_VDD);
+	USBTHING_dac_configure(usbthing);
+
+	USBTHING_dac_set(usbthing, 1, 3.3);
+	usleep(1000);
+	USBTHING_adc_get(usbthing, 1, &val);
+	if (val < (3.3 * 0.990)) {
+		printf("DAC->ADC test error, expected: %.4f got: %.4f\r\n", 3.3, val);
+		return -1;
+	}
+
+	USBTHING_dac_set(usbthing, 1, 0.0);
+	usleep(1000);
+	USBTHING_adc_get(usbthing, 1, &val);
+	if (val > (3.3 * 0.010)) {
+		printf("DAC->ADC test error, expected: %.4f got: %.4f\r\n", 0.0, val);
+		return -1;
+	}
+
+	printf("DAC to ADC test complete\r\n");
+
+	return 0;
+}
+
+//Stream a low then high level to the DAC (looped to ADC ch 2), every sample should be output in order
+static int test_dac_stream(usbthing_t usbthing, int interactive)
+{
+	uint16_t samples[2 * DAC_STREAM_TEST_SAMPLES];
+	unsigned int played = 0, underruns = 0;
+	int queued = 0;
+	float val;
+	int res;
+
+	printf("DAC stream test\r\n");
+
+	for (int i = 0; i < DAC_STREAM_TEST_SAMPLES; i++) {
+		samples[i] = 0x0400;
+		samples[DAC_STREAM_TEST_SAMPLES + i] = 0x0C00;
+	}
+
+	res = USBTHING_dac_stream_start(usbthing, DAC_STREAM_TEST_RATE);
+	if (res < 0) {
+		printf("DAC stream start error: %d\r\n", res);
+		return -1;
+	}
+
+	res = USBTHING_dac_stream_write(usbthing, samples, 2 * DAC_STREAM_TEST_SAMPLES, 1000);
+	if (res != 2 * DAC_STREAM_TEST_SAMPLES) {
+		printf("DAC stream write error: %d\r\n", res);
+		USBTHING_dac_stream_stop(usbthing);
+		return -2;
+	}
+	USBTHING_dac_stream_flush(usbthing);
+
+	//Allow twice the stream duration to play out
+	for (int i = 0; i < 20; i++) {
+		usleep(2 * DAC_STREAM_TEST_SAMPLES * (1000000 / DAC_STREAM_TEST_RATE) / 10);
+		res = USBTHING_dac_stream_status(usbthing, &queued, &played, &underruns);
+		if ((res < 0) || ((res == USBTHING_DAC_STREAM_RUNNING) && (queued == 0))) {
+			break;
+		}
+	}
+
+	USBTHING_adc_get(usbthing, 1, &val);
+	USBTHING_dac_stream_stop(usbthing);
+
+	if (res < 0) {
+		printf("DAC stream status error: %d\r\n", res);
+		return -3;
+	}
+
+	//The only underrun should be the end of the stream
+	if ((played != 2 * DAC_STREAM_TEST_SAMPLES) || (underruns != 1)) {
+		printf("DAC stream error, played: %u underruns: %u\r\n", played, underruns);
+		return -4;
+	}
+
+	if ((val < 3.3 * 0x0C00 / 4096 - 3.3 * 0.010) || (val > 3.3 * 0x0C00 / 4096 + 3.3 * 0.010)) {
+		printf("DAC stream error, expected: %.4f got: %.4f\r\n", 3.3 * 0x0C00 / 4096, val);
+		return -5;
+	}
+
+	return 0;
+}
+
+static int test_dac_gen(usbthing_t usbthing, int interactive)
+{
+	int high = 0, low = 0;
+	float val;
+	int res;
+
+	printf("DAC generator test\r\n");
+
+	//Slow square wave between 0.65 and 2.65V, sampled over two periods
+	res = USBTHING_dac_gen_set(usbthing, USBTHING_DAC_SHAPE_SQUARE, DAC_GEN_TEST_FREQUENCY, 1.0, 1.65);
+	if (res < 0) {
+		printf("DAC generator start error: %d\r\n", res);
+		return -1;
+	}
+
+	usleep(100000);
+
+	//Direct writes would glitch the waveform
+	if (USBTHING_dac_set(usbthing, 1, 1.65) >= 0) {
+		printf("DAC generator error, direct write accepted\r\n");
+		USBTHING_dac_gen_stop(usbthing);
+		return -2;
+	}
+
+	for (int i = 0; i < DAC_GEN_TEST_READS; i++) {
+		USBTHING_adc_get(usbthing, 1, &val);
+		if ((val > 2.65 - 3.3 * 0.010) && (val < 2.65 + 3.3 * 0.010)) {
+			high ++;
+		} else if ((val > 0.65 - 3.3 * 0.010) && (val < 0.65 + 3.3 * 0.010)) {
+			low ++;
+		}
+		usleep(2 * 1000000 / DAC_GEN_TEST_FREQUENCY / DAC_GEN_TEST_READS);
+	}
+
+	USBTHING_dac_gen_stop(usbthing);
+
+	//Roughly half of the reads at each level, allowing for edges and USB latency
+	if ((high < DAC_GEN_TEST_READS / 4) || (low < DAC_GEN_TEST_READS / 4)) {
+		printf("DAC generator error, high: %d low: %d of %d\r\n", high, low, DAC_GEN_TEST_READS);
+		return -3;
+	}
+
+	return 0;
+}
+
+//Route edges on GPIO0 (looped from GPIO1) to the DAC and ADC, DAC writes and ADC scans should wait for them
+static int test_trigger(usbthing_t usbthing, int interactive)
+{
+	uint16_t samples[TRIGGER_TEST_EDGES];
+	int total = 0;
+	float val;
+	int res;
+
+	printf("Trigger routing test\r\n");
+
+	USBTHING_gpio_configure(usbthing, 1, 1, 0, 0);
+	USBTHING_gpio_configure(usbthing, 0, 0, 0, 0);
+	USBTHING_gpio_set(usbthing, 1, 0);
+	USBTHING_dac_set(usbthing, 1, 0.0);
+
+	res = USBTHING_trigger_route(usbthing, USBTHING_TRIGGER_SINK_DAC, USBTHING_TRIGGER_SOURCE_GPIO, 0,
+	                             USBTHING_TRIGGER_EDGE_RISING);
+	if (res < 0) {
+		printf("Trigger route error: %d\r\n", res);
+		return -1;
+	}
+
+	//The write is held until the rising edge
+	USBTHING_dac_set(usbthing, 1, 3.3);
+	usleep(1000);
+	USBTHING_adc_get(usbthing, 1, &val);
+	if (val > (3.3 * 0.010)) {
+		printf("Trigger error, DAC updated before the edge: %.4f\r\n", val);
+		res = -2;
+	} else {
+		USBTHING_gpio_set(usbthing, 1, 1);
+		usleep(1000);
+		USBTHING_adc_get(usbthing, 1, &val);
+		if (val < (3.3 * 0.990)) {
+			printf("Trigger error, DAC not updated on the edge: %.4f\r\n", val);
+			res = -3;
+		}
+	}
+
+	USBTHING_trigger_clear(usbthing, USBTHING_TRIGGER_SINK_DAC);
+	USBTHING_gpio_set(usbthing, 1, 0);
+	if (res < 0) {
+		return res;
+	}
+
+	//One scan per edge, in either direction
+	res = USBTHING_trigger_route(usbthing, USBTHING_TRIGGER_SINK_ADC, USBTHING_TRIGGER_SOURCE_GPIO, 0,
+	                             USBTHING_TRIGGER_EDGE_BOTH);
+	if (res < 0) {
+		printf("Trigger route error: %d\r\n", res);
+		return -4;
+	}
+
+	res = USBTHING_adc_stream_start(usbthing, 1 << USBTHING_ADC_CH1, 0, USBTHING_ADC_ENCODING_RAW, NULL, NULL);
+	if (res < 0) {
+		printf("Triggered ADC stream start error: %d\r\n", res);
+		USBTHING_trigger_clear(usbthing, USBTHING_TRIGGER_SINK_ADC);
+		return -5;
+	}
+
+	for (int i = 0; i < TRIGGER_TEST_EDGES; i++) {
+		USBTHING_gpio_set(usbthing, 1, (i + 1) & 1);
+		usleep(1000);
+	}
+
+	while (total < TRIGGER_TEST_EDGES) {
+		res = USBTHING_adc_stream_read(usbthing, samples + total, TRIGGER_TEST_EDGES - total, 1000);
+		if (res <= 0) {
+			break;
+		}
+		total += res;
+	}
+
+	//No more edges, so there should be no more scans
+	res = (total == TRIGGER_TEST_EDGES) ? USBTHING_adc_stream_read(usbthing, samples, 1, 100) : 0;
+
+	USBTHING_adc_stream_stop(usbthing);
+	USBTHING_trigger_clear(usbthing, USBTHING_TRIGGER_SINK_ADC);
+
+	if ((total != TRIGGER_TEST_EDGES) || (res > 0)) {
+		printf("Trigger error, expected %d scans got %d\r\n", TRIGGER_TEST_EDGES, total);
+		return -6;
+	}
+
+	return 0;
+}
+
+//Count rising edges on GPIO0 (looped from GPIO1), latching should restart the count
+static int test_counter(usbthing_t usbthing, int interactive)
+{
+	int32_t count;
+	int res;
+
+	printf("Counter test\r\n");
+
+	USBTHING_gpio_configure(usbthing, 1, 1, 0, 0);
+	USBTHING_gpio_configure(usbthing, 0, 0, 0, 0);
+	USBTHING_gpio_set(usbthing, 1, 0);
+
+	res = USBTHING_counter_configure(usbthing, USBTHING_COUNTER_MODE_SINGLE, 0, -1, 0, 0);
+	if (res < 0) {
+		printf("Counter configure error: %d\r\n", res);
+		return -1;
+	}
+
+	for (int i = 0; i < COUNTER_TEST_EDGES; i++) {
+		USBTHING_gpio_set(usbthing, 1, 1);
+		USBTHING_gpio_set(usbthing, 1, 0);
+	}
+
+	res = USBTHING_counter_read(usbthing, 1, &count, NULL);
+	if ((res < 0) || (count != COUNTER_TEST_EDGES)) {
+		printf("Counter error, expected %d edges got %d (%d)\r\n", COUNTER_TEST_EDGES, count, res);
+		USBTHING_counter_stop(usbthing);
+		return -2;
+	}
+
+	res = USBTHING_counter_read(usbthing, 0, &count, NULL);
+	USBTHING_counter_stop(usbthing);
+	if ((res < 0) || (count != 0)) {
+		printf("Counter error, %d edges after latching (%d)\r\n", count, res);
+		return -3;
+	}
+
+	return 0;
+}
+
+//Hold ADC channel 1 (looped from the DAC) at mid scale with a PI loop on the device
+static int test_control(usbthing_t usbthing, int interactive)
+{
+	int state, saturated;
+	float setpoint, input, output;
+	unsigned int iterations;
+	int res;
+
+	printf("Control loop test\r\n");
+
+	USBTHING_dac_set(usbthing, 1, 0.0);
+
+	res = USBTHING_control_configure(usbthing, USBTHING_ADC_CH1, CONTROL_TEST_RATE, 0.5, 100.0, 0.0, 0.0, 3.3, 0);
+	if (res < 0) {
+		printf("Control loop configure error: %d\r\n", res);
+		return -1;
+	}
+
+	res = USBTHING_control_setpoint(usbthing, CONTROL_TEST_SETPOINT, 0.0);
+	if (res < 0) {
+		printf("Control loop setpoint error: %d\r\n", res);
+		return -2;
+	}
+
+	res = USBTHING_control_start(usbthing);
+	if (res < 0) {
+		printf("Control loop start error: %d\r\n", res);
+		return -3;
+	}
+
+	usleep(500000);
+
+	//The loop owns the DAC while running
+	if (USBTHING_dac_set(usbthing, 1, 0.0) >= 0) {
+		printf("Control loop error, direct DAC write accepted\r\n");
+		USBTHING_control_stop(usbthing);
+		return -4;
+	}
+
+	res = USBTHING_control_status(usbthing, &state, &saturated, &setpoint, &input, &output, &iterations);
+
+	USBTHING_control_stop(usbthing);
+
+	if (res < 0) {
+		printf("Control loop status error: %d\r\n", res);
+		return -5;
+	}
+
+	if ((state != USBTHING_CONTROL_STATE_RUNNING) || (iterations < CONTROL_TEST_RATE / 4)) {
+		printf("Control loop error, state: %d iterations: %u\r\n", state, iterations);
+		return -6;
+	}
+
+	if ((input < CONTROL_TEST_SETPOINT - 3.3 * 0.010) || (input > CONTROL_TEST_SETPOINT + 3.3 * 0.010)) {
+		printf("Control loop error, input: %.4f output: %.4f\r\n", input, output);
+		return -7;
+	}
+
+	//PWM output, nothing is fed back so only the duty limits and ownership of the channel are checked
+	res = USBTHING_pwm_configure(usbthing, PWM_TEST_FREQUENCY);
+	if (res >= 0) {
+		res = USBTHING_control_configure_pwm(usbthing, USBTHING_ADC_CH1, CONTROL_TEST_RATE, 0, 0.5, 100.0, 0.0,
+		                                     0.25, 0.75, 0);
+	}
+	if (res >= 0) {
+		res = USBTHING_control_start(usbthing);
+	}
+	if (res < 0) {
+		printf("Control loop PWM start error: %d\r\n", res);
+		return -8;
+	}
+
+	usleep(100000);
+
+	if (USBTHING_pwm_set(usbthing, 0, 0.5) >= 0) {
+		printf("Control loop error, direct PWM write accepted\r\n");
+		USBTHING_control_stop(usbthing);
+		return -9;
+	}
+
+	res = USBTHING_control_status(usbthing, &state, &saturated, &setpoint, &input, &output, &iterations);
+
+	USBTHING_control_stop(usbthing);
+
+	if ((res < 0) || (state != USBTHING_CONTROL_STATE_RUNNING) || (output < 0.25 - 0.001) || (output > 0.75 + 0.001)) {
+		printf("Control loop PWM error: %d state: %d output: %.4f\r\n", res, state, output);
+		return -10;
+	}
+
+	return 0;
+}
+
+//Capture PWM0 on GPIO2 and PWM1 on GPIO4 with the logic analyser, returns the fraction of samples high
+static int pwm_measure(usbthing_t usbthing, float *duty0, float *duty1)
+{
+	uint8_t samples[PWM_TEST_SAMPLES];
+	int state, available;
+	int high0 = 0, high1 = 0;
+	int res;
+
+	res = USBTHING_logic_configure(usbthing, LOGIC_TEST_RATE, 0, PWM_TEST_SAMPLES,
+	                               USBTHING_LOGIC_TRIGGER_MANUAL, 0, 0, 0, USBTHING_LOGIC_ENCODING_RAW);
+	if (res < 0) {
+		return res;
+	}
+
+	USBTHING_logic_arm(usbthing);
+	USBTHING_logic_trigger(usbthing);
+
+	for (int i = 0; i < 100; i++) {
+		res = USBTHING_logic_status(usbthing, &state, &available);
+		if ((res < 0) || (state == USBTHING_SCOPE_STATE_DONE)) {
+			break;
+		}
+		usleep(1000);
+	}
+
+	res = USBTHING_logic_read(usbthing, samples, PWM_TEST_SAMPLES);
+	if (res != PWM_TEST_SAMPLES) {
+		return -1;
+	}
+
+	for (int i = 0; i < PWM_TEST_SAMPLES; i++) {
+		high0 += (samples[i] >> 2) & 1;
+		high1 += (samples[i] >> 4) & 1;
+	}
+	*duty0 = (float)high0 / PWM_TEST_SAMPLES;
+	*duty1 = (float)high1 / PWM_TEST_SAMPLES;
+
+	return 0;
+}
+
+//Set both channels, then swap them in a single update
+static int test_pwm(usbthing_t usbthing, int interactive)
+{
+	float swapped[USBTHING_PWM_NUM_CHANNELS] = {0.75, 0.25};
+	float duty0, duty1;
+	int res;
+
+	printf("PWM test\r\n");
+
+	if (interactive != 0) {
+		printf("Connect PWM0 to GPIO2 and PWM1 to GPIO4 and press any key to continue\r\n");
+		getchar();
+	}
+
+	USBTHING_gpio_configure(usbthing, 2, 0, 0, 0);
+	USBTHING_gpio_configure(usbthing, 4, 0, 0, 0);
+
+	res = USBTHING_pwm_configure(usbthing, PWM_TEST_FREQUENCY);
+	if (res < 0) {
+		printf("PWM configure error: %d\r\n", res);
+		return -1;
+	}
+
+	USBTHING_pwm_set(usbthing, 0, 0.25);
+	USBTHING_pwm_set(usbthing, 1, 0.75);
+	USBTHING_pwm_enable(usbthing, 0, 1);
+	USBTHING_pwm_enable(usbthing, 1, 1);
+	usleep(10000);
+
+	res = pwm_measure(usbthing, &duty0, &duty1);
+	if ((res < 0) || (duty0 < 0.23) || (duty0 > 0.27) || (duty1 < 0.73) || (duty1 > 0.77)) {
+		printf("PWM set error: %d duty: %.3f %.3f\r\n", res, duty0, duty1);
+		res = -2;
+	} else {
+		USBTHING_pwm_update(usbthing, swapped);
+		usleep(10000);
+
+		res = pwm_measure(usbthing, &duty0, &duty1);
+		if ((res < 0) || (duty0 < 0.73) || (duty0 > 0.77) || (duty1 < 0.23) || (duty1 > 0.27)) {
+			printf("PWM update error: %d duty: %.3f %.3f\r\n", res, duty0, duty1);
+			res = -3;
+		}
+	}
+
+	USBTHING_pwm_enable(usbthing, 0, 0);
+	USBTHING_pwm_enable(usbthing, 1, 0);
+
+	return res;
+}
+
+//Measure a full swing square wave from the DAC generator on PWM0
+static int test_pwm_capture(usbthing_t usbthing, int interactive)
+{
+	int state = USBTHING_PWM_CAPTURE_RUNNING;
+	int waves = 0;
+	float frequency = 0, duty = 0;
+	int res;
+
+	printf("PWM capture test\r\n");
+
+	if (interactive != 0) {
+		printf("Connect DAC0 to PWM0 and press any key to continue\r\n");
+		getchar();
+	}
+
+	res = USBTHING_dac_gen_set(usbthing, USBTHING_DAC_SHAPE_SQUARE, PWM_CAPTURE_TEST_FREQUENCY, 1.6, 1.65);
+	if (res < 0) {
+		printf("DAC generator start error: %d\r\n", res);
+		return -1;
+	}
+	usleep(10000);
+
+	res = USBTHING_pwm_capture(usbthing, 0, PWM_CAPTURE_TEST_WAVES, 1000);
+	if (res < 0) {
+		printf("PWM capture start error: %d\r\n", res);
+		USBTHING_dac_gen_stop(usbthing);
+		return -2;
+	}
+
+	for (int i = 0; (i < 100) && (state == USBTHING_PWM_CAPTURE_RUNNING); i++) {
+		usleep(10000);
+		res = USBTHING_pwm_capture_status(usbthing, &state, &frequency, &duty, &waves);
+		if (res < 0) {
+			break;
+		}
+	}
+
+	USBTHING_dac_gen_stop(usbthing);
+
+	if ((res < 0) || (state != USBTHING_PWM_CAPTURE_DONE) || (waves != PWM_CAPTURE_TEST_WAVES)) {
+		printf("PWM capture error: %d state: %d waves: %d\r\n", res, state, waves);
+		return -3;
+	}
+
+	if ((frequency < PWM_CAPTURE_TEST_FREQUENCY * 0.99) || (frequency > PWM_CAPTURE_TEST_FREQUENCY * 1.01)
+	        || (duty < 0.45) || (duty > 0.55)) {
+		printf("PWM capture error, frequency: %.2f duty: %.3f\r\n", frequency, duty);
+		return -4;
+	}
+
+	return 0;
+}
+
+//Move out and back, counting steps on GPIO0 (looped from GPIO1) in the direction given by GPIO3 (looped
+//from GPIO2), the count should follow the reported position
+static int test_motion(usbthing_t usbthing, int interactive)
+{
+	const int32_t targets[] = {MOTION_TEST_STEPS, -MOTION_TEST_STEPS / 2};
+	int32_t position, count;
+	int moving;
+	int res;
+
+	printf("Motion test\r\n");
+
+	USBTHING_gpio_configure(usbthing, 0, 0, 0, 0);
+	USBTHING_gpio_configure(usbthing, 3, 0, 0, 0);
+
+	res = USBTHING_counter_configure(usbthing, USBTHING_COUNTER_MODE_SINGLE, 0, 3, 0, 0);
+	if (res < 0) {
+		printf("Counter configure error: %d\r\n", res);
+		return -1;
+	}
+
+	//Direction low for positive moves, so the counter counts up
+	res = USBTHING_motion_configure(usbthing, 1, 2, 1, 0);
+	if (res < 0) {
+		printf("Motion configure error: %d\r\n", res);
+		USBTHING_counter_stop(usbthing);
+		return -2;
+	}
+	USBTHING_motion_set_position(usbthing, 0);
+
+	//Outputs configured now are stopped by the first move
+	USBTHING_pwm_configure(usbthing, PWM_TEST_FREQUENCY);
+
+	for (int t = 0; t < 2; t++) {
+		res = USBTHING_motion_move(usbthing, targets[t], MOTION_TEST_SPEED, MOTION_TEST_ACCELERATION);
+		if (res < 0) {
+			printf("Motion move error: %d\r\n", res);
+			USBTHING_counter_stop(usbthing);
+			return -3;
+		}
+
+		moving = 1;
+		for (int i = 0; (i < 100) && (moving != 0); i++) {
+			usleep(10000);
+			res = USBTHING_motion_status(usbthing, &moving, &position, NULL, NULL);
+			if (res < 0) {
+				break;
+			}
+		}
+
+		if ((res < 0) || (moving != 0) || (position != targets[t])) {
+			printf("Motion error: %d moving: %d position: %d expected: %d\r\n", res, moving, position, targets[t]);
+			USBTHING_motion_stop(usbthing, 1);
+			USBTHING_counter_stop(usbthing);
+			return -4;
+		}
+
+		res = USBTHING_counter_read(usbthing, 0, &count, NULL);
+		if ((res < 0) || (count != targets[t])) {
+			printf("Motion error, counted %d steps to %d (%d)\r\n", count, targets[t], res);
+			USBTHING_counter_stop(usbthing);
+			return -5;
+		}
+	}
+
+	USBTHING_counter_stop(usbthing);
+
+	//The timer stays lent to the motion generator until PWM is configured again
+	res = USBTHING_pwm_set(usbthing, 0, 0.5);
+	if (res >= 0) {
+		printf("Motion error, PWM set accepted after a move\r\n");
+		return -6;
+	}
+
+	return 0;
+}
+
+static int test_uart(usbthing_t usbthing, int interactive)
+{
+	uint8_t data_out[UART_TEST_SIZE];
+	uint8_t data_in[UART_TEST_SIZE];
+	int written = 0, received = 0;
+	unsigned int lost, errors;
+	int res;
+
+	printf("UART test\r\n");
+
+	if (interactive != 0) {
+		printf("Connect UART TX to UART RX and press any key to continue\r\n");
+		getchar();
+	}
+
+	for (int i = 0; i < UART_TEST_SIZE; i++) {
+		data_out[i] = rand();
+	}
+
+	res = USBTHING_uart_configure(usbthing, UART_TEST_BAUD, 8, USBTHING_UART_PARITY_NONE, 1);
+	if (res < 0) {
+		printf("UART configure error: %d\r\n", res);
+		return -1;
+	}
+
+	//Neither call waits, so keep writing and reading until everything is back or time runs out
+	for (int i = 0; (i < 200) && (received < UART_TEST_SIZE); i++) {
+		if (written < UART_TEST_SIZE) {
+			res = USBTHING_uart_write(usbthing, data_out + written, UART_TEST_SIZE - written);
+			if (res < 0) {
+				printf("UART write error: %d\r\n", res);
+				USBTHING_uart_close(usbthing);
+				return -2;
+			}
+			written += res;
+		}
+
+		res = USBTHING_uart_read(usbthing, data_in + received, UART_TEST_SIZE - received);
+		if (res < 0) {
+			printf("UART read error: %d\r\n", res);
+			USBTHING_uart_close(usbthing);
+			return -3;
+		}
+		received += res;
+
+		usleep(10000);
+	}
+
+	res = USBTHING_uart_status(usbthing, NULL, NULL, &lost, &errors);
+	USBTHING_uart_close(usbthing);
+
+	if ((res < 0) || (lost != 0) || (errors != 0)) {
+		printf("UART status error: %d lost: %u errors: %u\r\n", res, lost, errors);
+		return -4;
+	}
+
+	if (received != UART_TEST_SIZE) {
+		printf("UART error, received %d of %d bytes\r\n", received, UART_TEST_SIZE);
+		return -5;
+	}
+
+	for (int i = 0; i < UART_TEST_SIZE; i++) {
+		if (data_in[i] != data_out[i]) {
+			printf("UART error at index %d (sent: %.2x received: %.2x)\r\n", i, data_out[i], data_in[i]);
+			return -6;
+		}
+	}
+
+	return 0;
+}
+
+static int test_i2c(usbthing_t usbthing, int interactive)
+{
+	uint8_t data_out[I2C_TEST_SIZE];
+	uint8_t data_in[I2C_TEST_SIZE];
+	int found[I2C_TEST_SIZE];
+	struct usbthing_i2c_message_s messages[2] = {
+		{ .address = I2C_TEST_ADDRESS, .flags = 0, .length = 1, .data = data_out },
+		{ .address = I2C_TEST_ADDRESS, .flags = USBTHING_I2C_MSG_FLAG_READ, .length = sizeof(data_in), .data = data_in }
+	};
+	struct timeval start, end;
+	double elapsed;
+	int res;
+
+	res = USBTHING_i2c_configure(usbthing, USBTHING_I2C_SPEED_STANDARD);
+	if (res < 0) {
+		printf("Error %d configuring I2C\r\n", res);
+		return -1;
+	}
+
+	for (int i = 0; i < I2C_TEST_SIZE; i++) {
+		data_out[i] = rand();
+	}
+
+	//With no device at the address each transfer should be refused, and promptly
+	gettimeofday(&start, NULL);
+
+	res = USBTHING_i2c_write(usbthing, I2C_TEST_ADDRESS, sizeof(data_out), data_out);
+	if (res != USBTHING_ERROR_PERIPHERAL_FAILED) {
+		printf("Unexpected I2C write result %d\r\n", res);
+		return -2;
+	}
+
+	res = USBTHING_i2c_read(usbthing, I2C_TEST_ADDRESS, sizeof(data_in), data_in);
+	if (res != USBTHING_ERROR_PERIPHERAL_FAILED) {
+		printf("Unexpected I2C read result %d\r\n", res);
+		return -3;
+	}
+
+	res = USBTHING_i2c_write_read(usbthing, I2C_TEST_ADDRESS, 1, data_out, sizeof(data_in), data_in);
+	if (res != USBTHING_ERROR_PERIPHERAL_FAILED) {
+		printf("Unexpected I2C write read result %d\r\n", res);
+		return -4;
+	}
+
+	//A register read as a message array stops at the unacknowledged address
+	res = USBTHING_i2c_transfer(usbthing, 2, messages);
+	if (res != USBTHING_ERROR_PERIPHERAL_FAILED) {
+		printf("Unexpected I2C message result %d\r\n", res);
+		return -5;
+	}
+
+	gettimeofday(&end, NULL);
+
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	if (elapsed * 1000 > I2C_TEST_MAX_MS) {
+		printf("I2C transfers took %.1f ms to fail\r\n", elapsed * 1000);
+		return -6;
+	}
+
+	res = USBTHING_i2c_scan(usbthing, I2C_TEST_SIZE, found);
+	if (res < 0) {
+		printf("Error %d scanning I2C bus\r\n", res);
+		return -7;
+	}
+	for (int i = 0; (i < res) && (i < I2C_TEST_SIZE); i++) {
+		if ((found[i] < USBTHING_I2C_SCAN_FIRST) || (found[i] > USBTHING_I2C_SCAN_LAST)) {
+			printf("I2C scan found reserved address %.2x\r\n", found[i]);
+			return -8;
+		}
+	}
+	printf("I2C scan found %d device(s)\r\n", res);
+
+	//Lengths beyond the device buffer are refused by the library
+	res = USBTHING_i2c_read(usbthing, I2C_TEST_ADDRESS, USBTHING_I2C_MAX_SIZE + 1, data_in);
+	if (res != USBTHING_ERROR_INVALID_REQUEST) {
+		printf("Unexpected oversized I2C read result %d\r\n", res);
+		return -9;
+	}
 
 	return 0;
 }